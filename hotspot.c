@@ -1,25 +1,464 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #define AP_IFACE "ap0"
 #define HOSTAPD_CONF "/tmp/hostapd.conf"
-#define AP_IP "192.168.4.1/24"
-#define DHCP_RANGE "192.168.4.2,192.168.4.100,12h"
+#define HOSTAPD_CTRL "/var/run/hostapd"
+#define DEFAULT_SUBNET "192.168.4.0/24"
+#define DEFAULT_LEASE_TIME "12h"
 #define CONFIG_FILE "/tmp/hotspot.conf" // file to persist SSID and password
+#define OPTIONS_FILE "/tmp/hotspot.opts" // optional key=value engine settings
+#define PROFILES_FILE "/etc/hotspot/profiles.conf" // Named headless profiles
+#define PROFILE_CACHE_DIR "/var/lib/hotspot" // Holds PSKs: root only
+#define PROFILE_CACHE PROFILE_CACHE_DIR "/profiles.bin" // Compiled profiles
+#define OLD_PROFILE_CACHE "/var/cache/hotspot/profiles.bin"
+#define PROFILE_MAGIC 0x46505348 // "HSPF"
+#define PROFILE_FORMAT 2 // Bump when validation or the record meaning changes
+#define MAX_PROFILES 16
+#define RATE_LIMIT_FILE "/tmp/hotspot.ratelimits" // Per-client caps
+#define SPEEDTEST_DOWN_URL "https://speed.cloudflare.com/__down?bytes=25000000"
+#define SPEEDTEST_UP_URL "https://speed.cloudflare.com/__up"
+#define SPEEDTEST_PORT 8080 // Built-in test server on the AP address
+#define SPEEDTEST_RESULTS "/tmp/hotspot.speedtest"
+#define SPEEDTEST_RESULTS_MAX 65536 // Results file is reset beyond this
+#define SPEEDTEST_CHUNK (1 << 20)   // memfd size and transfer step
+#define SPEEDTEST_DEFAULT_BYTES 100000000LL
+#define SPEEDTEST_MAX_BYTES 10000000000LL
+#define SPEEDTEST_MIN_BYTES 1000000 // Smaller transfers are not recorded
+#define SPEEDTEST_MAX_CLIENTS 8 // Connections served at once, others get 503
+#define SPEEDTEST_TIMEOUT_S 10  // A stalled connection is dropped after this
+#define LATENCY_TARGET "1.1.1.1"
+#define MAX_RATE_LIMITS 64
+#define FASTPATH_TABLE "hotspot_fastpath"
+#define BPF_PIN_DIR "/sys/fs/bpf/hotspot"
+#define METRICS_FILE "/tmp/hotspot.metrics" // Prometheus text format
+#define STATE_FILE "/tmp/hotspot.state" // What a warm restart may adopt
+#define TUNING_FILE "/tmp/hotspot.tuning" // Originals of cpu_tuning's files
+#define HISTORY_DIR "/var/lib/hotspot"
+#define HISTORY_FILE HISTORY_DIR "/history.bin" // Per-second uplink samples
+#define HISTORY_MAGIC 0x54534848 // "HHST"
+#define HISTORY_SLOTS 262144     // Three days at one record per second
+#define HISTORY_UPLINKS 64
+#define HISTORY_MARGIN 16 // Oldest slots readers skip while the ring wraps
+#define HISTORY_LOSS_WINDOW 60 // Probes the loss percentage covers
+#define MAX_CLIENTS 4096
+#define BUILTIN_LEASE_FILE "/tmp/hotspot.leases"
+#define DNSMASQ_LEASE_FILE "/tmp/hotspot.dnsmasq.leases"
+#define DNSMASQ_PID_FILE "/tmp/hotspot.dnsmasq.pid"
+#define LEASE_FILE_MAGIC 0x31534c48
+#define DHCP_OFFER_HOLD 30    // Seconds an offered address stays reserved
+#define DHCP_DECLINE_HOLD 600 // Seconds a declined address is quarantined
+#define DHCP_RCVBUF (1 << 20) // Socket buffer that absorbs a join storm
+#define DNS_NEG_TTL 60        // dnsmasq --neg-ttl under the DNS profile
+#define DNS_TIMEOUT_MS 500
+#define DNS_MAX_SERVERS 8
+#define MAX_CHANNELS 64
+#define CSA_BEACONS 5 // Beacons announcing a channel switch
+#define ACS_MARGIN 10 // Score gain needed before ACS moves the AP
+#define SAE_ANTI_CLOGGING 5 // Pending SAE commits before tokens are required
+#define UNDO_TIER_MS 2000   // Time budget for each rollback tier
+#define AP_ENABLE_TIMEOUT_MS 10000 // Wait for hostapd to enable the AP
+#define NDP_PROXY_MAX 256     // IPv6 client addresses the NDP proxy tracks
+#define NDP_PROXY_EXPIRE 600  // Seconds before a silent client is dropped
+#define PMTU_MIN 576          // Smallest path MTU probed for
+#define PMTU_PROBE_MS 500     // Wait for the reply to one PMTU probe
+#define MAX_TUNED_FILES 128   // /proc and /sys files cpu_tuning may change
+#define MAX_TUNED_IRQS 16
+#define NAT_RULES 3 // Rules format_nat_rule() describes
+#define RFS_FLOW_ENTRIES 32768 // rps_sock_flow_entries under cpu_tuning
 
 pid_t hostapd_pid = -1;
+pid_t dhcpd_pid = -1; // Built-in DHCP server process
+
+// Uplink currently carrying the NAT rules and its address at install time.
+char uplink_iface[32] = "";
+char uplink_addr[64] = "";
+char ap_radio[32] = ""; // Spare radio hosting ap0 under ACS, else empty
+char ap_bssid[18] = "";
+int nat_installed = 0;
+char nat_iptables[128] = "iptables"; // Binary the NAT rules were added with
+
+// Engine settings, overridable from OPTIONS_FILE.
+typedef struct {
+  int make_before_break; // switch_mode=mbb|classic
+  int shaper;            // shaper=on|off
+  int shaper_down_kbit;  // 0 = measure
+  int shaper_up_kbit;    // 0 = measure
+  int fastpath;          // fastpath=on|off (nftables flowtable)
+  int bpf_acct;          // bpf_acct=on|off (per-client eBPF accounting)
+  int ct_autosize;       // ct_autosize=on|off
+  int ct_watermark;      // Percent of nf_conntrack_max that triggers growth
+  int ct_max_limit;      // Upper bound for nf_conntrack_max
+  char subnet[32];       // AP network, /16 to /30
+  char dhcp_start[16];   // Empty = derive from subnet
+  char dhcp_end[16];     // Empty = derive from subnet
+  char lease_time[16];   // dnsmasq lease time, e.g. 12h
+  int builtin_dhcp;      // dhcp_backend=dnsmasq|builtin
+  int dns_profile;       // dns_profile=on|off (tuned dnsmasq cache)
+  int dns_cache_size;    // dnsmasq --cache-size
+  int dns_min_ttl;       // dnsmasq --min-cache-ttl
+  int acs;               // channel_select=follow|acs
+  int acs_interval;      // Seconds between idle ACS re-evaluations
+  int security;          // security=wpa2|transition|wpa3
+  int ft;                // ft=on|off (802.11r fast transition)
+  char bssid[18];        // Empty = derive a stable one from the SSID
+  int reconcile;         // reconcile=on|off (adopt state on restart)
+  int band;              // band=any|2.4|5 (channels ACS may pick)
+  char probe[128];       // Comma-separated connectivity probe targets
+  int check_interval;    // Seconds between checks, 0 = ask (hsc only)
+  int history;           // history=on|off (per-second uplink history)
+  int ipv6;              // ipv6=off|proxy|routed
+  char ipv6_prefix[48];  // Routed /64 for ipv6=routed
+  int mtu_clamp;         // mtu_clamp=on|off (PMTU probe, MSS clamp)
+  int uplink_mtu;        // 0 = probe the uplink path MTU
+  int cpu_tuning;        // cpu_tuning=on|off (RPS/RFS/XPS, IRQ affinity)
+  int speedtest_server;  // speedtest_server=on|off
+} HotspotOptions;
+
+enum { SECURITY_WPA2, SECURITY_TRANSITION, SECURITY_WPA3 };
+enum { BAND_ANY, BAND_2G, BAND_5G };
+enum { IPV6_OFF, IPV6_PROXY, IPV6_ROUTED };
+
+HotspotOptions opts = {.make_before_break = 1,
+                       .bpf_acct = 1,
+                       .ct_autosize = 1,
+                       .ct_watermark = 80,
+                       .ct_max_limit = 1048576,
+                       .subnet = DEFAULT_SUBNET,
+                       .lease_time = DEFAULT_LEASE_TIME,
+                       .dns_cache_size = 10000,
+                       .dns_min_ttl = 60,
+                       .acs_interval = 900,
+                       .probe = "google.com",
+                       .history = 1,
+                       .mtu_clamp = 1};
+
+// Address plan derived from the options by validate_net_config().
+char ap_addr[16];   // AP address, first host of the subnet
+char ap_cidr[24];   // AP address with prefix length
+char dhcp_range[64]; // dnsmasq --dhcp-range value
+int dhcp_pool_size = 0;
+int path_mtu = 0;  // Measured uplink path MTU, 0 = not measured
+int lan_mtu = 0;   // MTU advertised on ap0, 0 = interface default
+int clamp_mss = 0; // MSS of the installed TCPMSS rules, 0 = none
+char clamp_iptables[128] = "";  // Binaries the TCPMSS rules were added with,
+char clamp_ip6tables[128] = ""; // empty for no IPv6 rules
+
+int shaper_up_kbit = 0; // Rate of the uplink shaper, 0 when not installed.
+int fastpath_installed = 0;
+int bpf_acct_active = 0;
+int dnsmasq_active = 0;
+
+// Startup and failover timings, exported with the metrics so a benchmark
+// can read them without instrumenting the engine.
+struct timespec engine_start; // CLOCK_MONOTONIC at startup
+time_t engine_start_wall;
+double ap_enabled_seconds = -1;  // Until hostapd reported the AP enabled
+double first_lease_seconds = -1; // Until the first DHCP lease was granted
+double last_outage_seconds = -1; // Last uplink outage until restored
+unsigned long long outages = 0;
+
+// Per-client download/upload caps in kbit/s (0 = uncapped).
+typedef struct {
+  char ip[16];
+  int down_kbit;
+  int up_kbit;
+} RateLimit;
+
+// Per-client counters kept by the BPF accounting program. "up" is traffic
+// sent by the client (AP ingress), "down" is traffic sent to it.
+typedef struct {
+  unsigned long long up_packets;
+  unsigned long long up_bytes;
+  unsigned long long down_packets;
+  unsigned long long down_bytes;
+} ClientCounters;
+
+typedef struct {
+  unsigned int addr; // IPv4 address in network byte order
+  ClientCounters counters;
+} ClientStats;
+
+// Conntrack table usage and error counters (summed over CPUs).
+typedef struct {
+  long count;
+  long max;
+  long buckets;
+  unsigned long long insert_failed;
+  unsigned long long drop;
+  unsigned long long early_drop;
+  unsigned long long resizes; // Growth steps taken by the engine
+} ConntrackStats;
+
+ConntrackStats ct_stats;
+
+// Upstream resolver as reported by dnsmasq's servers.bind.
+typedef struct {
+  char server[48];
+  unsigned long long queries, failed;
+  double rtt_ms; // Direct query round trip, -1 when it went unanswered
+} DnsUpstream;
+
+// dnsmasq cache counters and upstream latency, refreshed each check.
+typedef struct {
+  int valid;
+  unsigned long long cache_size, hits, misses, insertions, evictions;
+  DnsUpstream upstreams[DNS_MAX_SERVERS];
+  int upstream_count;
+} DnsStats;
+
+DnsStats dns_stats;
+
+// --- Command tracing ---
+
+// Every external tool runs through run_cmd(), exec_cmd() or
+// open_cmd_pipe(). With HSC_TRACE_RECORD=file each invocation's command
+// line, exit status, duration and output are appended to file. With
+// HSC_TRACE_REPLAY=file nothing is executed: the recorded results are
+// returned instantly, or after the recorded duration when
+// HSC_TRACE_LATENCY=real. Replay matches command lines in recorded order and
+// wraps around, so one recorded start can be replayed any number of times.
+//
+// A record is "<status> <usec> <cmd_len> <output_len>\n<cmd>\n<output>\n".
+typedef struct {
+  char *cmd, *output;
+  size_t output_len;
+  int status;
+  long usec;
+} TraceRecord;
+
+enum { TRACE_OFF, TRACE_RECORD, TRACE_REPLAY };
+int trace_mode = -1; // Until trace_init() has read the environment
+int trace_fd = -1;
+int trace_real_latency = 0;
+TraceRecord *trace_records = NULL;
+int trace_count = 0, trace_cursor = 0;
+
+// Parse one decimal field of a trace record header, ended by sep, and step
+// *p past it. Returns nonzero when the field is not a number or is ended by
+// anything else.
+int parse_trace_field(char **p, char sep, long *value) {
+  char *end;
+  if ((**p < '0' || **p > '9') && **p != '-')
+    return 1;
+  *value = strtol(*p, &end, 10);
+  if (end == *p || *end != sep)
+    return 1;
+  *p = end + 1;
+  return 0;
+}
+
+// Load a trace into memory. The buffer is kept for the life of the process
+// and the records point into it.
+int load_trace(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 1;
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  rewind(fp);
+  char *buf = malloc(size + 1);
+  if (!buf || fread(buf, 1, size, fp) != (size_t)size) {
+    free(buf);
+    fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+  buf[size] = '\0';
+  int cap = 0;
+  for (char *p = buf; p < buf + size;) {
+    // The header ends at exactly one newline, then cmd_len and output_len
+    // bytes follow, each ended by a newline. A trailing record cut short by
+    // an interrupted write is dropped; anything else malformed is an error.
+    TraceRecord r;
+    long status, cmd_len, output_len;
+    char *q = p;
+    if (parse_trace_field(&q, ' ', &status) ||
+        parse_trace_field(&q, ' ', &r.usec) ||
+        parse_trace_field(&q, ' ', &cmd_len) ||
+        parse_trace_field(&q, '\n', &output_len) || cmd_len < 0 ||
+        output_len < 0) {
+      if (!memchr(p, '\n', buf + size - p))
+        break;
+      return 1;
+    }
+    r.status = status;
+    r.output_len = output_len;
+    size_t left = buf + size - q;
+    if ((size_t)cmd_len >= left || r.output_len + 1 >= left - cmd_len)
+      break;
+    r.cmd = q;
+    r.output = r.cmd + cmd_len + 1;
+    if (r.cmd[cmd_len] != '\n' || r.output[r.output_len] != '\n')
+      return 1;
+    r.cmd[cmd_len] = '\0';
+    r.output[r.output_len] = '\0';
+    p = r.output + r.output_len + 1;
+    if (trace_count == cap) {
+      cap = cap ? cap * 2 : 64;
+      TraceRecord *grown = realloc(trace_records, cap * sizeof(r));
+      if (!grown)
+        break;
+      trace_records = grown;
+    }
+    trace_records[trace_count++] = r;
+  }
+  return 0;
+}
+
+void trace_init() {
+  if (trace_mode >= 0)
+    return;
+  trace_mode = TRACE_OFF;
+  const char *record = getenv("HSC_TRACE_RECORD");
+  const char *replay = getenv("HSC_TRACE_REPLAY");
+  const char *latency = getenv("HSC_TRACE_LATENCY");
+  trace_real_latency = latency && strcmp(latency, "real") == 0;
+  if (replay && replay[0]) {
+    if (load_trace(replay) != 0) {
+      fprintf(stderr, "Cannot load command trace %s.\n", replay);
+      exit(1);
+    }
+    trace_mode = TRACE_REPLAY;
+  } else if (record && record[0]) {
+    trace_fd = open(record, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (trace_fd >= 0)
+      trace_mode = TRACE_RECORD;
+  }
+}
+
+// Append one invocation with a single write(), so records from forked
+// children do not interleave.
+void trace_record(const char *cmd, int status, const struct timespec *t0,
+                  const char *output, size_t output_len) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long usec = (t1.tv_sec - t0->tv_sec) * 1000000L +
+              (t1.tv_nsec - t0->tv_nsec) / 1000;
+  size_t cmd_len = strlen(cmd);
+  char *rec = malloc(cmd_len + output_len + 64);
+  if (!rec)
+    return;
+  int len = sprintf(rec, "%d %ld %zu %zu\n", status, usec, cmd_len,
+                    output_len);
+  memcpy(rec + len, cmd, cmd_len);
+  len += cmd_len;
+  rec[len++] = '\n';
+  memcpy(rec + len, output, output_len);
+  len += output_len;
+  rec[len++] = '\n';
+  if (write(trace_fd, rec, len) != len)
+    perror("write trace");
+  free(rec);
+}
+
+// Replay cmd: returns its recorded status and, when output is given, a copy
+// of its recorded output (NULL when it printed nothing).
+int trace_replay(const char *cmd, char **output) {
+  for (int k = 0; k < trace_count; k++) {
+    int i = (trace_cursor + k) % trace_count;
+    TraceRecord *r = &trace_records[i];
+    if (strcmp(r->cmd, cmd) != 0)
+      continue;
+    trace_cursor = i + 1;
+    if (trace_real_latency)
+      usleep(r->usec);
+    if (output)
+      *output = r->output_len ? strdup(r->output) : NULL;
+    return r->status;
+  }
+  fprintf(stderr, "No recorded result for: %s\n", cmd);
+  if (output)
+    *output = NULL;
+  return 127 << 8;
+}
+
+// system() through the trace layer.
+int run_cmd(const char *cmd) {
+  trace_init();
+  if (trace_mode == TRACE_REPLAY)
+    return trace_replay(cmd, NULL);
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int status = system(cmd);
+  if (trace_mode == TRACE_RECORD)
+    trace_record(cmd, status, &t0, "", 0);
+  return status;
+}
+
+// Open a pipe to a tool's stdin. Under replay the input is discarded and
+// close_cmd_pipe() returns the recorded status.
+FILE *open_cmd_pipe(const char *cmd) {
+  trace_init();
+  if (trace_mode == TRACE_REPLAY)
+    return fopen("/dev/null", "w");
+  return popen(cmd, "w");
+}
+
+int close_cmd_pipe(FILE *fp, const char *cmd) {
+  if (trace_mode == TRACE_REPLAY) {
+    fclose(fp);
+    return trace_replay(cmd, NULL);
+  }
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int status = pclose(fp);
+  if (trace_mode == TRACE_RECORD)
+    trace_record(cmd, status, &t0, "", 0);
+  return status;
+}
+
+// sleep() that a zero-latency replay skips.
+void pause_seconds(unsigned int seconds) {
+  if (trace_mode != TRACE_REPLAY || trace_real_latency)
+    sleep(seconds);
+}
 
 // Helper function to run a command and capture its output.
 char *exec_cmd(const char *cmd) {
+  trace_init();
+  if (trace_mode == TRACE_REPLAY) {
+    char *output;
+    trace_replay(cmd, &output);
+    return output;
+  }
   FILE *fp;
   char *result = NULL;
   size_t size = 0;
   char buffer[256];
 
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
   fp = popen(cmd, "r");
   if (fp == NULL) {
     perror("popen failed");
@@ -36,7 +475,9 @@ char *exec_cmd(const char *cmd) {
     size += len;
     result[size] = '\0';
   }
-  pclose(fp);
+  int status = pclose(fp);
+  if (trace_mode == TRACE_RECORD)
+    trace_record(cmd, status, &t0, result ? result : "", result ? size : 0);
   return result;
 }
 
@@ -54,8 +495,9 @@ char *get_cmd_path(const char *cmd) {
 // Check that dnsmasq is running.
 int check_dnsmasq_running(const char *dnsmasq_path) {
   char cmd[128];
-  snprintf(cmd, sizeof(cmd), "pgrep -x %s >/dev/null 2>&1", "dnsmasq");
-  return (system(cmd) == 0);
+  snprintf(cmd, sizeof(cmd), "pgrep -F %s -x dnsmasq >/dev/null 2>&1",
+           DNSMASQ_PID_FILE);
+  return (run_cmd(cmd) == 0);
 }
 
 // Check that the AP interface has the expected IP.
@@ -65,7 +507,9 @@ int check_ap_ip(const char *ip_path) {
   char *output = exec_cmd(cmd);
   if (!output)
     return 0;
-  int ok = (strstr(output, "192.168.4.1") != NULL);
+  char expected[40];
+  snprintf(expected, sizeof(expected), "inet %s ", ap_cidr);
+  int ok = (strstr(output, expected) != NULL);
   free(output);
   return ok;
 }
@@ -151,6 +595,421 @@ WifiEntry *get_available_networks(const char *nmcli_path, int *count) {
   return networks;
 }
 
+// Check internet connectivity: the uplink is up when any probe target
+// answers. When iface is given the probe is forced out of that interface, so
+// a new uplink can be verified before traffic moves to it.
+int check_connectivity(const char *iface) {
+  char targets[sizeof(opts.probe)], cmd[192];
+  strcpy(targets, opts.probe);
+  char *save = NULL;
+  for (char *host = strtok_r(targets, ",", &save); host;
+       host = strtok_r(NULL, ",", &save)) {
+    if (iface && iface[0])
+      snprintf(cmd, sizeof(cmd), "ping -I %s -c 2 %s >/dev/null 2>&1", iface,
+               host);
+    else
+      snprintf(cmd, sizeof(cmd), "ping -c 2 %s >/dev/null 2>&1", host);
+    if (run_cmd(cmd) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Get the first IPv4 address (without prefix length) of an interface.
+void get_iface_ipv4(const char *iface, char *addr, size_t len) {
+  char cmd[160];
+  snprintf(cmd, sizeof(cmd),
+           "ip -4 -o addr show dev %s 2>/dev/null | awk '{print $4}' | "
+           "cut -d/ -f1 | head -n1",
+           iface);
+  char *output = exec_cmd(cmd);
+  addr[0] = '\0';
+  if (output) {
+    output[strcspn(output, "\n")] = '\0';
+    strncpy(addr, output, len - 1);
+    addr[len - 1] = '\0';
+    free(output);
+  }
+}
+
+// Get the device an active NetworkManager connection is bound to.
+int get_connection_device(const char *conn, char *dev, size_t len) {
+  char *output = exec_cmd("nmcli -t -f NAME,DEVICE con show --active");
+  dev[0] = '\0';
+  if (!output)
+    return 0;
+  char *line = strtok(output, "\n");
+  while (line) {
+    char *colon = strrchr(line, ':');
+    if (colon) {
+      *colon = '\0';
+      if (strcmp(line, conn) == 0) {
+        strncpy(dev, colon + 1, len - 1);
+        dev[len - 1] = '\0';
+        break;
+      }
+    }
+    line = strtok(NULL, "\n");
+  }
+  free(output);
+  return dev[0] != '\0';
+}
+
+// Find an idle Wi-Fi device other than the AP and the current uplink, so the
+// next uplink can be brought up before the current one is released.
+int find_spare_wifi_device(char *dev, size_t len) {
+  char *output = exec_cmd("nmcli -t -f DEVICE,TYPE,STATE dev status");
+  dev[0] = '\0';
+  if (!output)
+    return 0;
+  char *line = strtok(output, "\n");
+  while (line) {
+    char name[32], type[32], state[64];
+    if (sscanf(line, "%31[^:]:%31[^:]:%63s", name, type, state) == 3 &&
+        strcmp(type, "wifi") == 0 && strcmp(state, "disconnected") == 0 &&
+        strcmp(name, AP_IFACE) != 0 && strcmp(name, uplink_iface) != 0 &&
+        strcmp(name, ap_radio) != 0) {
+      strncpy(dev, name, len - 1);
+      dev[len - 1] = '\0';
+      break;
+    }
+    line = strtok(NULL, "\n");
+  }
+  free(output);
+  return dev[0] != '\0';
+}
+
+// Run tc commands (one per line) through a single tc -batch invocation.
+// Errors in individual lines do not stop the batch.
+int run_tc_batch(const char *batch) {
+  const char *cmd = "sudo tc -force -batch - >/dev/null 2>&1";
+  FILE *fp = open_cmd_pipe(cmd);
+  if (!fp) {
+    perror("popen tc");
+    return 1;
+  }
+  fputs(batch, fp);
+  return (close_cmd_pipe(fp, cmd) != 0);
+}
+
+// Measure uplink throughput in kbit/s with curl (upload when upload != 0).
+int measure_uplink_kbit(int upload) {
+  char cmd[256];
+  if (upload)
+    snprintf(cmd, sizeof(cmd),
+             "head -c 10000000 /dev/zero | curl -s -o /dev/null --max-time 10 "
+             "-w '%%{speed_upload}' --data-binary @- '%s'",
+             SPEEDTEST_UP_URL);
+  else
+    snprintf(cmd, sizeof(cmd),
+             "curl -s -o /dev/null --max-time 10 -w '%%{speed_download}' '%s'",
+             SPEEDTEST_DOWN_URL);
+  char *output = exec_cmd(cmd);
+  if (!output)
+    return 0;
+  double bytes_per_sec = atof(output);
+  free(output);
+  return (int)(bytes_per_sec * 8 / 1000);
+}
+
+// Shape uplink egress just below its capacity so the queue forms here, where
+// CAKE (or fq_codel under HTB) can manage it, instead of in the modem.
+int install_uplink_shaper(const char *iface, int kbit) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd),
+           "sudo tc qdisc replace dev %s root cake bandwidth %dkbit "
+           "dual-srchost nat >/dev/null 2>&1",
+           iface, kbit);
+  if (run_cmd(cmd) == 0)
+    return 0;
+  char batch[512];
+  snprintf(batch, sizeof(batch),
+           "qdisc replace dev %s root handle 1: htb default 10\n"
+           "class replace dev %s parent 1: classid 1:10 htb rate %dkbit ceil "
+           "%dkbit\n"
+           "qdisc replace dev %s parent 1:10 fq_codel\n",
+           iface, iface, kbit, kbit, iface);
+  return run_tc_batch(batch);
+}
+
+// Shape AP egress (client downloads): an HTB root at the measured rate whose
+// default class gets a CAKE leaf for per-host fairness (fq_codel when CAKE is
+// unavailable). Per-client caps hang off 1:1 as separate classes.
+int install_ap_shaper(int kbit) {
+  char batch[512];
+  snprintf(batch, sizeof(batch),
+           "qdisc replace dev %s root handle 1: htb default 10\n"
+           "class replace dev %s parent 1: classid 1:1 htb rate %dkbit ceil "
+           "%dkbit\n"
+           "class replace dev %s parent 1:1 classid 1:10 htb rate %dkbit ceil "
+           "%dkbit\n",
+           AP_IFACE, AP_IFACE, kbit, kbit, AP_IFACE, kbit, kbit);
+  if (run_tc_batch(batch) != 0)
+    return 1;
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "sudo tc qdisc add dev %s clsact 2>/dev/null",
+           AP_IFACE);
+  run_cmd(cmd);
+  snprintf(cmd, sizeof(cmd),
+           "sudo tc qdisc replace dev %s parent 1:10 handle 10: cake unlimited "
+           "dual-dsthost >/dev/null 2>&1",
+           AP_IFACE);
+  if (run_cmd(cmd) != 0) {
+    snprintf(cmd, sizeof(cmd),
+             "sudo tc qdisc replace dev %s parent 1:10 handle 10: fq_codel",
+             AP_IFACE);
+    return (run_cmd(cmd) != 0);
+  }
+  return 0;
+}
+
+// Load per-client caps ("IP down_kbit up_kbit" per line) from RATE_LIMIT_FILE.
+int load_rate_limits(RateLimit *limits, int max) {
+  FILE *fp = fopen(RATE_LIMIT_FILE, "r");
+  if (!fp)
+    return 0;
+  int n = 0;
+  char line[128];
+  while (n < max && fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%15s %d %d", limits[n].ip, &limits[n].down_kbit,
+               &limits[n].up_kbit) == 3)
+      n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+// Rebuild the per-client classes and filters from RATE_LIMIT_FILE in one tc
+// batch. Download caps are HTB classes on AP egress, upload caps are policers
+// on AP ingress. Returns the number of clients capped.
+int apply_client_rate_limits() {
+  RateLimit limits[MAX_RATE_LIMITS];
+  int n = load_rate_limits(limits, MAX_RATE_LIMITS);
+  size_t cap = 256 + MAX_RATE_LIMITS * 64 + n * 512, len = 0;
+  char *batch = malloc(cap);
+  if (!batch)
+    return 0;
+  len += snprintf(batch + len, cap - len,
+                  "filter del dev %s parent 1: prio 1\n"
+                  "filter del dev %s ingress prio 10\n",
+                  AP_IFACE, AP_IFACE);
+  for (int i = 0; i < MAX_RATE_LIMITS; i++)
+    len += snprintf(batch + len, cap - len, "class del dev %s classid 1:%x\n",
+                    AP_IFACE, 0x100 + i);
+  for (int i = 0; i < n; i++) {
+    int minor = 0x100 + i;
+    if (limits[i].down_kbit > 0)
+      len += snprintf(batch + len, cap - len,
+                      "class replace dev %s parent 1:1 classid 1:%x htb rate "
+                      "%dkbit ceil %dkbit\n"
+                      "qdisc replace dev %s parent 1:%x fq_codel\n"
+                      "filter add dev %s parent 1: protocol ip prio 1 u32 "
+                      "match ip dst %s/32 flowid 1:%x\n",
+                      AP_IFACE, minor, limits[i].down_kbit, limits[i].down_kbit,
+                      AP_IFACE, minor, AP_IFACE, limits[i].ip, minor);
+    if (limits[i].up_kbit > 0)
+      len += snprintf(batch + len, cap - len,
+                      "filter add dev %s ingress protocol ip prio 10 u32 "
+                      "match ip src %s/32 action police rate %dkbit burst 64k "
+                      "drop\n",
+                      AP_IFACE, limits[i].ip, limits[i].up_kbit);
+  }
+  run_tc_batch(batch);
+  free(batch);
+  return n;
+}
+
+// Measure the uplink, then install the AP and uplink shapers and any
+// per-client caps. Rates are set to 90% of the measured capacity unless fixed
+// through shaper_down_kbit / shaper_up_kbit.
+int setup_traffic_shaping() {
+  int down = opts.shaper_down_kbit, up = opts.shaper_up_kbit;
+  if (down == 0)
+    down = measure_uplink_kbit(0) * 9 / 10;
+  if (up == 0)
+    up = measure_uplink_kbit(1) * 9 / 10;
+  if (down <= 0 || up <= 0) {
+    fprintf(stderr, "Could not measure uplink capacity; shaping disabled.\n");
+    return 1;
+  }
+  printf("Shaping %s to %d kbit/s and %s to %d kbit/s.\n", AP_IFACE, down,
+         uplink_iface, up);
+  if (install_ap_shaper(down) != 0 ||
+      install_uplink_shaper(uplink_iface, up) != 0) {
+    fprintf(stderr, "Failed to install traffic shaper.\n");
+    return 1;
+  }
+  shaper_up_kbit = up;
+  int capped = apply_client_rate_limits();
+  if (capped > 0)
+    printf("Applied rate limits for %d client(s).\n", capped);
+  return 0;
+}
+
+// Average RTT in ms reported by "ping <args>", or -1 without replies.
+double ping_avg_rtt(const char *args) {
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "ping %s 2>/dev/null", args);
+  char *output = exec_cmd(cmd);
+  if (!output)
+    return -1;
+  double rtt = -1;
+  char *stats = strstr(output, "min/avg/max");
+  if (stats && (stats = strchr(stats, '=')) != NULL)
+    sscanf(stats, "= %*f/%lf", &rtt);
+  free(output);
+  return rtt;
+}
+
+// Compare RTT on an idle uplink with RTT while a bulk download saturates it.
+// Returns nonzero if either measurement got no replies.
+int measure_latency_under_load(double *idle_ms, double *loaded_ms) {
+  *idle_ms = ping_avg_rtt("-c 10 -i 0.2 " LATENCY_TARGET);
+  pid_t load_pid = fork();
+  if (load_pid == 0) {
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    execlp("curl", "curl", "-s", "-o", "/dev/null", "--max-time", "15",
+           SPEEDTEST_DOWN_URL, NULL);
+    exit(1);
+  }
+  sleep(2); // Let the download ramp up and fill the queues.
+  *loaded_ms = ping_avg_rtt("-c 20 -i 0.2 " LATENCY_TARGET);
+  if (load_pid > 0) {
+    kill(load_pid, SIGTERM);
+    waitpid(load_pid, NULL, 0);
+  }
+  return (*idle_ms < 0 || *loaded_ms < 0);
+}
+
+// Offload established flows between the AP and the uplink to an nftables
+// flowtable, so after the first packets they skip the FORWARD/POSTROUTING
+// hooks walked by the iptables rules. Reinstalling replaces the table.
+int install_flowtable(const char *iface) {
+  FILE *fp = open_cmd_pipe("sudo nft -f -");
+  if (!fp) {
+    perror("popen nft");
+    return 1;
+  }
+  fprintf(fp,
+          "table inet " FASTPATH_TABLE "\n"
+          "delete table inet " FASTPATH_TABLE "\n"
+          "table inet " FASTPATH_TABLE " {\n"
+          "  flowtable ft {\n"
+          "    hook ingress priority 0;\n"
+          "    devices = { \"%s\", \"%s\" };\n"
+          "  }\n"
+          "  chain forward {\n"
+          "    type filter hook forward priority 0; policy accept;\n"
+          "    meta l4proto { tcp, udp } ct state established flow add @ft\n"
+          "  }\n"
+          "}\n",
+          AP_IFACE, iface);
+  if (close_cmd_pipe(fp, "sudo nft -f -") != 0) {
+    fprintf(stderr, "Failed to install nftables flowtable on %s and %s.\n",
+            AP_IFACE, iface);
+    return 1;
+  }
+  fastpath_installed = 1;
+  return 0;
+}
+
+// Add an iptables rule unless an identical one is already installed, so
+// restarts and failovers do not stack duplicate NAT rules. Returns nonzero
+// when the rule could not be added.
+int ensure_iptables_rule(const char *iptables_path, const char *table,
+                         const char *rule) {
+  char cmd[768];
+  snprintf(cmd, sizeof(cmd),
+           "sudo %s -t %s -C %s 2>/dev/null || sudo %s -t %s -A %s",
+           iptables_path, table, rule, iptables_path, table, rule);
+  return run_cmd(cmd) != 0;
+}
+
+// The MASQUERADE rule (i = 0) and the two forward rules (filter table) that
+// share the hotspot through uplink iface.
+void format_nat_rule(int i, const char *iface, char *buf, size_t len) {
+  if (i == 0)
+    snprintf(buf, len, "POSTROUTING -o %s -j MASQUERADE", iface);
+  else if (i == 1)
+    snprintf(buf, len, "FORWARD -i %s -o %s -j ACCEPT", AP_IFACE, iface);
+  else
+    snprintf(buf, len,
+             "FORWARD -i %s -o %s -m state --state RELATED,ESTABLISHED "
+             "-j ACCEPT",
+             iface, AP_IFACE);
+}
+
+// Delete the NAT and forward rules for iface that were added with
+// nat_iptables.
+void remove_nat_rules(const char *iface) {
+  char rule[160], cmd[384];
+  for (int i = 0; i < NAT_RULES; i++) {
+    format_nat_rule(i, iface, rule, sizeof(rule));
+    snprintf(cmd, sizeof(cmd), "sudo %s -w -t %s -D %s 2>/dev/null",
+             nat_iptables, i == 0 ? "nat" : "filter", rule);
+    run_cmd(cmd);
+  }
+}
+
+// Make new_iface the uplink: add its NAT and forward rules next to the
+// current ones and move the uplink shaper and the flowtable over. Rules a
+// warm restart already found are not added twice. The old rules stay until
+// release_uplink(), so flows keep being NATed by whichever link the route
+// still picks until the old one is disconnected.
+int rebind_uplink(const char *new_iface) {
+  char new_addr[64];
+  get_iface_ipv4(new_iface, new_addr, sizeof(new_addr));
+
+  if (nat_installed && strcmp(new_iface, uplink_iface) != 0) {
+    char rule[160];
+    for (int i = 0; i < NAT_RULES; i++) {
+      format_nat_rule(i, new_iface, rule, sizeof(rule));
+      if (ensure_iptables_rule(nat_iptables, i == 0 ? "nat" : "filter",
+                               rule) != 0) {
+        fprintf(stderr, "Failed to add NAT rules for %s.\n", new_iface);
+        return 1;
+      }
+    }
+    if (shaper_up_kbit > 0) {
+      char tcCmd[128];
+      snprintf(tcCmd, sizeof(tcCmd),
+               "sudo tc qdisc del dev %s root 2>/dev/null", uplink_iface);
+      run_cmd(tcCmd);
+      install_uplink_shaper(new_iface, shaper_up_kbit);
+    }
+    if (fastpath_installed)
+      install_flowtable(new_iface);
+  }
+
+  strncpy(uplink_iface, new_iface, sizeof(uplink_iface) - 1);
+  uplink_iface[sizeof(uplink_iface) - 1] = '\0';
+  strncpy(uplink_addr, new_addr, sizeof(uplink_addr) - 1);
+  uplink_addr[sizeof(uplink_addr) - 1] = '\0';
+  return 0;
+}
+
+// Finish a switch once old_iface is disconnected: delete its rules and drop
+// only the conntrack entries still masqueraded to old_addr, which the
+// hotspot no longer owns; everything else survives. Flushing earlier would
+// let packets on the still-preferred old route create entries without NAT
+// that stick to their flows after the route moves.
+void release_uplink(const char *old_iface, const char *old_addr) {
+  if (!nat_installed)
+    return;
+  if (old_iface[0] && strcmp(old_iface, uplink_iface) != 0) {
+    remove_nat_rules(old_iface);
+    printf("NAT rules moved from %s to %s.\n", old_iface, uplink_iface);
+  }
+  if (old_addr[0] && strcmp(old_addr, uplink_addr) != 0) {
+    char ctCmd[128];
+    snprintf(ctCmd, sizeof(ctCmd),
+             "sudo conntrack -D --reply-dst %s >/dev/null 2>&1", old_addr);
+    printf("Flushing conntrack entries masqueraded to %s...\n", old_addr);
+    run_cmd(ctCmd);
+  }
+}
+
 // Automatically switch to the best saved Wi-Fi (highest signal)
 // Returns 0 on success, nonzero on failure.
 int auto_switch_wifi(const char *nmcli_path) {
@@ -196,38 +1055,76 @@ int auto_switch_wifi(const char *nmcli_path) {
   }
   printf("Best candidate found: \"%s\" with signal strength %d\n", bestSSID,
          bestSignal);
+
+  // In make-before-break mode prefer an idle radio, so the current uplink
+  // keeps forwarding until the new one is verified.
+  char spare[32] = "";
+  if (opts.make_before_break && find_spare_wifi_device(spare, sizeof(spare)))
+    printf("Bringing up \"%s\" on %s before releasing %s...\n", bestSSID,
+           spare, uplink_iface);
+  else if (opts.make_before_break)
+    fprintf(stderr,
+            "No spare Wi-Fi radio: falling back to break-before-make on %s. "
+            "Client traffic stops until \"%s\" is up.\n",
+            uplink_iface, bestSSID);
   char cmd[256];
-  snprintf(cmd, sizeof(cmd), "sudo %s con up \"%s\"", nmcli_path, bestSSID);
+  if (spare[0])
+    snprintf(cmd, sizeof(cmd), "sudo %s con up \"%s\" ifname %s", nmcli_path,
+             bestSSID, spare);
+  else
+    snprintf(cmd, sizeof(cmd), "sudo %s con up \"%s\"", nmcli_path, bestSSID);
   printf("Attempting to connect to \"%s\"...\n", bestSSID);
-  if (system(cmd) != 0) {
+  if (run_cmd(cmd) != 0) {
     fprintf(stderr, "Failed to activate connection for \"%s\".\n", bestSSID);
     return 1;
   }
-  sleep(2);
-  if (system("ping -c 2 google.com >/dev/null 2>&1") != 0) {
+  pause_seconds(2);
+  char new_iface[32] = "";
+  get_connection_device(bestSSID, new_iface, sizeof(new_iface));
+  if (!check_connectivity(spare[0] ? new_iface : NULL)) {
     fprintf(
         stderr,
         "Connection attempt to \"%s\" did not restore internet connectivity.\n",
         bestSSID);
+    if (spare[0]) {
+      snprintf(cmd, sizeof(cmd), "sudo %s dev disconnect %s", nmcli_path,
+               spare);
+      run_cmd(cmd);
+    }
     return 1;
   } else {
     printf("Reconnected to \"%s\" successfully!\n", bestSSID);
   }
+
+  if (opts.make_before_break && new_iface[0]) {
+    char old_iface[32], old_addr[64];
+    snprintf(old_iface, sizeof(old_iface), "%s", uplink_iface);
+    snprintf(old_addr, sizeof(old_addr), "%s", uplink_addr);
+    if (rebind_uplink(new_iface) != 0)
+      return 1;
+    // Only now release the previous uplink.
+    if (old_iface[0] && strcmp(old_iface, new_iface) != 0) {
+      snprintf(cmd, sizeof(cmd), "sudo %s dev disconnect %s", nmcli_path,
+               old_iface);
+      run_cmd(cmd);
+    }
+    release_uplink(old_iface, old_addr);
+  }
   return 0;
 }
 
 // Check if systemd-resolved is active and warn the user.
 void check_systemd_resolved() {
-  if (system("systemctl is-active --quiet systemd-resolved") == 0) {
+  if (run_cmd("systemctl is-active --quiet systemd-resolved") == 0) {
     fprintf(stderr, "Warning: systemd-resolved is active. It may conflict with "
                     "dnsmasq on port 53.\n");
   }
 }
 
 // Function to load hotspot configuration (SSID and password) from file,
-// or prompt the user if not present.
+// or prompt the user if not present and interactive is set.
 void load_hotspot_config(char *ssid, size_t ssid_len, char *pass,
-                         size_t pass_len) {
+                         size_t pass_len, int interactive) {
   FILE *config = fopen(CONFIG_FILE, "r");
   if (config) {
     if (fgets(ssid, ssid_len, config) != NULL) {
@@ -238,6 +1135,11 @@ void load_hotspot_config(char *ssid, size_t ssid_len, char *pass,
     }
     fclose(config);
     printf("Using saved hotspot configuration:\n  SSID: %s\n", ssid);
+  } else if (!interactive) {
+    fprintf(stderr, "No saved hotspot configuration in %s. Use a profile or "
+                    "--ssid/--psk.\n",
+            CONFIG_FILE);
+    exit(1);
   } else {
     printf("Enter SSID for hotspot: ");
     if (!fgets(ssid, ssid_len, stdin)) {
@@ -263,90 +1165,4592 @@ void load_hotspot_config(char *ssid, size_t ssid_len, char *pass,
   }
 }
 
-// Cleanup function to be called on SIGINT/SIGTERM.
-void cleanup_handler(int sig) {
-  printf("\nStopping hotspot...\n");
-  if (hostapd_pid > 0) {
-    kill(hostapd_pid, SIGTERM);
-  }
-  system("sudo killall dnsmasq 2>/dev/null");
-  char delCmd[128];
-  snprintf(delCmd, sizeof(delCmd), "sudo iw dev %s del", AP_IFACE);
-  system(delCmd);
-  exit(0);
+// Format a host-order IPv4 address.
+void format_ipv4(unsigned int addr, char *buf, size_t len) {
+  struct in_addr in = {htonl(addr)};
+  inet_ntop(AF_INET, &in, buf, len);
 }
 
-int main(void) {
-  signal(SIGINT, cleanup_handler);
-  signal(SIGTERM, cleanup_handler);
+// Parse a dotted-quad IPv4 address into host order.
+int parse_ipv4(const char *text, unsigned int *addr) {
+  struct in_addr in;
+  if (inet_pton(AF_INET, text, &in) != 1)
+    return 1;
+  *addr = ntohl(in.s_addr);
+  return 0;
+}
 
-  // Increase file descriptor limit.
-  struct rlimit rl;
-  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
-    rl.rlim_cur = 4096;
-    setrlimit(RLIMIT_NOFILE, &rl);
+// Convert a dnsmasq lease time to seconds: "infinite" (0xffffffff), or at
+// least two minutes given as a number with an optional s/m/h/d/w suffix.
+// Returns 0 for invalid values.
+unsigned int lease_seconds(const char *lease) {
+  if (strcmp(lease, "infinite") == 0)
+    return 0xffffffffu;
+  char *end;
+  long n = strtol(lease, &end, 10);
+  if (end == lease || n <= 0 || (end[0] && end[1]))
+    return 0;
+  long unit = 1;
+  switch (*end) {
+  case '\0':
+  case 's':
+    break;
+  case 'm':
+    unit = 60;
+    break;
+  case 'h':
+    unit = 3600;
+    break;
+  case 'd':
+    unit = 86400;
+    break;
+  case 'w':
+    unit = 604800;
+    break;
+  default:
+    return 0;
   }
+  if (n > 0xfffffffeL / unit || n * unit < 120)
+    return 0;
+  return n * unit;
+}
 
-  // Fetch full paths for required commands.
-  char *iw_path = get_cmd_path("iw");
-  char *hostapd_path = get_cmd_path("hostapd");
-  char *dnsmasq_path = get_cmd_path("dnsmasq");
-  char *nmcli_path = get_cmd_path("nmcli");
-  char *systemctl_path = get_cmd_path("systemctl");
-  char *ip_path = get_cmd_path("ip");
-  char *iptables_path = get_cmd_path("iptables");
-
-  if (!iw_path || !hostapd_path || !dnsmasq_path || !nmcli_path ||
-      !systemctl_path || !ip_path || !iptables_path) {
-    fprintf(stderr, "One or more required tools are missing.\n");
-    exit(1);
+// Derive the AP address and DHCP pool from the subnet options and validate
+// them: a private network between /16 and /30, a pool inside it that leaves
+// out the network, AP and broadcast addresses, and a lease time dnsmasq
+// accepts. Without an explicit pool the whole subnet is used, except for the
+// default subnet, which keeps its historical .2-.100 range. On failure a
+// message is left in err.
+int validate_net_config(char *err, size_t err_len) {
+  char net[32];
+  strncpy(net, opts.subnet, sizeof(net) - 1);
+  net[sizeof(net) - 1] = '\0';
+  char *slash = strchr(net, '/');
+  char *end = NULL;
+  long prefix = slash ? strtol(slash + 1, &end, 10) : 0;
+  if (slash)
+    *slash = '\0';
+  unsigned int base;
+  if (!slash || *end != '\0' || prefix < 16 || prefix > 30 ||
+      parse_ipv4(net, &base) != 0) {
+    snprintf(err, err_len, "Invalid subnet '%s': expected a.b.c.d/16 to /30.",
+             opts.subnet);
+    return 1;
+  }
+  unsigned int mask = ~0u << (32 - prefix);
+  if (base & ~mask) {
+    snprintf(err, err_len, "Invalid subnet '%s': host bits are set.",
+             opts.subnet);
+    return 1;
+  }
+  if ((base & 0xff000000) != 0x0a000000 && (base & 0xfff00000) != 0xac100000 &&
+      (base & 0xffff0000) != 0xc0a80000) {
+    snprintf(err, err_len, "Invalid subnet '%s': not a private range.",
+             opts.subnet);
+    return 1;
   }
 
-  printf("Found tools:\n");
-  printf("iw:         %s\n", iw_path);
-  printf("hostapd:    %s\n", hostapd_path);
-  printf("dnsmasq:    %s\n", dnsmasq_path);
-  printf("nmcli:      %s\n", nmcli_path);
-  printf("systemctl:  %s\n", systemctl_path);
-  printf("ip:         %s\n", ip_path);
-  printf("iptables:   %s\n", iptables_path);
+  unsigned int ap = base + 1, broadcast = base | ~mask;
+  int legacy = (strcmp(opts.subnet, DEFAULT_SUBNET) == 0);
+  unsigned int start = legacy ? base + 2 : ap + 1;
+  unsigned int last = legacy ? base + 100 : broadcast - 1;
+  if ((opts.dhcp_start[0] && parse_ipv4(opts.dhcp_start, &start) != 0) ||
+      (opts.dhcp_end[0] && parse_ipv4(opts.dhcp_end, &last) != 0))
+    start = last = 0;
+  if (start <= ap || last >= broadcast || start > last ||
+      (start & mask) != base || (last & mask) != base) {
+    snprintf(err, err_len,
+             "Invalid DHCP range: it must lie inside %s, after the AP "
+             "address and before broadcast.",
+             opts.subnet);
+    return 1;
+  }
+  if (!lease_seconds(opts.lease_time)) {
+    snprintf(err, err_len, "Invalid lease time '%s'.", opts.lease_time);
+    return 1;
+  }
 
-  check_systemd_resolved();
+  char start_text[16], last_text[16];
+  format_ipv4(ap, ap_addr, sizeof(ap_addr));
+  format_ipv4(start, start_text, sizeof(start_text));
+  format_ipv4(last, last_text, sizeof(last_text));
+  snprintf(ap_cidr, sizeof(ap_cidr), "%s/%ld", ap_addr, prefix);
+  snprintf(dhcp_range, sizeof(dhcp_range), "%s,%s,%s", start_text, last_text,
+           opts.lease_time);
+  dhcp_pool_size = last - start + 1;
 
-  // Fetch the connected WLAN interface using nmcli.
-  char *wlan_iface = exec_cmd("nmcli -t -f DEVICE,TYPE,STATE dev status | grep "
-                              "':wifi:connected' | cut -d: -f1 | head -n1");
-  if (!wlan_iface || strlen(wlan_iface) == 0) {
-    fprintf(stderr, "No connected WLAN interface detected.\n");
-    exit(1);
+  if (opts.ipv6 == IPV6_ROUTED && !opts.ipv6_prefix[0]) {
+    snprintf(err, err_len, "ipv6=routed needs ipv6_prefix.");
+    return 1;
   }
-  wlan_iface[strcspn(wlan_iface, "\n")] = '\0';
-  printf("Detected connected WLAN interface: %s\n", wlan_iface);
+  if (opts.ipv6 != IPV6_OFF && opts.builtin_dhcp && !opts.dns_profile) {
+    snprintf(err, err_len, "IPv6 needs dnsmasq for router advertisements: "
+                           "use dhcp_backend=dnsmasq or dns_profile=on.");
+    return 1;
+  }
+  return 0;
+}
 
-  // Load hotspot configuration (SSID and password) from file or prompt.
-  char ssid[128], pass[128];
-  load_hotspot_config(ssid, sizeof(ssid), pass, sizeof(pass));
+// Parse a colon-separated MAC address.
+int parse_mac(const char *text, unsigned char *mac) {
+  char end;
+  return sscanf(text, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%c", &mac[0],
+                &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &end) != 6;
+}
 
-  // Prompt for connectivity check interval.
-  int check_interval = 10; // default seconds
-  char interval_input[16];
-  printf("Enter connectivity check interval in seconds [default 10]: ");
-  if (fgets(interval_input, sizeof(interval_input), stdin) != NULL) {
-    if (interval_input[0] != '\n') {
-      check_interval = atoi(interval_input);
-      if (check_interval <= 0)
-        check_interval = 10;
-    }
-  }
-  printf("Using connectivity check interval: %d seconds\n", check_interval);
+// Parse an IPv6 /64 prefix, e.g. 2001:db8:1:2::/64, with the host bits
+// clear.
+int parse_ipv6_prefix(const char *text, struct in6_addr *prefix) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s", text);
+  char *slash = strchr(buf, '/');
+  if (!slash || strcmp(slash, "/64") != 0)
+    return 1;
+  *slash = '\0';
+  if (inet_pton(AF_INET6, buf, prefix) != 1)
+    return 1;
+  for (int i = 8; i < 16; i++)
+    if (prefix->s6_addr[i])
+      return 1;
+  return 0;
+}
+
+// A WPA passphrase of 8-63 characters or a raw PSK of 64 hex digits.
+int valid_psk(const char *psk) {
+  size_t len = strlen(psk);
+  return (len >= 8 && len <= 63) ||
+         (len == 64 && strspn(psk, "0123456789abcdefABCDEF") == 64);
+}
+
+// Parse an on/off option value.
+int parse_switch(const char *value, int *out) {
+  if (strcmp(value, "on") == 0)
+    *out = 1;
+  else if (strcmp(value, "off") == 0)
+    *out = 0;
+  else
+    return 1;
+  return 0;
+}
+
+// Parse a non-negative integer option value.
+int parse_count(const char *value, int *out) {
+  char *end;
+  long v = strtol(value, &end, 10);
+  if (value[0] == '\0' || *end != '\0' || v < 0 || v > INT_MAX)
+    return 1;
+  *out = (int)v;
+  return 0;
+}
+
+// Parse an integer option value between min and max. A rejected value leaves
+// *out as it was.
+int parse_range(const char *value, int min, int max, int *out) {
+  int v;
+  if (parse_count(value, &v) != 0 || v < min || v > max)
+    return 1;
+  *out = v;
+  return 0;
+}
+
+// Copy a string option value, rejecting values that do not fit.
+int copy_option(const char *value, char *out, size_t len) {
+  if (strlen(value) >= len)
+    return 1;
+  strcpy(out, value);
+  return 0;
+}
+
+// Accept a comma-separated list of host names or addresses. The list ends up
+// in a shell command, so anything else is rejected.
+int valid_probe_list(const char *value) {
+  if (value[0] == '\0' || value[0] == ',' || strstr(value, ",,") ||
+      value[strlen(value) - 1] == ',')
+    return 0;
+  return strspn(value, "abcdefghijklmnopqrstuvwxyz"
+                       "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.:-,") ==
+         strlen(value);
+}
+
+// Apply a single engine setting. Returns nonzero for unknown keys or values.
+int set_hotspot_option(const char *key, const char *value) {
+  if (strcmp(key, "switch_mode") == 0) {
+    if (strcmp(value, "mbb") == 0)
+      opts.make_before_break = 1;
+    else if (strcmp(value, "classic") == 0)
+      opts.make_before_break = 0;
+    else
+      return 1;
+  } else if (strcmp(key, "shaper") == 0) {
+    return parse_switch(value, &opts.shaper);
+  } else if (strcmp(key, "shaper_down_kbit") == 0) {
+    return parse_count(value, &opts.shaper_down_kbit);
+  } else if (strcmp(key, "shaper_up_kbit") == 0) {
+    return parse_count(value, &opts.shaper_up_kbit);
+  } else if (strcmp(key, "fastpath") == 0) {
+    return parse_switch(value, &opts.fastpath);
+  } else if (strcmp(key, "bpf_acct") == 0) {
+    return parse_switch(value, &opts.bpf_acct);
+  } else if (strcmp(key, "ct_autosize") == 0) {
+    return parse_switch(value, &opts.ct_autosize);
+  } else if (strcmp(key, "ct_watermark") == 0) {
+    return parse_range(value, 10, 95, &opts.ct_watermark);
+  } else if (strcmp(key, "ct_max_limit") == 0) {
+    return parse_range(value, 1024, INT_MAX, &opts.ct_max_limit);
+  } else if (strcmp(key, "subnet") == 0) {
+    return copy_option(value, opts.subnet, sizeof(opts.subnet));
+  } else if (strcmp(key, "dhcp_start") == 0) {
+    return copy_option(value, opts.dhcp_start, sizeof(opts.dhcp_start));
+  } else if (strcmp(key, "dhcp_end") == 0) {
+    return copy_option(value, opts.dhcp_end, sizeof(opts.dhcp_end));
+  } else if (strcmp(key, "lease_time") == 0) {
+    return copy_option(value, opts.lease_time, sizeof(opts.lease_time));
+  } else if (strcmp(key, "dhcp_backend") == 0) {
+    if (strcmp(value, "builtin") == 0)
+      opts.builtin_dhcp = 1;
+    else if (strcmp(value, "dnsmasq") == 0)
+      opts.builtin_dhcp = 0;
+    else
+      return 1;
+  } else if (strcmp(key, "dns_profile") == 0) {
+    return parse_switch(value, &opts.dns_profile);
+  } else if (strcmp(key, "dns_cache_size") == 0) {
+    return parse_range(value, 0, 100000, &opts.dns_cache_size);
+  } else if (strcmp(key, "dns_min_ttl") == 0) {
+    return parse_range(value, 0, 3600, &opts.dns_min_ttl);
+  } else if (strcmp(key, "channel_select") == 0) {
+    if (strcmp(value, "acs") == 0)
+      opts.acs = 1;
+    else if (strcmp(value, "follow") == 0)
+      opts.acs = 0;
+    else
+      return 1;
+  } else if (strcmp(key, "acs_interval") == 0) {
+    return parse_range(value, 60, INT_MAX, &opts.acs_interval);
+  } else if (strcmp(key, "security") == 0) {
+    const char *modes[] = {"wpa2", "transition", "wpa3"};
+    for (int i = 0; i < 3; i++)
+      if (strcmp(value, modes[i]) == 0) {
+        opts.security = i;
+        return 0;
+      }
+    return 1;
+  } else if (strcmp(key, "ft") == 0) {
+    return parse_switch(value, &opts.ft);
+  } else if (strcmp(key, "reconcile") == 0) {
+    return parse_switch(value, &opts.reconcile);
+  } else if (strcmp(key, "band") == 0) {
+    const char *bands[] = {"any", "2.4", "5"};
+    for (int i = 0; i < 3; i++)
+      if (strcmp(value, bands[i]) == 0) {
+        opts.band = i;
+        return 0;
+      }
+    return 1;
+  } else if (strcmp(key, "probe") == 0) {
+    return !valid_probe_list(value) ||
+           copy_option(value, opts.probe, sizeof(opts.probe));
+  } else if (strcmp(key, "check_interval") == 0) {
+    return parse_range(value, 1, 3600, &opts.check_interval);
+  } else if (strcmp(key, "history") == 0) {
+    return parse_switch(value, &opts.history);
+  } else if (strcmp(key, "ipv6") == 0) {
+    const char *modes[] = {"off", "proxy", "routed"};
+    for (int i = 0; i < 3; i++)
+      if (strcmp(value, modes[i]) == 0) {
+        opts.ipv6 = i;
+        return 0;
+      }
+    return 1;
+  } else if (strcmp(key, "ipv6_prefix") == 0) {
+    struct in6_addr prefix;
+    if (value[0] && parse_ipv6_prefix(value, &prefix) != 0)
+      return 1;
+    return copy_option(value, opts.ipv6_prefix, sizeof(opts.ipv6_prefix));
+  } else if (strcmp(key, "mtu_clamp") == 0) {
+    return parse_switch(value, &opts.mtu_clamp);
+  } else if (strcmp(key, "uplink_mtu") == 0) {
+    int mtu;
+    if (parse_count(value, &mtu) != 0 ||
+        (mtu && (mtu < PMTU_MIN || mtu > 9000)))
+      return 1;
+    opts.uplink_mtu = mtu;
+  } else if (strcmp(key, "cpu_tuning") == 0) {
+    return parse_switch(value, &opts.cpu_tuning);
+  } else if (strcmp(key, "speedtest_server") == 0) {
+    return parse_switch(value, &opts.speedtest_server);
+  } else if (strcmp(key, "bssid") == 0) {
+    unsigned char mac[6];
+    if (value[0] && (parse_mac(value, mac) != 0 || (mac[0] & 1)))
+      return 1;
+    return copy_option(value, opts.bssid, sizeof(opts.bssid));
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+// Load optional engine settings (one key=value per line) from OPTIONS_FILE.
+void load_hotspot_options() {
+  FILE *fp = fopen(OPTIONS_FILE, "r");
+  if (!fp)
+    return;
+  char line[256];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '#' || line[0] == '\0')
+      continue;
+    char *eq = strchr(line, '=');
+    if (eq)
+      *eq = '\0';
+    if (!eq || set_hotspot_option(line, eq + 1) != 0)
+      fprintf(stderr, "Ignoring invalid option '%s' in %s.\n", line,
+              OPTIONS_FILE);
+  }
+  fclose(fp);
+}
+
+// --- Headless profiles ---
+
+// Named profiles live in an INI-style file: a [name] header followed by
+// ssid=, psk= and any engine option (subnet, band, probe, check_interval,
+// ...). Every profile is validated once and the results are cached as an
+// array of HotspotProfile records, keyed on the source file's identity, so
+// a boot-time start reads one small file and parses nothing. The cache holds
+// the PSKs, so it lives in a root-only state directory.
+typedef struct {
+  char name[32];
+  char ssid[33];
+  char psk[65]; // 8-63 character passphrase or 64 hex digits
+  HotspotOptions opts; // Defaults with the profile's options applied
+} HotspotProfile;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int format;      // PROFILE_FORMAT
+  unsigned int record_size; // sizeof(HotspotProfile); catches layout changes
+  unsigned long long defaults_hash; // Compiled-in defaults profiles start from
+  char source[128];
+  long long source_ino, source_size, source_mtime_ns;
+  int count;
+} ProfileCacheHeader;
+
+// Parse and validate every profile in path, starting each one from base.
+// Returns the number of profiles, or -1 after reporting the first error.
+int compile_profiles(const char *path, const HotspotOptions *base,
+                     HotspotProfile *out, int max) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Cannot open profile file %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  HotspotOptions saved = opts;
+  char line[256], err[256] = "";
+  int n = 0, lineno = 0;
+  while (!err[0] && fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '#' || line[0] == ';' || line[0] == '\0')
+      continue;
+    char *eq = strchr(line, '=');
+    if (line[0] == '[') {
+      char *close = strchr(line, ']');
+      if (!close || close == line + 1 || close - line > 32 || close[1]) {
+        snprintf(err, sizeof(err), "bad section header");
+      } else if (n == max) {
+        snprintf(err, sizeof(err), "more than %d profiles", max);
+      } else {
+        memset(&out[n], 0, sizeof(out[n]));
+        memcpy(out[n].name, line + 1, close - line - 1);
+        out[n++].opts = *base;
+      }
+    } else if (n == 0 || !eq) {
+      snprintf(err, sizeof(err), "expected [profile] or key=value");
+    } else {
+      *eq = '\0';
+      HotspotProfile *p = &out[n - 1];
+      const char *value = eq + 1;
+      size_t len = strlen(value);
+      if (strcmp(line, "ssid") == 0) {
+        if (len < 1 || len > 32)
+          snprintf(err, sizeof(err), "ssid must be 1-32 characters");
+        else
+          strcpy(p->ssid, value);
+      } else if (strcmp(line, "psk") == 0) {
+        if (!valid_psk(value))
+          snprintf(err, sizeof(err),
+                   "psk must be 8-63 characters or 64 hex digits");
+        else
+          memcpy(p->psk, value, len);
+      } else {
+        opts = p->opts;
+        if (set_hotspot_option(line, value) != 0)
+          snprintf(err, sizeof(err), "invalid option '%.64s'", line);
+        p->opts = opts;
+      }
+    }
+  }
+  fclose(fp);
+  if (err[0])
+    fprintf(stderr, "%s:%d: %s\n", path, lineno, err);
+  // Whole-profile checks: credentials present and a consistent address
+  // plan.
+  for (int i = 0; !err[0] && i < n; i++) {
+    char netErr[160];
+    opts = out[i].opts;
+    if (!out[i].ssid[0] || !out[i].psk[0])
+      snprintf(err, sizeof(err), "profile '%s' needs ssid and psk",
+               out[i].name);
+    else if (validate_net_config(netErr, sizeof(netErr)) != 0)
+      snprintf(err, sizeof(err), "profile '%s': %s", out[i].name, netErr);
+    if (err[0])
+      fprintf(stderr, "%s: %s\n", path, err);
+  }
+  opts = saved;
+  if (err[0])
+    return -1;
+  return n;
+}
+
+// Find profile name in path, using the compiled cache when it still matches
+// the source file and rebuilding it otherwise.
+int load_profile(const char *path, const char *name,
+                 const HotspotOptions *base, HotspotProfile *profile) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Cannot open profile file %s: %s\n", path,
+            strerror(errno));
+    return 1;
+  }
+  // Zeroed first so the padding compares equal to the cached header.
+  ProfileCacheHeader want;
+  memset(&want, 0, sizeof(want));
+  want.magic = PROFILE_MAGIC;
+  want.format = PROFILE_FORMAT;
+  want.record_size = sizeof(HotspotProfile);
+  // A build with other defaults must not reuse profiles compiled from the
+  // old ones.
+  want.defaults_hash = 14695981039346656037ull; // FNV-1a 64
+  for (size_t i = 0; i < sizeof(*base); i++)
+    want.defaults_hash =
+        (want.defaults_hash ^ ((const unsigned char *)base)[i]) *
+        1099511628211ull;
+  want.source_ino = st.st_ino;
+  want.source_size = st.st_size;
+  want.source_mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  snprintf(want.source, sizeof(want.source), "%s", path);
+
+  HotspotProfile all[MAX_PROFILES];
+  ProfileCacheHeader have;
+  int fd = open(PROFILE_CACHE, O_RDONLY);
+  int n = -1;
+  if (fd >= 0) {
+    if (read(fd, &have, sizeof(have)) == sizeof(have) &&
+        have.count > 0 && have.count <= MAX_PROFILES) {
+      want.count = have.count;
+      ssize_t bytes = have.count * (ssize_t)sizeof(HotspotProfile);
+      if (memcmp(&have, &want, sizeof(have)) == 0 &&
+          read(fd, all, bytes) == bytes)
+        n = have.count;
+    }
+    close(fd);
+  }
+  if (n < 0) {
+    n = compile_profiles(path, base, all, MAX_PROFILES);
+    if (n < 0)
+      return 1;
+    want.count = n;
+    unlink(OLD_PROFILE_CACHE); // Earlier builds cached PSKs there
+    mkdir(PROFILE_CACHE_DIR, 0700);
+    chmod(PROFILE_CACHE_DIR, 0700);
+    unlink(PROFILE_CACHE ".tmp");
+    fd = open(PROFILE_CACHE ".tmp", O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+      int ok = write(fd, &want, sizeof(want)) == sizeof(want) &&
+               write(fd, all, n * sizeof(HotspotProfile)) ==
+                   (ssize_t)(n * sizeof(HotspotProfile));
+      close(fd);
+      if (!ok || rename(PROFILE_CACHE ".tmp", PROFILE_CACHE) != 0)
+        unlink(PROFILE_CACHE ".tmp");
+    }
+  }
+  for (int i = 0; i < n; i++)
+    if (strcmp(all[i].name, name) == 0) {
+      *profile = all[i];
+      return 0;
+    }
+  fprintf(stderr, "No profile named '%s' in %s.\n", name, path);
+  return 1;
+}
+
+// --- eBPF per-client accounting ---
+
+#define BPF_INSN(c, d, s, o, i)                                                \
+  ((struct bpf_insn){                                                          \
+      .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+
+long sys_bpf(int cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int bpf_obj_get(const char *path) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.pathname = (unsigned long)path;
+  return sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+int bpf_map_lookup(int fd, const void *key, void *value) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (unsigned long)key;
+  attr.value = (unsigned long)value;
+  return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+// Get the key after key (the first key when key is NULL).
+int bpf_map_next_key(int fd, const void *key, void *next) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (unsigned long)key;
+  attr.next_key = (unsigned long)next;
+  return sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+// Load a tc classifier that counts packets and bytes per client on one
+// direction of the AP interface and drops clients listed in drops_fd.
+// key_off is the offset of the client address in the frame (IPv4 source on
+// ingress, destination on egress) and cnt_off selects the counter pair.
+int load_acct_prog(int key_off, int cnt_off, int counters_fd, int drops_fd) {
+  struct bpf_insn p[48];
+  int n = 0, to_pass[4], npass = 0, to_drop, to_insert;
+
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0);
+  p[n++] = BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+                    offsetof(struct __sk_buff, data), 0);
+  p[n++] = BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 6,
+                    offsetof(struct __sk_buff, data_end), 0);
+  // Need the Ethernet and IPv4 headers.
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 34);
+  to_pass[npass++] = n;
+  p[n++] = BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0);
+  p[n++] = BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0);
+  to_pass[npass++] = n;
+  p[n++] = BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, htons(ETH_P_IP));
+  // Client address becomes the map key at fp-4.
+  p[n++] = BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 7, 2, key_off, 0);
+  p[n++] = BPF_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 7, -4, 0);
+
+  p[n++] = BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0,
+                    drops_fd);
+  p[n++] = BPF_INSN(0, 0, 0, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4);
+  p[n++] = BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  to_drop = n;
+  p[n++] = BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 0, 0);
+
+  p[n++] = BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0,
+                    counters_fd);
+  p[n++] = BPF_INSN(0, 0, 0, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4);
+  p[n++] = BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  to_insert = n;
+  p[n++] = BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0, 0);
+  // Existing client: atomically bump packets and bytes.
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1);
+  p[n++] = BPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 0, 1, cnt_off, BPF_ADD);
+  p[n++] = BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 1, 6,
+                    offsetof(struct __sk_buff, len), 0);
+  p[n++] = BPF_INSN(BPF_STX | BPF_ATOMIC | BPF_DW, 0, 1, cnt_off + 8, BPF_ADD);
+  to_pass[npass++] = n;
+  p[n++] = BPF_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+
+  // New client: insert a zeroed value at fp-40 with this packet counted.
+  p[to_insert].off = n - to_insert - 1;
+  for (int off = -40; off < -8; off += 8)
+    p[n++] = BPF_INSN(BPF_ST | BPF_MEM | BPF_DW, 10, 0, off, 0);
+  p[n++] = BPF_INSN(BPF_ST | BPF_MEM | BPF_DW, 10, 0, -40 + cnt_off, 1);
+  p[n++] = BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 1, 6,
+                    offsetof(struct __sk_buff, len), 0);
+  p[n++] = BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, 10, 1, -40 + cnt_off + 8, 0);
+  p[n++] = BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0,
+                    counters_fd);
+  p[n++] = BPF_INSN(0, 0, 0, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -40);
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, BPF_NOEXIST);
+  p[n++] = BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem);
+
+  // Pass: TC_ACT_UNSPEC lets later filters (rate-limit policers) run.
+  for (int i = 0; i < npass; i++)
+    p[to_pass[i]].off = n - to_pass[i] - 1;
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, -1);
+  p[n++] = BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  p[to_drop].off = n - to_drop - 1;
+  p[n++] = BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, 2); // TC_ACT_SHOT
+  p[n++] = BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+  attr.insns = (unsigned long)p;
+  attr.insn_cnt = n;
+  attr.license = (unsigned long)"GPL";
+  return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+int bpf_create_map(int type, int key_size, int value_size, int max_entries) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+int bpf_pin(int fd, const char *path) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.bpf_fd = fd;
+  attr.pathname = (unsigned long)path;
+  return sys_bpf(BPF_OBJ_PIN, &attr);
+}
+
+// Detach the accounting programs and remove their pinned objects.
+void teardown_bpf_accounting() {
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd),
+           "sudo tc filter del dev %s ingress prio 1 2>/dev/null; "
+           "sudo tc filter del dev %s egress prio 1 2>/dev/null",
+           AP_IFACE, AP_IFACE);
+  if (bpf_acct_active)
+    run_cmd(cmd);
+  unlink(BPF_PIN_DIR "/acct_in");
+  unlink(BPF_PIN_DIR "/acct_out");
+  unlink(BPF_PIN_DIR "/clients");
+  unlink(BPF_PIN_DIR "/drops");
+  rmdir(BPF_PIN_DIR);
+  bpf_acct_active = 0;
+}
+
+// Attach per-client accounting and drop-list programs to both directions of
+// the AP interface and pin their maps under BPF_PIN_DIR, where the TUI and
+// the metrics writer read them. Without BPF support or privileges the
+// hotspot simply runs without it.
+int setup_bpf_accounting() {
+  teardown_bpf_accounting();
+  if (mkdir(BPF_PIN_DIR, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "BPF filesystem unavailable (%s); per-client accounting "
+                    "disabled.\n",
+            strerror(errno));
+    return 1;
+  }
+  int counters = bpf_create_map(BPF_MAP_TYPE_LRU_HASH, sizeof(unsigned int),
+                                sizeof(ClientCounters), MAX_CLIENTS);
+  int drops = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(unsigned int),
+                             sizeof(unsigned char), 256);
+  int prog_in = -1, prog_out = -1;
+  if (counters >= 0 && drops >= 0) {
+    prog_in = load_acct_prog(26, 0, counters, drops);
+    prog_out = load_acct_prog(30, 16, counters, drops);
+  }
+  int ok = (prog_in >= 0 && prog_out >= 0 &&
+            bpf_pin(counters, BPF_PIN_DIR "/clients") == 0 &&
+            bpf_pin(drops, BPF_PIN_DIR "/drops") == 0 &&
+            bpf_pin(prog_in, BPF_PIN_DIR "/acct_in") == 0 &&
+            bpf_pin(prog_out, BPF_PIN_DIR "/acct_out") == 0);
+  int err = errno;
+  int fds[] = {counters, drops, prog_in, prog_out};
+  for (int i = 0; i < 4; i++)
+    if (fds[i] >= 0)
+      close(fds[i]);
+  if (!ok) {
+    fprintf(stderr, "BPF unavailable (%s); per-client accounting disabled.\n",
+            strerror(err));
+    teardown_bpf_accounting();
+    return 1;
+  }
+
+  char cmd[512];
+  snprintf(cmd, sizeof(cmd),
+           "sudo tc qdisc add dev %s clsact 2>/dev/null; "
+           "sudo tc filter replace dev %s ingress prio 1 handle 1 bpf da "
+           "object-pinned " BPF_PIN_DIR "/acct_in && "
+           "sudo tc filter replace dev %s egress prio 1 handle 1 bpf da "
+           "object-pinned " BPF_PIN_DIR "/acct_out",
+           AP_IFACE, AP_IFACE, AP_IFACE);
+  if (run_cmd(cmd) != 0) {
+    fprintf(stderr, "Failed to attach BPF accounting to %s.\n", AP_IFACE);
+    bpf_acct_active = 1; // Detach whichever direction did attach.
+    teardown_bpf_accounting();
+    return 1;
+  }
+  bpf_acct_active = 1;
+  return 0;
+}
+
+// Read per-client counters straight from the pinned map. Returns the number
+// of clients, or -1 when accounting is not loaded.
+int read_client_stats(ClientStats *stats, int max) {
+  int fd = bpf_obj_get(BPF_PIN_DIR "/clients");
+  if (fd < 0)
+    return -1;
+  int n = 0;
+  unsigned int key, next;
+  void *prev = NULL;
+  while (n < max && bpf_map_next_key(fd, prev, &next) == 0) {
+    if (bpf_map_lookup(fd, &next, &stats[n].counters) == 0) {
+      stats[n].addr = next;
+      n++;
+    }
+    key = next;
+    prev = &key;
+  }
+  close(fd);
+  return n;
+}
+
+// Read a single integer from a /proc or /sys file, -1 on failure.
+long read_long_file(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  long value = -1;
+  if (fscanf(fp, "%ld", &value) != 1)
+    value = -1;
+  fclose(fp);
+  return value;
+}
+
+// Sum the per-CPU conntrack error counters. They come from ctnetlink through
+// "conntrack -S"; /proc/net/stat/nf_conntrack is used when the tool is
+// missing.
+int read_conntrack_counters(ConntrackStats *ct) {
+  ct->insert_failed = ct->drop = ct->early_drop = 0;
+  char *output = exec_cmd("conntrack -S 2>/dev/null");
+  if (output && strstr(output, "cpu=")) {
+    for (char *line = strtok(output, "\n"); line; line = strtok(NULL, "\n")) {
+      char *p;
+      if ((p = strstr(line, " insert_failed=")) != NULL)
+        ct->insert_failed += strtoull(p + 15, NULL, 10);
+      if ((p = strstr(line, " drop=")) != NULL)
+        ct->drop += strtoull(p + 6, NULL, 10);
+      if ((p = strstr(line, " early_drop=")) != NULL)
+        ct->early_drop += strtoull(p + 12, NULL, 10);
+    }
+    free(output);
+    return 0;
+  }
+  free(output);
+
+  FILE *fp = fopen("/proc/net/stat/nf_conntrack", "r");
+  if (!fp)
+    return 1;
+  char header[512], line[512];
+  int col_failed = -1, col_drop = -1, col_early = -1, col = 0;
+  if (fgets(header, sizeof(header), fp) != NULL) {
+    for (char *tok = strtok(header, " \n"); tok; tok = strtok(NULL, " \n")) {
+      if (strcmp(tok, "insert_failed") == 0)
+        col_failed = col;
+      else if (strcmp(tok, "drop") == 0)
+        col_drop = col;
+      else if (strcmp(tok, "early_drop") == 0)
+        col_early = col;
+      col++;
+    }
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    col = 0;
+    for (char *tok = strtok(line, " \n"); tok; tok = strtok(NULL, " \n")) {
+      unsigned long long v = strtoull(tok, NULL, 16);
+      if (col == col_failed)
+        ct->insert_failed += v;
+      else if (col == col_drop)
+        ct->drop += v;
+      else if (col == col_early)
+        ct->early_drop += v;
+      col++;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Refresh conntrack usage and grow the table before it overflows. When the
+// entry count crosses ct_watermark percent of nf_conntrack_max, or the
+// kernel has started failing inserts or early-dropping since the last
+// check, the limit is doubled (capped at ct_max_limit) and the hash resized
+// to keep about four entries per bucket.
+void check_conntrack_pressure() {
+  ConntrackStats prev = ct_stats;
+  ct_stats.count = read_long_file("/proc/sys/net/netfilter/nf_conntrack_count");
+  ct_stats.max = read_long_file("/proc/sys/net/netfilter/nf_conntrack_max");
+  ct_stats.buckets =
+      read_long_file("/sys/module/nf_conntrack/parameters/hashsize");
+  if (ct_stats.count < 0 || ct_stats.max <= 0)
+    return; // nf_conntrack not loaded yet.
+  read_conntrack_counters(&ct_stats);
+
+  int dropping = prev.max > 0 && (ct_stats.insert_failed > prev.insert_failed ||
+                                  ct_stats.drop > prev.drop ||
+                                  ct_stats.early_drop > prev.early_drop);
+  int full = ct_stats.count * 100 >= ct_stats.max * opts.ct_watermark;
+  if (!opts.ct_autosize || (!dropping && !full))
+    return;
+  if (ct_stats.max >= opts.ct_max_limit) {
+    fprintf(stderr,
+            "Conntrack table under pressure (%ld/%ld) and already at the "
+            "configured limit.\n",
+            ct_stats.count, ct_stats.max);
+    return;
+  }
+  long new_max = ct_stats.max * 2;
+  if (new_max > opts.ct_max_limit)
+    new_max = opts.ct_max_limit;
+  printf("Conntrack table under pressure (%ld/%ld%s); raising limit to %ld.\n",
+         ct_stats.count, ct_stats.max, dropping ? ", dropping" : "", new_max);
+  char cmd[160];
+  snprintf(cmd, sizeof(cmd),
+           "sudo sysctl -q -w net.netfilter.nf_conntrack_max=%ld", new_max);
+  if (run_cmd(cmd) != 0)
+    return;
+  if (ct_stats.buckets > 0 && ct_stats.buckets < new_max / 4) {
+    snprintf(cmd, sizeof(cmd),
+             "echo %ld | sudo tee /sys/module/nf_conntrack/parameters/hashsize "
+             ">/dev/null",
+             new_max / 4);
+    run_cmd(cmd);
+  }
+  ct_stats.max = new_max;
+  ct_stats.resizes++;
+}
+
+// Write the metrics surface (Prometheus text format) for scraping by a
+// textfile collector. Written to a temporary file and renamed into place.
+void write_metrics() {
+  FILE *fp = fopen(METRICS_FILE ".tmp", "w");
+  if (!fp)
+    return;
+  fprintf(fp, "hotspot_bpf_accounting %d\n", bpf_acct_active);
+  fprintf(fp, "hotspot_uplink_outages_total %llu\n", outages);
+  if (ap_enabled_seconds >= 0)
+    fprintf(fp, "hotspot_ap_enabled_seconds %.3f\n", ap_enabled_seconds);
+  if (first_lease_seconds >= 0)
+    fprintf(fp, "hotspot_first_lease_seconds %.0f\n", first_lease_seconds);
+  if (last_outage_seconds >= 0)
+    fprintf(fp, "hotspot_last_outage_seconds %.3f\n", last_outage_seconds);
+  if (ct_stats.max > 0)
+    fprintf(fp,
+            "hotspot_conntrack_entries %ld\n"
+            "hotspot_conntrack_max %ld\n"
+            "hotspot_conntrack_buckets %ld\n"
+            "hotspot_conntrack_insert_failed_total %llu\n"
+            "hotspot_conntrack_drop_total %llu\n"
+            "hotspot_conntrack_early_drop_total %llu\n"
+            "hotspot_conntrack_resizes_total %llu\n",
+            ct_stats.count, ct_stats.max, ct_stats.buckets,
+            ct_stats.insert_failed, ct_stats.drop, ct_stats.early_drop,
+            ct_stats.resizes);
+  if (dns_stats.valid) {
+    fprintf(fp,
+            "hotspot_dns_cache_size %llu\n"
+            "hotspot_dns_cache_hits_total %llu\n"
+            "hotspot_dns_cache_misses_total %llu\n"
+            "hotspot_dns_cache_insertions_total %llu\n"
+            "hotspot_dns_cache_evictions_total %llu\n",
+            dns_stats.cache_size, dns_stats.hits, dns_stats.misses,
+            dns_stats.insertions, dns_stats.evictions);
+    for (int i = 0; i < dns_stats.upstream_count; i++) {
+      DnsUpstream *up = &dns_stats.upstreams[i];
+      fprintf(fp,
+              "hotspot_dns_upstream_queries_total{server=\"%s\"} %llu\n"
+              "hotspot_dns_upstream_failed_total{server=\"%s\"} %llu\n",
+              up->server, up->queries, up->server, up->failed);
+      if (up->rtt_ms >= 0)
+        fprintf(fp, "hotspot_dns_upstream_rtt_seconds{server=\"%s\"} %.4f\n",
+                up->server, up->rtt_ms / 1000);
+    }
+  }
+  ClientStats *stats = malloc(sizeof(ClientStats) * MAX_CLIENTS);
+  int n = stats ? read_client_stats(stats, MAX_CLIENTS) : -1;
+  for (int i = 0; i < n; i++) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &stats[i].addr, ip, sizeof(ip));
+    ClientCounters *c = &stats[i].counters;
+    fprintf(fp,
+            "hotspot_client_up_packets{client=\"%s\"} %llu\n"
+            "hotspot_client_up_bytes{client=\"%s\"} %llu\n"
+            "hotspot_client_down_packets{client=\"%s\"} %llu\n"
+            "hotspot_client_down_bytes{client=\"%s\"} %llu\n",
+            ip, c->up_packets, ip, c->up_bytes, ip, c->down_packets, ip,
+            c->down_bytes);
+  }
+  free(stats);
+  fclose(fp);
+  rename(METRICS_FILE ".tmp", METRICS_FILE);
+}
+
+// --- Built-in DHCPv4 server ---
+
+// Lease record in the memory-mapped lease file; record i describes pool
+// address pool_start + i. The checksum covers the other fields, so a record
+// torn by a crash mid-write reads back as free instead of as a bogus lease.
+typedef struct {
+  unsigned char mac[6];
+  unsigned char state;
+  unsigned char pad;
+  unsigned int expires;
+  unsigned int crc;
+} LeaseRecord;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int pool_start; // Host byte order
+  unsigned int pool_size;
+  unsigned int reserved;
+} LeaseFileHeader;
+
+enum { LEASE_FREE, LEASE_OFFERED, LEASE_BOUND, LEASE_DECLINED };
+
+enum {
+  DHCP_DISCOVER = 1,
+  DHCP_OFFER,
+  DHCP_REQUEST,
+  DHCP_DECLINE,
+  DHCP_ACK,
+  DHCP_NAK,
+  DHCP_RELEASE,
+  DHCP_INFORM
+};
+
+typedef struct {
+  LeaseFileHeader *header;
+  LeaseRecord *records;
+  size_t map_len;
+  int *index; // MAC hash table of record indexes, -1 = empty slot
+  unsigned int index_mask;
+  unsigned int lease_secs;
+  unsigned int server, netmask; // Network byte order
+  unsigned int dns[3];
+  int dns_count;
+  int mtu; // Interface MTU option (26), 0 = not sent
+} DhcpServer;
+
+unsigned int lease_checksum(const LeaseRecord *rec) {
+  const unsigned char *p = (const unsigned char *)rec;
+  unsigned int hash = 2166136261u; // FNV-1a over everything but crc
+  for (size_t i = 0; i < offsetof(LeaseRecord, crc); i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  return hash;
+}
+
+void lease_store(LeaseRecord *rec, const unsigned char *mac, int state,
+                 unsigned int expires) {
+  LeaseRecord next = {{0}, (unsigned char)state, 0, expires, 0};
+  memcpy(next.mac, mac, 6);
+  next.crc = lease_checksum(&next);
+  *rec = next;
+}
+
+unsigned int mac_hash(const unsigned char *mac) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < 6; i++)
+    hash = (hash ^ mac[i]) * 16777619u;
+  return hash;
+}
+
+int lease_index_find(DhcpServer *srv, const unsigned char *mac) {
+  for (unsigned int i = mac_hash(mac) & srv->index_mask;;
+       i = (i + 1) & srv->index_mask) {
+    int idx = srv->index[i];
+    if (idx < 0)
+      return -1;
+    if (memcmp(srv->records[idx].mac, mac, 6) == 0)
+      return idx;
+  }
+}
+
+void lease_index_add(DhcpServer *srv, int idx) {
+  unsigned int i = mac_hash(srv->records[idx].mac) & srv->index_mask;
+  while (srv->index[i] >= 0 && srv->index[i] != idx)
+    i = (i + 1) & srv->index_mask;
+  srv->index[i] = idx;
+}
+
+// Remove a MAC from the index, shifting later probe entries back.
+void lease_index_remove(DhcpServer *srv, const unsigned char *mac) {
+  unsigned int hole = mac_hash(mac) & srv->index_mask;
+  while (srv->index[hole] >= 0 &&
+         memcmp(srv->records[srv->index[hole]].mac, mac, 6) != 0)
+    hole = (hole + 1) & srv->index_mask;
+  if (srv->index[hole] < 0)
+    return;
+  for (unsigned int i = (hole + 1) & srv->index_mask; srv->index[i] >= 0;
+       i = (i + 1) & srv->index_mask) {
+    unsigned int home = mac_hash(srv->records[srv->index[i]].mac) &
+                        srv->index_mask;
+    if (((i - home) & srv->index_mask) >= ((i - hole) & srv->index_mask)) {
+      srv->index[hole] = srv->index[i];
+      hole = i;
+    }
+  }
+  srv->index[hole] = -1;
+}
+
+// Map the lease file, reinitialising it when the pool changed, and rebuild
+// the MAC index from every intact record.
+int dhcp_server_init(DhcpServer *srv, unsigned int pool_start,
+                     unsigned int pool_size) {
+  srv->map_len = sizeof(LeaseFileHeader) + pool_size * sizeof(LeaseRecord);
+  int fd = open(BUILTIN_LEASE_FILE, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, srv->map_len) != 0) {
+    perror("lease file");
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  void *map =
+      mmap(NULL, srv->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap lease file");
+    return 1;
+  }
+  srv->header = map;
+  srv->records = (LeaseRecord *)(srv->header + 1);
+  if (srv->header->magic != LEASE_FILE_MAGIC ||
+      srv->header->pool_start != pool_start ||
+      srv->header->pool_size != pool_size) {
+    memset(map, 0, srv->map_len);
+    srv->header->pool_start = pool_start;
+    srv->header->pool_size = pool_size;
+    srv->header->magic = LEASE_FILE_MAGIC;
+  }
+
+  unsigned int slots = 1;
+  while (slots < pool_size * 2)
+    slots <<= 1;
+  srv->index = malloc(sizeof(int) * slots);
+  if (!srv->index)
+    return 1;
+  memset(srv->index, 0xff, sizeof(int) * slots);
+  srv->index_mask = slots - 1;
+  int restored = 0;
+  for (unsigned int i = 0; i < pool_size; i++) {
+    LeaseRecord *rec = &srv->records[i];
+    if (rec->crc != lease_checksum(rec))
+      memset(rec, 0, sizeof(*rec));
+    else if (rec->state != LEASE_FREE && rec->state != LEASE_DECLINED &&
+             lease_index_find(srv, rec->mac) < 0) {
+      lease_index_add(srv, i);
+      restored++;
+    }
+  }
+  printf("Built-in DHCP: %u addresses, %d leases restored from %s.\n",
+         pool_size, restored, BUILTIN_LEASE_FILE);
+  return 0;
+}
+
+int lease_available(const LeaseRecord *rec, unsigned int now) {
+  return rec->state == LEASE_FREE || rec->expires < now;
+}
+
+// Pick the record for a client: its previous address if it still holds it,
+// else the requested address if free, else the first free address probing
+// from a MAC-derived start so returning clients tend to land on the same IP.
+int lease_allocate(DhcpServer *srv, const unsigned char *mac,
+                   unsigned int requested, unsigned int now) {
+  unsigned int size = srv->header->pool_size, start = srv->header->pool_start;
+  int idx = lease_index_find(srv, mac);
+  if (idx >= 0 && srv->records[idx].state != LEASE_DECLINED)
+    return idx;
+  idx = -1;
+  unsigned int want = ntohl(requested) - start;
+  if (requested && want < size && lease_available(&srv->records[want], now))
+    idx = want;
+  for (unsigned int i = 0; idx < 0 && i < size; i++) {
+    unsigned int j = (mac_hash(mac) + i) % size;
+    if (lease_available(&srv->records[j], now))
+      idx = j;
+  }
+  if (idx < 0)
+    return -1;
+  LeaseRecord *rec = &srv->records[idx];
+  // The previous holder's MAC is unindexed only if it still points here: a
+  // declined or expired record's client may hold another address by now.
+  if (rec->state != LEASE_FREE && memcmp(rec->mac, mac, 6) != 0 &&
+      lease_index_find(srv, rec->mac) == idx)
+    lease_index_remove(srv, rec->mac);
+  lease_store(rec, mac, LEASE_OFFERED, now + DHCP_OFFER_HOLD);
+  lease_index_add(srv, idx);
+  return idx;
+}
+
+void put_option(unsigned char *out, size_t *len, int code, const void *data,
+                int data_len) {
+  out[(*len)++] = code;
+  out[(*len)++] = data_len;
+  memcpy(out + *len, data, data_len);
+  *len += data_len;
+}
+
+// Send an OFFER/ACK/NAK. Replies go to the client's address when it is
+// renewing one it already holds and to broadcast otherwise, so no ARP entry
+// is needed for clients that are still unconfigured.
+void dhcp_reply(DhcpServer *srv, int sock, const unsigned char *req, int type,
+                unsigned int yiaddr, int with_lease) {
+  unsigned char out[576] = {0};
+  size_t len = 240;
+  out[0] = 2; // BOOTREPLY
+  out[1] = 1;
+  out[2] = 6;
+  memcpy(out + 4, req + 4, 4);   // xid
+  memcpy(out + 10, req + 10, 2); // flags
+  if (type != DHCP_NAK) {
+    memcpy(out + 12, req + 12, 4); // ciaddr
+    memcpy(out + 16, &yiaddr, 4);
+    memcpy(out + 20, &srv->server, 4);
+  }
+  memcpy(out + 28, req + 28, 16); // chaddr
+  memcpy(out + 236, "\x63\x82\x53\x63", 4);
+  unsigned char msg = type;
+  put_option(out, &len, 53, &msg, 1);
+  put_option(out, &len, 54, &srv->server, 4);
+  if (type != DHCP_NAK) {
+    if (with_lease) {
+      unsigned int lease = htonl(srv->lease_secs);
+      put_option(out, &len, 51, &lease, 4);
+      if (srv->lease_secs != 0xffffffffu) {
+        unsigned int t1 = htonl(srv->lease_secs / 2);
+        unsigned int t2 = htonl(srv->lease_secs / 8 * 7);
+        put_option(out, &len, 58, &t1, 4);
+        put_option(out, &len, 59, &t2, 4);
+      }
+    }
+    put_option(out, &len, 1, &srv->netmask, 4);
+    put_option(out, &len, 3, &srv->server, 4);
+    put_option(out, &len, 6, srv->dns, 4 * srv->dns_count);
+    if (srv->mtu) {
+      unsigned short mtu = htons(srv->mtu);
+      put_option(out, &len, 26, &mtu, 2);
+    }
+  }
+  out[len++] = 255;
+
+  struct sockaddr_in dest = {0};
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(68);
+  unsigned int ciaddr;
+  memcpy(&ciaddr, req + 12, 4);
+  dest.sin_addr.s_addr =
+      (type == DHCP_ACK && ciaddr) ? ciaddr : htonl(INADDR_BROADCAST);
+  if (len < 300)
+    len = 300; // Minimum BOOTP size some clients insist on
+  sendto(sock, out, len, 0, (struct sockaddr *)&dest, sizeof(dest));
+}
+
+void dhcp_handle(DhcpServer *srv, int sock, const unsigned char *pkt,
+                 ssize_t len) {
+  if (len < 240 || pkt[0] != 1 || pkt[1] != 1 || pkt[2] != 6 ||
+      memcmp(pkt + 236, "\x63\x82\x53\x63", 4) != 0)
+    return;
+  int type = 0;
+  unsigned int requested = 0, server_id = 0, ciaddr;
+  memcpy(&ciaddr, pkt + 12, 4);
+  for (ssize_t i = 240; i < len && pkt[i] != 255;) {
+    if (pkt[i] == 0) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= len || i + 2 + pkt[i + 1] > len)
+      break;
+    int code = pkt[i], olen = pkt[i + 1];
+    const unsigned char *val = pkt + i + 2;
+    if (code == 53 && olen == 1)
+      type = val[0];
+    else if (code == 50 && olen == 4)
+      memcpy(&requested, val, 4);
+    else if (code == 54 && olen == 4)
+      memcpy(&server_id, val, 4);
+    i += 2 + olen;
+  }
+
+  const unsigned char *mac = pkt + 28;
+  unsigned int now = time(NULL);
+  unsigned int start = srv->header->pool_start, size = srv->header->pool_size;
+  int idx;
+  switch (type) {
+  case DHCP_DISCOVER:
+    idx = lease_allocate(srv, mac, requested, now);
+    if (idx < 0) {
+      fprintf(stderr, "Built-in DHCP: pool exhausted.\n");
+      return;
+    }
+    if (srv->records[idx].state == LEASE_BOUND &&
+        srv->records[idx].expires >= now)
+      ; // Re-offer the lease the client still holds.
+    else
+      lease_store(&srv->records[idx], mac, LEASE_OFFERED,
+                  now + DHCP_OFFER_HOLD);
+    dhcp_reply(srv, sock, pkt, DHCP_OFFER, htonl(start + idx), 1);
+    break;
+  case DHCP_REQUEST: {
+    if (server_id && server_id != srv->server) {
+      // The client picked another server; release our offer.
+      idx = lease_index_find(srv, mac);
+      if (idx >= 0 && srv->records[idx].state == LEASE_OFFERED) {
+        lease_index_remove(srv, mac);
+        memset(&srv->records[idx], 0, sizeof(LeaseRecord));
+      }
+      return;
+    }
+    unsigned int addr = requested ? requested : ciaddr;
+    unsigned int want = ntohl(addr) - start;
+    idx = lease_index_find(srv, mac);
+    if (want >= size || (idx != (int)want &&
+                         !lease_available(&srv->records[want], now))) {
+      dhcp_reply(srv, sock, pkt, DHCP_NAK, 0, 0);
+      return;
+    }
+    if (idx >= 0 && idx != (int)want) {
+      lease_index_remove(srv, mac);
+      memset(&srv->records[idx], 0, sizeof(LeaseRecord));
+    }
+    LeaseRecord *rec = &srv->records[want];
+    if (rec->state != LEASE_FREE && memcmp(rec->mac, mac, 6) != 0 &&
+        lease_index_find(srv, rec->mac) == (int)want)
+      lease_index_remove(srv, rec->mac);
+    unsigned int expires =
+        srv->lease_secs == 0xffffffffu ? 0xffffffffu : now + srv->lease_secs;
+    lease_store(rec, mac, LEASE_BOUND, expires);
+    lease_index_add(srv, want);
+    dhcp_reply(srv, sock, pkt, DHCP_ACK, addr, 1);
+    break;
+  }
+  case DHCP_DECLINE:
+    // Someone else uses the address; keep it out of the pool for a while.
+    idx = lease_index_find(srv, mac);
+    if (idx >= 0 && ntohl(requested) - start == (unsigned int)idx) {
+      lease_index_remove(srv, mac);
+      lease_store(&srv->records[idx], mac, LEASE_DECLINED,
+                  now + DHCP_DECLINE_HOLD);
+    }
+    break;
+  case DHCP_RELEASE:
+    idx = lease_index_find(srv, mac);
+    if (idx >= 0 && ntohl(ciaddr) - start == (unsigned int)idx) {
+      lease_index_remove(srv, mac);
+      memset(&srv->records[idx], 0, sizeof(LeaseRecord));
+    }
+    break;
+  case DHCP_INFORM:
+    dhcp_reply(srv, sock, pkt, DHCP_ACK, 0, 0);
+    break;
+  }
+}
+
+// Collect the uplink's DNS servers from NetworkManager for DHCP option 6,
+// falling back to a public resolver.
+int get_uplink_dns(unsigned int *dns, int max) {
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "nmcli -g IP4.DNS dev show %s 2>/dev/null",
+           uplink_iface);
+  char *output = exec_cmd(cmd);
+  int n = 0;
+  for (char *tok = output ? strtok(output, " |\n") : NULL; tok && n < max;
+       tok = strtok(NULL, " |\n"))
+    if (inet_pton(AF_INET, tok, &dns[n]) == 1)
+      n++;
+  free(output);
+  if (n == 0)
+    inet_pton(AF_INET, LATENCY_TARGET, &dns[n++]);
+  return n;
+}
+
+// Event loop of the built-in DHCP server process. Signals are taken through
+// a signalfd so SIGTERM ends the loop cleanly and the lease file is synced.
+int run_builtin_dhcp(int ready_fd) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+
+  DhcpServer srv = {0};
+  unsigned int pool_start, pool_end;
+  char start_text[16], end_text[16];
+  sscanf(dhcp_range, "%15[^,],%15[^,]", start_text, end_text);
+  if (parse_ipv4(start_text, &pool_start) != 0 ||
+      parse_ipv4(end_text, &pool_end) != 0 ||
+      dhcp_server_init(&srv, pool_start, pool_end - pool_start + 1) != 0)
+    return 1;
+  srv.lease_secs = lease_seconds(opts.lease_time);
+  inet_pton(AF_INET, ap_addr, &srv.server);
+  int prefix = atoi(strchr(ap_cidr, '/') + 1);
+  srv.netmask = htonl(~0u << (32 - prefix));
+  if (opts.dns_profile) {
+    srv.dns[0] = srv.server; // Clients use the caching dnsmasq on ap0
+    srv.dns_count = 1;
+  } else {
+    srv.dns_count = get_uplink_dns(srv.dns, 3);
+  }
+  srv.mtu = lan_mtu;
+
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  int one = 1;
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(67);
+  if (sock < 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) != 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, AP_IFACE,
+                 strlen(AP_IFACE)) != 0 ||
+      bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("built-in DHCP socket (needs root)");
+    return 1;
+  }
+  // The default buffer holds about 150 requests; a storm of new clients
+  // overflows it and each dropped one waits for its retransmission.
+  int rcvbuf = DHCP_RCVBUF;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) !=
+      0)
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+  int ep = epoll_create1(0);
+  struct epoll_event ev = {.events = EPOLLIN};
+  ev.data.fd = sock;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+  ev.data.fd = sig_fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sig_fd, &ev);
+
+  write(ready_fd, "1", 1);
+  close(ready_fd);
+
+  int running = 1;
+  unsigned char pkt[1500];
+  while (running) {
+    struct epoll_event events[4];
+    int n = epoll_wait(ep, events, 4, -1);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == sig_fd) {
+        running = 0;
+        continue;
+      }
+      // Drain the socket: a join storm arrives as a burst of datagrams.
+      ssize_t len;
+      while ((len = recv(sock, pkt, sizeof(pkt), 0)) > 0)
+        dhcp_handle(&srv, sock, pkt, len);
+    }
+  }
+  msync(srv.header, srv.map_len, MS_SYNC);
+  munmap(srv.header, srv.map_len);
+  free(srv.index);
+  close(sock);
+  return 0;
+}
+
+// Fork the built-in DHCP server and wait until its socket is bound.
+int start_builtin_dhcp() {
+  int ready[2];
+  if (pipe(ready) != 0)
+    return 1;
+  dhcpd_pid = fork();
+  if (dhcpd_pid == 0) {
+    close(ready[0]);
+    exit(run_builtin_dhcp(ready[1]));
+  }
+  close(ready[1]);
+  if (dhcpd_pid < 0) {
+    close(ready[0]);
+    return 1;
+  }
+  char ok = 0;
+  struct pollfd pfd = {ready[0], POLLIN, 0};
+  if (poll(&pfd, 1, 5000) == 1)
+    read(ready[0], &ok, 1);
+  close(ready[0]);
+  if (ok != '1') {
+    kill(dhcpd_pid, SIGTERM);
+    waitpid(dhcpd_pid, NULL, 0);
+    dhcpd_pid = -1;
+    return 1;
+  }
+  return 0;
+}
+
+// --- DNS statistics ---
+
+// Skip a possibly compressed name in a DNS message. Returns the offset after
+// it, or -1 when the message is truncated.
+int dns_skip_name(const unsigned char *msg, int len, int pos) {
+  while (pos >= 0 && pos < len) {
+    int l = msg[pos];
+    if (l == 0)
+      return pos + 1;
+    if ((l & 0xc0) == 0xc0)
+      return pos + 2;
+    pos += l + 1;
+  }
+  return -1;
+}
+
+// Send one query over UDP and wait for the matching reply. Returns the reply
+// length, 0 on timeout or error, and the round trip in *rtt_ms.
+int dns_query(const char *server, const char *name, int qtype, int qclass,
+              unsigned char *reply, int reply_len, double *rtt_ms) {
+  static unsigned short next_id;
+  unsigned short id = ++next_id ^ (unsigned short)getpid();
+  unsigned char q[300] = {id >> 8, id & 0xff, 0x01, 0, 0, 1};
+  int len = 12;
+  for (const char *p = name; *p;) {
+    const char *dot = strchr(p, '.');
+    int l = dot ? (int)(dot - p) : (int)strlen(p);
+    if (l == 0 || l > 63 || len + l + 6 > (int)sizeof(q))
+      return 0;
+    q[len++] = l;
+    memcpy(q + len, p, l);
+    len += l;
+    p += l + (dot != NULL);
+  }
+  q[len++] = 0;
+  q[len++] = qtype >> 8;
+  q[len++] = qtype & 0xff;
+  q[len++] = qclass >> 8;
+  q[len++] = qclass & 0xff;
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(53);
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    return 0;
+  if (inet_pton(AF_INET, server, &addr.sin_addr) != 1) {
+    close(sock);
+    return 0;
+  }
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int n = 0;
+  if (sendto(sock, q, len, 0, (struct sockaddr *)&addr, sizeof(addr)) ==
+      len) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (n == 0 && poll(&pfd, 1, DNS_TIMEOUT_MS) == 1) {
+      n = recv(sock, reply, reply_len, 0);
+      if (n < 12 || reply[0] != q[0] || reply[1] != q[1])
+        n = 0;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  *rtt_ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  close(sock);
+  return n;
+}
+
+// Collect the TXT answers of a reply, joining each record's strings with
+// spaces. Returns the number of records found.
+int dns_txt_answers(const unsigned char *msg, int len, char out[][64],
+                    int max) {
+  if (len < 12)
+    return 0;
+  int answers = msg[6] << 8 | msg[7];
+  int pos = dns_skip_name(msg, len, 12);
+  pos = pos < 0 ? -1 : pos + 4;
+  int n = 0;
+  for (int a = 0; a < answers && pos >= 0 && n < max; a++) {
+    pos = dns_skip_name(msg, len, pos);
+    if (pos < 0 || pos + 10 > len)
+      break;
+    int type = msg[pos] << 8 | msg[pos + 1];
+    int rdlen = msg[pos + 8] << 8 | msg[pos + 9];
+    pos += 10;
+    if (pos + rdlen > len)
+      break;
+    if (type == 16) {
+      size_t used = 0;
+      for (int i = pos; i < pos + rdlen;) {
+        int slen = msg[i++];
+        if (i + slen > pos + rdlen)
+          break;
+        if (used && used < 63)
+          out[n][used++] = ' ';
+        size_t copy = (size_t)slen < 63 - used ? (size_t)slen : 63 - used;
+        memcpy(out[n] + used, msg + i, copy);
+        used += copy;
+        i += slen;
+      }
+      out[n++][used] = '\0';
+    }
+    pos += rdlen;
+  }
+  return n;
+}
+
+// Read dnsmasq's cache counters through its CHAOS TXT *.bind names and time
+// a root NS query sent straight to each upstream it forwards to.
+void collect_dns_stats() {
+  if (trace_mode == TRACE_REPLAY)
+    return; // No dnsmasq to ask
+  const char *names[] = {"cachesize.bind", "hits.bind", "misses.bind",
+                         "insertions.bind", "evictions.bind"};
+  DnsStats next = {0};
+  unsigned long long *fields[] = {&next.cache_size, &next.hits, &next.misses,
+                                  &next.insertions, &next.evictions};
+  unsigned char reply[1500];
+  char txt[DNS_MAX_SERVERS][64];
+  double rtt;
+  for (int i = 0; i < 5; i++) {
+    int len = dns_query(ap_addr, names[i], 16, 3, reply, sizeof(reply), &rtt);
+    if (dns_txt_answers(reply, len, txt, 1) != 1) {
+      dns_stats.valid = 0;
+      return;
+    }
+    *fields[i] = strtoull(txt[0], NULL, 10);
+  }
+  int len =
+      dns_query(ap_addr, "servers.bind", 16, 3, reply, sizeof(reply), &rtt);
+  int n = dns_txt_answers(reply, len, txt, DNS_MAX_SERVERS);
+  for (int i = 0; i < n; i++) {
+    DnsUpstream *up = &next.upstreams[next.upstream_count];
+    if (sscanf(txt[i], "%47[^#]#%*d %llu %llu", up->server, &up->queries,
+               &up->failed) != 3)
+      continue;
+    up->rtt_ms = -1;
+    unsigned char answer[512];
+    if (dns_query(up->server, "", 2, 1, answer, sizeof(answer), &rtt) > 0)
+      up->rtt_ms = rtt;
+    next.upstream_count++;
+  }
+  next.valid = 1;
+  dns_stats = next;
+}
+
+// --- Radio capabilities and hostapd configuration ---
+
+// Channel, width and capabilities the AP will use. The AP shares the radio
+// with the uplink, so it stays on the uplink's primary channel and at most
+// the uplink's width.
+typedef struct {
+  int channel, freq;
+  int width;          // 20, 40, 80 or 160 MHz
+  int center_channel; // Centre of the 40/80/160 MHz block
+  unsigned int ht_cap;  // HT capability info, 0 = no HT
+  unsigned int vht_cap; // VHT capability info, 0 = no VHT
+  int he;               // HE usable in AP mode
+  int he_width;         // HE PHY channel width set (first PHY cap byte)
+  int radar;            // Channel needs DFS
+  int ft;               // Driver handles FT (802.11r) IEs
+  char country[3];
+} RadioPlan;
+
+int freq_to_channel(int freq) {
+  if (freq == 2484)
+    return 14;
+  if (freq < 3000)
+    return (freq - 2407) / 5;
+  return (freq - 5000) / 5;
+}
+
+// Fill in the phy's capabilities for the plan's band and the regulatory
+// country, then narrow the width to what the phy supports.
+void fit_radio_plan(RadioPlan *plan, const char *phy_info,
+                    const char *reg_info) {
+  const char *p;
+  plan->ft = phy_info && strstr(phy_info, "update_ft_ies") != NULL;
+  // Walk the plan's band: Band 1 is 2.4 GHz, Band 2 is 5 GHz.
+  int want_band = plan->freq < 5000 ? 1 : 2, band = 0, he_ap = 0;
+  char *copy = strdup(phy_info ? phy_info : "");
+  char *save = NULL;
+  for (char *line = strtok_r(copy, "\n", &save); line;
+       line = strtok_r(NULL, "\n", &save)) {
+    int n;
+    unsigned int hex;
+    if (sscanf(line, "\tBand %d:", &n) == 1)
+      band = n;
+    else if (line[0] == '\t' && line[1] != '\t')
+      band = 0; // Another top-level section of the wiphy
+    if (band != want_band)
+      continue;
+    if ((p = strstr(line, "VHT Capabilities (0x")) &&
+        sscanf(p + 18, "0x%x", &hex) == 1)
+      plan->vht_cap = hex;
+    else if ((p = strstr(line, "HE Iftypes:")))
+      he_ap = strstr(p, " AP") != NULL;
+    else if ((p = strstr(line, "HE PHY Capabilities: (0x")) && he_ap &&
+             sscanf(p + 22, "0x%2x", &hex) == 1) {
+      plan->he = 1;
+      plan->he_width = hex;
+    } else if ((p = strstr(line, "Capabilities: 0x")))
+      sscanf(p + 14, "0x%x", &plan->ht_cap);
+    else if ((p = strstr(line, "* ")) && sscanf(p, "* %d", &n) == 1 &&
+             n == plan->freq)
+      plan->radar = strstr(line, "radar detection") != NULL;
+  }
+  free(copy);
+
+  // Narrow the width until the phy supports it, halving the block around
+  // the primary channel each time.
+  int vht160 = (plan->vht_cap >> 2) & 3, he160 = plan->he_width & 0x08;
+  int he80 = plan->he_width & 0x04, ht40 = plan->ht_cap & 0x02;
+  while ((plan->width == 160 && !vht160 && !he160) ||
+         (plan->width == 80 && !plan->vht_cap && !he80) ||
+         (plan->width == 40 && !ht40)) {
+    plan->width /= 2;
+    plan->center_channel += plan->channel < plan->center_channel
+                                ? -plan->width / 10
+                                : plan->width / 10;
+    if (plan->width == 20)
+      plan->center_channel = plan->channel;
+  }
+  if (plan->freq < 5000 && plan->width > 40)
+    plan->width = 40;
+
+  p = reg_info ? strstr(reg_info, "country ") : NULL;
+  for (; p; p = strstr(p + 1, "country ")) {
+    if (strncmp(p + 8, "00", 2) != 0 && p[10] == ':') {
+      memcpy(plan->country, p + 8, 2);
+      break;
+    }
+  }
+}
+
+// Fill in the uplink's channel and width from `iw dev <iface> info`, then
+// fit the plan to the phy (`iw phy <phy> info`) and regulatory domain
+// (`iw reg get`).
+int build_radio_plan(const char *dev_info, const char *phy_info,
+                     const char *reg_info, RadioPlan *plan) {
+  memset(plan, 0, sizeof(*plan));
+  const char *p = dev_info ? strstr(dev_info, "channel ") : NULL;
+  int center_freq = 0;
+  if (!p || sscanf(p, "channel %d (%d MHz)", &plan->channel, &plan->freq) != 2)
+    return 1;
+  const char *w = strstr(p, "width: ");
+  plan->width = w ? atoi(w + 7) : 20;
+  const char *c = strstr(p, "center1: ");
+  if (c)
+    center_freq = atoi(c + 9);
+  if (plan->width < 20 || !center_freq)
+    plan->width = 20;
+  if (plan->freq >= 5925) {
+    fprintf(stderr, "6 GHz uplinks are not supported for the AP.\n");
+    return 1;
+  }
+
+  // Edge case: keep the AP on a valid channel for the band, at 20 MHz.
+  if (plan->freq < 5000 && (plan->channel < 1 || plan->channel > 14)) {
+    fprintf(stderr,
+            "Detected 2.4 GHz channel %d is out of expected range (1-14). "
+            "Defaulting to channel 6.\n",
+            plan->channel);
+    plan->channel = 6;
+    plan->freq = 2437;
+    plan->width = 20;
+  } else if (plan->freq >= 5000 &&
+             (plan->channel < 36 || plan->channel > 165)) {
+    fprintf(stderr,
+            "Detected 5 GHz channel %d is out of expected range (36-165). "
+            "Defaulting to channel 36.\n",
+            plan->channel);
+    plan->channel = 36;
+    plan->freq = 5180;
+    plan->width = 20;
+  }
+  plan->center_channel =
+      plan->width > 20 ? freq_to_channel(center_freq) : plan->channel;
+  fit_radio_plan(plan, phy_info, reg_info);
+  return 0;
+}
+
+// Gather the plan for the radio behind iface.
+int probe_radio(const char *iw_path, const char *iface, RadioPlan *plan) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "%s dev %s info", iw_path, iface);
+  char *dev_info = exec_cmd(cmd);
+  const char *wiphy = dev_info ? strstr(dev_info, "wiphy ") : NULL;
+  char *phy_info = NULL;
+  if (wiphy) {
+    snprintf(cmd, sizeof(cmd), "%s phy phy%d info", iw_path, atoi(wiphy + 6));
+    phy_info = exec_cmd(cmd);
+  }
+  snprintf(cmd, sizeof(cmd), "%s reg get 2>/dev/null", iw_path);
+  char *reg_info = exec_cmd(cmd);
+  int ret = build_radio_plan(dev_info, phy_info, reg_info, plan);
+  free(dev_info);
+  free(phy_info);
+  free(reg_info);
+  return ret;
+}
+
+// Whether the secondary 40 MHz channel lies above the primary. On 5 GHz the
+// pairs are fixed (36+40, 44+48, ...); on 2.4 GHz the secondary follows the
+// centre of the plan.
+int ht40_above(const RadioPlan *plan) {
+  if (plan->freq >= 5000)
+    return (plan->channel - (plan->channel >= 149 ? 149 : 36)) / 4 % 2 == 0;
+  return plan->center_channel > plan->channel;
+}
+
+// Append the hostapd lines selecting band, channel, width and the HT/VHT/HE
+// features the phy advertises for the plan.
+void format_radio_config(const RadioPlan *plan, char *buf, size_t len) {
+  size_t used = 0;
+#define EMIT(...)                                                              \
+  do {                                                                         \
+    if (used < len)                                                            \
+      used += snprintf(buf + used, len - used, __VA_ARGS__);                   \
+  } while (0)
+  int five = plan->freq >= 5000;
+  EMIT("hw_mode=%s\nchannel=%d\n", five ? "a" : "g", plan->channel);
+  if (plan->country[0]) {
+    EMIT("country_code=%s\nieee80211d=1\n", plan->country);
+    if (plan->radar)
+      EMIT("ieee80211h=1\n");
+  }
+  if (plan->ht_cap || plan->vht_cap || plan->he)
+    EMIT("wmm_enabled=1\n");
+  unsigned int ht = plan->ht_cap;
+  if (ht) {
+    EMIT("ieee80211n=1\nht_capab=");
+    if (plan->width >= 40)
+      EMIT(ht40_above(plan) ? "[HT40+]" : "[HT40-]");
+    if (ht & 0x0001)
+      EMIT("[LDPC]");
+    if (ht & 0x0020)
+      EMIT("[SHORT-GI-20]");
+    if (ht & 0x0040)
+      EMIT("[SHORT-GI-40]");
+    if (ht & 0x0080)
+      EMIT("[TX-STBC]");
+    const char *rx_stbc[] = {"", "[RX-STBC1]", "[RX-STBC12]", "[RX-STBC123]"};
+    EMIT("%s", rx_stbc[(ht >> 8) & 3]);
+    if (ht & 0x0800)
+      EMIT("[MAX-AMSDU-7935]");
+    if ((ht & 0x1000) && !five)
+      EMIT("[DSSS_CCK-40]");
+    EMIT("\n");
+  }
+  int chwidth = plan->width == 160 ? 2 : plan->width == 80 ? 1 : 0;
+  int seg0 = plan->width >= 80 ? plan->center_channel : 0;
+  unsigned int vht = plan->vht_cap;
+  if (five && vht) {
+    const char *mpdu[] = {"", "[MAX-MPDU-7991]", "[MAX-MPDU-11454]", ""};
+    const char *vht160[] = {"", "[VHT160]", "[VHT160-80PLUS80]", ""};
+    const char *rx_stbc[] = {"", "[RX-STBC-1]", "[RX-STBC-12]",
+                             "[RX-STBC-123]", "[RX-STBC-1234]", "", "", ""};
+    EMIT("ieee80211ac=1\nvht_capab=%s%s", mpdu[vht & 3],
+         vht160[(vht >> 2) & 3]);
+    if (vht & (1 << 4))
+      EMIT("[RXLDPC]");
+    if (vht & (1 << 5))
+      EMIT("[SHORT-GI-80]");
+    if (vht & (1 << 6))
+      EMIT("[SHORT-GI-160]");
+    if (vht & (1 << 7))
+      EMIT("[TX-STBC-2BY1]");
+    EMIT("%s", rx_stbc[(vht >> 8) & 7]);
+    if (vht & (1 << 11))
+      EMIT("[SU-BEAMFORMER][SOUNDING-DIMENSION-%u]", ((vht >> 16) & 7) + 1);
+    if (vht & (1 << 12))
+      EMIT("[SU-BEAMFORMEE][BF-ANTENNA-%u]", ((vht >> 13) & 7) + 1);
+    if (vht & (1 << 19))
+      EMIT("[MU-BEAMFORMER]");
+    if (vht & (1 << 20))
+      EMIT("[MU-BEAMFORMEE]");
+    if ((vht >> 23) & 7)
+      EMIT("[MAX-A-MPDU-LEN-EXP%u]", (vht >> 23) & 7);
+    if (vht & (1 << 28))
+      EMIT("[RX-ANTENNA-PATTERN]");
+    if (vht & (1 << 29))
+      EMIT("[TX-ANTENNA-PATTERN]");
+    EMIT("\nvht_oper_chwidth=%d\nvht_oper_centr_freq_seg0_idx=%d\n", chwidth,
+         seg0);
+  }
+  if (plan->he) {
+    EMIT("ieee80211ax=1\n");
+    if (five)
+      EMIT("he_oper_chwidth=%d\nhe_oper_centr_freq_seg0_idx=%d\n", chwidth,
+           seg0);
+  }
+#undef EMIT
+}
+
+// Derive the BSSID for ap0: the bssid option, else a locally administered
+// unicast address hashed from the parent radio's MAC and the SSID, so the
+// AP keeps the same BSSID across restarts and clients reconnect to a
+// network they already know.
+void derive_bssid(const char *parent, const char *ssid, char *out,
+                  size_t len) {
+  if (opts.bssid[0]) {
+    snprintf(out, len, "%s", opts.bssid);
+    return;
+  }
+  char path[128], base[32] = "";
+  snprintf(path, sizeof(path), "/sys/class/net/%s/address", parent);
+  FILE *fp = fopen(path, "r");
+  if (fp) {
+    if (!fgets(base, sizeof(base), fp))
+      base[0] = '\0';
+    fclose(fp);
+  }
+  unsigned long long hash = 14695981039346656037ull; // FNV-1a 64
+  for (const char *p = base; *p && *p != '\n'; p++)
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+  for (const char *p = ssid; *p; p++)
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+  unsigned char mac[6];
+  for (int i = 0; i < 6; i++)
+    mac[i] = hash >> (8 * i);
+  mac[0] = (mac[0] & 0xfc) | 0x02;
+  snprintf(out, len, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2],
+           mac[3], mac[4], mac[5]);
+}
+
+// Append the RSN settings: WPA2-PSK, WPA2/WPA3 transition or WPA3-SAE only,
+// PMKSA caching with opportunistic key caching, SAE anti-clogging, and
+// FT-PSK/FT-SAE with locally generated keys when enabled and the driver
+// handles FT.
+void format_security_config(const RadioPlan *plan, const char *bssid,
+                            char *buf, size_t len) {
+  int sae = opts.security != SECURITY_WPA2;
+  int psk = opts.security != SECURITY_WPA3;
+  int ft = opts.ft && plan->ft;
+  char akm[64] = "";
+  if (psk)
+    strcat(akm, " WPA-PSK");
+  if (sae)
+    strcat(akm, " SAE");
+  if (ft && psk)
+    strcat(akm, " FT-PSK");
+  if (ft && sae)
+    strcat(akm, " FT-SAE");
+  size_t used = snprintf(buf, len, "wpa_key_mgmt=%s\n", akm + 1);
+  if (used < len)
+    used += snprintf(buf + used, len - used,
+                     "okc=1\ndisable_pmksa_caching=0\n");
+  if (sae && used < len)
+    used += snprintf(buf + used, len - used,
+                     "ieee80211w=%d\nsae_require_mfp=1\nsae_pwe=2\n"
+                     "sae_anti_clogging_threshold=%d\n",
+                     psk ? 1 : 2, SAE_ANTI_CLOGGING);
+  if (ft && used < len) {
+    char holder[13];
+    unsigned char mac[6] = {0};
+    parse_mac(bssid, mac);
+    snprintf(holder, sizeof(holder), "%02x%02x%02x%02x%02x%02x", mac[0],
+             mac[1], mac[2], mac[3], mac[4], mac[5]);
+    used += snprintf(buf + used, len - used,
+                     "mobility_domain=%02x%02x\nnas_identifier=%s\n"
+                     "r1_key_holder=%s\nft_over_ds=0\n"
+                     "ft_psk_generate_local=1\n",
+                     mac[4], mac[5], holder, holder);
+  }
+}
+
+// Write HOSTAPD_CONF for the given credentials, BSSID and radio plan.
+int write_hostapd_config(const char *ssid, const char *pass,
+                         const char *bssid, const RadioPlan *plan) {
+  char radio[1024], security[512];
+  format_radio_config(plan, radio, sizeof(radio));
+  format_security_config(plan, bssid, security, sizeof(security));
+  // 64 hex digits are the PSK itself, which SAE cannot use.
+  int raw_psk = strlen(pass) == 64;
+  if (raw_psk && opts.security != SECURITY_WPA2) {
+    fprintf(stderr, "WPA3 needs a passphrase; a 64-hex-digit PSK only works "
+                    "with security=wpa2.\n");
+    return 1;
+  }
+  FILE *fp = fopen(HOSTAPD_CONF, "w");
+  if (!fp) {
+    perror("fopen hostapd config");
+    return 1;
+  }
+  fprintf(fp,
+          "interface=%s\n"
+          "driver=nl80211\n"
+          "ctrl_interface=%s\n"
+          "ssid=%s\n"
+          "bssid=%s\n"
+          "%s"
+          "wpa=2\n"
+          "%s=%s\n"
+          "%s"
+          "wpa_pairwise=CCMP\n"
+          "rsn_pairwise=CCMP\n",
+          AP_IFACE, HOSTAPD_CTRL, ssid, bssid, radio,
+          raw_psk ? "wpa_psk" : "wpa_passphrase", pass, security);
+  fclose(fp);
+  return 0;
+}
+
+// --- Automatic channel selection ---
+
+// Survey and scan data for one allowed channel of the AP radio.
+typedef struct {
+  int freq, channel;
+  double busy_pct;     // Busy share of the surveyed active time
+  double noise_dbm;    // 0 when the driver reports no noise floor
+  double interference; // Neighbour BSSes weighted by signal and overlap
+  int bss;
+} ChannelSurvey;
+
+// Collect the channels the phy may start an AP on: enabled 2.4/5 GHz
+// frequencies without no-IR or radar restrictions.
+int parse_allowed_channels(const char *phy_info, ChannelSurvey *ch, int max) {
+  int n = 0;
+  char *copy = strdup(phy_info ? phy_info : "");
+  char *save = NULL;
+  for (char *line = strtok_r(copy, "\n", &save); line && n < max;
+       line = strtok_r(NULL, "\n", &save)) {
+    const char *p = strstr(line, "* ");
+    int freq, channel;
+    if (!p || !strstr(p, " MHz [") ||
+        sscanf(strchr(p, '['), "[%d]", &channel) != 1 ||
+        sscanf(p, "* %d", &freq) != 1 || freq >= 5925 ||
+        (opts.band == BAND_2G && freq > 2500) ||
+        (opts.band == BAND_5G && freq < 5000) ||
+        strstr(line, "disabled") || strstr(line, "no IR") ||
+        strstr(line, "radar detection"))
+      continue;
+    memset(&ch[n], 0, sizeof(ch[n]));
+    ch[n].freq = freq;
+    ch[n].channel = channel;
+    n++;
+  }
+  free(copy);
+  return n;
+}
+
+int find_channel(const ChannelSurvey *ch, int n, int freq) {
+  for (int i = 0; i < n; i++)
+    if (ch[i].freq == freq)
+      return i;
+  return -1;
+}
+
+// Apply `iw dev <dev> survey dump` output: busy time and noise per channel.
+void apply_survey_dump(const char *survey, ChannelSurvey *ch, int n) {
+  char *copy = strdup(survey ? survey : "");
+  char *save = NULL;
+  int cur = -1;
+  double active = 0, busy = 0;
+  for (char *line = strtok_r(copy, "\n", &save); line;
+       line = strtok_r(NULL, "\n", &save)) {
+    const char *colon = strchr(line, ':');
+    double value = colon ? atof(colon + 1) : 0;
+    if (strstr(line, "Survey data from"))
+      cur = -1, active = busy = 0;
+    else if (strstr(line, "frequency:"))
+      cur = find_channel(ch, n, (int)value);
+    else if (cur < 0)
+      continue;
+    else if (strstr(line, "noise:"))
+      ch[cur].noise_dbm = value;
+    else if (strstr(line, "channel active time:"))
+      active = value;
+    else if (strstr(line, "channel busy time:"))
+      busy = value;
+    if (cur >= 0 && active > 0)
+      ch[cur].busy_pct = busy * 100 / active;
+  }
+  free(copy);
+}
+
+// Apply `iw dev <dev> scan` output. Each BSS counts by signal strength, and
+// on 2.4 GHz it also loads the channels its 20 MHz overlaps.
+void apply_scan_dump(const char *scan, ChannelSurvey *ch, int n) {
+  char *copy = strdup(scan ? scan : "");
+  char *save = NULL;
+  int freq = 0;
+  for (char *line = strtok_r(copy, "\n", &save); line;
+       line = strtok_r(NULL, "\n", &save)) {
+    const char *p;
+    double signal;
+    if (strncmp(line, "BSS ", 4) == 0)
+      freq = 0;
+    else if ((p = strstr(line, "freq: ")))
+      freq = atoi(p + 6);
+    else if ((p = strstr(line, "signal: ")) &&
+             sscanf(p + 8, "%lf", &signal) == 1 && freq) {
+      double weight = (signal + 100) / 2;
+      weight = weight < 2 ? 2 : weight > 30 ? 30 : weight;
+      int bss_channel = freq_to_channel(freq);
+      for (int i = 0; i < n; i++) {
+        int d = abs(ch[i].channel - bss_channel);
+        if (ch[i].freq == freq)
+          ch[i].bss++;
+        if (ch[i].freq == freq || (freq < 5000 && ch[i].freq < 5000 && d < 5))
+          ch[i].interference += weight * (5 - d) / 5;
+      }
+      freq = 0;
+    }
+  }
+  free(copy);
+}
+
+double survey_score(const ChannelSurvey *c) {
+  double noise = c->noise_dbm < 0 && c->noise_dbm > -95 ? c->noise_dbm + 95 : 0;
+  return c->busy_pct + c->interference + noise;
+}
+
+// Score primary channel i at the widest block whose channels are all
+// allowed (up to 80 MHz on 5 GHz, 20 MHz on crowded 2.4 GHz): the mean of
+// the member scores plus a penalty for each halving of the width. Lower is
+// better.
+double channel_score(const ChannelSurvey *ch, int n, int i, int *width,
+                     int *center) {
+  int c = ch[i].channel;
+  *width = 20;
+  *center = c;
+  if (ch[i].freq >= 5000 && c != 165) {
+    int first = c >= 149 ? 149 : 36;
+    for (int w = 80; w >= 40; w /= 2) {
+      int span = w / 5, base = first + (c - first) / span * span, ok = 1;
+      for (int k = 0; k < span && ok; k += 4)
+        ok = find_channel(ch, n, 5000 + 5 * (base + k)) >= 0;
+      if (ok) {
+        *width = w;
+        *center = base + span / 2 - 2;
+        break;
+      }
+    }
+  }
+  double sum = 0;
+  int members = 0;
+  for (int k = *center - (*width / 10 - 2); k <= *center + (*width / 10 - 2);
+       k += 4) {
+    int j = *width == 20 ? i : find_channel(ch, n, 5000 + 5 * k);
+    if (j >= 0) {
+      sum += survey_score(&ch[j]);
+      members++;
+    }
+  }
+  return sum / (members ? members : 1) + (80 - *width) / 4.0;
+}
+
+// Score the channels of dev's phy from a fresh scan and its survey dump and
+// fill plan with the best one. *current gets the score of current_channel
+// (or a very high score when that channel is not allowed).
+int acs_select(const char *iw_path, const char *dev, int current_channel,
+               RadioPlan *plan, double *best, double *current) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "%s dev %s info", iw_path, dev);
+  char *dev_info = exec_cmd(cmd);
+  const char *wiphy = dev_info ? strstr(dev_info, "wiphy ") : NULL;
+  if (!wiphy) {
+    free(dev_info);
+    return 1;
+  }
+  snprintf(cmd, sizeof(cmd), "%s phy phy%d info", iw_path, atoi(wiphy + 6));
+  free(dev_info);
+  char *phy_info = exec_cmd(cmd);
+  snprintf(cmd, sizeof(cmd), "sudo %s dev %s scan 2>/dev/null", iw_path, dev);
+  char *scan = exec_cmd(cmd);
+  snprintf(cmd, sizeof(cmd), "%s dev %s survey dump 2>/dev/null", iw_path,
+           dev);
+  char *survey = exec_cmd(cmd);
+  snprintf(cmd, sizeof(cmd), "%s reg get 2>/dev/null", iw_path);
+  char *reg_info = exec_cmd(cmd);
+
+  ChannelSurvey ch[MAX_CHANNELS];
+  int n = parse_allowed_channels(phy_info, ch, MAX_CHANNELS);
+  apply_survey_dump(survey, ch, n);
+  apply_scan_dump(scan, ch, n);
+  int pick = -1, pick_width = 20, pick_center = 0;
+  *best = *current = 1e9;
+  for (int i = 0; i < n; i++) {
+    int width, center;
+    double score = channel_score(ch, n, i, &width, &center);
+    if (ch[i].channel == current_channel)
+      *current = score;
+    if (pick < 0 || score < *best ||
+        (score == *best && width > pick_width)) {
+      pick = i;
+      *best = score;
+      pick_width = width;
+      pick_center = center;
+    }
+  }
+  int ret = 1;
+  if (pick >= 0) {
+    memset(plan, 0, sizeof(*plan));
+    plan->channel = ch[pick].channel;
+    plan->freq = ch[pick].freq;
+    plan->width = pick_width;
+    plan->center_channel = pick_center;
+    fit_radio_plan(plan, phy_info, reg_info);
+    ret = 0;
+  }
+  free(phy_info);
+  free(scan);
+  free(survey);
+  free(reg_info);
+  return ret;
+}
+
+int iface_wiphy(const char *iw_path, const char *iface) {
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "%s dev %s info", iw_path, iface);
+  char *info = exec_cmd(cmd);
+  const char *p = info ? strstr(info, "wiphy ") : NULL;
+  int wiphy = p ? atoi(p + 6) : -1;
+  free(info);
+  return wiphy;
+}
+
+// For channel_select=acs, put the AP on a spare Wi-Fi radio (a different
+// phy than the uplink) and its best scoring channel. Without one the AP
+// keeps sharing the uplink's channel.
+void select_ap_channel(const char *iw_path, RadioPlan *plan) {
+  char dev[32];
+  if (!find_spare_wifi_device(dev, sizeof(dev)) ||
+      iface_wiphy(iw_path, dev) == iface_wiphy(iw_path, uplink_iface)) {
+    fprintf(stderr, "ACS needs a second radio; sharing the uplink's "
+                    "channel.\n");
+    return;
+  }
+  RadioPlan acs;
+  double best, current;
+  if (acs_select(iw_path, dev, 0, &acs, &best, &current) != 0) {
+    fprintf(stderr, "ACS found no usable channel on %s; sharing the "
+                    "uplink's channel.\n",
+            dev);
+    return;
+  }
+  *plan = acs;
+  snprintf(ap_radio, sizeof(ap_radio), "%s", dev);
+  printf("ACS: AP on %s, channel %d (score %.1f).\n", dev, acs.channel, best);
+}
+
+// Move ap0 with a channel switch announcement so associated clients follow
+// instead of reconnecting.
+int hostapd_chan_switch(const RadioPlan *plan) {
+  char cmd[384];
+  int len = snprintf(cmd, sizeof(cmd),
+                     "sudo hostapd_cli -p %s -i %s chan_switch %d %d",
+                     HOSTAPD_CTRL, AP_IFACE, CSA_BEACONS, plan->freq);
+  if (plan->width > 20)
+    len += snprintf(cmd + len, sizeof(cmd) - len,
+                    " center_freq1=%d sec_channel_offset=%d bandwidth=%d",
+                    (plan->freq < 5000 ? 2407 : 5000) +
+                        5 * plan->center_channel,
+                    ht40_above(plan) ? 1 : -1, plan->width);
+  snprintf(cmd + len, sizeof(cmd) - len, "%s%s%s 2>&1",
+           plan->ht_cap ? " ht" : "",
+           plan->vht_cap && plan->freq >= 5000 ? " vht" : "",
+           plan->he ? " he" : "");
+  char *output = exec_cmd(cmd);
+  int ok = output && strstr(output, "OK") != NULL;
+  free(output);
+  return ok ? 0 : 1;
+}
+
+// Re-run ACS every acs_interval seconds while no client is associated and
+// switch channel when another one scores clearly better.
+void acs_reevaluate(const char *iw_path, RadioPlan *plan) {
+  static time_t last;
+  time_t now = time(NULL);
+  if (!ap_radio[0])
+    return;
+  if (last == 0 || now - last < opts.acs_interval) {
+    if (last == 0)
+      last = now;
+    return;
+  }
+  last = now;
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "%s dev %s station dump", iw_path, AP_IFACE);
+  char *stations = exec_cmd(cmd);
+  int idle = !stations || !strstr(stations, "Station ");
+  free(stations);
+  if (!idle)
+    return;
+  RadioPlan next;
+  double best, current;
+  if (acs_select(iw_path, ap_radio, plan->channel, &next, &best, &current) !=
+          0 ||
+      next.channel == plan->channel || best + ACS_MARGIN >= current)
+    return;
+  printf("ACS: moving AP from channel %d to %d (score %.1f -> %.1f).\n",
+         plan->channel, next.channel, current, best);
+  if (hostapd_chan_switch(&next) == 0)
+    *plan = next;
+  else
+    fprintf(stderr, "Channel switch to %d failed.\n", next.channel);
+}
+
+// A single radio keeps ap0 on the uplink's channel. When the uplink moves
+// (auto_switch_wifi() or a NetworkManager roam), follow it with a channel
+// switch announcement so clients stay associated. Returns 1 when the AP
+// moved, -1 when the plan changed but hostapd refused the switch, and 0 when
+// there was nothing to do.
+int follow_uplink_channel(const char *iw_path, RadioPlan *plan) {
+  if (ap_radio[0] || !uplink_iface[0])
+    return 0;
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "%s dev %s info", iw_path, uplink_iface);
+  char *info = exec_cmd(cmd);
+  const char *chan = info ? strstr(info, "channel ") : NULL;
+  const char *wiphy = info ? strstr(info, "wiphy ") : NULL;
+  int channel = 0, freq = 0;
+  if (chan)
+    sscanf(chan, "channel %d (%d MHz)", &channel, &freq);
+  int phy = wiphy ? atoi(wiphy + 6) : -1;
+  free(info);
+  // A make-before-break switch may have left the uplink on another radio,
+  // which frees the AP from its channel.
+  if (freq == 0 || freq == plan->freq ||
+      phy != iface_wiphy(iw_path, AP_IFACE))
+    return 0;
+  RadioPlan next;
+  if (probe_radio(iw_path, uplink_iface, &next) != 0)
+    return 0;
+  printf("Uplink moved to channel %d; moving %s from channel %d...\n",
+         next.channel, AP_IFACE, plan->channel);
+  int ok = hostapd_chan_switch(&next) == 0;
+  *plan = next;
+  return ok ? 1 : -1;
+}
+
+char *read_text_file(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+  char *result = NULL;
+  size_t size = 0;
+  char buffer[4096];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    char *grown = realloc(result, size + len + 1);
+    if (!grown)
+      break;
+    result = grown;
+    memcpy(result + size, buffer, len);
+    size += len;
+    result[size] = '\0';
+  }
+  fclose(fp);
+  return result;
+}
+
+// --- Startup and failover timings ---
+
+double elapsed_seconds(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+// --- Startup phase events ---
+
+// While phase_fd is open (the uic progress view, or HSC_PHASE_FD for hsc)
+// the startup reports each phase as a "<phase> <result> <ms>" line, where
+// result is begin, ok, fail or timeout and ms counts from engine_start. A
+// final "ready ok" line follows the last phase; a failed start ends with the
+// open phase's "fail" and, if anything was set up, a "rollback" phase.
+int phase_fd = -1;
+const char *current_phase = NULL;
+
+void phase_event(const char *phase, const char *result) {
+  if (phase_fd < 0)
+    return;
+  char line[96];
+  int len = snprintf(line, sizeof(line), "%s %s %.0f\n", phase, result,
+                     elapsed_seconds(&engine_start) * 1000);
+  if (write(phase_fd, line, len) < 0 && errno != EINTR) {
+    close(phase_fd); // Nobody is listening any more
+    phase_fd = -1;
+  }
+}
+
+void phase_end(const char *result) {
+  if (current_phase)
+    phase_event(current_phase, result);
+  current_phase = NULL;
+}
+
+// Start a phase, closing the previous one as successful.
+void phase_begin(const char *phase) {
+  phase_end("ok");
+  current_phase = phase;
+  phase_event(phase, "begin");
+}
+
+// --- Uplink history ---
+
+// A sampler process appends one HistoryRecord per second to HISTORY_FILE, a
+// memory-mapped ring of HISTORY_SLOTS records behind a HistoryHeader, so
+// recording a sample is a handful of stores with no system call; the kernel
+// writes the pages back. The engine maps the same file to publish the
+// current uplink and pending events, and readers (the uic view, hsc
+// --export-history) map it read-only. head only grows: record i lives in
+// slot i % HISTORY_SLOTS and is complete once head > i.
+typedef struct {
+  char iface[16];
+  char name[48]; // NetworkManager connection, usually the SSID
+} HistoryUplink;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int slots;
+  unsigned long long head; // Records written so far
+  unsigned int uplink;     // Index of the current uplink in uplinks
+  unsigned int n_uplinks;
+  unsigned int events; // HIST_EV_* bits waiting for the next record
+  unsigned int reserved;
+  HistoryUplink uplinks[HISTORY_UPLINKS];
+} HistoryHeader;
+
+typedef struct {
+  unsigned int time;      // Unix time at the start of the second
+  float rtt_ms;           // Probe round trip, negative when unanswered
+  unsigned int rx_kbit;   // Uplink throughput during the second
+  unsigned int tx_kbit;
+  unsigned short clients; // Resolved neighbours on ap0
+  unsigned char uplink;   // Index into HistoryHeader.uplinks
+  unsigned char events;   // HIST_EV_* bits
+  unsigned char loss;     // Percent of the last HISTORY_LOSS_WINDOW probes
+  unsigned char probed;   // Whether a probe was sent this second
+  unsigned char pad[2];
+} HistoryRecord;
+
+enum {
+  HIST_EV_START = 1,
+  HIST_EV_STOP = 2,
+  HIST_EV_OUTAGE = 4,
+  HIST_EV_RESTORED = 8,
+  HIST_EV_FAILOVER = 16,
+  HIST_EV_CHANNEL = 32
+};
+
+const char *history_event_names[] = {"start",    "stop",     "outage",
+                                     "restored", "failover", "channel"};
+
+HistoryHeader *history = NULL; // Mapped by the engine while recording
+pid_t history_pid = -1;        // Sampler, possibly adopted from a past run
+
+size_t history_map_len() {
+  return sizeof(HistoryHeader) + HISTORY_SLOTS * sizeof(HistoryRecord);
+}
+
+HistoryRecord *history_records(HistoryHeader *h) {
+  return (HistoryRecord *)(h + 1);
+}
+
+// Oldest record a reader may use: the sampler could be rewriting the few
+// slots just behind the oldest one.
+unsigned long long history_first(unsigned long long head) {
+  return head > HISTORY_SLOTS - HISTORY_MARGIN
+             ? head - (HISTORY_SLOTS - HISTORY_MARGIN)
+             : 0;
+}
+
+// Map HISTORY_FILE, creating or resetting it when writable.
+HistoryHeader *history_map(int writable) {
+  size_t len = history_map_len();
+  if (writable)
+    mkdir(HISTORY_DIR, 0755);
+  int fd = open(HISTORY_FILE, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  struct stat st;
+  if (fd < 0 || (writable ? ftruncate(fd, len) != 0
+                          : fstat(fd, &st) != 0 || (size_t)st.st_size < len)) {
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  HistoryHeader *h = mmap(NULL, len, PROT_READ | (writable ? PROT_WRITE : 0),
+                          MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED)
+    return NULL;
+  if (h->magic != HISTORY_MAGIC || h->slots != HISTORY_SLOTS) {
+    if (!writable) {
+      munmap(h, len);
+      return NULL;
+    }
+    // Records are only read below head, so only the header needs clearing.
+    memset(h, 0, sizeof(*h));
+    h->slots = HISTORY_SLOTS;
+    h->magic = HISTORY_MAGIC;
+  }
+  return h;
+}
+
+// Join the names of the event bits with sep.
+void format_history_events(unsigned int events, char *buf, size_t len,
+                           const char *sep) {
+  size_t used = 0;
+  buf[0] = '\0';
+  for (int i = 0; i < 6 && used < len; i++)
+    if (events & (1u << i))
+      used += snprintf(buf + used, len - used, "%s%s", used ? sep : "",
+                       history_event_names[i]);
+}
+
+void history_event(unsigned int event) {
+  if (history)
+    __atomic_fetch_or(&history->events, event, __ATOMIC_RELEASE);
+}
+
+// Publish the uplink (interface and NetworkManager connection) the samples
+// that follow belong to. When the table is full the entry after the
+// current one is reused, and older records pointing at it are relabelled.
+void history_note_uplink(const char *nmcli_path) {
+  if (!history || !uplink_iface[0])
+    return;
+  HistoryUplink up;
+  memset(&up, 0, sizeof(up));
+  snprintf(up.iface, sizeof(up.iface), "%.15s", uplink_iface);
+  char cmd[160];
+  snprintf(cmd, sizeof(cmd), "%s -g GENERAL.CONNECTION dev show %s",
+           nmcli_path, uplink_iface);
+  char *name = exec_cmd(cmd);
+  if (name) {
+    name[strcspn(name, "\n")] = '\0';
+    snprintf(up.name, sizeof(up.name), "%s", name);
+    free(name);
+  }
+  unsigned int i;
+  for (i = 0; i < history->n_uplinks; i++)
+    if (memcmp(&history->uplinks[i], &up, sizeof(up)) == 0)
+      break;
+  if (i == history->n_uplinks) {
+    if (history->n_uplinks < HISTORY_UPLINKS)
+      history->n_uplinks++;
+    else
+      i = (history->uplink + 1) % HISTORY_UPLINKS;
+    history->uplinks[i] = up;
+  }
+  __atomic_store_n(&history->uplink, i, __ATOMIC_RELEASE);
+}
+
+// Internet checksum, for the echo requests a raw socket sends.
+unsigned short icmp_checksum(const void *data, size_t len) {
+  const unsigned short *p = data;
+  unsigned int sum = 0;
+  for (; len > 1; len -= 2)
+    sum += *p++;
+  if (len)
+    sum += *(const unsigned char *)p;
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum += sum >> 16;
+  return ~sum;
+}
+
+// Resolve the first connectivity probe target.
+int resolve_probe_target(struct in_addr *addr) {
+  char host[sizeof(opts.probe)];
+  snprintf(host, sizeof(host), "%s", opts.probe);
+  host[strcspn(host, ",")] = '\0';
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0)
+    return 1;
+  *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return 0;
+}
+
+// Drain the probe socket. Returns 1 when the reply to seq was among the
+// packets.
+int take_probe_reply(int sock, int raw, unsigned short id,
+                     unsigned short seq) {
+  unsigned char buf[256];
+  ssize_t n;
+  int found = 0;
+  while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) {
+    const unsigned char *p = buf;
+    if (raw) { // Raw sockets deliver the IP header as well
+      int ihl = (buf[0] & 0x0f) * 4;
+      p += ihl;
+      n -= ihl;
+    }
+    const struct icmphdr *rep = (const struct icmphdr *)p;
+    if (n >= (ssize_t)sizeof(*rep) && rep->type == ICMP_ECHOREPLY &&
+        ntohs(rep->un.echo.sequence) == seq &&
+        (!raw || rep->un.echo.id == htons(id)))
+      found = 1;
+  }
+  return found;
+}
+
+// Count the resolved ARP neighbours on the AP interface.
+int count_ap_clients(FILE *arp) {
+  char line[256], flags[16], dev[32];
+  int n = 0;
+  rewind(arp); // procfs regenerates the table on every read from offset 0
+  if (!fgets(line, sizeof(line), arp))
+    return 0;
+  while (fgets(line, sizeof(line), arp))
+    if (sscanf(line, "%*s %*s %15s %*s %*s %31s", flags, dev) == 2 &&
+        strcmp(dev, AP_IFACE) == 0 && (strtol(flags, NULL, 16) & 0x2))
+      n++;
+  return n;
+}
+
+// Read a sysfs counter through a descriptor kept open. Returns -1 when
+// unavailable.
+long long read_counter(int fd) {
+  char buf[32];
+  ssize_t n = fd >= 0 ? pread(fd, buf, sizeof(buf) - 1, 0) : -1;
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  return strtoll(buf, NULL, 10);
+}
+
+// Sampler process: once a second, probe the first connectivity target with
+// an ICMP echo (through an unprivileged ping socket, else a raw one), read
+// the uplink byte counters and the client count, and append a record. It
+// holds a write lock on HISTORY_FILE so a later engine can adopt it, and
+// writes a final record with HIST_EV_STOP on SIGTERM/SIGINT.
+int run_history_sampler() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  if (phase_fd >= 0)
+    close(phase_fd);
+  phase_fd = -1;
+
+  int lock_fd = open(HISTORY_FILE, O_RDWR);
+  struct flock lk = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (lock_fd < 0 || fcntl(lock_fd, F_SETLK, &lk) != 0)
+    return 1; // Another sampler is recording
+  int sig_fd = signalfd(-1, &mask, 0);
+
+  int raw = 0;
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_ICMP);
+  if (sock < 0) {
+    sock = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+    raw = 1;
+  }
+  struct sockaddr_in target;
+  memset(&target, 0, sizeof(target));
+  target.sin_family = AF_INET;
+  time_t looked_up = 0;
+  unsigned short id = getpid() & 0xffff, seq = 0;
+  unsigned long long lost = 0; // Bit per recent probe, 1 = unanswered
+  int probes = 0;
+
+  FILE *arp = fopen("/proc/net/arp", "r");
+  int rx_fd = -1, tx_fd = -1;
+  char counted[16] = ""; // Interface the byte counters belong to
+  long long rx_prev = -1, tx_prev = -1;
+  struct timespec prev_at;
+  clock_gettime(CLOCK_MONOTONIC, &prev_at);
+
+  int running = 1;
+  while (running) {
+    struct timespec now, sent;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t second = now.tv_sec;
+    // Look the target up again every ten minutes, or every minute until it
+    // resolves. A failed lookup keeps the old address, so an outage does
+    // not stop the probes.
+    if (sock >= 0 &&
+        second - looked_up >= (target.sin_addr.s_addr ? 600 : 60)) {
+      resolve_probe_target(&target.sin_addr);
+      looked_up = second;
+    }
+    int probed = 0;
+    if (sock >= 0 && target.sin_addr.s_addr) {
+      struct icmphdr req;
+      memset(&req, 0, sizeof(req));
+      req.type = ICMP_ECHO;
+      req.un.echo.id = htons(id);
+      req.un.echo.sequence = htons(++seq);
+      req.checksum = icmp_checksum(&req, sizeof(req));
+      clock_gettime(CLOCK_MONOTONIC, &sent);
+      probed = sendto(sock, &req, sizeof(req), 0, (struct sockaddr *)&target,
+                      sizeof(target)) == sizeof(req);
+    }
+
+    // Wait out the second, taking the reply when it arrives.
+    float rtt = -1;
+    struct pollfd pfd[2] = {{sig_fd, POLLIN, 0}, {sock, POLLIN, 0}};
+    int wait_ms = 1000 - now.tv_nsec / 1000000;
+    while (wait_ms > 0) {
+      int n = poll(pfd, sock >= 0 ? 2 : 1, wait_ms);
+      if (n > 0 && pfd[0].revents) {
+        running = 0;
+        break;
+      }
+      if (n > 0 && (pfd[1].revents & POLLIN) &&
+          take_probe_reply(sock, raw, id, seq) && probed && rtt < 0) {
+        struct timespec got;
+        clock_gettime(CLOCK_MONOTONIC, &got);
+        rtt = (got.tv_sec - sent.tv_sec) * 1e3 +
+              (got.tv_nsec - sent.tv_nsec) / 1e6;
+      }
+      clock_gettime(CLOCK_REALTIME, &now);
+      wait_ms = now.tv_sec != second ? 0 : 1000 - now.tv_nsec / 1000000;
+    }
+    if (!running && rtt < 0)
+      probed = 0; // Cut short; the reply may still have been on its way
+
+    HistoryRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time = second;
+    rec.rtt_ms = rtt;
+    rec.probed = probed;
+    if (probed) {
+      lost = (lost << 1) | (rtt < 0);
+      if (probes < HISTORY_LOSS_WINDOW)
+        probes++;
+    }
+    int missed = 0;
+    for (int i = 0; i < probes; i++)
+      missed += (lost >> i) & 1;
+    rec.loss = probes ? missed * 100 / probes : 0;
+
+    // Reopen the counters when the engine moved to another uplink.
+    unsigned int cur = __atomic_load_n(&history->uplink, __ATOMIC_ACQUIRE);
+    const char *iface = history->uplinks[cur % HISTORY_UPLINKS].iface;
+    if (strncmp(iface, counted, sizeof(counted)) != 0) {
+      char path[96];
+      if (rx_fd >= 0)
+        close(rx_fd);
+      if (tx_fd >= 0)
+        close(tx_fd);
+      snprintf(counted, sizeof(counted), "%.15s", iface);
+      snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_bytes",
+               counted);
+      rx_fd = open(path, O_RDONLY);
+      snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/tx_bytes",
+               counted);
+      tx_fd = open(path, O_RDONLY);
+      rx_prev = tx_prev = -1;
+    }
+    rec.uplink = cur;
+    struct timespec at;
+    clock_gettime(CLOCK_MONOTONIC, &at);
+    double secs = (at.tv_sec - prev_at.tv_sec) +
+                  (at.tv_nsec - prev_at.tv_nsec) / 1e9;
+    prev_at = at;
+    long long rx = read_counter(rx_fd), tx = read_counter(tx_fd);
+    if (rx >= rx_prev && rx_prev >= 0 && secs > 0)
+      rec.rx_kbit = (rx - rx_prev) * 8 / 1000 / secs;
+    if (tx >= tx_prev && tx_prev >= 0 && secs > 0)
+      rec.tx_kbit = (tx - tx_prev) * 8 / 1000 / secs;
+    rx_prev = rx;
+    tx_prev = tx;
+    rec.clients = arp ? count_ap_clients(arp) : 0;
+    rec.events = __atomic_exchange_n(&history->events, 0, __ATOMIC_ACQ_REL) |
+                 (running ? 0 : HIST_EV_STOP);
+
+    // Publish: fill the slot, then move head past it.
+    unsigned long long head = history->head;
+    history_records(history)[head % HISTORY_SLOTS] = rec;
+    __atomic_store_n(&history->head, head + 1, __ATOMIC_RELEASE);
+  }
+  msync(history, history_map_len(), MS_SYNC);
+  return 0;
+}
+
+// Map the history file and fork the sampler, or adopt the one a previous
+// run left recording: a sampler holds a write lock on the file for as long
+// as it runs. Returns 0 when history is being recorded.
+int start_history(const char *nmcli_path) {
+  history = history_map(1);
+  if (!history) {
+    fprintf(stderr, "Cannot map %s; uplink history is off.\n", HISTORY_FILE);
+    return 1;
+  }
+  int fd = open(HISTORY_FILE, O_RDONLY);
+  struct flock lk = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (fd >= 0 && fcntl(fd, F_GETLK, &lk) == 0 && lk.l_type != F_UNLCK) {
+    history_pid = lk.l_pid;
+    printf("Keeping the uplink history sampler (PID %d).\n", history_pid);
+  } else {
+    fflush(stdout);
+    history_pid = fork();
+    if (history_pid == 0)
+      exit(run_history_sampler());
+  }
+  if (fd >= 0)
+    close(fd);
+  if (history_pid < 0)
+    return 1;
+  history_event(HIST_EV_START);
+  history_note_uplink(nmcli_path);
+  return 0;
+}
+
+// Print a CSV field, quoted when it holds a comma or a quote.
+void print_csv_field(const char *text) {
+  if (!strpbrk(text, ",\"\n")) {
+    fputs(text, stdout);
+    return;
+  }
+  putchar('"');
+  for (const char *p = text; *p; p++) {
+    if (*p == '"')
+      putchar('"');
+    putchar(*p);
+  }
+  putchar('"');
+}
+
+// hsc --export-history: print the recorded history as CSV, only the last
+// minutes of it when minutes > 0.
+int export_history(int minutes) {
+  HistoryHeader *h = history_map(0);
+  if (!h) {
+    fprintf(stderr, "No uplink history in %s.\n", HISTORY_FILE);
+    return 1;
+  }
+  unsigned long long head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  time_t since = minutes > 0 ? time(NULL) - minutes * 60L : 0;
+  printf("time,uplink,connection,rtt_ms,loss_pct,clients,rx_kbit,tx_kbit,"
+         "events\n");
+  for (unsigned long long i = history_first(head); i < head; i++) {
+    HistoryRecord *r = &history_records(h)[i % HISTORY_SLOTS];
+    if ((time_t)r->time < since)
+      continue;
+    HistoryUplink *up = &h->uplinks[r->uplink % HISTORY_UPLINKS];
+    time_t t = r->time;
+    char when[32], events[64];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    format_history_events(r->events, events, sizeof(events), "|");
+    printf("%s,", when);
+    print_csv_field(up->iface);
+    putchar(',');
+    print_csv_field(up->name);
+    if (r->rtt_ms >= 0)
+      printf(",%.1f", r->rtt_ms);
+    else
+      putchar(',');
+    if (r->probed)
+      printf(",%u", r->loss);
+    else
+      putchar(',');
+    printf(",%u,%u,%u,%s\n", r->clients, r->rx_kbit, r->tx_kbit, events);
+  }
+  munmap(h, history_map_len());
+  return 0;
+}
+
+// Poll hostapd until it reports the AP as enabled. Returns 0 once it does,
+// 1 after AP_ENABLE_TIMEOUT_MS (a DFS channel stays in CAC for a minute).
+int wait_ap_enabled() {
+  char cmd[192];
+  snprintf(cmd, sizeof(cmd),
+           "sudo hostapd_cli -p %s -i %s status 2>/dev/null | "
+           "grep -q '^state=ENABLED'",
+           HOSTAPD_CTRL, AP_IFACE);
+  for (int ms = 0; ms < AP_ENABLE_TIMEOUT_MS; ms += 100) {
+    if (run_cmd(cmd) == 0)
+      return 0;
+    usleep(100000);
+  }
+  return 1;
+}
+
+// Track uplink outages from the last successful probe until connectivity is
+// confirmed again, an upper bound on the forwarding blackhole clients saw.
+void note_connectivity(int up) {
+  static struct timespec last_ok;
+  static int down;
+  if (!up) {
+    if (!down)
+      history_event(HIST_EV_OUTAGE);
+    down = 1;
+    return;
+  }
+  if (down) {
+    last_outage_seconds = elapsed_seconds(&last_ok);
+    outages++;
+    history_event(HIST_EV_RESTORED);
+    down = 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &last_ok);
+}
+
+// Record when the first lease since startup was granted. The grant time is
+// taken from the lease expiry, so it is exact to the second however long
+// the check interval is.
+void update_first_lease() {
+  unsigned int secs = lease_seconds(opts.lease_time);
+  if (first_lease_seconds >= 0 || secs == 0xffffffffu)
+    return;
+  long long first = -1;
+  FILE *fp = fopen(opts.builtin_dhcp ? BUILTIN_LEASE_FILE : DNSMASQ_LEASE_FILE,
+                   "r");
+  if (!fp)
+    return;
+  if (opts.builtin_dhcp) {
+    LeaseFileHeader hdr;
+    LeaseRecord rec;
+    if (fread(&hdr, sizeof(hdr), 1, fp) == 1 && hdr.magic == LEASE_FILE_MAGIC)
+      for (unsigned int i = 0;
+           i < hdr.pool_size && fread(&rec, sizeof(rec), 1, fp) == 1; i++) {
+        long long granted = (long long)rec.expires - secs;
+        if (rec.state == LEASE_BOUND && granted >= engine_start_wall &&
+            (first < 0 || granted < first))
+          first = granted;
+      }
+  } else {
+    // dnsmasq: "<expiry> <mac> <ip> <name> <client-id>" per lease.
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      long long granted = strtoll(line, NULL, 10) - secs;
+      if (granted >= engine_start_wall && (first < 0 || granted < first))
+        first = granted;
+    }
+  }
+  fclose(fp);
+  if (first >= 0)
+    first_lease_seconds = first - engine_start_wall;
+}
+
+// --- Path MTU ---
+
+// Tethered, PPPoE and VPN uplinks often carry less than the 1500 bytes
+// clients on ap0 assume, and many paths drop the ICMP "fragmentation
+// needed" that would tell them. The engine measures the path MTU itself,
+// clamps the MSS of forwarded TCP handshakes to it and advertises it to
+// clients in DHCP (option 26) and in router advertisements. path_mtu,
+// lan_mtu and clamp_mss sit with the address plan, which DHCP reads.
+
+int read_iface_mtu(const char *iface) {
+  char path[96];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/mtu", iface);
+  return read_long_file(path);
+}
+
+// Send one echo request that fills a size-byte IP packet with DF set and
+// wait for its reply.
+int pmtu_probe(int sock, int raw, unsigned short id, unsigned short seq,
+               int size) {
+  unsigned char pkt[9000];
+  struct icmphdr *req = (struct icmphdr *)pkt;
+  int len = size - 20; // ICMP header and payload after the IP header
+  memset(pkt, 0, len);
+  req->type = ICMP_ECHO;
+  req->un.echo.id = htons(id);
+  req->un.echo.sequence = htons(seq);
+  req->checksum = icmp_checksum(pkt, len);
+  if (send(sock, pkt, len, 0) != len)
+    return 0;
+  struct pollfd pfd = {sock, POLLIN, 0};
+  for (int ms = PMTU_PROBE_MS; ms > 0; ms -= 50)
+    if (poll(&pfd, 1, 50) > 0 && take_probe_reply(sock, raw, id, seq))
+      return 1;
+  return 0;
+}
+
+// Largest packet that reaches the first probe target through the uplink, at
+// most link_mtu. A full-size probe settles the common case at once. When it
+// is lost, the MTU the kernel learnt from an ICMP "fragmentation needed" is
+// tried next, and a binary search over DF-marked echoes handles paths that
+// drop those messages. A lost echo counts against its size, so the result
+// errs low; each size gets two tries. Returns link_mtu when the target
+// cannot be probed or does not answer even minimum-size echoes.
+int probe_path_mtu(int link_mtu) {
+  struct sockaddr_in target;
+  memset(&target, 0, sizeof(target));
+  target.sin_family = AF_INET;
+  if (link_mtu < PMTU_MIN || resolve_probe_target(&target.sin_addr) != 0)
+    return link_mtu;
+  int raw = 0;
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_ICMP);
+  if (sock < 0) {
+    sock = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+    raw = 1;
+  }
+  int pmtudisc = IP_PMTUDISC_PROBE; // Set DF, ignore the cached path MTU
+  if (sock < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc,
+                 sizeof(pmtudisc)) != 0 ||
+      connect(sock, (struct sockaddr *)&target, sizeof(target)) != 0) {
+    if (sock >= 0)
+      close(sock);
+    return link_mtu;
+  }
+  unsigned short id = getpid() & 0xffff, seq = 0;
+  int lo = PMTU_MIN, hi = link_mtu, found = 0;
+  for (int try = 0; try < 2 && !found; try++)
+    found = pmtu_probe(sock, raw, id, ++seq, hi);
+  if (!found && (pmtu_probe(sock, raw, id, ++seq, lo) ||
+                 pmtu_probe(sock, raw, id, ++seq, lo))) {
+    int learnt = 0;
+    socklen_t len = sizeof(learnt);
+    if (getsockopt(sock, IPPROTO_IP, IP_MTU, &learnt, &len) == 0 &&
+        learnt > lo && learnt < hi &&
+        (pmtu_probe(sock, raw, id, ++seq, learnt) ||
+         pmtu_probe(sock, raw, id, ++seq, learnt))) {
+      lo = learnt; // A router reported it, no need to search
+      hi = learnt + 1;
+    }
+    // lo got through and hi did not.
+    while (hi - lo > 1) {
+      int mid = (lo + hi) / 2;
+      if (pmtu_probe(sock, raw, id, ++seq, mid) ||
+          pmtu_probe(sock, raw, id, ++seq, mid))
+        lo = mid;
+      else
+        hi = mid;
+    }
+    hi = lo;
+  }
+  close(sock);
+  return hi;
+}
+
+// Measure the uplink's path MTU, or take uplink_mtu when it is set, and
+// derive what ap0 advertises.
+void discover_uplink_mtu() {
+  int link_mtu = read_iface_mtu(uplink_iface);
+  if (opts.uplink_mtu)
+    path_mtu = opts.uplink_mtu;
+  else if (trace_mode == TRACE_REPLAY)
+    path_mtu = link_mtu; // No network to probe
+  else
+    path_mtu = probe_path_mtu(link_mtu);
+  int ap_mtu = read_iface_mtu(AP_IFACE);
+  lan_mtu = path_mtu > 0 && path_mtu < ap_mtu ? path_mtu : 0;
+  printf("Uplink %s: link MTU %d, path MTU %d.\n", uplink_iface, link_mtu,
+         path_mtu);
+}
+
+// Delete the TCPMSS rules apply_mss_clamp() installed, with the binaries
+// it installed them with.
+void remove_mss_clamp() {
+  if (!clamp_mss)
+    return;
+  char cmd[384];
+  for (int i = 0; i < (clamp_ip6tables[0] ? 4 : 2); i++) {
+    snprintf(cmd, sizeof(cmd),
+             "sudo %s -w -t mangle -D FORWARD %s %s -p tcp "
+             "--tcp-flags SYN,RST SYN -j TCPMSS --set-mss %d 2>/dev/null",
+             i < 2 ? clamp_iptables : clamp_ip6tables, i % 2 ? "-o" : "-i",
+             AP_IFACE, i < 2 ? clamp_mss : clamp_mss - 20);
+    run_cmd(cmd);
+  }
+  clamp_mss = 0;
+  clamp_iptables[0] = clamp_ip6tables[0] = '\0';
+}
+
+// --- IPv6 ---
+
+// Clients get IPv6 routed without translation. ap0 takes a /64 (ipv6=routed:
+// one the upstream routes to this host; ipv6=proxy: the uplink's own /64)
+// and dnsmasq advertises it for SLAAC. In proxy mode ap0's address has no
+// prefix route and the /64 stays on-link on the uplink, so every client
+// address needs a host route to ap0 and a proxy neighbour entry on the
+// uplink. The NDP proxy process below maintains both.
+char ap_ipv6_prefix[52] = ""; // Advertised /64, empty while IPv6 is off
+char ap_ipv6_addr[48] = "";
+char ipv6_uplink[32] = "";  // Uplink whose sysctls were changed
+long ipv6_saved_forwarding = -1; // Values to restore, -1 = unknown
+long ipv6_saved_accept_ra = -1;
+long ipv6_saved_proxy_ndp = -1;
+pid_t ndp_proxy_pid = -1;
+
+typedef struct {
+  struct in6_addr addr;
+  time_t seen;
+} NdpClient;
+
+// The uplink's global /64, skipping temporary and deprecated addresses.
+int uplink_ipv6_prefix(const char *iface, struct in6_addr *prefix) {
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "ip -6 -o addr show dev %s scope global", iface);
+  char *out = exec_cmd(cmd);
+  int found = 0;
+  char *save = NULL;
+  for (char *line = out ? strtok_r(out, "\n", &save) : NULL; line && !found;
+       line = strtok_r(NULL, "\n", &save)) {
+    char addr[64];
+    int len;
+    if (strstr(line, "temporary") || strstr(line, "deprecated") ||
+        sscanf(line, "%*d: %*s inet6 %63[^/]/%d", addr, &len) != 2 ||
+        len != 64 || inet_pton(AF_INET6, addr, prefix) != 1)
+      continue;
+    memset(prefix->s6_addr + 8, 0, 8);
+    found = 1;
+  }
+  free(out);
+  return found ? 0 : 1;
+}
+
+// Give ap0 an address in prefix: ::1 of a routed prefix, or the EUI-64 of
+// ap0's MAC in the shared one, where ::1 is likely the upstream router.
+void assign_ap_ipv6(const struct in6_addr *prefix) {
+  struct in6_addr addr = *prefix;
+  unsigned char mac[6];
+  if (opts.ipv6 == IPV6_PROXY && parse_mac(ap_bssid, mac) == 0) {
+    unsigned char eui[8] = {mac[0] ^ 2, mac[1], mac[2], 0xff,
+                            0xfe,       mac[3], mac[4], mac[5]};
+    memcpy(addr.s6_addr + 8, eui, 8);
+  } else {
+    addr.s6_addr[15] = 1;
+  }
+  char text[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, prefix, text, sizeof(text));
+  snprintf(ap_ipv6_prefix, sizeof(ap_ipv6_prefix), "%s/64", text);
+  inet_ntop(AF_INET6, &addr, ap_ipv6_addr, sizeof(ap_ipv6_addr));
+  char cmd[192];
+  snprintf(cmd, sizeof(cmd), "sudo ip -6 addr replace %s/64 dev %s%s",
+           ap_ipv6_addr, AP_IFACE,
+           opts.ipv6 == IPV6_PROXY ? " noprefixroute nodad" : "");
+  run_cmd(cmd);
+}
+
+// Pick the prefix for ap0 and address ap0 in it. Returns 0 when IPv6 can be
+// offered to clients.
+int setup_ipv6_address() {
+  struct in6_addr prefix;
+  if (opts.ipv6 == IPV6_ROUTED) {
+    parse_ipv6_prefix(opts.ipv6_prefix, &prefix);
+  } else if (uplink_ipv6_prefix(uplink_iface, &prefix) != 0) {
+    fprintf(stderr, "%s has no global IPv6 /64; clients get IPv4 only.\n",
+            uplink_iface);
+    return 1;
+  }
+  assign_ap_ipv6(&prefix);
+  printf("Advertising %s on %s (%s).\n", ap_ipv6_prefix, AP_IFACE,
+         opts.ipv6 == IPV6_PROXY ? "shared with the uplink via NDP proxy"
+                                 : "routed");
+  return 0;
+}
+
+// Let the uplink keep accepting router advertisements once forwarding is on
+// (accept_ra=1 is ignored on forwarding interfaces) and, in proxy mode,
+// answer neighbour solicitations for the proxied clients.
+// The values of an uplink a warm restart carried over are kept.
+void prepare_ipv6_uplink(const char *iface) {
+  char path[96], cmd[160];
+  if (strcmp(ipv6_uplink, iface) != 0) {
+    snprintf(ipv6_uplink, sizeof(ipv6_uplink), "%s", iface);
+    snprintf(path, sizeof(path), "/proc/sys/net/ipv6/conf/%s/accept_ra",
+             iface);
+    ipv6_saved_accept_ra = read_long_file(path);
+    snprintf(path, sizeof(path), "/proc/sys/net/ipv6/conf/%s/proxy_ndp",
+             iface);
+    ipv6_saved_proxy_ndp = read_long_file(path);
+  }
+  if (ipv6_saved_accept_ra == 1) {
+    snprintf(cmd, sizeof(cmd), "sudo sysctl -qw net.ipv6.conf.%s.accept_ra=2",
+             iface);
+    run_cmd(cmd);
+  }
+  if (opts.ipv6 == IPV6_PROXY && ipv6_saved_proxy_ndp == 0) {
+    snprintf(cmd, sizeof(cmd), "sudo sysctl -qw net.ipv6.conf.%s.proxy_ndp=1",
+             iface);
+    run_cmd(cmd);
+  }
+}
+
+void release_ipv6_uplink() {
+  char cmd[160];
+  if (!ipv6_uplink[0])
+    return;
+  if (ipv6_saved_accept_ra == 1) {
+    snprintf(cmd, sizeof(cmd), "sudo sysctl -qw net.ipv6.conf.%s.accept_ra=1",
+             ipv6_uplink);
+    run_cmd(cmd);
+  }
+  if (ipv6_saved_proxy_ndp == 0) {
+    snprintf(cmd, sizeof(cmd), "sudo sysctl -qw net.ipv6.conf.%s.proxy_ndp=0",
+             ipv6_uplink);
+    run_cmd(cmd);
+  }
+  ipv6_uplink[0] = '\0';
+}
+
+// Packet socket on iface that receives ICMPv6 neighbour solicitations and
+// advertisements, multicast ones included. The filter runs in the kernel,
+// so other traffic on the interface never reaches the proxy.
+int open_nd_socket(const char *iface) {
+  static struct sock_filter code[] = {
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12), // EtherType
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 6),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 20), // Next header
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 4),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 54), // ICMPv6 type
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_ADVERT, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 128),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+  struct sockaddr_ll sll;
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_IPV6);
+  sll.sll_ifindex = if_nametoindex(iface);
+  struct packet_mreq mr;
+  memset(&mr, 0, sizeof(mr));
+  mr.mr_ifindex = sll.sll_ifindex;
+  mr.mr_type = PACKET_MR_ALLMULTI;
+  int fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_IPV6));
+  if (fd < 0 || !sll.sll_ifindex ||
+      setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0 ||
+      bind(fd, (struct sockaddr *)&sll, sizeof(sll)) != 0 ||
+      setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) !=
+          0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Solicit target on ap0, so a client that owns it answers and is learned.
+void ndp_probe(int sock, unsigned int ifindex, const unsigned char *mac,
+               const struct in6_addr *target) {
+  struct {
+    struct nd_neighbor_solicit ns;
+    unsigned char opt[8]; // Source link-layer address
+  } pkt;
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.ns.nd_ns_type = ND_NEIGHBOR_SOLICIT;
+  pkt.ns.nd_ns_target = *target;
+  pkt.opt[0] = ND_OPT_SOURCE_LINKADDR;
+  pkt.opt[1] = 1; // In units of 8 bytes
+  memcpy(pkt.opt + 2, mac, 6);
+  struct sockaddr_in6 dst;
+  memset(&dst, 0, sizeof(dst));
+  dst.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "ff02::1:ff00:0", &dst.sin6_addr);
+  memcpy(dst.sin6_addr.s6_addr + 13, target->s6_addr + 13, 3);
+  dst.sin6_scope_id = ifindex;
+  sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *)&dst, sizeof(dst));
+}
+
+// Add or remove the proxy entry and host route for one client.
+void ndp_route(const struct in6_addr *addr, const char *uplink, int add) {
+  char text[INET6_ADDRSTRLEN], cmd[256];
+  const char *verb = add ? "replace" : "del";
+  const char *quiet = add ? "" : " 2>/dev/null";
+  inet_ntop(AF_INET6, addr, text, sizeof(text));
+  snprintf(cmd, sizeof(cmd),
+           "sudo ip -6 neigh %s proxy %s dev %s%s; "
+           "sudo ip -6 route %s %s/128 dev %s%s",
+           verb, text, uplink, quiet, verb, text, AP_IFACE, quiet);
+  run_cmd(cmd);
+  printf("IPv6 client %s %s.\n", text, add ? "proxied" : "removed");
+}
+
+// NDP proxy process for ipv6=proxy. Clients are learned on ap0 from their
+// duplicate address detection and from any solicitation or advertisement
+// they send with an address in the prefix. A solicitation on the uplink
+// for an unknown address in the prefix is relayed to ap0 as a probe, which
+// covers clients configured before the proxy started. Once learned, the
+// kernel answers for the client (proxy_ndp). Clients silent for
+// NDP_PROXY_EXPIRE seconds are probed, then dropped; everything is removed
+// on SIGTERM/SIGINT.
+int run_ndp_proxy(const struct in6_addr *prefix, const char *uplink) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  if (phase_fd >= 0)
+    close(phase_fd);
+  phase_fd = -1;
+  int sig_fd = signalfd(-1, &mask, 0);
+  int up_fd = open_nd_socket(uplink), ap_fd = open_nd_socket(AP_IFACE);
+  int tx = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+  int hops = 255; // Required on neighbour discovery messages
+  unsigned int ifindex = if_nametoindex(AP_IFACE);
+  unsigned char mac[6];
+  if (up_fd < 0 || ap_fd < 0 || tx < 0 || parse_mac(ap_bssid, mac) != 0 ||
+      setsockopt(tx, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops,
+                 sizeof(hops)) != 0) {
+    perror("NDP proxy sockets (needs root)");
+    return 1;
+  }
+  struct in6_addr self;
+  inet_pton(AF_INET6, ap_ipv6_addr, &self);
+
+  NdpClient *clients = calloc(NDP_PROXY_MAX, sizeof(NdpClient));
+  int n = 0, running = clients != NULL;
+  time_t next_sweep = time(NULL) + NDP_PROXY_EXPIRE / 2;
+  while (running) {
+    struct pollfd pfd[3] = {
+        {sig_fd, POLLIN, 0}, {up_fd, POLLIN, 0}, {ap_fd, POLLIN, 0}};
+    int wait_s = next_sweep - time(NULL);
+    if (poll(pfd, 3, wait_s > 0 ? wait_s * 1000 : 0) < 0 && errno != EINTR)
+      break;
+    if (pfd[0].revents)
+      running = 0;
+    for (int p = 1; p <= 2; p++) {
+      unsigned char frame[128];
+      struct sockaddr_ll from;
+      socklen_t from_len = sizeof(from);
+      ssize_t len;
+      while ((len = recvfrom(pfd[p].fd, frame, sizeof(frame), 0,
+                             (struct sockaddr *)&from, &from_len)) >= 78) {
+        if (from.sll_pkttype == PACKET_OUTGOING)
+          continue;
+        struct in6_addr src, target;
+        memcpy(&src, frame + 22, 16);
+        memcpy(&target, frame + 62, 16);
+        int type = frame[54];
+        if (p == 1) { // Uplink: somebody looks for a client
+          if (type != ND_NEIGHBOR_SOLICIT ||
+              memcmp(&target, prefix, 8) != 0 ||
+              memcmp(&target, &self, 16) == 0)
+            continue;
+          int known = 0;
+          for (int i = 0; i < n && !known; i++)
+            known = memcmp(&clients[i].addr, &target, 16) == 0;
+          if (!known)
+            ndp_probe(tx, ifindex, mac, &target);
+          continue;
+        }
+        // ap0: DAD (unspecified source) and advertisements name the
+        // client's address as target, other solicitations as source.
+        struct in6_addr *addr = type == ND_NEIGHBOR_ADVERT ||
+                                        IN6_IS_ADDR_UNSPECIFIED(&src)
+                                    ? &target
+                                    : &src;
+        if (memcmp(addr, prefix, 8) != 0 || memcmp(addr, &self, 16) == 0)
+          continue;
+        int i = 0;
+        while (i < n && memcmp(&clients[i].addr, addr, 16) != 0)
+          i++;
+        if (i == n) {
+          if (n == NDP_PROXY_MAX)
+            continue;
+          clients[n++].addr = *addr;
+          ndp_route(addr, uplink, 1);
+        }
+        clients[i].seen = time(NULL);
+      }
+    }
+    time_t now = time(NULL);
+    if (now < next_sweep)
+      continue;
+    next_sweep = now + NDP_PROXY_EXPIRE / 2;
+    for (int i = 0; i < n; i++) {
+      if (now - clients[i].seen < NDP_PROXY_EXPIRE / 2)
+        continue;
+      if (now - clients[i].seen < NDP_PROXY_EXPIRE) {
+        ndp_probe(tx, ifindex, mac, &clients[i].addr);
+        continue;
+      }
+      ndp_route(&clients[i].addr, uplink, 0);
+      clients[i--] = clients[--n];
+    }
+  }
+  for (int i = 0; i < n; i++)
+    ndp_route(&clients[i].addr, uplink, 0);
+  free(clients);
+  return 0;
+}
+
+void start_ndp_proxy() {
+  struct in6_addr prefix;
+  parse_ipv6_prefix(ap_ipv6_prefix, &prefix);
+  fflush(stdout);
+  ndp_proxy_pid = fork();
+  if (ndp_proxy_pid == 0)
+    exit(run_ndp_proxy(&prefix, uplink_iface));
+}
+
+// --- Multi-core forwarding ---
+
+// Forwarded packets are normally processed on the CPU that takes the
+// Wi-Fi interrupt, which saturates long before the radio on small
+// multi-core boxes. cpu_tuning=on spreads the work: the Wi-Fi interrupts
+// of ap0 and the uplink go round-robin over the CPUs, RPS hands received
+// packets of both interfaces to the remaining CPUs (RFS steers flows that
+// end on this host to the CPU of their socket), and XPS gives each
+// transmit queue its own CPUs. Every file is read before its first write
+// and written back on teardown, so the previous settings come back
+// exactly. The originals are also recorded in TUNING_FILE, where a warm
+// restart after a crash finds them.
+typedef struct {
+  char path[96];
+  char value[80];
+} TunedFile;
+
+TunedFile tuned_files[MAX_TUNED_FILES];
+int n_tuned_files = 0;
+
+// Write value to a /proc or /sys file, remembering what it held the first
+// time it is changed. Files that cannot be read are left alone.
+void tune_file(const char *path, const char *value) {
+  int i = 0;
+  while (i < n_tuned_files && strcmp(tuned_files[i].path, path) != 0)
+    i++;
+  if (i == n_tuned_files) {
+    char *old = read_text_file(path);
+    if (!old || n_tuned_files == MAX_TUNED_FILES) {
+      free(old);
+      return;
+    }
+    old[strcspn(old, "\n")] = '\0';
+    snprintf(tuned_files[i].path, sizeof(tuned_files[i].path), "%s", path);
+    snprintf(tuned_files[i].value, sizeof(tuned_files[i].value), "%s", old);
+    n_tuned_files++;
+    free(old);
+    FILE *fp = fopen(TUNING_FILE, "a");
+    if (fp) {
+      fprintf(fp, "%s %s\n", tuned_files[i].path, tuned_files[i].value);
+      fclose(fp);
+    }
+  }
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "echo %s | sudo tee %s >/dev/null", value, path);
+  run_cmd(cmd);
+}
+
+// Write every tuned file back, newest first.
+void restore_cpu_tuning() {
+  char cmd[256];
+  for (int i = n_tuned_files - 1; i >= 0; i--) {
+    snprintf(cmd, sizeof(cmd), "echo %s | sudo tee %s >/dev/null",
+             tuned_files[i].value, tuned_files[i].path);
+    run_cmd(cmd);
+  }
+  n_tuned_files = 0;
+  unlink(TUNING_FILE);
+}
+
+// Whether a TUNING_FILE line names a file cpu_tuning changes and a value
+// it may write back. Both end up in a root shell command.
+int valid_tuned_file(const char *path, const char *value) {
+  const char *chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                      "0123456789/._-";
+  return (strncmp(path, "/sys/class/net/", 15) == 0 ||
+          strncmp(path, "/proc/irq/", 10) == 0 ||
+          strcmp(path, "/proc/sys/net/core/rps_sock_flow_entries") == 0) &&
+         !strstr(path, "..") && strspn(path, chars) == strlen(path) &&
+         value[0] && strspn(value, "0123456789abcdefABCDEF,") == strlen(value);
+}
+
+// Take over the originals the previous run recorded in TUNING_FILE, so its
+// tuning is not read back as the values to restore.
+void load_tuned_files() {
+  FILE *fp = fopen(TUNING_FILE, "r");
+  if (!fp)
+    return;
+  char line[192];
+  while (n_tuned_files < MAX_TUNED_FILES && fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    char *value = strchr(line, ' ');
+    if (!value)
+      continue;
+    *value++ = '\0';
+    TunedFile *t = &tuned_files[n_tuned_files];
+    if (valid_tuned_file(line, value) &&
+        copy_option(line, t->path, sizeof(t->path)) == 0 &&
+        copy_option(value, t->value, sizeof(t->value)) == 0)
+      n_tuned_files++;
+  }
+  fclose(fp);
+}
+
+// Format a CPU mask the way the kernel parses it: 32-bit hex words,
+// separated by commas.
+void format_cpumask(unsigned long long mask, char *buf, size_t len) {
+  if (mask >> 32)
+    snprintf(buf, len, "%llx,%08llx", mask >> 32, mask & 0xffffffffull);
+  else
+    snprintf(buf, len, "%llx", mask);
+}
+
+// Collect the interrupts of iface's device: its MSI vectors, or its legacy
+// line. Virtual interfaces such as ap0 share the radio's device. Returns
+// the new count of irqs.
+int collect_iface_irqs(const char *iface, int *irqs, int n, int max) {
+  char path[96];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", iface);
+  int found[MAX_TUNED_IRQS], n_found = 0;
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  while (dir && (de = readdir(dir)) && n_found < MAX_TUNED_IRQS)
+    if (de->d_name[0] != '.')
+      found[n_found++] = atoi(de->d_name);
+  if (dir)
+    closedir(dir);
+  if (n_found == 0) {
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/irq", iface);
+    long irq = read_long_file(path);
+    if (irq > 0)
+      found[n_found++] = irq;
+  }
+  for (int i = 0; i < n_found; i++) {
+    int j = 0;
+    while (j < n && irqs[j] != found[i])
+      j++;
+    if (j == n && n < max)
+      irqs[n++] = found[i];
+  }
+  return n;
+}
+
+// Count iface's receive or transmit queues (prefix "rx-" or "tx-").
+int count_queues(const char *iface, const char *prefix) {
+  char path[96];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/queues", iface);
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  int n = 0;
+  while (dir && (de = readdir(dir)))
+    n += strncmp(de->d_name, prefix, 3) == 0;
+  if (dir)
+    closedir(dir);
+  return n;
+}
+
+// RPS, RFS and XPS for one interface.
+void tune_iface_queues(const char *iface, unsigned long long rps_mask,
+                       int ncpu) {
+  char path[96], value[32];
+  int n_rx = count_queues(iface, "rx-"), n_tx = count_queues(iface, "tx-");
+  for (int q = 0; q < n_rx; q++) {
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues/rx-%d/rps_cpus",
+             iface, q);
+    format_cpumask(rps_mask, value, sizeof(value));
+    tune_file(path, value);
+    snprintf(path, sizeof(path),
+             "/sys/class/net/%s/queues/rx-%d/rps_flow_cnt", iface, q);
+    snprintf(value, sizeof(value), "%d", RFS_FLOW_ENTRIES / n_rx);
+    tune_file(path, value);
+  }
+  for (int q = 0; n_tx > 1 && q < n_tx; q++) {
+    unsigned long long mask = 0;
+    for (int c = q; c < ncpu; c += n_tx)
+      mask |= 1ull << c;
+    if (!mask)
+      mask = 1ull << (q % ncpu);
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues/tx-%d/xps_cpus",
+             iface, q);
+    format_cpumask(mask, value, sizeof(value));
+    tune_file(path, value);
+  }
+}
+
+// Spread forwarding between ap0 and the uplink over the CPUs.
+void apply_cpu_tuning() {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  int ncpu = online > 64 ? 64 : online;
+  if (ncpu < 2) {
+    printf("One CPU online; nothing to spread.\n");
+    return;
+  }
+  int irqs[MAX_TUNED_IRQS], n_irqs = 0;
+  n_irqs = collect_iface_irqs(AP_IFACE, irqs, n_irqs, MAX_TUNED_IRQS);
+  n_irqs = collect_iface_irqs(uplink_iface, irqs, n_irqs, MAX_TUNED_IRQS);
+  unsigned long long all = ncpu == 64 ? ~0ull : (1ull << ncpu) - 1;
+  unsigned long long irq_cpus = 0;
+  char path[64], value[32];
+  for (int i = 0; i < n_irqs; i++) {
+    snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity", irqs[i]);
+    format_cpumask(1ull << (i % ncpu), value, sizeof(value));
+    tune_file(path, value);
+    irq_cpus |= 1ull << (i % ncpu);
+  }
+  // Keep protocol work off the interrupt CPUs while others are left.
+  unsigned long long rps_mask = (all & ~irq_cpus) ? all & ~irq_cpus : all;
+  snprintf(value, sizeof(value), "%d", RFS_FLOW_ENTRIES);
+  tune_file("/proc/sys/net/core/rps_sock_flow_entries", value);
+  tune_iface_queues(AP_IFACE, rps_mask, ncpu);
+  tune_iface_queues(uplink_iface, rps_mask, ncpu);
+  format_cpumask(rps_mask, value, sizeof(value));
+  printf("Spreading forwarding over %d CPUs: %d interrupt%s pinned, RPS "
+         "mask %s on %s and %s.\n",
+         ncpu, n_irqs, n_irqs == 1 ? "" : "s", value, AP_IFACE,
+         uplink_iface);
+}
+
+// Per-CPU counters from /proc/stat and the NET_RX column of /proc/softirqs.
+typedef struct {
+  unsigned long long busy, total, softirq, net_rx;
+} CpuLoad;
+
+// Fill cpu[] and return the number of CPUs read.
+int read_cpu_load(CpuLoad *cpu, int max) {
+  FILE *fp = fopen("/proc/stat", "r");
+  char line[512];
+  int n = 0;
+  while (fp && fgets(line, sizeof(line), fp)) {
+    unsigned long long v[8] = {0};
+    int id;
+    if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &id,
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 8 ||
+        id != n || n == max)
+      continue;
+    cpu[n].total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+    cpu[n].busy = cpu[n].total - v[3] - v[4]; // Minus idle and iowait
+    cpu[n].softirq = v[6];
+    cpu[n++].net_rx = 0;
+  }
+  if (fp)
+    fclose(fp);
+  fp = fopen("/proc/softirqs", "r");
+  while (fp && fgets(line, sizeof(line), fp)) {
+    char *p = strstr(line, "NET_RX:");
+    if (!p)
+      continue;
+    p += 7;
+    for (int i = 0; i < n; i++)
+      cpu[i].net_rx = strtoull(p, &p, 10);
+  }
+  if (fp)
+    fclose(fp);
+  return n;
+}
+
+// Byte counters of every interface but lo, from /proc/net/dev.
+int read_iface_bytes(char names[][16], unsigned long long *rx,
+                     unsigned long long *tx, int max) {
+  FILE *fp = fopen("/proc/net/dev", "r");
+  char line[512];
+  int n = 0;
+  while (fp && n < max && fgets(line, sizeof(line), fp)) {
+    char *colon = strchr(line, ':');
+    if (!colon)
+      continue; // Header lines
+    *colon = '\0';
+    char *name = line + strspn(line, " ");
+    if (strcmp(name, "lo") == 0 ||
+        sscanf(colon + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu", &rx[n],
+               &tx[n]) != 2)
+      continue;
+    snprintf(names[n++], 16, "%s", name);
+  }
+  if (fp)
+    fclose(fp);
+  return n;
+}
+
+// hsc --cpu-load: show how busy each CPU is and how much the interfaces
+// carry over a few seconds, e.g. while a forwarding benchmark runs, to see
+// whether cpu_tuning spreads the work.
+int report_cpu_load(int seconds) {
+  CpuLoad before[64], after[64];
+  char names[32][16], later[32][16];
+  unsigned long long rx0[32], tx0[32], rx1[32], tx1[32];
+  if (seconds <= 0)
+    seconds = 5;
+  int ncpu = read_cpu_load(before, 64);
+  int nif = read_iface_bytes(names, rx0, tx0, 32);
+  sleep(seconds);
+  if (read_cpu_load(after, 64) != ncpu || ncpu == 0) {
+    fprintf(stderr, "Cannot read per-CPU statistics.\n");
+    return 1;
+  }
+  printf("CPU   busy%%  softirq%%  NET_RX/s\n");
+  for (int i = 0; i < ncpu; i++) {
+    double total = after[i].total - before[i].total;
+    if (total <= 0)
+      total = 1;
+    printf("%-4d %6.1f %9.1f %9.0f\n", i,
+           100 * (after[i].busy - before[i].busy) / total,
+           100 * (after[i].softirq - before[i].softirq) / total,
+           (double)(after[i].net_rx - before[i].net_rx) / seconds);
+  }
+  printf("\nInterface        rx Mbit/s  tx Mbit/s\n");
+  int n = read_iface_bytes(later, rx1, tx1, 32);
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < nif; j++)
+      if (strcmp(later[i], names[j]) == 0)
+        printf("%-16s %9.1f %10.1f\n", later[i],
+               (rx1[i] - rx0[j]) * 8 / 1e6 / seconds,
+               (tx1[i] - tx0[j]) * 8 / 1e6 / seconds);
+  return 0;
+}
+
+// --- Speed test server ---
+
+// A small HTTP endpoint on ap_addr:SPEEDTEST_PORT that measures the Wi-Fi
+// hop on its own: clients transfer to and from the hotspot itself, while
+// the uplink is measured from the hotspot. GET /down?bytes=N streams N
+// bytes from a memfd with sendfile(), and POST /up splices the body
+// through a pipe into /dev/null, so payload never passes through user
+// space. Each transfer also takes the connection's RTT from TCP_INFO,
+// after the handshake (idle) and while data flows (loaded), which exposes
+// queueing on the Wi-Fi hop. Results are appended to SPEEDTEST_RESULTS as
+// "<time> <client> <down|up> <bytes> <seconds> <idle_ms> <loaded_ms>".
+pid_t speedtest_pid = -1;
+
+// Smoothed RTT of a connection in ms, the receive-side estimate when the
+// host is receiving. -1 while the kernel has no sample.
+double connection_rtt_ms(int sock, int receiving) {
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0)
+    return -1;
+  unsigned int us = receiving ? ti.tcpi_rcv_rtt : ti.tcpi_rtt;
+  return us ? us / 1000.0 : -1;
+}
+
+// Send bytes from the SPEEDTEST_CHUNK-sized memfd src, over and over.
+// Returns the bytes sent; *loaded_ms gets the mean RTT while sending.
+long long speedtest_send(int sock, int src, long long bytes,
+                         double *loaded_ms) {
+  long long sent = 0;
+  double sum = 0;
+  int samples = 0;
+  while (sent < bytes) {
+    off_t off = 0;
+    long long left = bytes - sent;
+    ssize_t n = sendfile(sock, src, &off,
+                         left < SPEEDTEST_CHUNK ? left : SPEEDTEST_CHUNK);
+    if (n <= 0)
+      break;
+    sent += n;
+    double rtt = connection_rtt_ms(sock, 0);
+    if (rtt >= 0) {
+      sum += rtt;
+      samples++;
+    }
+  }
+  *loaded_ms = samples ? sum / samples : -1;
+  return sent;
+}
+
+// Discard bytes of request body by splicing it into /dev/null. Returns the
+// bytes received.
+long long speedtest_receive(int sock, long long bytes, double *loaded_ms) {
+  int pipefd[2], null_fd = open("/dev/null", O_WRONLY);
+  long long got = 0;
+  double sum = 0;
+  int samples = 0;
+  if (null_fd < 0 || pipe(pipefd) != 0) {
+    if (null_fd >= 0)
+      close(null_fd);
+    *loaded_ms = -1;
+    return 0;
+  }
+  while (got < bytes) {
+    long long left = bytes - got;
+    long n = syscall(__NR_splice, sock, NULL, pipefd[1], NULL,
+                     left < SPEEDTEST_CHUNK ? left : SPEEDTEST_CHUNK, 0);
+    if (n <= 0)
+      break;
+    got += n;
+    while (n > 0) {
+      long out = syscall(__NR_splice, pipefd[0], NULL, null_fd, NULL, n, 0);
+      if (out <= 0)
+        break;
+      n -= out;
+    }
+    double rtt = connection_rtt_ms(sock, 1);
+    if (rtt >= 0) {
+      sum += rtt;
+      samples++;
+    }
+  }
+  close(pipefd[0]);
+  close(pipefd[1]);
+  close(null_fd);
+  *loaded_ms = samples ? sum / samples : -1;
+  return got;
+}
+
+// Serve one request on sock. Every read and write gives up after
+// SPEEDTEST_TIMEOUT_S without progress, so a client that stops sending or
+// receiving does not hold its child forever.
+void speedtest_client(int sock, int src, const struct sockaddr_in *peer) {
+  struct timeval timeout = {SPEEDTEST_TIMEOUT_S, 0};
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) !=
+          0 ||
+      setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0)
+    return;
+  char req[4096];
+  size_t len = 0;
+  char *body = NULL;
+  while (!body && len < sizeof(req) - 1) {
+    ssize_t n = read(sock, req + len, sizeof(req) - 1 - len);
+    if (n <= 0)
+      return;
+    len += n;
+    req[len] = '\0';
+    body = strstr(req, "\r\n\r\n");
+  }
+  if (!body)
+    return;
+  body += 4;
+  char method[8], path[256];
+  if (sscanf(req, "%7s %255s", method, path) != 2)
+    return;
+  double idle_ms = connection_rtt_ms(sock, 0), loaded_ms = -1;
+  long long bytes = -1, moved = 0;
+  const char *dir = NULL;
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (strcmp(method, "GET") == 0 && strncmp(path, "/down", 5) == 0) {
+    char *arg = strstr(path, "bytes=");
+    bytes = arg ? atoll(arg + 6) : SPEEDTEST_DEFAULT_BYTES;
+    if (bytes <= 0 || bytes > SPEEDTEST_MAX_BYTES)
+      bytes = SPEEDTEST_DEFAULT_BYTES;
+    dprintf(sock,
+            "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+            "Content-Length: %lld\r\nCache-Control: no-store\r\n"
+            "Connection: close\r\n\r\n",
+            bytes);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    moved = speedtest_send(sock, src, bytes, &loaded_ms);
+    dir = "down";
+  } else if (strcmp(method, "POST") == 0 && strncmp(path, "/up", 3) == 0) {
+    int expect = 0; // curl waits for "100 Continue" before large bodies
+    for (char *h = strstr(req, "\r\n"); h && h < body;
+         h = strstr(h + 2, "\r\n")) {
+      if (strncasecmp(h + 2, "Content-Length:", 15) == 0)
+        bytes = strtoll(h + 17, NULL, 10);
+      else if (strncasecmp(h + 2, "Expect: 100-continue", 20) == 0)
+        expect = 1;
+    }
+    if (bytes < 0) { // A chunked body, or one that ends only with EOF
+      dprintf(sock, "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\n"
+                    "Connection: close\r\n\r\n");
+      return;
+    }
+    if (expect)
+      dprintf(sock, "HTTP/1.1 100 Continue\r\n\r\n");
+    moved = len - (body - req); // Body bytes that came with the headers
+    if (moved > bytes)
+      moved = bytes; // The rest is not part of this body
+    if (moved < bytes)
+      moved += speedtest_receive(sock, bytes - moved, &loaded_ms);
+    dir = "up";
+  } else if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
+    char help[512];
+    int n = snprintf(help, sizeof(help),
+                     "Hotspot speed test\n"
+                     "curl -o /dev/null http://%s:%d/down?bytes=100000000\n"
+                     "curl -o /dev/null --data-binary @FILE "
+                     "http://%s:%d/up\n",
+                     ap_addr, SPEEDTEST_PORT, ap_addr, SPEEDTEST_PORT);
+    dprintf(sock,
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n%s",
+            n, help);
+    return;
+  } else {
+    dprintf(sock, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                  "Connection: close\r\n\r\n");
+    return;
+  }
+  double seconds = elapsed_seconds(&t0);
+  double mbit = seconds > 0 ? moved * 8 / 1e6 / seconds : 0;
+  if (strcmp(dir, "up") == 0) {
+    char result[128];
+    int n = snprintf(result, sizeof(result),
+                     "%lld bytes in %.2f s: %.1f Mbit/s\n", moved, seconds,
+                     mbit);
+    dprintf(sock,
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n%s",
+            n, result);
+  }
+  if (moved < SPEEDTEST_MIN_BYTES)
+    return; // Too short to say anything about throughput
+  int fd = open(SPEEDTEST_RESULTS, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd >= 0) {
+    char peer_text[16];
+    inet_ntop(AF_INET, &peer->sin_addr, peer_text, sizeof(peer_text));
+    dprintf(fd, "%ld %s %s %lld %.3f %.1f %.1f\n", (long)time(NULL),
+            peer_text, dir, moved, seconds, idle_ms, loaded_ms);
+    close(fd);
+  }
+}
+
+// Answer 503 to a connection over SPEEDTEST_MAX_CLIENTS. The request
+// headers are read first, for up to 100 ms: closing a socket with unread
+// data resets the connection, and the client would lose the answer.
+void speedtest_refuse(int sock) {
+  char req[4096];
+  size_t len = 0;
+  struct pollfd pfd = {sock, POLLIN, 0};
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (len < sizeof(req) - 1) {
+    int wait_ms = 100 - elapsed_seconds(&t0) * 1000;
+    if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) != 1)
+      break;
+    ssize_t n = recv(sock, req + len, sizeof(req) - 1 - len, MSG_DONTWAIT);
+    if (n <= 0)
+      break;
+    len += n;
+    req[len] = '\0';
+    if (strstr(req, "\r\n\r\n"))
+      break;
+  }
+  dprintf(sock, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                "Retry-After: %d\r\nConnection: close\r\n\r\n",
+          SPEEDTEST_TIMEOUT_S);
+  shutdown(sock, SHUT_WR);
+  close(sock);
+}
+
+// Server process: one forked child per connection, so a slow client does
+// not hold up the others. Beyond SPEEDTEST_MAX_CLIENTS connections at once
+// a client is answered 503 at once. Children die with the server.
+int run_speedtest_server(int listen_fd) {
+  if (phase_fd >= 0)
+    close(phase_fd);
+  phase_fd = -1;
+  signal(SIGPIPE, SIG_IGN);
+  int src = syscall(__NR_memfd_create, "speedtest", 0);
+  char *zeros = calloc(1, SPEEDTEST_CHUNK);
+  if (src < 0 || !zeros || write(src, zeros, SPEEDTEST_CHUNK) !=
+                               SPEEDTEST_CHUNK) {
+    perror("speed test buffer");
+    return 1;
+  }
+  free(zeros);
+  int children = 0; // Connection children not yet reaped
+  while (1) {
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    int sock = accept(listen_fd, (struct sockaddr *)&peer, &peer_len);
+    if (sock < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      return 1;
+    }
+    while (children > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+      children--;
+    if (children >= SPEEDTEST_MAX_CLIENTS) {
+      speedtest_refuse(sock);
+      continue;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(listen_fd);
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      speedtest_client(sock, src, &peer);
+      _exit(0);
+    }
+    children += pid > 0;
+    close(sock);
+  }
+}
+
+// Bind the test server to ap_addr and fork it. Returns 0 when it runs,
+// else nonzero with errno set, e.g. EADDRINUSE when another one serves
+// the port.
+int start_speedtest_server() {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(SPEEDTEST_PORT);
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || inet_pton(AF_INET, ap_addr, &addr.sin_addr) != 1 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    int saved = errno;
+    if (fd >= 0)
+      close(fd);
+    errno = saved;
+    return 1;
+  }
+  struct stat st;
+  if (stat(SPEEDTEST_RESULTS, &st) == 0 && st.st_size > SPEEDTEST_RESULTS_MAX)
+    close(open(SPEEDTEST_RESULTS, O_WRONLY | O_TRUNC)); // Start afresh
+  fflush(stdout);
+  speedtest_pid = fork();
+  if (speedtest_pid == 0)
+    exit(run_speedtest_server(fd));
+  close(fd);
+  return speedtest_pid < 0;
+}
+
+// --- Rollback journal ---
+
+// Every setup step that changes the system records itself here, and
+// rollback_journal() reverts exactly those steps on a startup failure, on
+// SIGINT/SIGTERM and on exit(). Steps run tier by tier: daemons first, then
+// rules and qdiscs on the interfaces, then the interface itself. Steps
+// within a tier are independent and run in parallel.
+typedef enum {
+  UNDO_HOSTAPD,
+  UNDO_DNSMASQ,
+  UNDO_DHCPD,
+  UNDO_IP_FORWARD,
+  UNDO_NAT,
+  UNDO_FASTPATH,
+  UNDO_SHAPER,
+  UNDO_BPF_ACCT,
+  UNDO_AP_IFACE,
+  UNDO_HISTORY,
+  UNDO_NDP_PROXY,
+  UNDO_IPV6,
+  UNDO_MSS_CLAMP,
+  UNDO_CPU_TUNING,
+  UNDO_SPEEDTEST,
+  UNDO_STEPS
+} UndoStep;
+
+const int undo_tier[UNDO_STEPS] = {0, 0, 0, 1, 1, 1, 1, 1, 2, 0, 0, 1, 1, 1, 0};
+unsigned int undo_journal = 0; // Bit per applied UndoStep
+pid_t journal_owner = -1;      // Forked children must not roll back
+
+void journal_step(UndoStep step) { undo_journal |= 1u << step; }
+
+// Whether pid has exited (a zombie counts: only its parent can reap it).
+int process_gone(pid_t pid) {
+  char path[64], stat[256];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 1;
+  int gone = 1;
+  if (fgets(stat, sizeof(stat), fp)) {
+    char *end = strrchr(stat, ')');
+    gone = !end || end[1] == '\0' || end[2] == 'Z' || end[2] == 'X';
+  }
+  fclose(fp);
+  return gone;
+}
+
+// SIGTERM pid and wait for it, escalating to SIGKILL halfway through the
+// tier's time budget.
+void stop_process(pid_t pid) {
+  if (pid <= 0 || kill(pid, SIGTERM) != 0)
+    return;
+  for (int ms = 0; !process_gone(pid); ms += 10) {
+    if (ms == UNDO_TIER_MS / 2)
+      kill(pid, SIGKILL);
+    usleep(10000);
+  }
+}
+
+// Stop the dnsmasq the engine started, found through its pid file, and wait
+// for it like stop_process(). Other dnsmasq instances on the host are left
+// alone. Returns 1 when there was one to stop.
+int stop_dnsmasq(void) {
+  pid_t pid = 0;
+  FILE *fp = fopen(DNSMASQ_PID_FILE, "r");
+  if (fp) {
+    if (fscanf(fp, "%d", &pid) != 1)
+      pid = 0;
+    fclose(fp);
+  }
+  if (run_cmd("sudo pkill -F " DNSMASQ_PID_FILE " -x dnsmasq 2>/dev/null") !=
+      0)
+    return 0;
+  for (int ms = 0; pid > 0 && !process_gone(pid) && ms < UNDO_TIER_MS;
+       ms += 10) {
+    if (ms == UNDO_TIER_MS / 2)
+      run_cmd("sudo pkill -KILL -F " DNSMASQ_PID_FILE " -x dnsmasq "
+              "2>/dev/null");
+    usleep(10000);
+  }
+  return 1;
+}
+
+// Revert one step. Runs in a child of rollback_journal(), so commands are
+// built from the current globals (the uplink may have moved since setup).
+void undo_step(UndoStep step) {
+  char cmd[512];
+  switch (step) {
+  case UNDO_HOSTAPD:
+    stop_process(hostapd_pid);
+    break;
+  case UNDO_DNSMASQ:
+    stop_dnsmasq();
+    break;
+  case UNDO_DHCPD:
+    stop_process(dhcpd_pid);
+    break;
+  case UNDO_IP_FORWARD:
+    run_cmd("sudo sysctl -qw net.ipv4.ip_forward=0");
+    break;
+  case UNDO_NAT:
+    remove_nat_rules(uplink_iface);
+    break;
+  case UNDO_FASTPATH:
+    run_cmd("sudo nft delete table inet " FASTPATH_TABLE " 2>/dev/null");
+    break;
+  case UNDO_SHAPER:
+    snprintf(cmd, sizeof(cmd), "sudo tc qdisc del dev %s root 2>/dev/null",
+             uplink_iface);
+    run_cmd(cmd);
+    break;
+  case UNDO_BPF_ACCT:
+    teardown_bpf_accounting();
+    break;
+  case UNDO_AP_IFACE:
+    run_cmd("sudo iw dev " AP_IFACE " del 2>/dev/null");
+    break;
+  case UNDO_HISTORY:
+    stop_process(history_pid);
+    break;
+  case UNDO_NDP_PROXY:
+    stop_process(ndp_proxy_pid);
+    break;
+  case UNDO_IPV6:
+    run_cmd("sudo ip6tables -w -D FORWARD -i " AP_IFACE " -j ACCEPT "
+            "2>/dev/null; sudo ip6tables -w -D FORWARD -o " AP_IFACE
+            " -m state --state RELATED,ESTABLISHED -j ACCEPT 2>/dev/null");
+    release_ipv6_uplink();
+    if (ipv6_saved_forwarding == 0)
+      run_cmd("sudo sysctl -qw net.ipv6.conf.all.forwarding=0");
+    break;
+  case UNDO_MSS_CLAMP:
+    remove_mss_clamp();
+    break;
+  case UNDO_CPU_TUNING:
+    restore_cpu_tuning();
+    break;
+  case UNDO_SPEEDTEST:
+    stop_process(speedtest_pid);
+    break;
+  default:
+    break;
+  }
+}
+
+void rollback_journal(void) {
+  if (getpid() != journal_owner)
+    return;
+  unsigned int steps = undo_journal;
+  undo_journal = 0;
+  phase_end("fail"); // Exiting with a phase still open
+  if (steps)
+    phase_begin("rollback");
+  for (int tier = 0; steps && tier <= undo_tier[UNDO_AP_IFACE]; tier++) {
+    pid_t kids[UNDO_STEPS];
+    int n = 0;
+    for (int s = 0; s < UNDO_STEPS; s++) {
+      if (!(steps & (1u << s)) || undo_tier[s] != tier)
+        continue;
+      pid_t pid = fork();
+      if (pid == 0) {
+        undo_step(s);
+        _exit(0);
+      }
+      if (pid > 0)
+        kids[n++] = pid;
+      else
+        undo_step(s); // Could not fork; revert in line
+    }
+    // Reap the tier, killing any step that overruns its budget.
+    int left = n;
+    for (int ms = 0; left > 0; ms += 10) {
+      for (int i = 0; i < n; i++)
+        if (kids[i] > 0 && waitpid(kids[i], NULL, WNOHANG) != 0) {
+          kids[i] = -1;
+          left--;
+        }
+      if (left == 0)
+        break;
+      if (ms >= UNDO_TIER_MS) {
+        for (int i = 0; i < n; i++)
+          if (kids[i] > 0) {
+            kill(kids[i], SIGKILL);
+            waitpid(kids[i], NULL, 0);
+          }
+        break;
+      }
+      usleep(10000);
+    }
+  }
+  if (hostapd_pid > 0)
+    waitpid(hostapd_pid, NULL, WNOHANG);
+  if (dhcpd_pid > 0)
+    waitpid(dhcpd_pid, NULL, WNOHANG);
+  if (history_pid > 0)
+    waitpid(history_pid, NULL, WNOHANG);
+  hostapd_pid = dhcpd_pid = history_pid = -1;
+  unlink(STATE_FILE);
+  phase_end("ok");
+}
+
+// --- Warm restart ---
+
+// What the previous run of the engine left behind, from STATE_FILE.
+typedef struct {
+  pid_t hostapd_pid, dhcpd_pid;
+  char dhcpd_config[80]; // Pool and DNS setting the DHCP child serves
+  char ap_radio[32];
+  int channel, freq, width, center_channel;
+  int shaper_up_kbit;
+  unsigned int journal; // undo_journal of the previous run
+  char ipv6_uplink[32]; // IPv6 sysctls from before the previous run
+  long ipv6_forwarding, ipv6_accept_ra, ipv6_proxy_ndp;
+} EngineState;
+
+void dhcpd_config_key(char *buf, size_t len) {
+  snprintf(buf, len, "%s/%d/%d", dhcp_range, opts.dns_profile, lan_mtu);
+}
+
+// Record the processes and settings a warm restart may adopt.
+void save_engine_state(const RadioPlan *plan) {
+  FILE *fp = fopen(STATE_FILE ".tmp", "w");
+  if (!fp)
+    return;
+  char key[80];
+  dhcpd_config_key(key, sizeof(key));
+  fprintf(fp,
+          "hostapd_pid=%d\ndhcpd_pid=%d\ndhcpd_config=%s\nap_radio=%s\n"
+          "channel=%d\nfreq=%d\nwidth=%d\ncenter_channel=%d\n"
+          "shaper_up_kbit=%d\njournal=%u\nipv6_uplink=%s\n"
+          "ipv6_forwarding=%ld\nipv6_accept_ra=%ld\nipv6_proxy_ndp=%ld\n",
+          hostapd_pid, dhcpd_pid, dhcpd_pid > 0 ? key : "", ap_radio,
+          plan->channel, plan->freq, plan->width, plan->center_channel,
+          shaper_up_kbit, undo_journal, ipv6_uplink, ipv6_saved_forwarding,
+          ipv6_saved_accept_ra, ipv6_saved_proxy_ndp);
+  fclose(fp);
+  rename(STATE_FILE ".tmp", STATE_FILE);
+}
+
+int load_engine_state(EngineState *st) {
+  FILE *fp = fopen(STATE_FILE, "r");
+  if (!fp)
+    return 1;
+  memset(st, 0, sizeof(*st));
+  st->hostapd_pid = st->dhcpd_pid = -1;
+  st->ipv6_forwarding = st->ipv6_accept_ra = st->ipv6_proxy_ndp = -1;
+  char line[160];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    char *eq = strchr(line, '=');
+    if (!eq)
+      continue;
+    *eq = '\0';
+    const char *v = eq + 1;
+    if (strcmp(line, "hostapd_pid") == 0)
+      st->hostapd_pid = atoi(v);
+    else if (strcmp(line, "dhcpd_pid") == 0)
+      st->dhcpd_pid = atoi(v);
+    else if (strcmp(line, "dhcpd_config") == 0)
+      snprintf(st->dhcpd_config, sizeof(st->dhcpd_config), "%s", v);
+    else if (strcmp(line, "ap_radio") == 0)
+      snprintf(st->ap_radio, sizeof(st->ap_radio), "%s", v);
+    else if (strcmp(line, "channel") == 0)
+      st->channel = atoi(v);
+    else if (strcmp(line, "freq") == 0)
+      st->freq = atoi(v);
+    else if (strcmp(line, "width") == 0)
+      st->width = atoi(v);
+    else if (strcmp(line, "center_channel") == 0)
+      st->center_channel = atoi(v);
+    else if (strcmp(line, "shaper_up_kbit") == 0)
+      st->shaper_up_kbit = atoi(v);
+    else if (strcmp(line, "journal") == 0)
+      st->journal = strtoul(v, NULL, 10);
+    else if (strcmp(line, "ipv6_uplink") == 0)
+      snprintf(st->ipv6_uplink, sizeof(st->ipv6_uplink), "%s", v);
+    else if (strcmp(line, "ipv6_forwarding") == 0)
+      st->ipv6_forwarding = atol(v);
+    else if (strcmp(line, "ipv6_accept_ra") == 0)
+      st->ipv6_accept_ra = atol(v);
+    else if (strcmp(line, "ipv6_proxy_ndp") == 0)
+      st->ipv6_proxy_ndp = atol(v);
+  }
+  fclose(fp);
+  return 0;
+}
+
+// Whether pid is alive and its command line mentions name.
+int process_running(pid_t pid, const char *name) {
+  if (pid <= 0)
+    return 0;
+  char path[64], cmdline[512];
+  snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+  size_t n = fread(cmdline, 1, sizeof(cmdline) - 1, fp);
+  fclose(fp);
+  for (size_t i = 0; i < n; i++)
+    if (cmdline[i] == '\0')
+      cmdline[i] = ' ';
+  cmdline[n] = '\0';
+  return strstr(cmdline, name) != NULL;
+}
+
+// Whether pid runs this same executable (the built-in DHCP child).
+int same_program(pid_t pid) {
+  if (pid <= 0)
+    return 0;
+  char path[64], exe[PATH_MAX], self[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+  ssize_t a = readlink(path, exe, sizeof(exe) - 1);
+  ssize_t b = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  return a > 0 && a == b && memcmp(exe, self, a) == 0;
+}
+
+void read_iface_mac(const char *iface, char *buf, size_t len) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/address", iface);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+  if (fgets(buf, len, fp))
+    buf[strcspn(buf, "\n")] = '\0';
+  fclose(fp);
+}
+
+// ap0 can be kept when it exists, is administratively up and holds the
+// configured address.
+int ap_iface_ready(const char *ip_path) {
+  char *flags = exec_cmd("cat /sys/class/net/" AP_IFACE "/flags 2>/dev/null");
+  int up = flags && (strtol(flags, NULL, 16) & 1);
+  free(flags);
+  return up && check_ap_ip(ip_path);
+}
+
+// Rebuild the channel plan ACS chose on the previous run so a warm restart
+// does not rescan and move the AP.
+int restore_ap_channel(const char *iw_path, const EngineState *st,
+                       RadioPlan *plan) {
+  int wiphy = st->ap_radio[0] ? iface_wiphy(iw_path, st->ap_radio) : -1;
+  if (wiphy < 0 || st->freq == 0)
+    return 1;
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "%s phy phy%d info", iw_path, wiphy);
+  char *phy_info = exec_cmd(cmd);
+  snprintf(cmd, sizeof(cmd), "%s reg get 2>/dev/null", iw_path);
+  char *reg_info = exec_cmd(cmd);
+  memset(plan, 0, sizeof(*plan));
+  plan->channel = st->channel;
+  plan->freq = st->freq;
+  plan->width = st->width;
+  plan->center_channel = st->center_channel;
+  fit_radio_plan(plan, phy_info, reg_info);
+  free(phy_info);
+  free(reg_info);
+  snprintf(ap_radio, sizeof(ap_radio), "%s", st->ap_radio);
+  return 0;
+}
+
+// Whether the tc shapers a previous run installed are still in place.
+int shapers_present() {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd),
+           "tc qdisc show dev %s | grep -q 'qdisc htb 1: root' && "
+           "tc qdisc show dev %s | grep -Eq 'qdisc (cake|htb) [0-9a-f]+: root'",
+           AP_IFACE, uplink_iface);
+  return run_cmd(cmd) == 0;
+}
+
+// Whether the BPF accounting programs are still pinned and attached.
+int bpf_accounting_present() {
+  return access(BPF_PIN_DIR "/clients", F_OK) == 0 &&
+         run_cmd("tc filter show dev " AP_IFACE
+                " ingress 2>/dev/null | grep -q bpf") == 0;
+}
+
+// Clamp the MSS of TCP handshakes through ap0 to what the uplink path
+// carries: 40 bytes of IPv4/TCP headers (60 for IPv6) below path_mtu. The
+// rules match ap0 rather than the uplink, so a failover only has to
+// replace them when the MTU changes. Nothing is installed while the path
+// takes full-size packets.
+void apply_mss_clamp(const char *iptables_path) {
+  int mss = lan_mtu ? lan_mtu - 40 : 0;
+  if (mss == clamp_mss)
+    return;
+  char *ip6tables_path = ap_ipv6_addr[0] ? get_cmd_path("ip6tables") : NULL;
+  int v6 = ip6tables_path && ip6tables_path[0] && lan_mtu >= 1280;
+  remove_mss_clamp();
+  char rule[160];
+  for (int i = 0; mss && i < (v6 ? 4 : 2); i++) {
+    snprintf(rule, sizeof(rule),
+             "FORWARD %s %s -p tcp --tcp-flags SYN,RST SYN -j TCPMSS "
+             "--set-mss %d",
+             i % 2 ? "-o" : "-i", AP_IFACE, i < 2 ? mss : mss - 20);
+    ensure_iptables_rule(i < 2 ? iptables_path : ip6tables_path, "mangle",
+                         rule);
+  }
+  clamp_mss = mss;
+  snprintf(clamp_iptables, sizeof(clamp_iptables), "%s", iptables_path);
+  snprintf(clamp_ip6tables, sizeof(clamp_ip6tables), "%s",
+           v6 ? ip6tables_path : "");
+  free(ip6tables_path);
+  if (mss)
+    printf("Clamping TCP MSS through %s to %d.\n", AP_IFACE, mss);
+}
+
+// After a crash the IPv6 sysctls still hold the previous run's values, so
+// a warm restart takes the ones to restore from its state.
+void adopt_ipv6_state(const EngineState *st) {
+  snprintf(ipv6_uplink, sizeof(ipv6_uplink), "%s", st->ipv6_uplink);
+  ipv6_saved_forwarding = st->ipv6_forwarding;
+  ipv6_saved_accept_ra = st->ipv6_accept_ra;
+  ipv6_saved_proxy_ndp = st->ipv6_proxy_ndp;
+}
+
+// Forward IPv6 between ap0 and the uplink. The firewall admits everything
+// from ap0 and only replies towards it, as a home router would; no rule
+// names the uplink, so a failover does not touch them.
+void setup_ipv6_forwarding() {
+  if (ipv6_saved_forwarding < 0)
+    ipv6_saved_forwarding = read_long_file("/proc/sys/net/ipv6/conf/all/"
+                                           "forwarding");
+  if (ipv6_uplink[0] && strcmp(ipv6_uplink, uplink_iface) != 0)
+    release_ipv6_uplink(); // Carried over, but the uplink has changed
+  prepare_ipv6_uplink(uplink_iface);
+  run_cmd("sudo sysctl -qw net.ipv6.conf.all.forwarding=1");
+  char *ip6tables_path = get_cmd_path("ip6tables");
+  if (ip6tables_path && ip6tables_path[0]) {
+    ensure_iptables_rule(ip6tables_path, "filter",
+                         "FORWARD -i " AP_IFACE " -j ACCEPT");
+    ensure_iptables_rule(ip6tables_path, "filter",
+                         "FORWARD -o " AP_IFACE " -m state --state "
+                         "RELATED,ESTABLISHED -j ACCEPT");
+  } else {
+    fprintf(stderr, "ip6tables not found; IPv6 forwarding relies on the "
+                    "existing FORWARD policy.\n");
+  }
+  free(ip6tables_path);
+  if (opts.ipv6 == IPV6_PROXY)
+    start_ndp_proxy();
+}
+
+// Follow the uplink's /64 after a failover or a renumbering in proxy mode.
+// dnsmasq notices ap0's new address by itself and deprecates the old
+// prefix in its advertisements.
+void refresh_ipv6() {
+  struct in6_addr prefix, old;
+  if (opts.ipv6 != IPV6_PROXY || !ap_ipv6_prefix[0] ||
+      uplink_ipv6_prefix(uplink_iface, &prefix) != 0 ||
+      parse_ipv6_prefix(ap_ipv6_prefix, &old) != 0)
+    return;
+  if (memcmp(&prefix, &old, 8) == 0 && strcmp(ipv6_uplink, uplink_iface) == 0)
+    return;
+  stop_process(ndp_proxy_pid);
+  waitpid(ndp_proxy_pid, NULL, WNOHANG);
+  char cmd[160];
+  snprintf(cmd, sizeof(cmd), "sudo ip -6 addr del %s/64 dev %s", ap_ipv6_addr,
+           AP_IFACE);
+  run_cmd(cmd);
+  if (strcmp(ipv6_uplink, uplink_iface) != 0) {
+    release_ipv6_uplink();
+    prepare_ipv6_uplink(uplink_iface);
+  }
+  assign_ap_ipv6(&prefix);
+  printf("IPv6 prefix is now %s.\n", ap_ipv6_prefix);
+  start_ndp_proxy();
+}
+
+// Cleanup function to be called on SIGINT/SIGTERM.
+void cleanup_handler(int sig) {
+  printf("\nStopping hotspot...\n");
+  rollback_journal();
+  exit(0);
+}
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--latency-test | --export-history [MINUTES] |\n"
+          "          --cpu-load [SECONDS]]\n"
+          "       %s [--headless] [--profile NAME] [--profiles FILE]\n"
+          "          [--ssid SSID --psk PSK] [--option key=value]...\n"
+          "          [--startup-only]\n"
+          "Environment: HSC_PROFILE, HSC_PROFILES, HSC_SSID, HSC_PSK,\n"
+          "             HSC_TRACE_RECORD, HSC_TRACE_REPLAY, "
+          "HSC_TRACE_LATENCY,\n"
+          "             HSC_PHASE_FD.\n",
+          prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+  clock_gettime(CLOCK_MONOTONIC, &engine_start);
+  engine_start_wall = time(NULL);
+  if (argc > 1 && strcmp(argv[1], "--latency-test") == 0) {
+    double idle_ms, loaded_ms;
+    printf("Measuring latency to %s idle and under a bulk download...\n",
+           LATENCY_TARGET);
+    if (measure_latency_under_load(&idle_ms, &loaded_ms) != 0) {
+      fprintf(stderr, "Latency test failed: no replies from %s.\n",
+              LATENCY_TARGET);
+      return 1;
+    }
+    printf("Idle RTT:       %.1f ms\n", idle_ms);
+    printf("Loaded RTT:     %.1f ms\n", loaded_ms);
+    printf("Added latency:  %.1f ms\n", loaded_ms - idle_ms);
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--export-history") == 0)
+    return export_history(argc > 2 ? atoi(argv[2]) : 0);
+  if (argc > 1 && strcmp(argv[1], "--cpu-load") == 0)
+    return report_cpu_load(argc > 2 ? atoi(argv[2]) : 0);
+
+  // Headless start: a profile or credentials from the command line or the
+  // environment mean nothing is read from stdin.
+  const char *profile_name = getenv("HSC_PROFILE");
+  const char *profiles_path = getenv("HSC_PROFILES");
+  const char *cli_ssid = getenv("HSC_SSID");
+  const char *cli_psk = getenv("HSC_PSK");
+  const char *cli_options[32];
+  int headless = 0, n_cli_options = 0, startup_only = 0;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--headless") == 0) {
+      headless = 1;
+    } else if (strcmp(arg, "--startup-only") == 0) {
+      startup_only = 1;
+    } else if (i + 1 < argc && strcmp(arg, "--profile") == 0) {
+      profile_name = argv[++i];
+    } else if (i + 1 < argc && strcmp(arg, "--profiles") == 0) {
+      profiles_path = argv[++i];
+    } else if (i + 1 < argc && strcmp(arg, "--ssid") == 0) {
+      cli_ssid = argv[++i];
+    } else if (i + 1 < argc && strcmp(arg, "--psk") == 0) {
+      cli_psk = argv[++i];
+    } else if (i + 1 < argc && strcmp(arg, "--option") == 0 &&
+               n_cli_options < 32) {
+      cli_options[n_cli_options++] = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (profile_name || cli_ssid || cli_psk)
+    headless = 1;
+  if (cli_psk && !valid_psk(cli_psk)) {
+    fprintf(stderr, "The PSK must be 8-63 characters or 64 hex digits.\n");
+    return 1;
+  }
+
+  signal(SIGINT, cleanup_handler);
+  signal(SIGTERM, cleanup_handler);
+  journal_owner = getpid();
+  atexit(rollback_journal);
+  const char *phase_env = getenv("HSC_PHASE_FD");
+  if (phase_env && fcntl(atoi(phase_env), F_GETFD) >= 0) {
+    phase_fd = atoi(phase_env);
+    signal(SIGPIPE, SIG_IGN); // A reader that goes away closes phase_fd
+  }
+
+  // Increase file descriptor limit.
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = 4096;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  phase_begin("tools");
+  // Fetch full paths for required commands.
+  char *iw_path = get_cmd_path("iw");
+  char *hostapd_path = get_cmd_path("hostapd");
+  char *dnsmasq_path = get_cmd_path("dnsmasq");
+  char *nmcli_path = get_cmd_path("nmcli");
+  char *systemctl_path = get_cmd_path("systemctl");
+  char *ip_path = get_cmd_path("ip");
+  char *iptables_path = get_cmd_path("iptables");
+
+  if (!iw_path || !hostapd_path || !dnsmasq_path || !nmcli_path ||
+      !systemctl_path || !ip_path || !iptables_path) {
+    fprintf(stderr, "One or more required tools are missing.\n");
+    exit(1);
+  }
+
+  printf("Found tools:\n");
+  printf("iw:         %s\n", iw_path);
+  printf("hostapd:    %s\n", hostapd_path);
+  printf("dnsmasq:    %s\n", dnsmasq_path);
+  printf("nmcli:      %s\n", nmcli_path);
+  printf("systemctl:  %s\n", systemctl_path);
+  printf("ip:         %s\n", ip_path);
+  printf("iptables:   %s\n", iptables_path);
+
+  check_systemd_resolved();
+  HotspotOptions defaults = opts;
+  HotspotProfile profile;
+  if (profile_name) {
+    // A profile declares the complete configuration, so OPTIONS_FILE is
+    // not consulted.
+    if (load_profile(profiles_path ? profiles_path : PROFILES_FILE,
+                     profile_name, &defaults, &profile) != 0)
+      exit(1);
+    opts = profile.opts;
+    printf("Using profile '%s'.\n", profile.name);
+  } else {
+    load_hotspot_options();
+  }
+  for (int i = 0; i < n_cli_options; i++) {
+    char key[64];
+    const char *eq = strchr(cli_options[i], '=');
+    if (!eq || eq - cli_options[i] >= (long)sizeof(key)) {
+      fprintf(stderr, "Invalid option '%s': expected key=value.\n",
+              cli_options[i]);
+      exit(1);
+    }
+    snprintf(key, sizeof(key), "%.*s", (int)(eq - cli_options[i]),
+             cli_options[i]);
+    if (set_hotspot_option(key, eq + 1) != 0) {
+      fprintf(stderr, "Invalid option '%s'.\n", cli_options[i]);
+      exit(1);
+    }
+  }
+  printf("Uplink switch mode: %s\n",
+         opts.make_before_break ? "make-before-break" : "classic");
+  char netErr[160];
+  if (validate_net_config(netErr, sizeof(netErr)) != 0) {
+    fprintf(stderr, "%s\n", netErr);
+    exit(1);
+  }
+  printf("AP address %s, DHCP pool %s (%d addresses)\n", ap_cidr, dhcp_range,
+         dhcp_pool_size);
+  EngineState prev;
+  int warm = opts.reconcile && load_engine_state(&prev) == 0;
+  if (warm)
+    printf("Reconciling with the state of the previous run...\n");
+
+  // Fetch the connected WLAN interface using nmcli.
+  phase_begin("uplink");
+  char *wlan_iface = exec_cmd("nmcli -t -f DEVICE,TYPE,STATE dev status | grep "
+                              "':wifi:connected' | cut -d: -f1 | head -n1");
+  if (!wlan_iface || strlen(wlan_iface) == 0) {
+    fprintf(stderr, "No connected WLAN interface detected.\n");
+    exit(1);
+  }
+  wlan_iface[strcspn(wlan_iface, "\n")] = '\0';
+  printf("Detected connected WLAN interface: %s\n", wlan_iface);
+  strncpy(uplink_iface, wlan_iface, sizeof(uplink_iface) - 1);
+
+  // Hotspot configuration (SSID and password): the profile, the command
+  // line and environment, or the saved file (prompting when interactive).
+  char ssid[128], pass[128];
+  if (profile_name) {
+    snprintf(ssid, sizeof(ssid), "%s", profile.ssid);
+    snprintf(pass, sizeof(pass), "%s", profile.psk);
+  } else if (!cli_ssid || !cli_psk) {
+    load_hotspot_config(ssid, sizeof(ssid), pass, sizeof(pass), !headless);
+  }
+  if (cli_ssid)
+    snprintf(ssid, sizeof(ssid), "%s", cli_ssid);
+  if (cli_psk)
+    snprintf(pass, sizeof(pass), "%s", cli_psk);
+
+  // Connectivity check interval: from the options, else prompt.
+  int check_interval = opts.check_interval ? opts.check_interval : 10;
+  char interval_input[16];
+  if (!opts.check_interval && !headless) {
+    printf("Enter connectivity check interval in seconds [default 10]: ");
+    if (fgets(interval_input, sizeof(interval_input), stdin) != NULL) {
+      if (interval_input[0] != '\n') {
+        check_interval = atoi(interval_input);
+        if (check_interval <= 0)
+          check_interval = 10;
+      }
+    }
+  }
+  printf("Using connectivity check interval: %d seconds\n", check_interval);
 
   // Start NetworkManager.
   char nmcli_start[256];
   snprintf(nmcli_start, sizeof(nmcli_start), "sudo %s start NetworkManager",
            systemctl_path);
   printf("Starting NetworkManager...\n");
-  system(nmcli_start);
-  if (system("systemctl is-active NetworkManager >/dev/null 2>&1") != 0) {
+  run_cmd(nmcli_start);
+  if (run_cmd("systemctl is-active NetworkManager >/dev/null 2>&1") != 0) {
     fprintf(stderr, "NetworkManager failed to start\n");
     exit(1);
   }
@@ -359,198 +5763,428 @@ int main(void) {
   char *connection = exec_cmd(nmcliCmd);
   if (!connection || strlen(connection) == 0) {
     fprintf(stderr, "Error: %s not connected.\n", wlan_iface);
-    system("nmcli dev status");
+    run_cmd("nmcli dev status");
     exit(1);
   }
   printf("Connected via: %s", connection);
 
-  // Extract channel and frequency info using iw.
-  char iwCmd[256];
-  snprintf(iwCmd, sizeof(iwCmd), "%s dev %s info", iw_path, wlan_iface);
-  char *wlanInfo = exec_cmd(iwCmd);
-  if (!wlanInfo) {
-    fprintf(stderr, "Failed to get wireless info\n");
+  // Work out channel, width and 802.11 features from the uplink and phy.
+  RadioPlan radio;
+  if (probe_radio(iw_path, wlan_iface, &radio) != 0) {
+    fprintf(stderr, "Failed to extract channel or frequency information.\n");
     exit(1);
   }
-  char channel[16] = {0};
-  char freq[16] = {0};
-  {
-    char *line = strtok(wlanInfo, "\n");
-    while (line) {
-      if (strstr(line, "channel")) {
-        sscanf(line, " channel %15s", channel);
-        char *paren = strchr(line, '(');
-        if (paren) {
-          sscanf(paren, "(%15s", freq);
-          char *m = strstr(freq, "MHz");
-          if (m)
-            *m = '\0';
-        }
-        break;
+  printf("Primary connection - Channel: %d, Frequency: %d MHz\n",
+         radio.channel, radio.freq);
+  if (!opts.acs && opts.band != BAND_ANY &&
+      (radio.freq < 5000) != (opts.band == BAND_2G))
+    fprintf(stderr, "Warning: the uplink is not on the %s GHz band; the AP "
+                    "follows its channel unless channel_select=acs.\n",
+            opts.band == BAND_2G ? "2.4" : "5");
+  if (opts.acs) {
+    phase_begin("channel");
+    if (warm && process_running(prev.hostapd_pid, "hostapd") &&
+        restore_ap_channel(iw_path, &prev, &radio) == 0)
+      printf("ACS: keeping channel %d on %s.\n", radio.channel, ap_radio);
+    else
+      select_ap_channel(iw_path, &radio);
+  }
+  char channel[16];
+  snprintf(channel, sizeof(channel), "%d", radio.channel);
+  printf("Using hardware mode: %s, %s, %d MHz wide%s.\n",
+         radio.freq < 5000 ? "g" : "a",
+         radio.he                                ? "802.11ax"
+         : radio.vht_cap && radio.freq >= 5000 ? "802.11ac"
+         : radio.ht_cap                          ? "802.11n"
+                                                 : "legacy rates",
+         radio.width, radio.radar ? ", DFS channel" : "");
+
+  phase_begin("interface");
+  int ap_ready = warm && ap_iface_ready(ip_path);
+  if (ap_ready) {
+    read_iface_mac(AP_IFACE, ap_bssid, sizeof(ap_bssid));
+    printf("Interface %s is up with %s; keeping it.\n", AP_IFACE, ap_cidr);
+  } else {
+    // Remove any existing AP interface.
+    char checkAP[128];
+    snprintf(checkAP, sizeof(checkAP), "sudo %s dev %s info >/dev/null 2>&1",
+             iw_path, AP_IFACE);
+    if (run_cmd(checkAP) == 0) {
+      printf("Interface %s already exists. Removing it...\n", AP_IFACE);
+      char delCmd[128];
+      snprintf(delCmd, sizeof(delCmd), "sudo %s dev %s del", iw_path, AP_IFACE);
+      run_cmd(delCmd);
+    }
+
+    // Create the AP interface.
+    const char *ap_parent = ap_radio[0] ? ap_radio : wlan_iface;
+    derive_bssid(ap_parent, ssid, ap_bssid, sizeof(ap_bssid));
+    char addIf[256];
+    snprintf(addIf, sizeof(addIf),
+             "sudo %s dev %s interface add %s type __ap addr %s", iw_path,
+             ap_parent, AP_IFACE, ap_bssid);
+    printf("Creating %s (BSSID %s)...\n", AP_IFACE, ap_bssid);
+    if (run_cmd(addIf) != 0) {
+      // Some drivers only accept addresses from their own range.
+      fprintf(stderr, "Driver rejected BSSID %s; using its default.\n",
+              ap_bssid);
+      snprintf(addIf, sizeof(addIf),
+               "sudo %s dev %s interface add %s type __ap", iw_path,
+               ap_parent, AP_IFACE);
+      if (run_cmd(addIf) != 0) {
+        fprintf(stderr, "Failed to create AP interface %s\n", AP_IFACE);
+        exit(1);
       }
-      line = strtok(NULL, "\n");
+      read_iface_mac(AP_IFACE, ap_bssid, sizeof(ap_bssid));
     }
+    char nmcliSet[128];
+    snprintf(nmcliSet, sizeof(nmcliSet), "sudo %s dev set %s managed no",
+             nmcli_path, AP_IFACE);
+    run_cmd(nmcliSet);
   }
-  free(wlanInfo);
-  if (strlen(channel) == 0 || strlen(freq) == 0) {
-    fprintf(stderr, "Failed to extract channel or frequency information.\n");
-    exit(1);
-  }
-  printf("Primary connection - Channel: %s, Frequency: %s MHz\n", channel,
-         freq);
-
-  const char *hw_mode = "a";
-  printf("Using hardware mode: %s\n", hw_mode);
-
-  // Remove any existing AP interface.
-  char checkAP[128];
-  snprintf(checkAP, sizeof(checkAP), "sudo %s dev %s info >/dev/null 2>&1",
-           iw_path, AP_IFACE);
-  if (system(checkAP) == 0) {
-    printf("Interface %s already exists. Removing it...\n", AP_IFACE);
-    char delCmd[128];
-    snprintf(delCmd, sizeof(delCmd), "sudo %s dev %s del", iw_path, AP_IFACE);
-    system(delCmd);
-  }
-
-  // Create the AP interface.
-  char addIf[256];
-  snprintf(addIf, sizeof(addIf), "sudo %s dev %s interface add %s type __ap",
-           iw_path, wlan_iface, AP_IFACE);
-  printf("Creating %s...\n", AP_IFACE);
-  if (system(addIf) != 0) {
-    fprintf(stderr, "Failed to create AP interface %s\n", AP_IFACE);
-    exit(1);
-  }
-  char nmcliSet[128];
-  snprintf(nmcliSet, sizeof(nmcliSet), "sudo %s dev set %s managed no",
-           nmcli_path, AP_IFACE);
-  system(nmcliSet);
+  journal_step(UNDO_AP_IFACE);
 
-  // Initial internet connectivity check.
-  printf("Checking internet connectivity...\n");
-  if (system("ping -c 2 google.com >/dev/null 2>&1") != 0) {
-    if (auto_switch_wifi(nmcli_path) != 0) {
-      fprintf(stderr, "Initial reconnection failed.\n");
-      exit(1);
+  // Initial internet connectivity check; a warm restart leaves it to the
+  // monitoring loop.
+  if (!warm) {
+    phase_begin("connectivity");
+    printf("Checking internet connectivity...\n");
+    if (!check_connectivity(NULL)) {
+      if (auto_switch_wifi(nmcli_path) != 0) {
+        fprintf(stderr, "Initial reconnection failed.\n");
+        exit(1);
+      }
     }
   }
   free(connection);
 
+  phase_begin("hostapd");
   // Write hostapd configuration.
   printf("Configuring hostapd...\n");
-  FILE *fp = fopen(HOSTAPD_CONF, "w");
-  if (!fp) {
-    perror("fopen hostapd config");
+  char *old_conf = warm ? read_text_file(HOSTAPD_CONF) : NULL;
+  if (write_hostapd_config(ssid, pass, ap_bssid, &radio) != 0)
     exit(1);
+  int hostapd_reused = 0;
+  if (warm && process_running(prev.hostapd_pid, "hostapd")) {
+    char *new_conf = read_text_file(HOSTAPD_CONF);
+    if (!ap_ready) {
+      kill(prev.hostapd_pid, SIGTERM); // Bound to an ap0 that is gone
+    } else if (old_conf && new_conf && strcmp(old_conf, new_conf) == 0) {
+      printf("hostapd (PID %d) already runs this configuration.\n",
+             prev.hostapd_pid);
+      hostapd_reused = 1;
+    } else {
+      printf("Reloading hostapd (PID %d) with the new configuration...\n",
+             prev.hostapd_pid);
+      hostapd_reused = (kill(prev.hostapd_pid, SIGHUP) == 0);
+    }
+    if (hostapd_reused)
+      hostapd_pid = prev.hostapd_pid;
+    free(new_conf);
   }
-  fprintf(fp,
-          "interface=%s\n"
-          "driver=nl80211\n"
-          "ssid=%s\n"
-          "hw_mode=%s\n"
-          "channel=%s\n"
-          "wpa=2\n"
-          "wpa_passphrase=%s\n"
-          "wpa_key_mgmt=WPA-PSK\n"
-          "wpa_pairwise=CCMP\n"
-          "rsn_pairwise=CCMP\n",
-          AP_IFACE, ssid, hw_mode, channel, pass);
-  fclose(fp);
+  free(old_conf);
 
-  // Stop any existing dnsmasq.
-  if (system("pgrep dnsmasq >/dev/null 2>&1") == 0) {
-    printf("Stopping existing dnsmasq...\n");
-    system("sudo killall dnsmasq");
-  }
+  // Stop a dnsmasq a previous run left behind.
+  if (!warm && stop_dnsmasq())
+    printf("Stopped the dnsmasq of a previous run.\n");
 
-  // Start hostapd.
-  printf("Starting hostapd...\n");
-  hostapd_pid = fork();
-  if (hostapd_pid == 0) {
-    execlp("sudo", "sudo", hostapd_path, HOSTAPD_CONF, NULL);
-    perror("execlp hostapd failed");
-    exit(1);
+  if (!hostapd_reused) {
+    // Start hostapd.
+    printf("Starting hostapd...\n");
+    hostapd_pid = fork();
+    if (hostapd_pid == 0) {
+      if (trace_mode == TRACE_REPLAY) {
+        pause(); // Stand-in for hostapd until the rollback stops it
+        _exit(0);
+      }
+      execlp("sudo", "sudo", hostapd_path, HOSTAPD_CONF, NULL);
+      perror("execlp hostapd failed");
+      exit(1);
+    }
+    if (kill(hostapd_pid, 0) != 0) {
+      fprintf(stderr, "hostapd failed to start. Configuration:\n");
+      run_cmd("cat " HOSTAPD_CONF);
+      exit(1);
+    }
   }
-  if (kill(hostapd_pid, 0) != 0) {
-    fprintf(stderr, "hostapd failed to start. Configuration:\n");
-    system("cat " HOSTAPD_CONF);
-    char delCmd3[128];
-    snprintf(delCmd3, sizeof(delCmd3), "sudo %s dev %s del", iw_path, AP_IFACE);
-    system(delCmd3);
-    exit(1);
+  journal_step(UNDO_HOSTAPD);
+  if (wait_ap_enabled() == 0) {
+    ap_enabled_seconds = elapsed_seconds(&engine_start);
+    printf("AP enabled %.2f s after start.\n", ap_enabled_seconds);
+  } else {
+    fprintf(stderr, "hostapd has not reported the AP as enabled yet.\n");
+    phase_end("timeout");
   }
 
-  // Set up IP and bring up the AP interface.
-  char ipCmd[128];
-  snprintf(ipCmd, sizeof(ipCmd), "sudo %s addr add %s dev %s", ip_path, AP_IP,
-           AP_IFACE);
-  system(ipCmd);
-  char linkCmd[128];
-  snprintf(linkCmd, sizeof(linkCmd), "sudo %s link set %s up", ip_path,
-           AP_IFACE);
-  system(linkCmd);
+  phase_begin("address");
+  if (!ap_ready) {
+    // Set up IP and bring up the AP interface.
+    char ipCmd[128];
+    snprintf(ipCmd, sizeof(ipCmd), "sudo %s addr add %s dev %s", ip_path,
+             ap_cidr, AP_IFACE);
+    run_cmd(ipCmd);
+    char linkCmd[128];
+    snprintf(linkCmd, sizeof(linkCmd), "sudo %s link set %s up", ip_path,
+             AP_IFACE);
+    run_cmd(linkCmd);
+  }
 
   if (!check_ap_ip(ip_path)) {
     fprintf(stderr, "AP interface %s did not receive the correct IP address.\n",
             AP_IFACE);
     exit(1);
   }
+  if (opts.ipv6 != IPV6_OFF)
+    setup_ipv6_address();
 
-  // Start dnsmasq for DHCP, binding only to the hotspot's IP.
-  char dnsCmd[256];
-  snprintf(dnsCmd, sizeof(dnsCmd),
-           "sudo %s --interface=%s --bind-interfaces "
-           "--listen-address=192.168.4.1 --dhcp-range=%s &",
-           dnsmasq_path, AP_IFACE, DHCP_RANGE);
-  system(dnsCmd);
+  phase_begin("mtu");
+  if (opts.mtu_clamp)
+    discover_uplink_mtu();
 
-  int retry = 3;
-  while (retry-- > 0) {
-    sleep(2);
-    if (check_dnsmasq_running(dnsmasq_path)) {
-      printf("dnsmasq is running and DHCP is enabled.\n");
-      break;
+  phase_begin("dhcp");
+  char dhcpd_key[80];
+  dhcpd_config_key(dhcpd_key, sizeof(dhcpd_key));
+  if (warm && same_program(prev.dhcpd_pid)) {
+    if (opts.builtin_dhcp && strcmp(prev.dhcpd_config, dhcpd_key) == 0)
+      dhcpd_pid = prev.dhcpd_pid;
+    else
+      kill(prev.dhcpd_pid, SIGTERM);
+  }
+  if (dhcpd_pid > 0) {
+    printf("Built-in DHCP server (PID %d) already serves %s.\n", dhcpd_pid,
+           dhcp_range);
+  } else if (opts.builtin_dhcp) {
+    printf("Starting built-in DHCP server...\n");
+    fflush(stdout);
+    if (start_builtin_dhcp() != 0) {
+      fprintf(stderr, "Built-in DHCP server failed to start. DHCP will not "
+                      "work.\n");
+      exit(1);
     }
-    printf("Waiting for dnsmasq to start...\n");
+    printf("Built-in DHCP server is running (PID %d).\n", dhcpd_pid);
   }
-  if (retry < 0) {
-    fprintf(stderr, "dnsmasq is not running. DHCP will not work.\n");
-    exit(1);
+  if (dhcpd_pid > 0)
+    journal_step(UNDO_DHCPD);
+  if (!opts.builtin_dhcp || opts.dns_profile) {
+    // Start dnsmasq, binding only to the hotspot's IP. It serves DHCP unless
+    // the built-in server does, and caches DNS more aggressively under the
+    // DNS profile.
+    char dhcpArgs[192] = "", dnsArgs[160] = "", raArgs[320] = "";
+    if (!opts.builtin_dhcp)
+      snprintf(dhcpArgs, sizeof(dhcpArgs),
+               " --dhcp-range=%s --dhcp-lease-max=%d --dhcp-leasefile=%s",
+               dhcp_range, dhcp_pool_size, DNSMASQ_LEASE_FILE);
+    if (!opts.builtin_dhcp && lan_mtu)
+      snprintf(dhcpArgs + strlen(dhcpArgs), sizeof(dhcpArgs) - strlen(dhcpArgs),
+               " --dhcp-option=option:mtu,%d", lan_mtu);
+    if (opts.dns_profile)
+      snprintf(dnsArgs, sizeof(dnsArgs),
+               " --cache-size=%d --all-servers --min-cache-ttl=%d "
+               "--neg-ttl=%d",
+               opts.dns_cache_size, opts.dns_min_ttl, DNS_NEG_TTL);
+    if (ap_ipv6_addr[0])
+      // Stateless: clients pick addresses by SLAAC and learn the DNS server
+      // from the RA. off-link keeps clients of a shared prefix from looking
+      // for uplink hosts on ap0.
+      snprintf(raArgs, sizeof(raArgs),
+               " --listen-address=%s --enable-ra "
+               "--dhcp-range=::,constructor:%s,ra-stateless,64%s "
+               "--dhcp-option=option6:dns-server,[%s]",
+               ap_ipv6_addr, AP_IFACE,
+               opts.ipv6 == IPV6_PROXY ? ",off-link" : "", ap_ipv6_addr);
+    if (ap_ipv6_addr[0] && lan_mtu >= 1280) // 600 s is dnsmasq's interval
+      snprintf(raArgs + strlen(raArgs), sizeof(raArgs) - strlen(raArgs),
+               " --ra-param=%s,mtu:%d,600", AP_IFACE, lan_mtu);
+    char dnsCmd[896];
+    snprintf(dnsCmd, sizeof(dnsCmd),
+             "%s --interface=%s --bind-interfaces --pid-file=" DNSMASQ_PID_FILE
+             " --listen-address=%s%s%s%s",
+             dnsmasq_path, AP_IFACE, ap_addr, dhcpArgs, dnsArgs, raArgs);
+    char pgrepCmd[1024];
+    snprintf(pgrepCmd, sizeof(pgrepCmd), "pgrep -xf '%s' >/dev/null 2>&1",
+             dnsCmd);
+    journal_step(UNDO_DNSMASQ);
+    if (warm && run_cmd(pgrepCmd) == 0) {
+      printf("dnsmasq already runs with these settings; keeping it.\n");
+    } else {
+      if (warm)
+        stop_dnsmasq();
+      char startCmd[1024];
+      snprintf(startCmd, sizeof(startCmd), "sudo %s &", dnsCmd);
+      run_cmd(startCmd);
+
+      int retry = 3;
+      while (retry-- > 0) {
+        pause_seconds(2);
+        if (check_dnsmasq_running(dnsmasq_path)) {
+          printf("dnsmasq is running%s.\n",
+                 opts.builtin_dhcp ? " (DNS only)" : " and DHCP is enabled");
+          break;
+        }
+        printf("Waiting for dnsmasq to start...\n");
+      }
+      if (retry < 0) {
+        fprintf(stderr, "dnsmasq is not running. %s will not work.\n",
+                opts.builtin_dhcp ? "DNS" : "DHCP");
+        exit(1);
+      }
+    }
+    dnsmasq_active = 1;
   }
 
+  phase_begin("nat");
   // Enable NAT for internet sharing.
   printf("Enabling NAT...\n");
-  system("sudo sysctl -w net.ipv4.ip_forward=1");
-  char iptCmd[256];
-  snprintf(iptCmd, sizeof(iptCmd),
-           "sudo %s -t nat -A POSTROUTING -o %s -j MASQUERADE", iptables_path,
-           wlan_iface);
-  system(iptCmd);
-  snprintf(iptCmd, sizeof(iptCmd), "sudo %s -A FORWARD -i %s -o %s -j ACCEPT",
-           iptables_path, AP_IFACE, wlan_iface);
-  system(iptCmd);
-  snprintf(iptCmd, sizeof(iptCmd),
-           "sudo %s -A FORWARD -i %s -o %s -m state --state "
-           "RELATED,ESTABLISHED -j ACCEPT",
-           iptables_path, wlan_iface, AP_IFACE);
-  system(iptCmd);
+  char *forwarding = read_text_file("/proc/sys/net/ipv4/ip_forward");
+  if ((forwarding && forwarding[0] == '0') ||
+      (warm && (prev.journal & (1u << UNDO_IP_FORWARD))))
+    journal_step(UNDO_IP_FORWARD);
+  free(forwarding);
+  run_cmd("sudo sysctl -w net.ipv4.ip_forward=1");
+  snprintf(nat_iptables, sizeof(nat_iptables), "%s", iptables_path);
+  char rule[160];
+  for (int i = 0; i < NAT_RULES; i++) {
+    format_nat_rule(i, uplink_iface, rule, sizeof(rule));
+    ensure_iptables_rule(iptables_path, i == 0 ? "nat" : "filter", rule);
+  }
+  get_iface_ipv4(uplink_iface, uplink_addr, sizeof(uplink_addr));
+  nat_installed = 1;
+  journal_step(UNDO_NAT);
+  if (warm && (prev.journal & (1u << UNDO_IPV6))) {
+    adopt_ipv6_state(&prev);
+    journal_step(UNDO_IPV6); // Restored even if IPv6 is now off
+  }
+  if (ap_ipv6_addr[0]) {
+    printf("Enabling IPv6 forwarding...\n");
+    journal_step(UNDO_IPV6);
+    setup_ipv6_forwarding();
+    if (ndp_proxy_pid > 0)
+      journal_step(UNDO_NDP_PROXY);
+  }
+  if (opts.mtu_clamp) {
+    journal_step(UNDO_MSS_CLAMP);
+    apply_mss_clamp(iptables_path);
+  }
+
+  if (opts.fastpath) {
+    printf("Enabling nftables flowtable fast path...\n");
+    char *nft_path = get_cmd_path("nft");
+    if (!nft_path || strlen(nft_path) == 0)
+      fprintf(stderr, "nft not found; using the classic forwarding path.\n");
+    else
+      install_flowtable(uplink_iface);
+    free(nft_path);
+  }
+
+  if (warm && (prev.journal & (1u << UNDO_CPU_TUNING))) {
+    load_tuned_files();
+    journal_step(UNDO_CPU_TUNING); // Restored even if cpu_tuning is now off
+  } else {
+    unlink(TUNING_FILE); // Left by a run that cannot be reconciled
+  }
+  if (opts.cpu_tuning) {
+    phase_begin("cpu");
+    journal_step(UNDO_CPU_TUNING);
+    apply_cpu_tuning();
+  }
+
+  phase_begin("qos");
+  if (opts.shaper && warm && prev.shaper_up_kbit > 0 && shapers_present()) {
+    shaper_up_kbit = prev.shaper_up_kbit;
+    printf("Keeping the installed traffic shapers.\n");
+  } else if (opts.shaper) {
+    printf("Configuring traffic shaping...\n");
+    setup_traffic_shaping();
+  }
+
+  if (opts.bpf_acct && warm && bpf_accounting_present()) {
+    bpf_acct_active = 1;
+    printf("Keeping the attached BPF accounting and its counters.\n");
+  } else if (opts.bpf_acct) {
+    printf("Loading per-client BPF accounting on %s...\n", AP_IFACE);
+    setup_bpf_accounting();
+  }
+  if (fastpath_installed)
+    journal_step(UNDO_FASTPATH);
+  if (shaper_up_kbit > 0)
+    journal_step(UNDO_SHAPER);
+  if (bpf_acct_active)
+    journal_step(UNDO_BPF_ACCT);
+  if (opts.history && trace_mode != TRACE_REPLAY && !startup_only &&
+      start_history(nmcli_path) == 0)
+    journal_step(UNDO_HISTORY);
+  if (opts.speedtest_server && trace_mode != TRACE_REPLAY && !startup_only) {
+    if (start_speedtest_server() == 0) {
+      journal_step(UNDO_SPEEDTEST);
+      printf("Speed test server on http://%s:%d/.\n", ap_addr,
+             SPEEDTEST_PORT);
+    } else {
+      perror("Speed test server");
+    }
+  }
+  check_conntrack_pressure();
+  if (dnsmasq_active)
+    collect_dns_stats();
+  update_first_lease();
+  write_metrics();
+  save_engine_state(&radio);
+  phase_end("ok");
+  phase_event("ready", "ok");
 
   printf("Hotspot started on channel %s using interface %s.\n", channel,
          AP_IFACE);
-  printf("Clients should obtain an IP address from dnsmasq.\n");
+  printf("Clients should obtain an IP address from %s.\n",
+         opts.builtin_dhcp ? "the built-in DHCP server" : "dnsmasq");
+  if (startup_only)
+    exit(0); // The journal tears everything down again
   printf("Press Ctrl+C to stop.\n");
 
+  note_connectivity(1);
   while (1) {
     sleep(check_interval);
-    if (system("ping -c 2 google.com >/dev/null 2>&1") != 0) {
+    if (!check_connectivity(NULL)) {
+      note_connectivity(0);
       printf("Internet connectivity lost. Attempting automatic switch...\n");
       if (auto_switch_wifi(nmcli_path) != 0) {
         fprintf(stderr, "Automatic switching failed. Retrying...\n");
+      } else {
+        note_connectivity(1);
+        history_event(HIST_EV_FAILOVER);
+        history_note_uplink(nmcli_path);
+        if (opts.mtu_clamp) {
+          discover_uplink_mtu();
+          apply_mss_clamp(iptables_path);
+        }
+        if (opts.cpu_tuning) { // Move the tuning to the new uplink
+          restore_cpu_tuning();
+          apply_cpu_tuning();
+        }
       }
     } else {
+      note_connectivity(1);
       printf("Internet connection stable.\n");
     }
+    refresh_ipv6();
+    if (opts.acs)
+      acs_reevaluate(iw_path, &radio);
+    int moved = follow_uplink_channel(iw_path, &radio);
+    if (moved != 0) {
+      history_event(HIST_EV_CHANNEL);
+      // Keep the config on the new channel for reloads and warm restarts.
+      write_hostapd_config(ssid, pass, ap_bssid, &radio);
+      if (moved < 0 && hostapd_pid > 0) {
+        fprintf(stderr, "Channel switch failed; reloading hostapd on channel "
+                        "%d.\n",
+                radio.channel);
+        kill(hostapd_pid, SIGHUP);
+      }
+    }
+    check_conntrack_pressure();
+    if (dnsmasq_active)
+      collect_dns_stats();
+    update_first_lease();
+    write_metrics();
+    save_engine_state(&radio);
   }
 
   free(iw_path);
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Automatic channel selection from scan and survey output. Each case in
+# fixtures/acs has `iw dev ... scan` (NAME.scan), `iw dev ... survey dump`
+# (NAME.survey), optional engine options (NAME.opts) and the channel, width
+# and centre it must pick (NAME.expect). The radio is the mt7921e from
+# fixtures/radio.
+. "$(dirname "$0")/lib.sh"
+
+build hsc-harness
+# The scan runs through sudo; the stand-in runs it as is, even where a real
+# sudo would ask for a password.
+mkdir -p "$WORK/bin"
+printf '#!/bin/sh\nexec "$@"\n' >"$WORK/bin/sudo"
+cat >"$WORK/bin/iw" <<'IW'
+#!/bin/sh
+case "$*" in
+"dev "*" info") exec cat "$IW_FIXTURE.dev" ;;
+"phy "*" info") exec cat "$IW_FIXTURE.phy" ;;
+"reg get") exec cat "$IW_FIXTURE.reg" ;;
+"dev "*" scan") exec cat "$ACS_FIXTURE.scan" ;;
+"dev "*" survey dump") exec cat "$ACS_FIXTURE.survey" ;;
+esac
+exit 1
+IW
+chmod +x "$WORK/bin/sudo" "$WORK/bin/iw"
+PATH="$WORK/bin:$PATH"
+export IW_FIXTURE="$FIXTURES/radio/mt7921e"
+
+for expect in "$FIXTURES"/acs/*.expect; do
+  name=$(basename "$expect" .expect)
+  options=()
+  if [ -f "${expect%.expect}.opts" ]; then
+    while read -r o; do options+=(-o "$o"); done <"${expect%.expect}.opts"
+  fi
+  if ! got=$(ACS_FIXTURE=${expect%.expect} "$WORK/hsc-harness" \
+    "${options[@]}" acs "$WORK/bin/iw" wlp3s0); then
+    check_failed "$name: no channel"
+    continue
+  fi
+  echo "$name: $got"
+  [ "$got" = "$(cat "$expect")" ] ||
+    check_failed "$name: expected $(cat "$expect")"
+done
+finish
@@ -0,0 +1,78 @@
+#!/bin/bash
+# Per-client eBPF accounting on ap0, on a veth pair:
+#
+#   hs-cl (192.168.4.2) c0 --- ap0 hs-gw (192.168.4.1)
+#
+# The client exchanges a known number of UDP echoes with the gateway and the
+# counters in the pinned map must match them exactly. Then the client is put
+# on the drop list and must get no replies, and a single-stream TCP download
+# with and without the programs attached shows what they cost; it must keep
+# MIN_BPF_RATIO of the throughput without them.
+. "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd tc nsenter
+provide_sudo
+MIN_BPF_RATIO=$(threshold MIN_BPF_RATIO 0.85)
+ECHOES=200
+# A 4-byte UDP payload is a 46-byte frame, as tc sees it.
+FRAME=46
+build netload
+build hsc-harness
+
+add_netns cl gw
+add_veth cl c0 gw ap0
+in_ns cl ip addr add 192.168.4.2/24 dev c0
+in_ns gw ip addr add 192.168.4.1/24 dev ap0
+in_ns gw "$WORK/netload" serve 6000 &
+sleep 0.3
+
+field() {
+  awk -v k="$1" '{ for (i = 1; i < NF; i++) if ($i == k) print $(i + 1) }' \
+    "$2"
+}
+
+in_ns cl "$WORK/netload" bulk 192.168.4.1 6000 down 6 1 >"$WORK/bulk.plain"
+echo "download without accounting: $(field mbit "$WORK/bulk.plain") Mbit/s"
+
+# ip netns exec gives every command a fresh /sys, so the BPF filesystem is
+# mounted by a process that stays in hs-gw and later steps join its mount
+# namespace.
+ip netns exec hs-gw bash -c 'mount -t bpf bpf /sys/fs/bpf &&
+  touch "$1/bpffs" && exec sleep infinity' bash "$WORK" &
+holder=$!
+for _ in $(seq 50); do
+  [ -e "$WORK/bpffs" ] && break
+  kill -0 "$holder" 2>/dev/null || skip "cannot mount the BPF filesystem"
+  sleep 0.1
+done
+in_gw() {
+  nsenter -t "$holder" -m -n "$@"
+}
+in_gw "$WORK/hsc-harness" bpfacct ||
+  skip "kernel cannot load or attach the accounting programs"
+
+in_ns cl "$WORK/netload" rtt 192.168.4.1 6000 1 5 >"$WORK/rtt"
+sent=$(field sent "$WORK/rtt")
+received=$(field received "$WORK/rtt")
+in_gw "$WORK/hsc-harness" clients >"$WORK/clients" ||
+  fail "cannot read the client map"
+cat "$WORK/clients"
+grep -q "^client 192.168.4.2 " "$WORK/clients" ||
+  fail "no counters for 192.168.4.2"
+expect="up_packets $sent up_bytes $((sent * FRAME))"
+expect="$expect down_packets $received down_bytes $((received * FRAME))"
+grep -q "^client 192.168.4.2 $expect\$" "$WORK/clients" ||
+  check_failed "counters differ from $sent echoes sent, $received received"
+
+in_ns cl "$WORK/netload" bulk 192.168.4.1 6000 down 6 1 >"$WORK/bulk.bpf"
+check "download with accounting / without" \
+  "$(awk -v a="$(field mbit "$WORK/bulk.bpf")" \
+    -v b="$(field mbit "$WORK/bulk.plain")" 'BEGIN { printf "%.2f", a / b }')" \
+  ">" "$MIN_BPF_RATIO"
+
+in_gw "$WORK/hsc-harness" bpfdrop 192.168.4.2 || fail "cannot fill drop list"
+in_ns cl "$WORK/netload" rtt 192.168.4.1 6000 1 20 >"$WORK/rtt.dropped"
+[ "$(field received "$WORK/rtt.dropped")" = 0 ] ||
+  check_failed "a client on the drop list still gets replies"
+finish
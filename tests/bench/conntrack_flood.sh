@@ -0,0 +1,85 @@
+#!/bin/bash
+# Conntrack table exhaustion under a flood of new flows:
+#
+#   hs-cl (10.77.0.2) c0 --- hsct0 host (10.77.0.1)
+#
+# nf_conntrack_max can only be changed from the initial network namespace,
+# so the host plays the gateway: an INPUT rule on hsct0 makes it track the
+# client's flows. The limit is lowered to 4096 for the run and restored
+# afterwards; the test skips on a host whose table is already in use.
+#
+# Each flood sends one datagram from each of many fresh source ports. The
+# engine's pressure check must double the limit once the table passes the
+# 80% watermark, see the drops of a flood that overran the table and
+# raise the limit again so the next flood gets through whole, but never past
+# ct_max_limit (16384 here).
+. "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd iptables
+provide_sudo
+CT=/proc/sys/net/netfilter
+[ -w $CT/nf_conntrack_max ] || skip "nf_conntrack is not loaded"
+[ "$(cat $CT/nf_conntrack_count)" -lt 256 ] ||
+  skip "the host's conntrack table is in use"
+build netload
+build hsc-harness
+
+saved_max=$(cat $CT/nf_conntrack_max)
+saved_buckets=$(cat /sys/module/nf_conntrack/parameters/hashsize)
+restore() {
+  iptables -w -D INPUT -i hsct0 -m conntrack --ctstate NEW -j ACCEPT \
+    2>/dev/null
+  echo "$saved_max" >$CT/nf_conntrack_max
+  echo "$saved_buckets" >/sys/module/nf_conntrack/parameters/hashsize
+}
+trap 'restore; cleanup' EXIT
+
+add_netns cl
+ip link add hsct0 type veth peer name c0 netns hs-cl ||
+  fail "cannot create veth hsct0-c0"
+ip addr add 10.77.0.1/24 dev hsct0
+ip link set hsct0 up
+in_ns cl ip link set c0 up
+in_ns cl ip addr add 10.77.0.2/24 dev c0
+iptables -w -I INPUT -i hsct0 -m conntrack --ctstate NEW -j ACCEPT ||
+  fail "cannot add the conntrack rule"
+echo 4096 >$CT/nf_conntrack_max
+
+# flood FLOWS [lossy]: send FLOWS new flows and, unless the table is
+# expected to overflow, check that every one arrived.
+flood() {
+  "$WORK/netload" udp-recv 5000 4 >"$WORK/recv" &
+  local recv=$!
+  sleep 0.2
+  in_ns cl "$WORK/netload" udp-flood 10.77.0.1 5000 "$1" >/dev/null
+  wait "$recv"
+  [ "${2:-}" = lossy ] && return
+  grep -q "^received $1 " "$WORK/recv" ||
+    check_failed "flood of $1 flows: $(cat "$WORK/recv")"
+}
+
+# pressure: run the engine's check and set MAX and LOST, the early drops
+# plus the inserts that found no room.
+pressure() {
+  "$WORK/hsc-harness" -o ct_max_limit=16384 ctpressure >"$WORK/ct" ||
+    fail "pressure check failed"
+  cat "$WORK/ct"
+  MAX=$(awk '{ print $4 }' "$WORK/ct")
+  LOST=$(awk '{ print $8 + $10 }' "$WORK/ct")
+}
+
+pressure
+lost_before=$LOST
+flood 3500
+pressure
+[ "$MAX" = 8192 ] || check_failed "limit is $MAX above the watermark, not 8192"
+flood 7000 lossy
+pressure
+[ "$MAX" = 16384 ] || check_failed "limit is $MAX after overflow, not 16384"
+[ "$LOST" -gt "$lost_before" ] ||
+  check_failed "the overflow was not seen in the drop counters"
+flood 4000
+pressure
+[ "$MAX" = 16384 ] || check_failed "limit grew past ct_max_limit to $MAX"
+finish
@@ -0,0 +1,116 @@
+#!/bin/bash
+# Forwarding with cpu_tuning=on over multi-queue veths:
+#
+#   hs-cl c0 --- ap0 hs-gw up0 --- n0 hs-net (10.1.0.1)
+#
+# ap0 and up0 have QUEUES receive and transmit queues. A four-stream
+# download is routed through hs-gw first as the kernel leaves it, then
+# with the engine's RPS, RFS and XPS settings. The run prints the Mbit/s
+# and the share of NET_RX softirqs taken by the busiest CPU, and the tuned
+# run must keep MIN_TUNED_RATIO (0.9) of the untuned throughput. Two queue
+# files hold values set by hand beforehand. Rolling the step back must
+# restore every queue file exactly, those two included. So must the
+# teardown of a warm restart that took over after the engine was killed
+# with the tuning in place.
+PRIVATE_TMP=1 . "$(dirname "$0")/../lib.sh"
+
+need_root
+[ "$(nproc)" -ge 2 ] || skip "needs two CPUs"
+provide_sudo
+MIN_TUNED_RATIO=$(threshold MIN_TUNED_RATIO 0.9)
+QUEUES=4
+build netload
+build hsc-harness
+
+add_netns cl gw net
+add_veth gw ap0 cl c0 numrxqueues $QUEUES numtxqueues $QUEUES
+add_veth gw up0 net n0 numrxqueues $QUEUES numtxqueues $QUEUES
+in_ns cl ip addr add 192.168.4.2/24 dev c0
+in_ns cl ip route add default via 192.168.4.1
+in_ns gw ip addr add 192.168.4.1/24 dev ap0
+in_ns gw ip addr add 10.1.0.2/24 dev up0
+in_ns gw ip route add default via 10.1.0.1
+in_ns gw sysctl -qw net.ipv4.ip_forward=1
+in_ns net ip addr add 10.1.0.1/24 dev n0
+in_ns net ip route add 192.168.4.0/24 via 10.1.0.2
+ip netns exec hs-net "$WORK/netload" serve 6000 &
+sleep 0.3
+
+# Settings an administrator made before the engine started.
+in_ns gw sh -c 'echo 1 >/sys/class/net/ap0/queues/rx-1/rps_cpus'
+in_ns gw sh -c 'echo 1 >/sys/class/net/up0/queues/tx-2/xps_cpus'
+
+# snapshot: every RPS, RFS and XPS file of ap0 and up0 with its value.
+snapshot() {
+  in_ns gw bash -c 'for f in /sys/class/net/{ap0,up0}/queues/*/*_{cpus,cnt}; do
+    echo "$f $(cat "$f" 2>&1)"
+  done'
+}
+
+# net_rx: NET_RX softirqs per CPU.
+net_rx() {
+  awk '$1 == "NET_RX:" { $1 = ""; print }' /proc/softirqs
+}
+
+# run NAME: download through hs-gw and print "mbit busiest_cpu_share".
+run() {
+  local rx0 rx1
+  rx0=$(net_rx)
+  in_ns cl "$WORK/netload" bulk 10.1.0.1 6000 down 10 4 >"$WORK/bulk.$1"
+  rx1=$(net_rx)
+  awk -v a="$rx0" -v b="$rx1" '{
+    n = split(a, x, " "); split(b, y, " ")
+    for (i = 1; i <= n; i++) {
+      d = y[i] - x[i]; sum += d
+      if (d > max) max = d
+    }
+    printf "%s %.2f\n", $2, sum ? max / sum : 0
+  }' "$WORK/bulk.$1"
+}
+
+before=$(snapshot)
+read -r plain plain_share < <(run untuned)
+echo "untuned: $plain Mbit/s, busiest CPU takes $plain_share of NET_RX"
+
+ip netns exec hs-gw "$WORK/hsc-harness" cputune up0 >"$WORK/tune" 2>&1 &
+harness=$!
+for _ in $(seq 50); do
+  grep -q "^tuned " "$WORK/tune" && break
+  sleep 0.1
+done
+grep -q "^tuned " "$WORK/tune" || { cat "$WORK/tune"; fail "tuning failed"; }
+grep -v "^tuned " "$WORK/tune"
+[ "$(snapshot)" != "$before" ] || check_failed "cpu_tuning changed nothing"
+read -r tuned tuned_share < <(run tuned)
+echo "tuned: $tuned Mbit/s, busiest CPU takes $tuned_share of NET_RX"
+check "tuned/untuned throughput" \
+  "$(awk -v a="$tuned" -v b="$plain" 'BEGIN { printf "%.2f", a / b }')" \
+  ">" "$MIN_TUNED_RATIO"
+
+kill -TERM "$harness"
+wait "$harness"
+grep -q "^restored" "$WORK/tune" || check_failed "the tuning was not undone"
+diff -u <(echo "$before") <(snapshot) ||
+  check_failed "the queue files were not restored exactly"
+
+# tune NAME [warm]: start cputune and wait until it has tuned.
+tune() {
+  ip netns exec hs-gw "$WORK/hsc-harness" cputune up0 "${@:2}" \
+    >"$WORK/$1" 2>&1 &
+  harness=$!
+  for _ in $(seq 50); do
+    grep -q "^tuned " "$WORK/$1" && return
+    sleep 0.1
+  done
+  cat "$WORK/$1"
+  fail "tuning failed"
+}
+tune crashed
+kill -KILL "$harness"
+wait "$harness" 2>/dev/null
+tune warm warm
+kill -TERM "$harness"
+wait "$harness"
+diff -u <(echo "$before") <(snapshot) ||
+  check_failed "a warm restart did not restore the queue files exactly"
+finish
@@ -0,0 +1,61 @@
+#!/bin/bash
+# DHCP join storm: CLIENTS simulated clients with distinct MACs start at
+# once on one veth and the time until each one's ACK is measured:
+#
+#   hs-cl c0 --- ap0 hs-gw (10.42.0.1/22, DHCP server)
+#
+# The /22 comes from the engine's address plan, so the pool is larger than
+# the old fixed 99 addresses. Every client must get an address. The 99th
+# percentile must stay under MAX_BUILTIN_STORM_P99_MS with the built-in
+# server and under MAX_DNSMASQ_STORM_P99_MS with dnsmasq, started with the
+# engine's DHCP arguments.
+PRIVATE_TMP=1 . "$(dirname "$0")/../lib.sh"
+
+need_root
+provide_sudo
+MAX_BUILTIN_STORM_P99_MS=$(threshold MAX_BUILTIN_STORM_P99_MS 500)
+MAX_DNSMASQ_STORM_P99_MS=$(threshold MAX_DNSMASQ_STORM_P99_MS 5000)
+CLIENTS=500
+SUBNET=10.42.0.0/22
+build netload
+build hsc-harness
+
+"$WORK/hsc-harness" -o subnet=$SUBNET addrplan >"$WORK/plan" ||
+  fail "address plan for $SUBNET rejected"
+read -r _ ap_cidr _ range _ pool <"$WORK/plan"
+echo "AP $ap_cidr, pool $range ($pool addresses)"
+[ "$pool" -ge "$CLIENTS" ] || fail "pool of $pool is too small"
+
+add_netns cl gw
+add_veth cl c0 gw ap0
+in_ns gw ip addr add "$ap_cidr" dev ap0
+
+# storm NAME LIMIT: run the storm against the server started in hs-gw.
+storm() {
+  in_ns cl "$WORK/netload" dhcp-storm c0 $CLIENTS 30 >"$WORK/storm.$1"
+  echo "$1: $(cat "$WORK/storm.$1")"
+  grep -q "^clients $CLIENTS bound $CLIENTS " "$WORK/storm.$1" ||
+    check_failed "$1: not every client got an address"
+  check "$1 time to address p99 ms" \
+    "$(awk '{ for (i = 1; i < NF; i++) if ($i == "p99_ms")
+      print $(i + 1) }' "$WORK/storm.$1")" "<" "$2"
+}
+
+in_ns gw "$WORK/hsc-harness" -o subnet=$SUBNET -o dhcp_backend=builtin \
+  dhcpd >"$WORK/dhcpd" || fail "built-in DHCP server did not start"
+storm builtin "$MAX_BUILTIN_STORM_P99_MS"
+kill "$(awk '$1 == "dhcpd" { print $2 }' "$WORK/dhcpd")"
+
+if command -v dnsmasq >/dev/null 2>&1; then
+  in_ns gw dnsmasq --conf-file=/dev/null --port=0 \
+    --pid-file="$WORK/dnsmasq.pid" --interface=ap0 --bind-interfaces \
+    --listen-address="${ap_cidr%/*}" --dhcp-range="$range" \
+    --dhcp-lease-max="$pool" --dhcp-leasefile="$WORK/dnsmasq.leases" ||
+    fail "dnsmasq did not start"
+  sleep 0.5
+  storm dnsmasq "$MAX_DNSMASQ_STORM_P99_MS"
+  kill "$(cat "$WORK/dnsmasq.pid")"
+else
+  echo "dnsmasq: not measured, it is not installed"
+fi
+finish
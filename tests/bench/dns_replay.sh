@@ -0,0 +1,61 @@
+#!/bin/bash
+# DNS query replay through dnsmasq on ap0, with a stub upstream 20 ms away
+# whose answers live 2 s:
+#
+#   hs-cl --- ap0 hs-gw (dnsmasq 192.168.4.1) --- hs-net (stub 10.9.9.9)
+#
+# The client replays 15 s of queries over 500 names with a long-tailed
+# popularity, first against dnsmasq as the engine starts it by default and
+# then with dns_profile=on. The profile's TTL floor and larger cache must
+# answer at least MIN_DNS_PROFILE_HIT_RATE of the queries from the cache,
+# and the engine's statistics must see the upstream.
+. "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd dnsmasq
+provide_sudo
+MIN_DNS_PROFILE_HIT_RATE=$(threshold MIN_DNS_PROFILE_HIT_RATE 0.8)
+DELAY_MS=20
+build netload
+build hsc-harness
+
+add_netns cl gw net
+add_veth cl c0 gw ap0
+add_veth gw up0 net n0
+in_ns cl ip addr add 192.168.4.2/24 dev c0
+in_ns gw ip addr add 192.168.4.1/24 dev ap0
+in_ns gw ip addr add 10.1.0.2/24 dev up0
+in_ns gw ip route add default via 10.1.0.1
+in_ns net ip addr add 10.1.0.1/24 dev n0
+in_ns net ip addr add 10.9.9.9/32 dev lo
+in_ns net ip route add 192.168.4.0/24 via 10.1.0.2
+in_ns net "$WORK/netload" dns-stub 10.9.9.9 $DELAY_MS 2 &
+
+# replay NAME DNSMASQ_ARGS...: start dnsmasq with the engine's arguments
+# plus DNSMASQ_ARGS and replay queries against it.
+replay() {
+  local name=$1
+  shift
+  in_ns gw dnsmasq --conf-file=/dev/null --no-resolv --server=10.9.9.9 \
+    --pid-file="$WORK/dnsmasq.pid" --interface=ap0 --bind-interfaces \
+    --listen-address=192.168.4.1 "$@" || fail "dnsmasq did not start"
+  sleep 0.5
+  in_ns cl "$WORK/netload" dns-replay 192.168.4.1 15 500 $DELAY_MS \
+    >"$WORK/replay.$name"
+  echo "$name: $(cat "$WORK/replay.$name")"
+  in_ns gw "$WORK/hsc-harness" dnsstats >"$WORK/stats.$name" ||
+    check_failed "$name: the engine could not read dnsmasq's statistics"
+  cat "$WORK/stats.$name"
+  kill "$(cat "$WORK/dnsmasq.pid")"
+  sleep 0.2
+}
+
+replay default
+replay profile --cache-size=10000 --all-servers --min-cache-ttl=60 \
+  --neg-ttl=60
+check "profile cache hit rate" \
+  "$(awk '{ print $6 }' "$WORK/replay.profile")" ">" \
+  "$MIN_DNS_PROFILE_HIT_RATE"
+grep -q "^upstream 10.9.9.9 " "$WORK/stats.profile" ||
+  check_failed "the engine's statistics do not list the upstream"
+finish
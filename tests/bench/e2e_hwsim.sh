@@ -0,0 +1,330 @@
+#!/bin/bash
+# The real engine, started headless on four mac80211_hwsim radios:
+#
+#   hs-cl: wpa_supplicant ~~~ ap0 hs-gw (engine) wlan ~~~ hs-up: uplink-a,
+#   uplink-b (hostapd) --- hs-net: DNS, HTTP and bulk servers (10.9.9.9)
+#
+# The gateway's wlan is associated with uplink-a by wpa_supplicant, and a
+# stand-in nmcli moves it to uplink-b. hs-net plays the internet: a DNS stub
+# that answers every name with 10.0.0.1, where an HTTP server and the bulk
+# and UDP servers listen. From the engine's own /tmp/hotspot.metrics and
+# from the client the run reports the time to AP enabled
+# (MAX_AP_ENABLED_S), the time from association to the first DHCP lease
+# (MAX_JOIN_MS), DNS and HTTP through the hotspot (MAX_E2E_DNS_P99_MS), a
+# download (MIN_E2E_MBIT) and the longest silence of a 1 kHz UDP stream
+# while uplink-a disappears (MAX_E2E_FAILOVER_MS).
+#
+# uplink-b is on channel 1 while uplink-a and the AP start on channel 6, so
+# after the failover the engine must move ap0 with a channel switch
+# announcement: ap0 reports 2412 MHz and the client follows without a new
+# association. Then uplink-b itself switches to channel 11 while a
+# stand-in hostapd_cli refuses chan_switch, and the engine must rewrite its
+# hostapd config and reload hostapd with SIGHUP. ap0 shares the gateway's
+# radio with its uplink, so this needs mac80211_hwsim with two channel
+# contexts (channels=2, which the run asks for when it loads the module).
+PRIVATE_TMP=1 . "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd iw hostapd hostapd_cli wpa_supplicant wpa_cli dnsmasq iptables ping
+real_hostapd_cli=$(command -v hostapd_cli)
+provide_sudo
+MAX_AP_ENABLED_S=$(threshold MAX_AP_ENABLED_S 30)
+MAX_JOIN_MS=$(threshold MAX_JOIN_MS 5000)
+MAX_E2E_DNS_P99_MS=$(threshold MAX_E2E_DNS_P99_MS 100)
+MIN_E2E_MBIT=$(threshold MIN_E2E_MBIT 20)
+MAX_E2E_FAILOVER_MS=$(threshold MAX_E2E_FAILOVER_MS 20000)
+SSID=hs-e2e
+PASS=e2e-test-pass
+build netload
+cc -O2 -o "$WORK/hsc" "$REPO_DIR/hotspot.c" || fail "cannot build hotspot.c"
+
+loaded_hwsim=0
+if [ ! -d /sys/module/mac80211_hwsim ]; then
+  command -v modprobe >/dev/null 2>&1 &&
+    modprobe mac80211_hwsim radios=4 channels=2 2>/dev/null ||
+    skip "mac80211_hwsim is not available"
+  loaded_hwsim=1
+fi
+hwsim_phys=()
+for phy in /sys/class/ieee80211/*; do
+  [ "$(basename "$(readlink -f "$phy/device/driver")")" = mac80211_hwsim ] &&
+    hwsim_phys+=("$(basename "$phy")")
+done
+[ ${#hwsim_phys[@]} -ge 4 ] || skip "needs four mac80211_hwsim radios"
+[ "$(cat /sys/module/mac80211_hwsim/parameters/channels)" -ge 2 ] ||
+  skip "mac80211_hwsim was loaded with one channel context"
+# radio PHY NS: move PHY to hs-NS and print its netdev.
+radio() {
+  local dev
+  dev=$(ls "/sys/class/ieee80211/$1/device/net" | head -n 1)
+  [ -n "$dev" ] || fail "$1 has no netdev"
+  iw phy "$1" set netns name "hs-$2" || fail "cannot move $1 to hs-$2"
+  ip -n "hs-$2" link set "$dev" up
+  echo "$dev"
+}
+
+engine=""
+teardown() {
+  [ -n "$engine" ] && kill "$engine" 2>/dev/null && wait "$engine"
+  cleanup
+  umount /etc/resolv.conf 2>/dev/null
+  [ "$loaded_hwsim" = 1 ] && rmmod mac80211_hwsim 2>/dev/null
+}
+trap teardown EXIT
+
+add_netns cl gw up net
+gw_if=$(radio "${hwsim_phys[0]}" gw)
+up_a=$(radio "${hwsim_phys[1]}" up)
+up_b=$(radio "${hwsim_phys[2]}" up)
+cl_if=$(radio "${hwsim_phys[3]}" cl)
+
+# The internet: hs-up routes both uplink subnets to hs-net.
+add_veth up r0 net n0
+in_ns up ip addr add 10.5.0.1/30 dev r0
+in_ns up ip route add default via 10.5.0.2
+in_ns up sysctl -qw net.ipv4.ip_forward=1
+in_ns up ip addr add 10.1.0.1/24 dev "$up_a"
+in_ns up ip addr add 10.3.0.1/24 dev "$up_b"
+in_ns net ip addr add 10.5.0.2/30 dev n0
+in_ns net ip addr add 10.9.9.9/32 dev lo
+in_ns net ip addr add 10.0.0.1/32 dev lo
+in_ns net ip route add 10.1.0.0/24 via 10.5.0.1
+in_ns net ip route add 10.3.0.0/24 via 10.5.0.1
+ip netns exec hs-net "$WORK/netload" dns-stub 10.9.9.9 5 60 >/dev/null &
+ip netns exec hs-net "$WORK/netload" http-serve 80 &
+ip netns exec hs-net "$WORK/netload" serve 6000 >/dev/null &
+
+# uplink NAME IFACE CHANNEL: start an upstream access point.
+uplink() {
+  mkdir -p "$WORK/$1"
+  cat >"$WORK/$1.conf" <<EOF
+interface=$2
+ctrl_interface=$WORK/$1
+ssid=$1
+hw_mode=g
+channel=$3
+wpa=2
+wpa_key_mgmt=WPA-PSK
+rsn_pairwise=CCMP
+wpa_passphrase=$PASS
+EOF
+  in_ns up hostapd -B -P "$WORK/$1.pid" "$WORK/$1.conf" >"$WORK/$1.log" ||
+    fail "$1 did not start: $(cat "$WORK/$1.log")"
+}
+uplink uplink-a "$up_a" 6
+uplink uplink-b "$up_b" 1
+
+# associated NS IFACE CTRL SSID: wait up to 15 s for the wpa_supplicant
+# on IFACE to be associated with SSID.
+associated() {
+  for _ in $(seq 1500); do
+    in_ns "$1" wpa_cli -p "$3" -i "$2" status 2>/dev/null |
+      grep -qx "ssid=$4" && in_ns "$1" wpa_cli -p "$3" -i "$2" status |
+      grep -qx 'wpa_state=COMPLETED' && return 0
+    sleep 0.01
+  done
+  return 1
+}
+
+# The gateway's uplink, and the NetworkManager in front of it.
+mkdir -p "$WORK/gw-wpa"
+cat >"$WORK/gw-wpa.conf" <<EOF
+ctrl_interface=$WORK/gw-wpa
+network={
+  ssid="uplink-a"
+  psk="$PASS"
+}
+network={
+  ssid="uplink-b"
+  psk="$PASS"
+  disabled=1
+}
+EOF
+in_ns gw wpa_supplicant -B -i "$gw_if" -c "$WORK/gw-wpa.conf" \
+  -P "$WORK/gw-wpa.pid" >/dev/null || fail "gateway wpa_supplicant failed"
+associated gw "$gw_if" "$WORK/gw-wpa" uplink-a ||
+  fail "the gateway never associated with uplink-a"
+in_ns gw ip addr add 10.1.0.2/24 dev "$gw_if"
+in_ns gw ip route add default via 10.1.0.1
+echo "nameserver 10.9.9.9" >"$WORK/resolv.conf"
+mount --bind "$WORK/resolv.conf" /etc/resolv.conf ||
+  fail "cannot replace /etc/resolv.conf"
+
+cat >"$WORK/bin/nmcli" <<EOF
+#!/bin/bash
+state=$WORK/nm.active
+case "\$*" in
+"-t -f NAME connection show") printf 'uplink-a\nuplink-b\n' ;;
+"-t -f SSID,SIGNAL device wifi list")
+  kill -0 "\$(cat $WORK/uplink-a.pid)" 2>/dev/null && echo uplink-a:80
+  echo uplink-b:60 ;;
+"-t -f DEVICE,TYPE,STATE dev status")
+  printf '$gw_if:wifi:connected\n'
+  ip link show ap0 >/dev/null 2>&1 && printf 'ap0:wifi:connected\n' ;;
+"-t -f NAME,DEVICE con show --active") cat "\$state" ;;
+"con up uplink-b")
+  wpa_cli -p $WORK/gw-wpa -i $gw_if select_network 1 >/dev/null
+  for _ in \$(seq 500); do
+    wpa_cli -p $WORK/gw-wpa -i $gw_if status | grep -qx ssid=uplink-b &&
+      break
+    sleep 0.01
+  done
+  ip addr flush dev $gw_if
+  ip addr add 10.3.0.2/24 dev $gw_if
+  ip route replace default via 10.3.0.1
+  echo uplink-b:$gw_if >"\$state" ;;
+"dev disconnect "*) ip addr flush dev "\$3" ;;
+"dev set "*|"dev status") ;;
+*) echo "nmcli stand-in: unexpected \$*" >&2; exit 1 ;;
+esac
+EOF
+cat >"$WORK/bin/systemctl" <<'EOF'
+#!/bin/sh
+# NetworkManager is the stand-in nmcli; nothing else is running.
+case "$*" in
+"start NetworkManager" | "is-active NetworkManager") exit 0 ;;
+*) exit 3 ;;
+esac
+EOF
+# hostapd_cli refuses chan_switch while $WORK/refuse-csa exists.
+cat >"$WORK/bin/hostapd_cli" <<EOF
+#!/bin/sh
+case " \$* " in
+*" chan_switch "*) [ -e $WORK/refuse-csa ] && { echo FAIL; exit 0; } ;;
+esac
+exec $real_hostapd_cli "\$@"
+EOF
+chmod +x "$WORK/bin/nmcli" "$WORK/bin/systemctl" "$WORK/bin/hostapd_cli"
+echo "uplink-a:$gw_if" >"$WORK/nm.active"
+
+# metric NAME: the engine's current value of NAME.
+metric() {
+  awk -v m="$1" '$1 == m { print $2 }' /tmp/hotspot.metrics 2>/dev/null
+}
+
+# The real startup.
+ip netns exec hs-gw "$WORK/hsc" --headless --ssid "$SSID" --psk "$PASS" \
+  --option probe=10.9.9.9 --option check_interval=1 \
+  --option history=off >"$WORK/engine.log" 2>&1 &
+engine=$!
+for _ in $(seq 600); do
+  grep -q "^Hotspot started" "$WORK/engine.log" && break
+  kill -0 "$engine" 2>/dev/null ||
+    { cat "$WORK/engine.log"; engine=""; fail "the engine exited"; }
+  sleep 0.1
+done
+grep -q "^Hotspot started" "$WORK/engine.log" ||
+  { cat "$WORK/engine.log"; fail "the hotspot did not start in 60 s"; }
+for _ in $(seq 50); do
+  [ -n "$(metric hotspot_ap_enabled_seconds)" ] && break
+  sleep 0.1
+done
+check "time to AP enabled s" "$(metric hotspot_ap_enabled_seconds)" "<" \
+  "$MAX_AP_ENABLED_S"
+ap_line=$(sed -n 's|^AP address \([0-9.]*\)/\([0-9]*\).*|\1 \2|p' \
+  "$WORK/engine.log" | head -n 1)
+read -r ap_addr prefix <<<"$ap_line"
+
+# A client joins: association, then a DHCP exchange over the air.
+mkdir -p "$WORK/cl-wpa"
+cat >"$WORK/cl-wpa.conf" <<EOF
+ctrl_interface=$WORK/cl-wpa
+sae_pwe=2
+network={
+  ssid="$SSID"
+  psk="$PASS"
+  key_mgmt=WPA-PSK SAE
+  ieee80211w=1
+}
+EOF
+start=$(date +%s%N)
+in_ns cl wpa_supplicant -B -i "$cl_if" -c "$WORK/cl-wpa.conf" \
+  -P "$WORK/cl-wpa.pid" -f "$WORK/cl-wpa.log" >/dev/null ||
+  fail "client wpa_supplicant failed"
+associated cl "$cl_if" "$WORK/cl-wpa" "$SSID" ||
+  fail "the client never associated with $SSID"
+in_ns cl "$WORK/netload" dhcp-storm "$cl_if" 1 10 >"$WORK/join"
+join_ms=$((($(date +%s%N) - start) / 1000000))
+grep -q "^clients 1 bound 1 " "$WORK/join" ||
+  fail "the client got no address: $(cat "$WORK/join")"
+check "association to first lease ms" "$join_ms" "<" "$MAX_JOIN_MS"
+sleep 2 # Two check intervals, so the metrics carry the lease
+echo "time to first DHCP lease s: $(metric hotspot_first_lease_seconds)"
+cl_addr=$(awk '$2 == "02:68:00:00:00:00" { print $3 }' \
+  /tmp/hotspot.dnsmasq.leases)
+[ -n "$cl_addr" ] || fail "the lease is not in the dnsmasq lease file"
+in_ns cl ip addr add "$cl_addr/$prefix" dev "$cl_if"
+in_ns cl ip route add default via "$ap_addr"
+
+# DNS and HTTP through the hotspot, then a download.
+in_ns cl "$WORK/netload" dns-replay "$ap_addr" 3 200 5 >"$WORK/dns" ||
+  check_failed "no DNS answers through $ap_addr"
+echo "dns: $(cat "$WORK/dns")"
+check "DNS p99 ms" "$(awk '{ for (i = 1; i < NF; i++) if ($i == "p99_ms")
+  print $(i + 1) }' "$WORK/dns")" "<" "$MAX_E2E_DNS_P99_MS"
+in_ns cl "$WORK/netload" http-get 10.0.0.1 80 >"$WORK/http" ||
+  check_failed "HTTP through the hotspot failed: $(cat "$WORK/http")"
+echo "http: $(cat "$WORK/http")"
+check "download Mbit/s" "$(in_ns cl "$WORK/netload" bulk 10.0.0.1 6000 down 5 \
+  4 | awk '$1 == "mbit" { print $2 }')" ">" "$MIN_E2E_MBIT"
+
+# Failover: uplink-a disappears under a 1 kHz UDP stream.
+ip netns exec hs-net "$WORK/netload" udp-recv 5000 30 >"$WORK/recv" &
+recv=$!
+sleep 0.2
+ip netns exec hs-cl "$WORK/netload" udp-send 10.0.0.1 5000 29 1000 \
+  >/dev/null &
+sleep 2
+kill "$(cat "$WORK/uplink-a.pid")"
+wait "$recv"
+check "failover blackhole ms" "$(awk '{ for (i = 1; i < NF; i++)
+  if ($i == "max_gap_ms") print $(i + 1) }' "$WORK/recv")" "<" \
+  "$MAX_E2E_FAILOVER_MS"
+grep -q uplink-b "$WORK/nm.active" ||
+  check_failed "the engine did not move to uplink-b"
+check "uplink outages" "$(metric hotspot_uplink_outages_total)" ">" 0
+echo "last outage s: $(metric hotspot_last_outage_seconds)"
+
+# ap_on MHZ: wait up to 10 s for ap0 to report MHZ.
+ap_on() {
+  for _ in $(seq 100); do
+    in_ns gw iw dev ap0 info | grep -q "channel [0-9]* ($1 MHz)" && return 0
+    sleep 0.1
+  done
+  return 1
+}
+# connections: how often the client has associated so far.
+connections() {
+  grep -c "CTRL-EVENT-CONNECTED" "$WORK/cl-wpa.log"
+}
+
+# uplink-b is on channel 1: ap0 follows it with a channel switch.
+ap_on 2412 || check_failed "ap0 did not follow uplink-b to channel 1"
+grep "^Uplink moved to channel" "$WORK/engine.log"
+associated cl "$cl_if" "$WORK/cl-wpa" "$SSID" &&
+  in_ns cl wpa_cli -p "$WORK/cl-wpa" -i "$cl_if" status | grep -qx freq=2412 ||
+  check_failed "the client did not follow ap0 to channel 1"
+[ "$(connections)" = 1 ] ||
+  check_failed "the client associated $(connections) times, not once"
+grep -q "^Channel switch failed" "$WORK/engine.log" &&
+  check_failed "the channel switch fell back to a hostapd reload"
+
+# uplink-b moves to channel 11 while ap0 refuses chan_switch: the engine
+# rewrites its hostapd config and reloads hostapd.
+touch "$WORK/refuse-csa"
+in_ns up "$real_hostapd_cli" -p "$WORK/uplink-b" -i "$up_b" \
+  chan_switch 5 2462 | grep -q OK || fail "uplink-b did not switch channel"
+ap_on 2462 || check_failed "ap0 did not reach channel 11 without chan_switch"
+grep -q "^Channel switch failed; reloading hostapd on channel 11" \
+  "$WORK/engine.log" || check_failed "no hostapd reload was logged"
+grep -qx "channel=11" /tmp/hostapd.conf ||
+  check_failed "the hostapd config was not rewritten for channel 11"
+rm "$WORK/refuse-csa"
+
+# A clean stop removes the AP.
+kill "$engine"
+wait "$engine"
+engine=""
+in_ns gw ip link show ap0 >/dev/null 2>&1 &&
+  check_failed "ap0 is still there after the engine stopped"
+finish
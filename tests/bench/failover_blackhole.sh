@@ -0,0 +1,112 @@
+#!/bin/bash
+# How long client traffic is blackholed while the engine switches uplinks.
+#
+#   hs-cl (client) --- ap0 hs-gw (engine) up0/up1 --- hs-net (10.9.9.9)
+#
+# A stand-in nmcli moves the gateway from uplink-a on up0 to uplink-b,
+# taking NM_ASSOC_DELAY to associate. With a spare radio uplink-b comes up
+# on up1; without one it replaces uplink-a on up0. hs-net drops packets
+# that were not masqueraded (strict rp_filter), as an ISP would. The client
+# sends a datagram every millisecond and the longest silence at the server
+# is the blackhole. Make-before-break must stay under MAX_MBB_GAP_MS.
+. "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd iptables conntrack ping
+provide_sudo
+MAX_MBB_GAP_MS=$(threshold MAX_MBB_GAP_MS 100)
+NM_ASSOC_DELAY=1
+build netload
+build hsc-harness
+
+# Stand-in for NetworkManager, run inside hs-gw.
+write_nmcli() {
+  local spare=$1
+  cat >"$WORK/bin/nmcli" <<EOF
+#!/bin/bash
+state=$WORK/nm.active
+case "\$*" in
+"-t -f NAME connection show") printf 'uplink-a\nuplink-b\n' ;;
+"-t -f SSID,SIGNAL device wifi list") printf 'uplink-b:80\n' ;;
+"-t -f DEVICE,TYPE,STATE dev status")
+  printf 'ap0:wifi:connected\nup0:wifi:connected\n'
+  [ $spare = 1 ] && printf 'up1:wifi:disconnected\n' ;;
+"-t -f NAME,DEVICE con show --active") cat "\$state" ;;
+"con up uplink-b ifname up1")
+  sleep $NM_ASSOC_DELAY
+  ip addr add 10.2.0.2/24 dev up1
+  ip route add default via 10.2.0.1 dev up1 metric 200
+  echo uplink-b:up1 >"\$state" ;;
+"con up uplink-b")
+  ip addr flush dev up0
+  sleep $NM_ASSOC_DELAY
+  ip addr add 10.3.0.2/24 dev up0
+  ip route add default via 10.3.0.1 dev up0
+  echo uplink-b:up0 >"\$state" ;;
+"dev disconnect "*) ip addr flush dev "\$3" ;;
+*) echo "nmcli stand-in: unexpected \$*" >&2; exit 1 ;;
+esac
+EOF
+  chmod +x "$WORK/bin/nmcli"
+  echo uplink-a:up0 >"$WORK/nm.active"
+}
+
+setup_world() {
+  add_netns cl gw net
+  add_veth cl c0 gw ap0
+  add_veth gw up0 net n0
+  add_veth gw up1 net n1
+  in_ns cl ip addr add 192.168.4.2/24 dev c0
+  in_ns cl ip route add default via 192.168.4.1
+  in_ns gw ip addr add 192.168.4.1/24 dev ap0
+  in_ns gw ip addr add 10.1.0.2/24 dev up0
+  in_ns gw ip route add default via 10.1.0.1
+  in_ns gw sysctl -qw net.ipv4.ip_forward=1
+  in_ns net ip addr add 10.1.0.1/24 dev n0
+  in_ns net ip addr add 10.3.0.1/24 dev n0
+  in_ns net ip addr add 10.2.0.1/24 dev n1
+  in_ns net ip addr add 10.9.9.9/32 dev lo
+  in_ns net sysctl -qw net.ipv4.conf.all.rp_filter=1
+  in_ns gw "$WORK/hsc-harness" nat up0 || fail "cannot install NAT rules"
+}
+
+# run_switch MODE SPARE: switch once under traffic and set GAP to the
+# longest silence in ms.
+run_switch() {
+  local mode=$1 spare=$2
+  setup_world
+  write_nmcli "$spare"
+  # A rule a warm restart left for up1 must not be duplicated.
+  [ "$spare" = 1 ] &&
+    in_ns gw iptables -t nat -A POSTROUTING -o up1 -j MASQUERADE
+  in_ns net "$WORK/netload" udp-recv 5000 13 >"$WORK/recv" &
+  local recv=$!
+  sleep 0.2
+  in_ns cl "$WORK/netload" udp-send 10.9.9.9 5000 12 1000 >/dev/null &
+  sleep 2
+  in_ns gw "$WORK/hsc-harness" -o switch_mode="$mode" -o probe=10.9.9.9 \
+    switch up0 "$WORK/bin/nmcli" >"$WORK/switch.log" 2>&1
+  grep -q "^switch ok" "$WORK/switch.log" ||
+    { cat "$WORK/switch.log"; fail "$mode switch failed"; }
+  wait "$recv"
+  if [ "$spare" = 1 ]; then
+    local rules
+    rules=$(in_ns gw iptables -t nat -S POSTROUTING | grep -c MASQUERADE)
+    [ "$rules" = 1 ] ||
+      check_failed "$rules MASQUERADE rules after the switch, expected 1"
+  fi
+  if [ "$mode" = mbb ] && [ "$spare" = 0 ]; then
+    grep -q "falling back to break-before-make" "$WORK/switch.log" ||
+      check_failed "break-before-make fallback was not logged"
+  fi
+  GAP=$(awk '{ for (i = 1; i < NF; i++) if ($i == "max_gap_ms")
+    print $(i + 1) }' "$WORK/recv")
+}
+
+run_switch mbb 1
+check "make-before-break blackhole ms" "$GAP" "<" "$MAX_MBB_GAP_MS"
+run_switch mbb 0
+echo "break-before-make fallback blackhole ms: $GAP"
+run_switch classic 0
+echo "classic blackhole ms: $GAP"
+finish
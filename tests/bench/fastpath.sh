@@ -0,0 +1,66 @@
+#!/bin/bash
+# Forwarding throughput and CPU cost per packet through the gateway with
+# the classic iptables NAT path and with the nftables flowtable fast path:
+#
+#   hs-cl --- ap0 hs-gw up0 --- hs-net (10.9.9.9)
+#
+# Each mode runs a four-stream download for 10 s. CPU time is read from
+# /proc/stat and covers the whole machine (sender and receiver included),
+# so the difference between the modes is the forwarding cost that changed.
+# The fast path must forward at least MIN_FASTPATH_RATIO of the classic
+# throughput.
+. "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd iptables nft
+provide_sudo
+MIN_FASTPATH_RATIO=$(threshold MIN_FASTPATH_RATIO 0.95)
+build netload
+build hsc-harness
+
+add_netns cl gw net
+add_veth cl c0 gw ap0
+add_veth gw up0 net n0
+in_ns cl ip addr add 192.168.4.2/24 dev c0
+in_ns cl ip route add default via 192.168.4.1
+in_ns gw ip addr add 192.168.4.1/24 dev ap0
+in_ns gw ip addr add 10.1.0.2/24 dev up0
+in_ns gw ip route add default via 10.1.0.1
+in_ns gw sysctl -qw net.ipv4.ip_forward=1
+in_ns net ip addr add 10.1.0.1/24 dev n0
+in_ns net ip addr add 10.9.9.9/32 dev lo
+in_ns gw "$WORK/hsc-harness" nat up0 || fail "cannot install NAT rules"
+in_ns net "$WORK/netload" serve 6000 &
+sleep 0.3
+
+# run MODE: download through the gateway and print
+# "MODE mbit ns_per_packet softirq_ns_per_packet".
+run() {
+  local stats=/sys/class/net/ap0/statistics/tx_packets
+  local p0 p1 busy0 soft0 busy1 soft1
+  p0=$(in_ns gw cat $stats)
+  read -r busy0 soft0 < <(cpu_jiffies)
+  in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 down 10 4 >"$WORK/bulk.$1"
+  read -r busy1 soft1 < <(cpu_jiffies)
+  p1=$(in_ns gw cat $stats)
+  local hz
+  hz=$(getconf CLK_TCK)
+  awk -v mode="$1" -v p=$((p1 - p0)) -v b=$((busy1 - busy0)) \
+    -v s=$((soft1 - soft0)) -v hz="$hz" \
+    '{ printf "%s %s %.0f %.0f\n", mode, $2, b * 1e9 / hz / p,
+       s * 1e9 / hz / p }' "$WORK/bulk.$1"
+}
+
+read -r _ classic classic_ns classic_soft < <(run classic)
+echo "classic: $classic Mbit/s, $classic_ns ns CPU" \
+  "($classic_soft ns softirq) per forwarded packet"
+in_ns gw "$WORK/hsc-harness" fastpath up0 || fail "cannot install flowtable"
+in_ns gw nft list flowtables | grep -q "flowtable ft" ||
+  fail "flowtable is not installed"
+read -r _ fast fast_ns fast_soft < <(run flowtable)
+echo "flowtable: $fast Mbit/s, $fast_ns ns CPU" \
+  "($fast_soft ns softirq) per forwarded packet"
+check "flowtable/classic throughput" \
+  "$(awk -v a="$fast" -v b="$classic" 'BEGIN { printf "%.2f", a / b }')" \
+  ">" "$MIN_FASTPATH_RATIO"
+finish
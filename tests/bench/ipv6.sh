@@ -0,0 +1,155 @@
+#!/bin/bash
+# IPv6 for clients with ipv6=proxy, where the gateway shares the uplink's
+# /64 through the engine's NDP proxy:
+#
+#   hs-cl c0 --- ap0 hs-gw up0 --- n0 hs-net (router 2001:db8::1/64)
+#
+# The router reaches a client that was learned from its duplicate address
+# detection, and one configured without it, which the proxy only finds by
+# probing ap0 when the router solicits it. Stopping removes the proxy
+# entries and host routes and restores forwarding, accept_ra and proxy_ndp.
+# With iptables installed a four-stream download through the routed IPv6
+# path is compared with the same download through the IPv4 NAT: the
+# IPv6 path must keep MIN_IPV6_RATIO (0.9) of the NAT throughput, and both
+# CPU costs per forwarded packet are printed. Last, the engine is killed
+# with the sysctls changed and a warm restart takes over its state: its
+# teardown must still restore the values from before the first run.
+PRIVATE_TMP=1 . "$(dirname "$0")/../lib.sh"
+
+need_root
+provide_sudo
+MIN_IPV6_RATIO=$(threshold MIN_IPV6_RATIO 0.9)
+build netload
+build hsc-harness
+
+add_netns cl gw net
+add_veth cl c0 gw ap0
+add_veth gw up0 net n0
+in_ns net ip addr add 2001:db8::1/64 dev n0 nodad
+in_ns gw ip addr add 2001:db8::2/64 dev up0 nodad
+in_ns gw ip -6 route add default via 2001:db8::1
+ip netns exec hs-cl "$WORK/netload" serve 6000 &
+ip netns exec hs-net "$WORK/netload" serve 6000 &
+
+# sysctls NAME...: print the values of net.ipv6.conf.NAME in hs-gw.
+sysctls() {
+  local n
+  for n in "$@"; do
+    in_ns gw sysctl -n "net.ipv6.conf.$n"
+  done | tr '\n' ' '
+}
+before=$(sysctls all.forwarding up0.accept_ra up0.proxy_ndp)
+
+# wait_for SECONDS CMD...: retry CMD until it succeeds.
+wait_for() {
+  local tries=$(($1 * 10))
+  shift
+  for _ in $(seq "$tries"); do
+    "$@" && return 0
+    sleep 0.1
+  done
+  return 1
+}
+settled() {
+  [ -z "$(in_ns "$1" ip -6 addr show dev "$2" tentative)" ]
+}
+proxied() {
+  in_ns gw ip -6 neigh show proxy dev up0 | grep -q "^$1 "
+}
+
+ip netns exec hs-gw "$WORK/hsc-harness" -o ipv6=proxy ipv6 up0 \
+  >"$WORK/ipv6" 2>&1 &
+harness=$!
+wait_for 5 grep -q "^ap6 " "$WORK/ipv6" ||
+  { cat "$WORK/ipv6"; fail "the IPv6 setup failed"; }
+grep "^ap6 " "$WORK/ipv6"
+during=$(sysctls all.forwarding up0.accept_ra up0.proxy_ndp)
+[ "$during" = "1 2 1 " ] ||
+  check_failed "forwarding, accept_ra, proxy_ndp are $during, expected 1 2 1"
+
+# Clients take addresses in the shared prefix without an on-link route,
+# as the advertised off-link prefix makes them do.
+wait_for 5 settled gw ap0 || fail "ap0 keeps a tentative address"
+gw_ll=$(in_ns gw ip -6 -o addr show dev ap0 scope link |
+  awk '{ sub("/.*", "", $4); print $4 }')
+in_ns cl ip -6 route add default via "$gw_ll" dev c0
+in_ns cl ip addr add 2001:db8::c1/64 dev c0 noprefixroute
+wait_for 5 settled cl c0 || fail "the client's address stays tentative"
+wait_for 5 proxied 2001:db8::c1 ||
+  check_failed "the client was not learned from its DAD"
+in_ns net "$WORK/netload" rtt 2001:db8::c1 6000 2 100 >"$WORK/rtt.dad" ||
+  check_failed "the router cannot reach the client learned from DAD"
+echo "learned from DAD: $(cat "$WORK/rtt.dad")"
+
+in_ns cl ip addr add 2001:db8::c2/64 dev c0 noprefixroute nodad
+proxied 2001:db8::c2 && check_failed "2001:db8::c2 was learned without DAD"
+in_ns net "$WORK/netload" rtt 2001:db8::c2 6000 3 100 >"$WORK/rtt.probe" ||
+  check_failed "the router cannot reach a client found by probing"
+echo "found by probing: $(cat "$WORK/rtt.probe")"
+proxied 2001:db8::c2 || check_failed "probing did not learn 2001:db8::c2"
+
+# run NAME HOST: download from HOST in hs-net and print
+# "mbit ns_per_packet".
+run() {
+  local stats=/sys/class/net/ap0/statistics/tx_packets
+  local p0 p1 busy0 busy1 hz
+  p0=$(in_ns gw cat $stats)
+  read -r busy0 _ < <(cpu_jiffies)
+  in_ns cl "$WORK/netload" bulk "$2" 6000 down 10 4 >"$WORK/bulk.$1"
+  read -r busy1 _ < <(cpu_jiffies)
+  p1=$(in_ns gw cat $stats)
+  hz=$(getconf CLK_TCK)
+  awk -v p=$((p1 - p0)) -v b=$((busy1 - busy0)) -v hz="$hz" \
+    '{ printf "%s %.0f\n", $2, b * 1e9 / hz / p }' "$WORK/bulk.$1"
+}
+
+if command -v iptables >/dev/null 2>&1; then
+  in_ns cl ip addr add 192.168.4.2/24 dev c0
+  in_ns cl ip route add default via 192.168.4.1
+  in_ns gw ip addr add 192.168.4.1/24 dev ap0
+  in_ns gw ip addr add 10.1.0.2/24 dev up0
+  in_ns gw ip route add default via 10.1.0.1
+  in_ns gw sysctl -qw net.ipv4.ip_forward=1
+  in_ns net ip addr add 10.1.0.1/24 dev n0
+  in_ns gw "$WORK/hsc-harness" nat up0 || fail "cannot install NAT rules"
+  read -r v4 v4_ns < <(run ipv4 10.1.0.1)
+  echo "IPv4 NAT: $v4 Mbit/s, $v4_ns ns CPU per forwarded packet"
+  read -r v6 v6_ns < <(run ipv6 2001:db8::1)
+  echo "IPv6 routed: $v6 Mbit/s, $v6_ns ns CPU per forwarded packet"
+  check "IPv6/IPv4 NAT throughput" \
+    "$(awk -v a="$v6" -v b="$v4" 'BEGIN { printf "%.2f", a / b }')" \
+    ">" "$MIN_IPV6_RATIO"
+else
+  echo "forwarding cost: not measured, iptables is not installed"
+fi
+
+kill -TERM "$harness"
+wait "$harness"
+grep -q "^undone" "$WORK/ipv6" || check_failed "the IPv6 steps were not undone"
+[ -z "$(in_ns gw ip -6 neigh show proxy dev up0)" ] ||
+  check_failed "proxy entries are left on up0"
+in_ns gw ip -6 route show dev ap0 | grep -q "^2001:db8::c" &&
+  check_failed "client host routes are left on ap0"
+after=$(sysctls all.forwarding up0.accept_ra up0.proxy_ndp)
+[ "$after" = "$before" ] ||
+  check_failed "forwarding, accept_ra, proxy_ndp are $after, were $before"
+
+# A crash, then a warm restart.
+ip netns exec hs-gw "$WORK/hsc-harness" -o ipv6=proxy ipv6 up0 \
+  >"$WORK/crashed" 2>&1 &
+harness=$!
+wait_for 5 grep -q "^ap6 " "$WORK/crashed" || fail "the IPv6 setup failed"
+kill -KILL "$harness"
+wait "$harness" 2>/dev/null
+kill "$(awk '$1 == "ap6" { print $4 }' "$WORK/crashed")" 2>/dev/null
+ip netns exec hs-gw "$WORK/hsc-harness" -o ipv6=proxy ipv6 up0 warm \
+  >"$WORK/warm" 2>&1 &
+harness=$!
+wait_for 5 grep -q "^ap6 " "$WORK/warm" ||
+  { cat "$WORK/warm"; fail "the warm IPv6 setup failed"; }
+kill -TERM "$harness"
+wait "$harness"
+after=$(sysctls all.forwarding up0.accept_ra up0.proxy_ndp)
+[ "$after" = "$before" ] || check_failed "after a warm restart forwarding, \
+accept_ra, proxy_ndp are $after, were $before"
+finish
@@ -0,0 +1,126 @@
+#!/bin/bash
+# Client reconnect time after a hotspot restart, on two mac80211_hwsim
+# radios:
+#
+#   host: hostapd on ap0 (phy A)  ~~~  hs-cl: wpa_supplicant (phy B)
+#
+# For each security mode the harness writes the engine's hostapd config and
+# derives ap0's BSSID. Once the client is associated, hostapd is stopped,
+# ap0 is deleted and both are brought back the way a restart does. The BSSID
+# must come back unchanged, and the client must be associated again within
+# MAX_RECONNECT_MS of the new hostapd starting.
+PRIVATE_TMP=1 . "$(dirname "$0")/../lib.sh"
+
+need_root
+need_cmd iw hostapd hostapd_cli wpa_supplicant wpa_cli
+provide_sudo
+MAX_RECONNECT_MS=$(threshold MAX_RECONNECT_MS 3000)
+SSID=hs-reconnect
+PASS=reconnect-test-pass
+build hsc-harness
+
+loaded_hwsim=0
+if [ ! -d /sys/module/mac80211_hwsim ]; then
+  command -v modprobe >/dev/null 2>&1 &&
+    modprobe mac80211_hwsim radios=2 2>/dev/null ||
+    skip "mac80211_hwsim is not available"
+  loaded_hwsim=1
+fi
+hwsim_phys=()
+for phy in /sys/class/ieee80211/*; do
+  [ "$(basename "$(readlink -f "$phy/device/driver")")" = mac80211_hwsim ] &&
+    hwsim_phys+=("$(basename "$phy")")
+done
+[ ${#hwsim_phys[@]} -ge 2 ] || skip "needs two mac80211_hwsim radios"
+ap_phy=${hwsim_phys[0]}
+cl_phy=${hwsim_phys[1]}
+ap_parent=$(ls "/sys/class/ieee80211/$ap_phy/device/net" | head -n 1)
+cl_if=$(ls "/sys/class/ieee80211/$cl_phy/device/net" | head -n 1)
+[ -n "$ap_parent" ] && [ -n "$cl_if" ] || skip "hwsim radios have no netdev"
+
+stop_hostapd() {
+  [ -f "$WORK/hostapd.pid" ] && kill "$(cat "$WORK/hostapd.pid")" 2>/dev/null
+  for _ in $(seq 50); do
+    [ -f "$WORK/hostapd.pid" ] && kill -0 "$(cat "$WORK/hostapd.pid")" \
+      2>/dev/null || break
+    sleep 0.1
+  done
+  rm -f "$WORK/hostapd.pid"
+  iw dev ap0 del 2>/dev/null
+}
+teardown() {
+  stop_hostapd
+  cleanup
+  [ "$loaded_hwsim" = 1 ] && rmmod mac80211_hwsim 2>/dev/null
+}
+trap teardown EXIT
+
+add_netns cl
+iw phy "$cl_phy" set netns name hs-cl || fail "cannot move $cl_phy to hs-cl"
+in_ns cl ip link set "$cl_if" up
+mkdir -p "$WORK/wpa"
+cat >"$WORK/wpa.conf" <<EOF
+ctrl_interface=$WORK/wpa
+sae_pwe=2
+network={
+  ssid="$SSID"
+  psk="$PASS"
+  key_mgmt=WPA-PSK SAE FT-PSK FT-SAE
+  ieee80211w=1
+}
+EOF
+
+now_ms() {
+  echo $(($(date +%s%N) / 1000000))
+}
+
+# start_ap MODE: create ap0 and start hostapd the way the engine does, and
+# set BSSID.
+start_ap() {
+  "$WORK/hsc-harness" -o security="$1" -o ft=on apconf "$ap_parent" \
+    "$SSID" "$PASS" >"$WORK/apconf" || fail "$1: cannot write the config"
+  BSSID=$(awk '{ print $2 }' "$WORK/apconf")
+  iw dev "$ap_parent" interface add ap0 type __ap addr "$BSSID" ||
+    fail "$1: cannot create ap0 with BSSID $BSSID"
+  hostapd -B -P "$WORK/hostapd.pid" /tmp/hostapd.conf >"$WORK/hostapd.log" ||
+    fail "$1: hostapd did not start: $(cat "$WORK/hostapd.log")"
+}
+
+# associated BSSID: wait up to 15 s until the client is associated with
+# BSSID and print how long it took in ms.
+associated() {
+  local start status
+  start=$(now_ms)
+  while [ $(($(now_ms) - start)) -lt 15000 ]; do
+    status=$(in_ns cl wpa_cli -p "$WORK/wpa" -i "$cl_if" status 2>/dev/null)
+    if grep -q '^wpa_state=COMPLETED' <<<"$status" &&
+      grep -qi "^bssid=$1\$" <<<"$status"; then
+      echo $(($(now_ms) - start))
+      return 0
+    fi
+    sleep 0.02
+  done
+  return 1
+}
+
+for mode in wpa2 wpa3; do
+  start_ap $mode
+  first_bssid=$BSSID
+  in_ns cl wpa_supplicant -B -i "$cl_if" -c "$WORK/wpa.conf" \
+    -P "$WORK/wpa.pid" >/dev/null || fail "wpa_supplicant did not start"
+  associated "$BSSID" >/dev/null || fail "$mode: client never associated"
+
+  stop_hostapd
+  start_ap $mode
+  [ "$BSSID" = "$first_bssid" ] ||
+    check_failed "$mode: BSSID changed from $first_bssid to $BSSID"
+  if ms=$(associated "$BSSID"); then
+    check "$mode reconnect ms" "$ms" "<" "$MAX_RECONNECT_MS"
+  else
+    check_failed "$mode: client did not reconnect"
+  fi
+  kill "$(cat "$WORK/wpa.pid")"
+  stop_hostapd
+  sleep 0.2
+done
+finish
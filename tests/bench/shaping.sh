@@ -0,0 +1,116 @@
+#!/bin/bash
+# Latency under load, per-host fairness and per-client caps of the shaping
+# stage, on veth pairs:
+#
+#   hs-cl (.2, .3) --- ap0 hs-gw up0 --- n0 hs-net (10.9.9.9)
+#
+# n0 plays a modem: a 25 Mbit/s token bucket with a 480 ms queue. The
+# engine shapes to 20 Mbit/s each way, so the queue should move to ap0 where
+# CAKE or fq_codel keeps it short. Client .2 downloads with four streams
+# while .3 measures UDP round trips, first without and then with shaping.
+PRIVATE_TMP=1 . "$(dirname "$0")/../lib.sh"
+
+need_root
+provide_sudo
+MAX_LOADED_RTT_MS=$(threshold MAX_LOADED_RTT_MS 50)
+MIN_FAIR_SHARE=$(threshold MIN_FAIR_SHARE 0.6)
+RATE_KBIT=20000
+build netload
+build hsc-harness
+
+add_netns cl gw net
+in_ns gw tc qdisc add dev lo root handle 1: htb 2>/dev/null ||
+  skip "kernel has no sch_htb"
+in_ns gw tc qdisc del dev lo root
+leaf=""
+for q in cake fq_codel; do
+  if in_ns gw tc qdisc add dev lo root "$q" 2>/dev/null; then
+    leaf=${leaf:-$q}
+    in_ns gw tc qdisc del dev lo root
+  fi
+done
+[ -n "$leaf" ] || skip "kernel has neither sch_cake nor sch_fq_codel"
+
+add_veth cl c0 gw ap0
+add_veth gw up0 net n0
+in_ns cl ip addr add 192.168.4.2/24 dev c0
+in_ns cl ip addr add 192.168.4.3/24 dev c0
+in_ns cl ip route add default via 192.168.4.1
+in_ns gw ip addr add 192.168.4.1/24 dev ap0
+in_ns gw ip addr add 10.1.0.2/24 dev up0
+in_ns gw ip route add default via 10.1.0.1
+in_ns gw sysctl -qw net.ipv4.ip_forward=1
+in_ns net ip addr add 10.1.0.1/24 dev n0
+in_ns net ip addr add 10.9.9.9/32 dev lo
+in_ns net ip route add 192.168.4.0/24 via 10.1.0.2
+in_ns net tc qdisc add dev n0 root tbf rate 25mbit burst 32kb limit 1500kb ||
+  skip "kernel has no sch_tbf for the modem"
+in_ns net "$WORK/netload" serve 6000 &
+sleep 0.3
+
+# field NAME FILE: the value after NAME in a netload result line.
+field() {
+  awk -v k="$1" '{ for (i = 1; i < NF; i++) if ($i == k) print $(i + 1) }' \
+    "$2"
+}
+
+# loaded LABEL: .2 downloads with four streams while .3 measures RTT.
+loaded() {
+  in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 down 12 4 192.168.4.2 \
+    >"$WORK/bulk.$1" &
+  local load=$!
+  sleep 3
+  in_ns cl "$WORK/netload" rtt 10.9.9.9 6000 8 20 192.168.4.3 \
+    >"$WORK/rtt.$1"
+  wait "$load"
+  echo "$1: download $(field mbit "$WORK/bulk.$1") Mbit/s," \
+    "loaded RTT p50 $(field p50_ms "$WORK/rtt.$1") ms"
+}
+
+loaded unshaped
+in_ns gw "$WORK/hsc-harness" -o shaper_down_kbit=$RATE_KBIT \
+  -o shaper_up_kbit=$RATE_KBIT shaper up0 || fail "shaper setup failed"
+echo "ap0 leaf: $leaf"
+loaded shaped
+check "shaped loaded RTT p50 ms" "$(field p50_ms "$WORK/rtt.shaped")" "<" \
+  "$MAX_LOADED_RTT_MS"
+check "shaped download Mbit/s" "$(field mbit "$WORK/bulk.shaped")" "<" \
+  "$((RATE_KBIT * 105 / 100000))"
+in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 up 8 4 192.168.4.2 \
+  >"$WORK/bulk.up"
+check "shaped upload Mbit/s" "$(field mbit "$WORK/bulk.up")" "<" \
+  "$((RATE_KBIT * 105 / 100000))"
+
+# One host with four streams against one with a single stream: CAKE's
+# dual-dsthost splits by host, fq_codel only by flow.
+in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 down 10 4 192.168.4.2 \
+  >"$WORK/bulk.many" &
+many=$!
+in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 down 10 1 192.168.4.3 \
+  >"$WORK/bulk.one"
+wait "$many"
+share=$(awk -v a="$(field mbit "$WORK/bulk.one")" \
+  -v b="$(field mbit "$WORK/bulk.many")" 'BEGIN { printf "%.2f", a / b }')
+if [ "$leaf" = cake ]; then
+  check "single-stream host share" "$share" ">" "$MIN_FAIR_SHARE"
+else
+  echo "single-stream host share: $share (not checked with fq_codel)"
+fi
+
+# Per-client caps from the rate limit file.
+echo "192.168.4.3 5000 2000" >/tmp/hotspot.ratelimits
+in_ns gw "$WORK/hsc-harness" ratelimits | grep -q "capped 1" ||
+  fail "rate limits were not applied"
+in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 down 8 4 192.168.4.3 \
+  >"$WORK/bulk.capped"
+check "capped client download Mbit/s" "$(field mbit "$WORK/bulk.capped")" \
+  "<" 5.5
+if in_ns gw tc filter show dev ap0 ingress | grep -q police; then
+  in_ns cl "$WORK/netload" bulk 10.9.9.9 6000 up 8 4 192.168.4.3 \
+    >"$WORK/bulk.capped_up"
+  check "capped client upload Mbit/s" \
+    "$(field mbit "$WORK/bulk.capped_up")" "<" 2.2
+else
+  echo "capped client upload: not checked, kernel has no act_police"
+fi
+finish
@@ -0,0 +1,10 @@
+#!/bin/bash
+# Lease index of the built-in DHCP server: a client that declined an
+# address and was given another must stay findable by its MAC when a second
+# client takes over the declined record after its quarantine, whether the
+# second client sends a DISCOVER or goes straight to a REQUEST.
+PRIVATE_TMP=1 . "$(dirname "$0")/lib.sh"
+
+build hsc-harness
+"$WORK/hsc-harness" leasecheck || check_failed "lease index lost a client"
+finish
@@ -0,0 +1,68 @@
+#!/bin/bash
+# Rollback of the engine's dnsmasq: only the instance named by the engine's
+# pid file is stopped, in bounded time, and other dnsmasq processes on the
+# host keep running. Stand-in dnsmasq processes record their PID like
+# --pid-file does; a stubborn one ignores SIGTERM and must be killed before
+# the rollback tier's budget runs out.
+PRIVATE_TMP=1 . "$(dirname "$0")/lib.sh"
+
+need_cmd pkill pgrep
+provide_sudo
+MAX_TEARDOWN_MS=$(threshold MAX_TEARDOWN_MS 500)
+MAX_STUBBORN_TEARDOWN_MS=$(threshold MAX_STUBBORN_TEARDOWN_MS 2500)
+PID_FILE=/tmp/hotspot.dnsmasq.pid
+build hsc-harness
+cat >"$WORK/bin/dnsmasq" <<'DNSMASQ'
+#!/bin/bash
+for a; do
+  case $a in
+  --pid-file=*) echo $$ >"${a#--pid-file=}" ;;
+  --stubborn) trap '' TERM ;;
+  esac
+done
+while :; do sleep 0.05; done
+DNSMASQ
+chmod +x "$WORK/bin/dnsmasq"
+
+# start_dnsmasq PIDFILE [--stubborn]: start a stand-in and wait for its PID.
+start_dnsmasq() {
+  rm -f "$1"
+  dnsmasq --pid-file="$1" "${@:2}" &
+  for _ in $(seq 100); do
+    [ -s "$1" ] && return
+    sleep 0.01
+  done
+  fail "stand-in dnsmasq did not start"
+}
+
+alive() {
+  kill -0 "$1" 2>/dev/null
+}
+
+# teardown NAME LIMIT: roll back the dnsmasq step and check its duration.
+teardown() {
+  local ms
+  ms=$("$WORK/hsc-harness" dnsmasqstop | awk '{ print $2 }')
+  check "$1 teardown ms" "$ms" "<" "$2"
+}
+
+start_dnsmasq "$WORK/other.pid"
+other=$(cat "$WORK/other.pid")
+start_dnsmasq $PID_FILE
+engine=$(cat $PID_FILE)
+teardown engine "$MAX_TEARDOWN_MS"
+alive "$engine" && check_failed "the engine's dnsmasq is still running"
+alive "$other" || check_failed "another dnsmasq on the host was stopped"
+
+start_dnsmasq $PID_FILE --stubborn
+stubborn=$(cat $PID_FILE)
+teardown stubborn "$MAX_STUBBORN_TEARDOWN_MS"
+alive "$stubborn" && check_failed "a dnsmasq ignoring SIGTERM survived"
+
+# A stale pid file naming a process that is not dnsmasq.
+sleep 60 &
+echo $! >$PID_FILE
+teardown stale "$MAX_TEARDOWN_MS"
+alive "$!" || check_failed "a stale pid file made the rollback stop $!"
+alive "$other" || check_failed "another dnsmasq on the host was stopped"
+finish
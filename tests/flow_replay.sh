@@ -0,0 +1,24 @@
+#!/bin/bash
+# Replay of synthetic conntrack event streams through the Top Talkers flow
+# table: 30000 flows over ten accounting dumps, a tenth of them replaced by
+# DESTROY and NEW events before each dump. The ranking must match a full
+# sort of the known rates, a line must cost under MAX_FLOW_LINE_NS and a
+# top-K scan of the table under MAX_TOPK_SCAN_US.
+. "$(dirname "$0")/lib.sh"
+
+MAX_FLOW_LINE_NS=$(threshold MAX_FLOW_LINE_NS 5000)
+MAX_TOPK_SCAN_US=$(threshold MAX_TOPK_SCAN_US 5000)
+build uic-harness -lncurses
+
+"$WORK/uic-harness" flows 30000 10 >"$WORK/replay"
+cat "$WORK/replay"
+grep -q "top_ok 1" "$WORK/replay" ||
+  check_failed "top talkers differ from the known rates"
+field() {
+  awk -v k="$1" '{ for (i = 1; i < NF; i++) if ($i == k) print $(i + 1) }' \
+    "$WORK/replay"
+}
+check "ns per event or dump line" "$(field ns_per_line)" "<" \
+  "$MAX_FLOW_LINE_NS"
+check "us per top-K scan" "$(field us_per_scan)" "<" "$MAX_TOPK_SCAN_US"
+finish
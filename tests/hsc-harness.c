@@ -0,0 +1,617 @@
+// Test driver for the engine: it compiles hotspot.c in with its main()
+// renamed and calls single steps of the engine, so a test can exercise a
+// failover or a parser without running a whole hotspot.
+//
+// Usage: hsc-harness [-o key=value]... COMMAND [ARGS]
+// Options are applied with set_hotspot_option() as if they came from
+// OPTIONS_FILE, which is not read.
+#define main hsc_main
+#include "../hotspot.c"
+#undef main
+
+// Take over NAT state for iface as if the engine had installed it.
+void adopt_nat(const char *iface) {
+  char *path = get_cmd_path("iptables");
+  if (path && path[0])
+    snprintf(nat_iptables, sizeof(nat_iptables), "%s", path);
+  free(path);
+  snprintf(uplink_iface, sizeof(uplink_iface), "%s", iface);
+  get_iface_ipv4(uplink_iface, uplink_addr, sizeof(uplink_addr));
+  nat_installed = 1;
+}
+
+// nat IFACE: install the NAT and forward rules the engine uses for IFACE.
+int cmd_nat(int argc, char **argv) {
+  if (argc != 1)
+    return 2;
+  adopt_nat(argv[0]);
+  char rule[160];
+  for (int i = 0; i < NAT_RULES; i++) {
+    format_nat_rule(i, uplink_iface, rule, sizeof(rule));
+    if (ensure_iptables_rule(nat_iptables, i == 0 ? "nat" : "filter",
+                             rule) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+// switch IFACE NMCLI: run the engine's failover from uplink IFACE, whose
+// NAT rules are in place. NMCLI is run through sudo; the queries go to the
+// nmcli first on PATH.
+int cmd_switch(int argc, char **argv) {
+  if (argc != 2)
+    return 2;
+  adopt_nat(argv[0]);
+  int status = auto_switch_wifi(argv[1]);
+  printf("switch %s uplink %s\n", status == 0 ? "ok" : "failed",
+         uplink_iface);
+  return status;
+}
+
+// fastpath IFACE: the nftables flowtable over ap0 and uplink IFACE.
+int cmd_fastpath(int argc, char **argv) {
+  if (argc != 1)
+    return 2;
+  return install_flowtable(argv[0]);
+}
+
+// shaper IFACE: the engine's shaping stage with IFACE as the uplink. Set
+// shaper_down_kbit and shaper_up_kbit to skip measuring the uplink.
+int cmd_shaper(int argc, char **argv) {
+  if (argc != 1)
+    return 2;
+  snprintf(uplink_iface, sizeof(uplink_iface), "%s", argv[0]);
+  return setup_traffic_shaping();
+}
+
+// ratelimits: rebuild the per-client caps from RATE_LIMIT_FILE, as the
+// Client Rate Limits screen does.
+int cmd_ratelimits(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  printf("capped %d\n", apply_client_rate_limits());
+  return 0;
+}
+
+// bpfacct: attach the per-client accounting programs to ap0.
+int cmd_bpfacct(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  return setup_bpf_accounting();
+}
+
+// clients: the per-client counters, one client per line.
+int cmd_clients(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  static ClientStats stats[MAX_CLIENTS];
+  int n = read_client_stats(stats, MAX_CLIENTS);
+  for (int i = 0; i < n; i++) {
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &stats[i].addr, addr, sizeof(addr));
+    printf("client %s up_packets %llu up_bytes %llu down_packets %llu "
+           "down_bytes %llu\n",
+           addr, stats[i].counters.up_packets, stats[i].counters.up_bytes,
+           stats[i].counters.down_packets, stats[i].counters.down_bytes);
+  }
+  return n < 0;
+}
+
+// bpfdrop ADDR: put client ADDR on the drop list.
+int cmd_bpfdrop(int argc, char **argv) {
+  if (argc != 1)
+    return 2;
+  unsigned int addr;
+  unsigned char one = 1;
+  if (inet_pton(AF_INET, argv[0], &addr) != 1)
+    return 2;
+  int fd = bpf_obj_get(BPF_PIN_DIR "/drops");
+  if (fd < 0)
+    return 1;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = fd;
+  attr.key = (unsigned long)&addr;
+  attr.value = (unsigned long)&one;
+  int status = sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0;
+  close(fd);
+  return status;
+}
+
+// ctpressure: one conntrack pressure check, then the table state.
+int cmd_ctpressure(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  check_conntrack_pressure();
+  if (ct_stats.max <= 0)
+    return 1;
+  printf("entries %ld max %ld buckets %ld early_drop %llu drop %llu "
+         "resizes %llu\n",
+         ct_stats.count, ct_stats.max, ct_stats.buckets, ct_stats.early_drop,
+         ct_stats.drop, ct_stats.resizes);
+  return 0;
+}
+
+// The settings cmd_options() reports back, a number or a string.
+typedef struct {
+  const char *key;
+  int *value;
+  const char *text;
+} KnownOption;
+
+const KnownOption known_options[] = {
+    {"ct_watermark", &opts.ct_watermark},
+    {"ct_max_limit", &opts.ct_max_limit},
+    {"dns_cache_size", &opts.dns_cache_size},
+    {"dns_min_ttl", &opts.dns_min_ttl},
+    {"acs_interval", &opts.acs_interval},
+    {"bssid", NULL, opts.bssid},
+    {"check_interval", &opts.check_interval},
+    {"ipv6_prefix", NULL, opts.ipv6_prefix},
+    {"uplink_mtu", &opts.uplink_mtu},
+};
+
+// options KEY=VALUE...: apply each setting as OPTIONS_FILE would and print
+// whether it was taken and the value the engine holds afterwards.
+int cmd_options(int argc, char **argv) {
+  if (argc < 1)
+    return 2;
+  for (int i = 0; i < argc; i++) {
+    char *eq = strchr(argv[i], '=');
+    if (!eq)
+      return 2;
+    *eq = '\0';
+    int status = set_hotspot_option(argv[i], eq + 1);
+    printf("%s=%s %s", argv[i], eq + 1, status ? "rejected" : "ok");
+    for (size_t k = 0; k < sizeof(known_options) / sizeof(known_options[0]);
+         k++) {
+      const KnownOption *known = &known_options[k];
+      if (strcmp(argv[i], known->key) != 0)
+        continue;
+      if (known->value)
+        printf(" now %d", *known->value);
+      else
+        printf(" now '%s'", known->text);
+    }
+    putchar('\n');
+  }
+  return 0;
+}
+
+// addrplan: the AP address and DHCP pool the options give.
+int cmd_addrplan(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  char err[160];
+  if (validate_net_config(err, sizeof(err)) != 0) {
+    fprintf(stderr, "%s\n", err);
+    return 1;
+  }
+  printf("ap %s range %s pool %d\n", ap_cidr, dhcp_range, dhcp_pool_size);
+  return 0;
+}
+
+// dnsstats: the engine's dnsmasq statistics, one line per upstream after
+// the cache counters.
+int cmd_dnsstats(int argc, char **argv) {
+  if (argc != 0 || cmd_addrplan(0, NULL) != 0)
+    return argc != 0 ? 2 : 1;
+  collect_dns_stats();
+  if (!dns_stats.valid)
+    return 1;
+  printf("cache_size %llu hits %llu misses %llu evictions %llu\n",
+         dns_stats.cache_size, dns_stats.hits, dns_stats.misses,
+         dns_stats.evictions);
+  for (int i = 0; i < dns_stats.upstream_count; i++)
+    printf("upstream %s queries %llu rtt_ms %.2f\n",
+           dns_stats.upstreams[i].server, dns_stats.upstreams[i].queries,
+           dns_stats.upstreams[i].rtt_ms);
+  return 0;
+}
+
+// dhcpd: start the built-in DHCP server on ap0 and print its PID. It keeps
+// running after the harness exits.
+int cmd_dhcpd(int argc, char **argv) {
+  if (argc != 0 || cmd_addrplan(0, NULL) != 0)
+    return argc != 0 ? 2 : 1;
+  if (start_builtin_dhcp() != 0)
+    return 1;
+  printf("dhcpd %d\n", dhcpd_pid);
+  return 0;
+}
+
+// Feed the built-in server one client message. Replies go nowhere.
+void lease_message(DhcpServer *srv, int type, int client, unsigned int addr,
+                   unsigned int server) {
+  unsigned char pkt[300] = {0};
+  pkt[0] = 1;
+  pkt[1] = 1;
+  pkt[2] = 6;
+  pkt[33] = client; // chaddr 00:00:00:00:00:client
+  memcpy(pkt + 236, "\x63\x82\x53\x63", 4);
+  unsigned char opts[] = {53, 1, type, 50, 4, 0, 0, 0, 0,
+                          54, 4, 0, 0, 0, 0, 255};
+  memcpy(opts + 5, &addr, 4);
+  memcpy(opts + 11, &server, 4);
+  memcpy(pkt + 240, opts, sizeof(opts));
+  dhcp_handle(srv, -1, pkt, sizeof(pkt));
+}
+
+// leasecheck: a client that declined an address and moved to another must
+// stay indexed when a second client takes over the expired declined record,
+// through DISCOVER and through REQUEST.
+int cmd_leasecheck(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  int failed = 0;
+  for (int via_request = 0; via_request < 2; via_request++) {
+    unlink(BUILTIN_LEASE_FILE);
+    DhcpServer srv = {0};
+    unsigned int start = 0xc0a80402, server = htonl(0xc0a80401);
+    if (dhcp_server_init(&srv, start, 16) != 0)
+      return 1;
+    srv.server = server;
+    srv.lease_secs = 3600;
+    unsigned char a[6] = {0, 0, 0, 0, 0, 1};
+    lease_message(&srv, DHCP_DISCOVER, 1, 0, 0);
+    int declined = lease_index_find(&srv, a);
+    unsigned int declined_addr = htonl(start + declined);
+    lease_message(&srv, DHCP_REQUEST, 1, declined_addr, server);
+    lease_message(&srv, DHCP_DECLINE, 1, declined_addr, server);
+    lease_message(&srv, DHCP_DISCOVER, 1, 0, 0);
+    int moved = lease_index_find(&srv, a);
+    lease_message(&srv, DHCP_REQUEST, 1, htonl(start + moved), server);
+    // The quarantine runs out; client 2 asks for that address.
+    LeaseRecord *rec = &srv.records[declined];
+    lease_store(rec, rec->mac, LEASE_DECLINED, time(NULL) - 1);
+    if (via_request)
+      lease_message(&srv, DHCP_REQUEST, 2, declined_addr, 0);
+    else
+      lease_message(&srv, DHCP_DISCOVER, 2, declined_addr, 0);
+    int found = lease_index_find(&srv, a);
+    printf("%s: client 1 holds record %d, index says %d\n",
+           via_request ? "request" : "discover", moved, found);
+    failed |= moved == declined || found != moved;
+    munmap(srv.header, srv.map_len);
+    free(srv.index);
+  }
+  unlink(BUILTIN_LEASE_FILE);
+  return failed;
+}
+
+// radio IW IFACE: probe the radio behind IFACE with IW and print the plan
+// and the hostapd lines generated for it.
+int cmd_radio(int argc, char **argv) {
+  if (argc != 2)
+    return 2;
+  RadioPlan plan;
+  if (probe_radio(argv[0], argv[1], &plan) != 0)
+    return 1;
+  char radio[1024];
+  format_radio_config(&plan, radio, sizeof(radio));
+  printf("# channel %d width %d center %d radar %d\n%s", plan.channel,
+         plan.width, plan.center_channel, plan.radar, radio);
+  return 0;
+}
+
+// acs IW DEV: score DEV's channels from IW's scan and survey dump and print
+// the one automatic channel selection picks.
+int cmd_acs(int argc, char **argv) {
+  if (argc != 2)
+    return 2;
+  RadioPlan plan;
+  double best, current;
+  if (acs_select(argv[0], argv[1], 0, &plan, &best, &current) != 0)
+    return 1;
+  printf("channel %d width %d center %d\n", plan.channel, plan.width,
+         plan.center_channel);
+  return 0;
+}
+
+// apconf PARENT SSID PASS: write HOSTAPD_CONF for an AP on channel 1 of
+// PARENT's phy with the BSSID the engine derives, and print the BSSID.
+int cmd_apconf(int argc, char **argv) {
+  if (argc != 3)
+    return 2;
+  char *iw_path = get_cmd_path("iw");
+  if (!iw_path || !iw_path[0])
+    return 1;
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "%s phy phy%d info", iw_path,
+           iface_wiphy(iw_path, argv[0]));
+  char *phy_info = exec_cmd(cmd);
+  RadioPlan plan = {.channel = 1, .freq = 2412, .width = 20,
+                    .center_channel = 1};
+  fit_radio_plan(&plan, phy_info, NULL);
+  derive_bssid(argv[0], argv[1], ap_bssid, sizeof(ap_bssid));
+  int status = write_hostapd_config(argv[1], argv[2], ap_bssid, &plan);
+  printf("bssid %s ft %d\n", ap_bssid, plan.ft);
+  free(phy_info);
+  free(iw_path);
+  return status;
+}
+
+// dnsmasqstop: roll back a journal holding only the dnsmasq step and print
+// how long it took.
+int cmd_dnsmasqstop(int argc, char **argv) {
+  if (argc != 0)
+    return 2;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  journal_owner = getpid();
+  journal_step(UNDO_DNSMASQ);
+  rollback_journal();
+  printf("stopped_ms %.0f\n", elapsed_seconds(&start) * 1000);
+  return 0;
+}
+
+// teardown UPLINK: apply the steps of a startup the way the engine does,
+// with ap0 and UPLINK made by the caller: a hostapd that ignores SIGTERM,
+// the dnsmasq named by DNSMASQ_PID_FILE, ip_forward, the NAT and forward
+// rules and the shapers. Prints "applied" (after "shaper failed" when no
+// shaper could be installed), then on SIGTERM rolls the journal back and
+// prints how long it took.
+int cmd_teardown(int argc, char **argv) {
+  if (argc != 1)
+    return 2;
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  journal_owner = getpid();
+  journal_step(UNDO_AP_IFACE);
+  hostapd_pid = fork();
+  if (hostapd_pid == 0) {
+    signal(SIGTERM, SIG_IGN);
+    for (;;)
+      pause();
+  }
+  journal_step(UNDO_HOSTAPD);
+  journal_step(UNDO_DNSMASQ);
+  char *forwarding = read_text_file("/proc/sys/net/ipv4/ip_forward");
+  if (forwarding && forwarding[0] == '0')
+    journal_step(UNDO_IP_FORWARD);
+  free(forwarding);
+  run_cmd("sudo sysctl -qw net.ipv4.ip_forward=1");
+  if (cmd_nat(1, argv) != 0)
+    return 1;
+  journal_step(UNDO_NAT);
+  journal_step(UNDO_SHAPER);
+  if (setup_traffic_shaping() != 0)
+    printf("shaper failed\n");
+  printf("applied\n");
+  fflush(stdout);
+  int sig;
+  sigwait(&mask, &sig);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  rollback_journal();
+  printf("rollback_ms %.0f\n", elapsed_seconds(&start) * 1000);
+  return 0;
+}
+
+// profile PATH NAME: load profile NAME from PATH, through the compiled
+// cache, starting from the defaults with the -o options applied.
+int cmd_profile(int argc, char **argv) {
+  if (argc != 2)
+    return 2;
+  HotspotOptions defaults = opts;
+  HotspotProfile profile;
+  if (load_profile(argv[0], argv[1], &defaults, &profile) != 0)
+    return 1;
+  printf("profile %s ssid %s psk_len %zu check_interval %d subnet %s\n",
+         profile.name, profile.ssid, strlen(profile.psk),
+         profile.opts.check_interval, profile.opts.subnet);
+  return 0;
+}
+
+// mssclamp IPTABLES MTU: clamp the MSS for a path MTU of MTU with IPTABLES,
+// and with the ip6tables on PATH as when ap0 has an IPv6 address, then roll
+// the step back.
+int cmd_mssclamp(int argc, char **argv) {
+  if (argc != 2)
+    return 2;
+  lan_mtu = atoi(argv[1]);
+  snprintf(ap_ipv6_addr, sizeof(ap_ipv6_addr), "2001:db8::1");
+  apply_mss_clamp(argv[0]);
+  printf("mss %d\n", clamp_mss);
+  undo_step(UNDO_MSS_CLAMP);
+  return 0;
+}
+
+// speedtest ADDR: start the speed test server on ADDR and print its PID.
+int cmd_speedtest(int argc, char **argv) {
+  if (argc != 1)
+    return 2;
+  snprintf(ap_addr, sizeof(ap_addr), "%s", argv[0]);
+  if (start_speedtest_server() != 0) {
+    perror("speed test server");
+    return 1;
+  }
+  printf("speedtest %d\n", speedtest_pid);
+  return 0;
+}
+
+// cputune UPLINK [warm]: spread forwarding between ap0 and UPLINK over the
+// CPUs as cpu_tuning=on does and save the engine state. With warm, first
+// take over what STATE_FILE and TUNING_FILE hold as a warm restart does.
+// Prints "tuned FILES", then restores every file on SIGTERM.
+int cmd_cputune(int argc, char **argv) {
+  if (argc < 1 || argc > 2 || (argc == 2 && strcmp(argv[1], "warm") != 0))
+    return 2;
+  snprintf(uplink_iface, sizeof(uplink_iface), "%s", argv[0]);
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  EngineState prev;
+  if (argc == 2 && load_engine_state(&prev) == 0 &&
+      (prev.journal & (1u << UNDO_CPU_TUNING)))
+    load_tuned_files();
+  apply_cpu_tuning();
+  journal_step(UNDO_CPU_TUNING);
+  RadioPlan plan = {0};
+  save_engine_state(&plan);
+  printf("tuned %d\n", n_tuned_files);
+  fflush(stdout);
+  int sig;
+  sigwait(&mask, &sig);
+  undo_step(UNDO_CPU_TUNING);
+  printf("restored\n");
+  return 0;
+}
+
+// ipv6 UPLINK [warm]: give ap0 an address for the ipv6 option and forward
+// IPv6 to UPLINK the way the engine does, starting the NDP proxy for
+// ipv6=proxy, and save the engine state. With warm, first take over what
+// STATE_FILE holds as a warm restart does. Prints "ap6 ADDR proxy PID",
+// then undoes both steps on SIGTERM.
+int cmd_ipv6(int argc, char **argv) {
+  if (argc < 1 || argc > 2 || (argc == 2 && strcmp(argv[1], "warm") != 0))
+    return 2;
+  FILE *fp = fopen("/sys/class/net/" AP_IFACE "/address", "r");
+  if (!fp || !fgets(ap_bssid, sizeof(ap_bssid), fp))
+    return 1;
+  fclose(fp);
+  snprintf(uplink_iface, sizeof(uplink_iface), "%s", argv[0]);
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  EngineState prev;
+  if (argc == 2 && load_engine_state(&prev) == 0 &&
+      (prev.journal & (1u << UNDO_IPV6)))
+    adopt_ipv6_state(&prev);
+  if (setup_ipv6_address() != 0)
+    return 1;
+  setup_ipv6_forwarding();
+  journal_step(UNDO_IPV6);
+  RadioPlan plan = {0};
+  save_engine_state(&plan);
+  printf("ap6 %s proxy %d\n", ap_ipv6_addr, ndp_proxy_pid);
+  fflush(stdout);
+  int sig;
+  sigwait(&mask, &sig);
+  undo_step(UNDO_NDP_PROXY);
+  waitpid(ndp_proxy_pid, NULL, 0);
+  undo_step(UNDO_IPV6);
+  printf("undone\n");
+  return 0;
+}
+
+// trace CMD...: run each CMD through exec_cmd() and run_cmd() and print its
+// status and output, escaped onto one line. Under HSC_TRACE_RECORD the
+// runs are recorded; under HSC_TRACE_REPLAY the same output must come back.
+int cmd_trace(int argc, char **argv) {
+  if (argc < 1)
+    return 2;
+  for (int i = 0; i < argc; i++) {
+    char *output = exec_cmd(argv[i]);
+    char quiet[512];
+    snprintf(quiet, sizeof(quiet), "%s >/dev/null", argv[i]);
+    int status = run_cmd(quiet);
+    size_t len = output ? strlen(output) : 0;
+    printf("status %d bytes %zu output ", WEXITSTATUS(status), len);
+    for (size_t k = 0; k < len; k++) {
+      unsigned char c = output[k];
+      if (c == '\n')
+        printf("\\n");
+      else if (c == '\\')
+        printf("\\\\");
+      else if (c < 0x20 || c > 0x7e)
+        printf("\\x%02x", c);
+      else
+        putchar(c);
+    }
+    putchar('\n');
+    free(output);
+  }
+  return 0;
+}
+
+// tracebench ITERATIONS: replay the whole trace in HSC_TRACE_REPLAY,
+// command by command through exec_cmd(), ITERATIONS times.
+int cmd_tracebench(int argc, char **argv) {
+  if (argc != 1 || atoi(argv[0]) < 1)
+    return 2;
+  int iterations = atoi(argv[0]);
+  trace_init();
+  if (trace_mode != TRACE_REPLAY || trace_count == 0) {
+    fprintf(stderr, "Set HSC_TRACE_REPLAY to a recorded trace.\n");
+    return 1;
+  }
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int n = 0; n < iterations; n++)
+    for (int i = 0; i < trace_count; i++)
+      free(exec_cmd(trace_records[i].cmd));
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("iterations %d commands %d per_s %.0f\n", iterations, trace_count,
+         iterations / secs);
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  int (*run)(int argc, char **argv);
+  const char *args;
+} HarnessCommand;
+
+const HarnessCommand commands[] = {
+    {"nat", cmd_nat, "IFACE"},
+    {"switch", cmd_switch, "IFACE NMCLI"},
+    {"fastpath", cmd_fastpath, "IFACE"},
+    {"shaper", cmd_shaper, "IFACE"},
+    {"ratelimits", cmd_ratelimits, ""},
+    {"bpfacct", cmd_bpfacct, ""},
+    {"clients", cmd_clients, ""},
+    {"bpfdrop", cmd_bpfdrop, "ADDR"},
+    {"ctpressure", cmd_ctpressure, ""},
+    {"options", cmd_options, "KEY=VALUE..."},
+    {"addrplan", cmd_addrplan, ""},
+    {"dhcpd", cmd_dhcpd, ""},
+    {"dnsstats", cmd_dnsstats, ""},
+    {"leasecheck", cmd_leasecheck, ""},
+    {"radio", cmd_radio, "IW IFACE"},
+    {"acs", cmd_acs, "IW DEV"},
+    {"apconf", cmd_apconf, "PARENT SSID PASS"},
+    {"dnsmasqstop", cmd_dnsmasqstop, ""},
+    {"teardown", cmd_teardown, "UPLINK"},
+    {"profile", cmd_profile, "PATH NAME"},
+    {"mssclamp", cmd_mssclamp, "IPTABLES MTU"},
+    {"ipv6", cmd_ipv6, "UPLINK [warm]"},
+    {"cputune", cmd_cputune, "UPLINK [warm]"},
+    {"speedtest", cmd_speedtest, "ADDR"},
+    {"trace", cmd_trace, "CMD..."},
+    {"tracebench", cmd_tracebench, "ITERATIONS"},
+};
+
+int main(int argc, char *argv[]) {
+  int i = 1;
+  for (; i + 1 < argc && strcmp(argv[i], "-o") == 0; i += 2) {
+    char *eq = strchr(argv[i + 1], '=');
+    if (!eq) {
+      fprintf(stderr, "Option %s is not key=value.\n", argv[i + 1]);
+      return 2;
+    }
+    *eq = '\0';
+    if (set_hotspot_option(argv[i + 1], eq + 1) != 0) {
+      fprintf(stderr, "Invalid option %s=%s.\n", argv[i + 1], eq + 1);
+      return 2;
+    }
+  }
+  for (size_t c = 0; i < argc && c < sizeof(commands) / sizeof(commands[0]);
+       c++)
+    if (strcmp(argv[i], commands[c].name) == 0) {
+      int status = commands[c].run(argc - i - 1, argv + i + 1);
+      if (status == 2)
+        fprintf(stderr, "Usage: %s %s %s\n", argv[0], commands[c].name,
+                commands[c].args);
+      return status;
+    }
+  fprintf(stderr, "Usage: %s [-o key=value]... COMMAND [ARGS]\n", argv[0]);
+  for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++)
+    fprintf(stderr, "  %s %s\n", commands[c].name, commands[c].args);
+  return 2;
+}
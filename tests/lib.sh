@@ -0,0 +1,143 @@
+# Helpers shared by the hotspot tests and benchmarks. A test is a bash
+# script that sources this file, prints what it measured and exits 0 when
+# it passed, 1 when it failed and 77 when it was skipped (no root, or a
+# kernel feature or tool it needs is missing).
+
+set -u
+
+# The engine keeps its files (options, rate limits, leases, metrics) at
+# fixed paths in /tmp. A test that makes it write them sets PRIVATE_TMP=1
+# before sourcing this file and runs in its own mount namespace, where /tmp
+# is an empty tmpfs.
+if [ "${PRIVATE_TMP:-0}" = 1 ] && [ -z "${HS_PRIVATE_TMP_DONE:-}" ]; then
+  [ "$(id -u)" = 0 ] || { echo "SKIP: needs root"; exit 77; }
+  exec unshare -m env HS_PRIVATE_TMP_DONE=1 bash -c \
+    'mount --make-rprivate / && mount -t tmpfs tmpfs /tmp && exec bash "$@"' \
+    bash "$0" "$@"
+fi
+
+TESTS_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+REPO_DIR=$(dirname "$TESTS_DIR")
+FIXTURES="$TESTS_DIR/fixtures"
+WORK=$(mktemp -d /tmp/hotspot-test.XXXXXX)
+NETNS_LIST=""
+FAILED=0
+
+skip() {
+  echo "SKIP: $*"
+  exit 77
+}
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+# Record a failed check but keep going, so one run reports every regression.
+check_failed() {
+  echo "FAIL: $*"
+  FAILED=1
+}
+
+finish() {
+  [ "$FAILED" = 0 ] || exit 1
+  echo "PASS"
+  exit 0
+}
+
+need_root() {
+  [ "$(id -u)" = 0 ] || skip "needs root"
+}
+
+need_cmd() {
+  local c
+  for c in "$@"; do
+    command -v "$c" >/dev/null 2>&1 || skip "$c is not installed"
+  done
+}
+
+# The engine runs privileged commands through sudo. As root a missing sudo
+# can be replaced by a shim that runs the command as is.
+provide_sudo() {
+  mkdir -p "$WORK/bin"
+  if ! command -v sudo >/dev/null 2>&1; then
+    printf '#!/bin/sh\nexec "$@"\n' >"$WORK/bin/sudo"
+    chmod +x "$WORK/bin/sudo"
+  fi
+  PATH="$WORK/bin:$PATH"
+}
+
+# Threshold NAME with a default, overridable from the environment so a
+# slower machine can relax it without editing the test.
+threshold() {
+  local value
+  eval "value=\${$1:-$2}"
+  echo "$value"
+}
+
+# Compare a measurement with its limit: check VALUE '<' LIMIT or '>' LIMIT.
+check() {
+  local name=$1 value=$2 op=$3 limit=$4
+  echo "$name: $value (limit $op $limit)"
+  if ! awk -v v="$value" -v l="$limit" -v op="$op" \
+    'BEGIN { exit !(op == "<" ? v + 0 < l + 0 : v + 0 > l + 0) }'; then
+    check_failed "$name $value is not $op $limit"
+  fi
+}
+
+# Print "busy softirq" jiffies summed over all CPUs, from /proc/stat.
+cpu_jiffies() {
+  awk '$1 == "cpu" { print $2 + $3 + $4 + $7 + $8, $8 }' /proc/stat
+}
+
+# Build a C helper from tests/NAME.c into $WORK/NAME.
+build() {
+  local name=$1
+  shift
+  cc -O2 -Wall -o "$WORK/$name" "$TESTS_DIR/$name.c" "$@" ||
+    fail "cannot build $name"
+}
+
+# --- Network namespaces ---
+
+# Create namespaces hs-NAME with loopback up. Leftovers of an aborted run
+# are removed first.
+add_netns() {
+  local n
+  for n in "$@"; do
+    ip netns del "hs-$n" 2>/dev/null
+    ip netns add "hs-$n" || skip "cannot create network namespaces"
+    ip -n "hs-$n" link set lo up
+    NETNS_LIST="$NETNS_LIST hs-$n"
+  done
+}
+
+# Run a command in namespace hs-NAME.
+in_ns() {
+  local n=$1
+  shift
+  ip netns exec "hs-$n" "$@"
+}
+
+# Connect IF_A in hs-A and IF_B in hs-B with a veth pair and bring both up.
+# Extra arguments go to "ip link add", e.g. numrxqueues 4.
+add_veth() {
+  local a=$1 if_a=$2 b=$3 if_b=$4
+  shift 4
+  ip link add "$if_a" netns "hs-$a" "$@" type veth peer name "$if_b" \
+    netns "hs-$b" || fail "cannot create veth $if_a-$if_b"
+  ip -n "hs-$a" link set "$if_a" up
+  ip -n "hs-$b" link set "$if_b" up
+}
+
+cleanup() {
+  local n
+  jobs -p | xargs -r kill 2>/dev/null
+  wait 2>/dev/null
+  for n in $NETNS_LIST; do
+    ip netns pids "$n" 2>/dev/null | xargs -r kill 2>/dev/null
+    ip netns del "$n" 2>/dev/null
+  done
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
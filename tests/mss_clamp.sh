@@ -0,0 +1,49 @@
+#!/bin/bash
+# The TCPMSS rules are removed with the same iptables and ip6tables they
+# were added with. The engine is given an iptables outside PATH, as when
+# it picked iptables-legacy, and a different iptables that only logs comes
+# first on PATH. Every -D must go to the binary of the matching -A, for
+# both directions through ap0 and both address families, and nothing may
+# reach the decoy.
+. "$(dirname "$0")/lib.sh"
+
+build hsc-harness
+mkdir -p "$WORK/bin" "$WORK/alt"
+printf '#!/bin/sh\nexec "$@"\n' >"$WORK/bin/sudo"
+# stand_in PATH: an iptables that logs its calls and holds no rules.
+stand_in() {
+  cat >"$1" <<STUB
+#!/bin/sh
+echo "\$(basename "\$0") \$*" >>"$WORK/calls"
+case " \$* " in
+*" -C "*) exit 1 ;;
+esac
+exit 0
+STUB
+  chmod +x "$1"
+}
+stand_in "$WORK/alt/iptables-legacy"
+stand_in "$WORK/bin/ip6tables"
+stand_in "$WORK/bin/iptables"
+chmod +x "$WORK/bin/sudo"
+PATH="$WORK/bin:$PATH"
+
+"$WORK/hsc-harness" mssclamp "$WORK/alt/iptables-legacy" 1400 >"$WORK/out" ||
+  fail "mssclamp failed"
+echo "$(cat "$WORK/out"), $(wc -l <"$WORK/calls") iptables calls"
+grep -q "^mss 1360$" "$WORK/out" || check_failed "no clamp to 1360"
+grep "^iptables " "$WORK/calls" &&
+  check_failed "the iptables on PATH was called"
+for bin in iptables-legacy ip6tables; do
+  mss=1360
+  [ $bin = ip6tables ] && mss=1340
+  for dir in -i -o; do
+    rule="FORWARD $dir ap0 -p tcp --tcp-flags SYN,RST SYN -j TCPMSS"
+    rule="$rule --set-mss $mss"
+    grep -qxF -- "$bin -t mangle -A $rule" "$WORK/calls" ||
+      check_failed "$bin did not add: $rule"
+    grep -qxF -- "$bin -w -t mangle -D $rule" "$WORK/calls" ||
+      check_failed "$bin did not delete: $rule"
+  done
+done
+finish
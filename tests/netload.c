@@ -0,0 +1,668 @@
+// Traffic generator for the namespace tests, so they need no iperf3 or
+// ping. Each subcommand prints one line of "key value" pairs that the test
+// scripts pick apart with awk.
+#define _GNU_SOURCE // struct in6_pktinfo
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int parse_addr(const char *host, int port, struct sockaddr_in *sa) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &sa->sin_addr) != 1) {
+    fprintf(stderr, "Bad IPv4 address %s.\n", host);
+    return 1;
+  }
+  return 0;
+}
+
+// An IPv4 or IPv6 socket address, for the subcommands that take either.
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+} SockAddr;
+
+// Parse host as an IPv6 address when it has a colon, else as IPv4, and
+// return the length of the socket address or 0.
+socklen_t parse_sockaddr(const char *host, int port, SockAddr *a) {
+  if (!strchr(host, ':'))
+    return parse_addr(host, port, &a->in) == 0 ? sizeof(a->in) : 0;
+  memset(a, 0, sizeof(*a));
+  a->in6.sin6_family = AF_INET6;
+  a->in6.sin6_port = htons(port);
+  if (inet_pton(AF_INET6, host, &a->in6.sin6_addr) != 1) {
+    fprintf(stderr, "Bad IPv6 address %s.\n", host);
+    return 0;
+  }
+  return sizeof(a->in6);
+}
+
+// udp-send HOST PORT SECONDS INTERVAL_US: a numbered datagram every
+// INTERVAL_US. Send errors (no route during a switch) count as sent.
+int udp_send(const char *host, int port, double seconds, int interval_us) {
+  struct sockaddr_in to;
+  if (parse_addr(host, port, &to) != 0)
+    return 1;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  unsigned int seq = 0;
+  double start = now_ms(), next = start;
+  while (now_ms() - start < seconds * 1000) {
+    unsigned int n = htonl(seq++);
+    sendto(sock, &n, sizeof(n), 0, (struct sockaddr *)&to, sizeof(to));
+    next += interval_us / 1000.0;
+    double wait = next - now_ms();
+    if (wait > 0)
+      usleep(wait * 1000);
+  }
+  printf("sent %u\n", seq);
+  return 0;
+}
+
+// udp-recv PORT SECONDS: count the datagrams of udp-send and report the
+// longest silence between two of them once traffic has started.
+int udp_recv(int port, double seconds) {
+  struct sockaddr_in addr;
+  if (parse_addr("0.0.0.0", port, &addr) != 0)
+    return 1;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("udp-recv");
+    return 1;
+  }
+  unsigned int received = 0, highest = 0;
+  double start = now_ms(), last = -1, max_gap = 0;
+  struct pollfd pfd = {sock, POLLIN, 0};
+  while (now_ms() - start < seconds * 1000) {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    unsigned int n;
+    if (recv(sock, &n, sizeof(n), 0) != sizeof(n))
+      continue;
+    double t = now_ms();
+    if (last >= 0 && t - last > max_gap)
+      max_gap = t - last;
+    last = t;
+    received++;
+    if (ntohl(n) > highest)
+      highest = ntohl(n);
+  }
+  printf("received %u lost %u max_gap_ms %.1f\n", received,
+         received ? highest + 1 - received : 0, max_gap);
+  return received == 0;
+}
+
+// udp-flood HOST PORT FLOWS: one datagram from each of FLOWS fresh source
+// ports, so every one is a new conntrack entry.
+int udp_flood(const char *host, int port, int flows) {
+  struct sockaddr_in to;
+  if (parse_addr(host, port, &to) != 0)
+    return 1;
+  int sent = 0;
+  for (int i = 0; i < flows; i++) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+      perror("socket");
+      return 1;
+    }
+    unsigned int n = htonl(i);
+    if (sendto(sock, &n, sizeof(n), 0, (struct sockaddr *)&to, sizeof(to)) ==
+        sizeof(n))
+      sent++;
+    close(sock);
+  }
+  printf("sent %d\n", sent);
+  return 0;
+}
+
+// Bind sock to source address src (NULL or "" for any).
+int bind_source(int sock, const char *src) {
+  SockAddr sa;
+  socklen_t len;
+  if (!src || !src[0])
+    return 0;
+  if (!(len = parse_sockaddr(src, 0, &sa)) || bind(sock, &sa.sa, len) != 0) {
+    perror("bind source");
+    return 1;
+  }
+  return 0;
+}
+
+// Serve one bulk connection: after a 'D' send zeros until the client
+// closes, after a 'U' discard what it sends.
+void serve_bulk(int sock) {
+  char buf[65536], dir;
+  if (recv(sock, &dir, 1, 0) != 1)
+    _exit(1);
+  memset(buf, 0, sizeof(buf));
+  if (dir == 'D')
+    while (send(sock, buf, sizeof(buf), MSG_NOSIGNAL) > 0)
+      ;
+  else
+    while (recv(sock, buf, sizeof(buf), 0) > 0)
+      ;
+  _exit(0);
+}
+
+// Send a datagram back from the address it was sent to, which need not be
+// the one the route back would pick.
+void echo_datagram(int udp) {
+  char buf[2048], ctl[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+  SockAddr from;
+  struct iovec iov = {buf, sizeof(buf)};
+  struct msghdr msg = {&from, sizeof(from), &iov, 1, ctl, sizeof(ctl), 0};
+  ssize_t n = recvmsg(udp, &msg, 0);
+  if (n <= 0)
+    return;
+  iov.iov_len = n;
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (c && c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+    struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(c);
+    info->ipi_spec_dst = info->ipi_addr;
+    info->ipi_ifindex = 0;
+  } else if (c && c->cmsg_level == IPPROTO_IPV6 &&
+             c->cmsg_type == IPV6_PKTINFO) {
+    // ipi6_addr, the address it was sent to, becomes the source.
+    ((struct in6_pktinfo *)CMSG_DATA(c))->ipi6_ifindex = 0;
+  }
+  sendmsg(udp, &msg, 0);
+}
+
+// serve PORT: bulk TCP server (a child per connection) and UDP echo on the
+// same port, over IPv4 and IPv6, until killed.
+int serve(int port) {
+  const char *any[2] = {"0.0.0.0", "::"};
+  struct pollfd pfd[4];
+  int one = 1;
+  for (int f = 0; f < 2; f++) {
+    SockAddr addr;
+    socklen_t len = parse_sockaddr(any[f], port, &addr);
+    int tcp = socket(addr.sa.sa_family, SOCK_STREAM, 0);
+    int udp = socket(addr.sa.sa_family, SOCK_DGRAM, 0);
+    setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (f == 1) {
+      setsockopt(tcp, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+      setsockopt(udp, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    }
+    if (tcp < 0 || udp < 0 || bind(tcp, &addr.sa, len) != 0 ||
+        bind(udp, &addr.sa, len) != 0 || listen(tcp, 64) != 0) {
+      perror("serve");
+      return 1;
+    }
+    if (f == 0)
+      setsockopt(udp, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+    else
+      setsockopt(udp, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+    pfd[f * 2] = (struct pollfd){tcp, POLLIN, 0};
+    pfd[f * 2 + 1] = (struct pollfd){udp, POLLIN, 0};
+  }
+  signal(SIGCHLD, SIG_IGN);
+  while (poll(pfd, 4, -1) >= 0) {
+    for (int f = 0; f < 2; f++) {
+      if (pfd[f * 2].revents & POLLIN) {
+        int conn = accept(pfd[f * 2].fd, NULL, NULL);
+        if (conn >= 0 && fork() == 0) {
+          close(pfd[f * 2].fd);
+          serve_bulk(conn);
+        }
+        if (conn >= 0)
+          close(conn);
+      }
+      if (pfd[f * 2 + 1].revents & POLLIN)
+        echo_datagram(pfd[f * 2 + 1].fd);
+    }
+  }
+  return 1;
+}
+
+// bulk HOST PORT down|up SECONDS STREAMS [SRC]: saturate the path with
+// STREAMS connections to serve and report the goodput in Mbit/s. The first
+// second, while the windows open, is not counted.
+int bulk(const char *host, int port, const char *dir, double seconds,
+         int streams, const char *src) {
+  SockAddr to;
+  socklen_t to_len = parse_sockaddr(host, port, &to);
+  if (!to_len || streams < 1 || streams > 64)
+    return 1;
+  int down = strcmp(dir, "down") == 0;
+  struct pollfd pfd[64];
+  for (int i = 0; i < streams; i++) {
+    int sock = socket(to.sa.sa_family, SOCK_STREAM, 0);
+    if (sock < 0 || bind_source(sock, src) != 0 ||
+        connect(sock, &to.sa, to_len) != 0 ||
+        send(sock, down ? "D" : "U", 1, 0) != 1) {
+      perror("bulk connect");
+      return 1;
+    }
+    pfd[i].fd = sock;
+    pfd[i].events = down ? POLLIN : POLLOUT;
+  }
+  static char buf[65536];
+  double start = now_ms(), warm = start + (seconds > 2 ? 1000 : 0);
+  long long bytes = 0;
+  while (now_ms() - start < seconds * 1000) {
+    if (poll(pfd, streams, 100) <= 0)
+      continue;
+    for (int i = 0; i < streams; i++) {
+      if (!(pfd[i].revents & (POLLIN | POLLOUT)))
+        continue;
+      ssize_t n = down ? recv(pfd[i].fd, buf, sizeof(buf), 0)
+                       : send(pfd[i].fd, buf, sizeof(buf), MSG_NOSIGNAL);
+      if (n > 0 && now_ms() >= warm)
+        bytes += n;
+    }
+  }
+  double counted = now_ms() - warm;
+  printf("mbit %.2f\n", bytes * 8 / counted / 1000);
+  return 0;
+}
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// rtt HOST PORT SECONDS INTERVAL_MS [SRC]: UDP echo round trips to serve.
+// Replies later than a second count as lost.
+int rtt(const char *host, int port, double seconds, int interval_ms,
+        const char *src) {
+  SockAddr to;
+  socklen_t to_len = parse_sockaddr(host, port, &to);
+  if (!to_len)
+    return 1;
+  int sock = socket(to.sa.sa_family, SOCK_DGRAM, 0);
+  if (sock < 0 || bind_source(sock, src) != 0 ||
+      connect(sock, &to.sa, to_len) != 0) {
+    perror("rtt");
+    return 1;
+  }
+  int max = seconds * 1000 / interval_ms + 1, sent = 0, got = 0;
+  double *sent_at = calloc(max, sizeof(double));
+  double *rtts = calloc(max, sizeof(double));
+  if (!sent_at || !rtts)
+    return 1;
+  double start = now_ms(), next = start;
+  struct pollfd pfd = {sock, POLLIN, 0};
+  while (now_ms() - start < seconds * 1000 + 1000) {
+    if (sent < max && now_ms() >= next && now_ms() - start < seconds * 1000) {
+      unsigned int seq = htonl(sent);
+      sent_at[sent++] = now_ms();
+      send(sock, &seq, sizeof(seq), 0);
+      next += interval_ms;
+    }
+    if (poll(&pfd, 1, 1) <= 0)
+      continue;
+    unsigned int seq;
+    if (recv(sock, &seq, sizeof(seq), 0) != sizeof(seq))
+      continue;
+    seq = ntohl(seq);
+    double t = seq < (unsigned int)sent ? now_ms() - sent_at[seq] : 1e9;
+    if (t <= 1000)
+      rtts[got++] = t;
+  }
+  qsort(rtts, got, sizeof(double), compare_double);
+  double sum = 0;
+  for (int i = 0; i < got; i++)
+    sum += rtts[i];
+  printf("sent %d received %d avg_ms %.2f p50_ms %.2f p90_ms %.2f\n", sent,
+         got, got ? sum / got : -1, got ? rtts[got / 2] : -1,
+         got ? rtts[got * 9 / 10] : -1);
+  return got == 0;
+}
+
+// Simulated DHCP client of dhcp-storm. state: 0 discovering, 1 requesting,
+// 2 bound.
+typedef struct {
+  int state;
+  unsigned int offered, server; // Network byte order
+  double sent_at;
+} DhcpClient;
+
+// Send client i's DISCOVER or REQUEST. Its MAC and xid derive from i.
+void dhcp_send(int sock, int i, DhcpClient *c) {
+  unsigned char pkt[300] = {0};
+  pkt[0] = 1; // BOOTREQUEST
+  pkt[1] = 1;
+  pkt[2] = 6;
+  unsigned int xid = htonl(0x5eed0000 + i);
+  memcpy(pkt + 4, &xid, 4);
+  pkt[10] = 0x80; // Broadcast replies: the client has no address yet
+  unsigned char mac[6] = {0x02, 0x68, 0, (i >> 16) & 0xff, (i >> 8) & 0xff,
+                          i & 0xff};
+  memcpy(pkt + 28, mac, 6);
+  memcpy(pkt + 236, "\x63\x82\x53\x63", 4);
+  int n = 240;
+  pkt[n++] = 53;
+  pkt[n++] = 1;
+  pkt[n++] = c->state == 0 ? 1 : 3;
+  if (c->state == 1) {
+    pkt[n++] = 50;
+    pkt[n++] = 4;
+    memcpy(pkt + n, &c->offered, 4);
+    n += 4;
+    pkt[n++] = 54;
+    pkt[n++] = 4;
+    memcpy(pkt + n, &c->server, 4);
+    n += 4;
+  }
+  pkt[n] = 255;
+  struct sockaddr_in to;
+  parse_addr("255.255.255.255", 67, &to);
+  sendto(sock, pkt, sizeof(pkt), 0, (struct sockaddr *)&to, sizeof(to));
+  c->sent_at = now_ms();
+}
+
+// dhcp-storm IFACE CLIENTS SECONDS: CLIENTS DHCP clients with distinct MACs
+// start at once on IFACE, retransmitting after a second of silence. Reports
+// the time from the start to each client's ACK.
+int dhcp_storm(const char *iface, int clients, double seconds) {
+  struct sockaddr_in addr;
+  parse_addr("0.0.0.0", 68, &addr);
+  int one = 1;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 || clients < 1 || clients > 65536 ||
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) != 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, iface, strlen(iface)) !=
+          0 ||
+      bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("dhcp-storm");
+    return 1;
+  }
+  int size = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  DhcpClient *c = calloc(clients, sizeof(DhcpClient));
+  double *times = calloc(clients, sizeof(double));
+  if (!c || !times)
+    return 1;
+  double start = now_ms();
+  for (int i = 0; i < clients; i++)
+    dhcp_send(sock, i, &c[i]);
+  int bound = 0, retries = 0;
+  struct pollfd pfd = {sock, POLLIN, 0};
+  while (bound < clients && now_ms() - start < seconds * 1000) {
+    if (poll(&pfd, 1, 50) > 0) {
+      unsigned char pkt[1500];
+      ssize_t len = recv(sock, pkt, sizeof(pkt), 0);
+      unsigned int xid;
+      if (len < 240 || pkt[0] != 2)
+        continue;
+      memcpy(&xid, pkt + 4, 4);
+      int i = (int)(ntohl(xid) - 0x5eed0000);
+      if (i < 0 || i >= clients || c[i].state == 2)
+        continue;
+      int type = 0;
+      unsigned int server = 0;
+      for (ssize_t o = 240; o + 1 < len && pkt[o] != 255;
+           o += pkt[o] ? 2 + pkt[o + 1] : 1) {
+        if (pkt[o] == 53)
+          type = pkt[o + 2];
+        else if (pkt[o] == 54 && pkt[o + 1] == 4 && o + 6 <= len)
+          memcpy(&server, pkt + o + 2, 4);
+      }
+      if (type == 2 && c[i].state == 0) { // OFFER
+        memcpy(&c[i].offered, pkt + 16, 4);
+        c[i].server = server;
+        c[i].state = 1;
+        dhcp_send(sock, i, &c[i]);
+      } else if (type == 5 && c[i].state == 1) { // ACK
+        c[i].state = 2;
+        times[bound++] = now_ms() - start;
+      } else if (type == 6) { // NAK: start over
+        c[i].state = 0;
+        dhcp_send(sock, i, &c[i]);
+      }
+    }
+    for (int i = 0; i < clients; i++)
+      if (c[i].state != 2 && now_ms() - c[i].sent_at > 1000) {
+        dhcp_send(sock, i, &c[i]);
+        retries++;
+      }
+  }
+  qsort(times, bound, sizeof(double), compare_double);
+  printf("clients %d bound %d retries %d p50_ms %.1f p90_ms %.1f p99_ms %.1f "
+         "max_ms %.1f\n",
+         clients, bound, retries, bound ? times[bound / 2] : -1,
+         bound ? times[bound * 9 / 10] : -1,
+         bound ? times[bound * 99 / 100] : -1, bound ? times[bound - 1] : -1);
+  return bound < clients;
+}
+
+// dns-stub ADDR DELAY_MS TTL: upstream resolver on ADDR port 53. It answers
+// every A query with 10.0.0.1 and the given TTL after DELAY_MS, as a distant
+// resolver would, except names starting with "nx", which get NXDOMAIN.
+int dns_stub(const char *host, int delay_ms, int ttl) {
+  struct sockaddr_in addr;
+  if (parse_addr(host, 53, &addr) != 0)
+    return 1;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("dns-stub");
+    return 1;
+  }
+  while (1) {
+    unsigned char msg[512];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom(sock, msg, sizeof(msg) - 16, 0,
+                         (struct sockaddr *)&from, &from_len);
+    if (n < 17 || (msg[2] & 0x80))
+      continue;
+    ssize_t q = 12;
+    while (q < n && msg[q] != 0)
+      q += msg[q] + 1;
+    q += 5; // Root label, QTYPE, QCLASS
+    if (q > n)
+      continue;
+    int nx = msg[12] >= 2 && memcmp(msg + 13, "nx", 2) == 0;
+    int a = !nx && msg[q - 4] == 0 && msg[q - 3] == 1;
+    msg[2] = 0x81; // Response, recursion desired
+    msg[3] = nx ? 0x83 : 0x80;
+    memset(msg + 6, 0, 6);
+    msg[7] = a;
+    if (a) {
+      // Name pointer to the question, A, IN, TTL, 10.0.0.1.
+      unsigned char rr[16] = {0xc0, 12, 0, 1, 0, 1};
+      unsigned int ttl_be = htonl(ttl);
+      memcpy(rr + 6, &ttl_be, 4);
+      memcpy(rr + 10, "\0\4\12\0\0\1", 6);
+      memcpy(msg + q, rr, sizeof(rr));
+      q += sizeof(rr);
+    }
+    if (delay_ms > 0)
+      usleep(delay_ms * 1000);
+    sendto(sock, msg, q, 0, (struct sockaddr *)&from, from_len);
+  }
+}
+
+// dns-replay SERVER SECONDS NAMES DELAY_MS: query SERVER back to back for
+// SECONDS, drawing from NAMES names with a long-tailed popularity (every
+// tenth rank nonexistent). Answers faster than half the upstream's DELAY_MS
+// count as cache hits.
+int dns_replay(const char *server, double seconds, int names, int delay_ms) {
+  struct sockaddr_in to;
+  if (parse_addr(server, 53, &to) != 0 || names < 1)
+    return 1;
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&to, sizeof(to)) != 0) {
+    perror("dns-replay");
+    return 1;
+  }
+  int max = 1 << 20, sent = 0, got = 0, hits = 0;
+  double *rtts = calloc(max, sizeof(double));
+  if (!rtts)
+    return 1;
+  unsigned int rng = 1;
+  double start = now_ms();
+  struct pollfd pfd = {sock, POLLIN, 0};
+  while (sent < max && now_ms() - start < seconds * 1000) {
+    // A rank below a random bound: low ranks are popular, most are rare.
+    rng = rng * 1103515245 + 12345;
+    int bound = (rng >> 8) % names + 1;
+    rng = rng * 1103515245 + 12345;
+    int rank = (rng >> 8) % bound;
+    char name[32];
+    snprintf(name, sizeof(name), "%s%d.example", rank % 10 ? "h" : "nx",
+             rank);
+    unsigned char q[64] = {sent >> 8, sent & 0xff, 1, 0, 0, 1};
+    int len = 12;
+    for (char *p = name, *dot; p; p = dot ? dot + 1 : NULL) {
+      dot = strchr(p, '.');
+      int l = dot ? (int)(dot - p) : (int)strlen(p);
+      q[len++] = l;
+      memcpy(q + len, p, l);
+      len += l;
+    }
+    q[len++] = 0;
+    q[len++] = 0;
+    q[len++] = 1; // A
+    q[len++] = 0;
+    q[len++] = 1; // IN
+    double t0 = now_ms();
+    send(sock, q, len, 0);
+    sent++;
+    unsigned char reply[512];
+    while (poll(&pfd, 1, 1000) == 1) {
+      if (recv(sock, reply, sizeof(reply), 0) < 12 || reply[0] != q[0] ||
+          reply[1] != q[1])
+        continue;
+      double t = now_ms() - t0;
+      rtts[got++] = t;
+      hits += t < delay_ms / 2.0;
+      break;
+    }
+  }
+  qsort(rtts, got, sizeof(double), compare_double);
+  printf("queries %d answered %d hit_rate %.3f p50_ms %.2f p90_ms %.2f "
+         "p99_ms %.2f\n",
+         sent, got, got ? (double)hits / got : 0, got ? rtts[got / 2] : -1,
+         got ? rtts[got * 9 / 10] : -1, got ? rtts[got * 99 / 100] : -1);
+  return got == 0;
+}
+
+// http-serve PORT: minimal HTTP server that answers every request with a
+// short fixed page, until killed.
+int http_serve(int port) {
+  struct sockaddr_in addr;
+  parse_addr("0.0.0.0", port, &addr);
+  int one = 1;
+  int tcp = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (tcp < 0 || bind(tcp, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(tcp, 64) != 0) {
+    perror("http-serve");
+    return 1;
+  }
+  const char page[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                      "Content-Length: 13\r\n\r\nhotspot-test\n";
+  while (1) {
+    int conn = accept(tcp, NULL, NULL);
+    if (conn < 0)
+      continue;
+    char req[1024];
+    size_t got = 0;
+    ssize_t n;
+    // Read up to the end of the request head.
+    while (got < sizeof(req) - 1 &&
+           (n = recv(conn, req + got, sizeof(req) - 1 - got, 0)) > 0) {
+      got += n;
+      req[got] = '\0';
+      if (strstr(req, "\r\n\r\n"))
+        break;
+    }
+    send(conn, page, sizeof(page) - 1, MSG_NOSIGNAL);
+    close(conn);
+  }
+}
+
+// http-get HOST PORT: fetch / from HOST and report the status code, the
+// response size and the time to the complete response.
+int http_get(const char *host, int port) {
+  struct sockaddr_in to;
+  if (parse_addr(host, port, &to) != 0)
+    return 1;
+  double start = now_ms();
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&to, sizeof(to)) != 0) {
+    perror("http-get");
+    return 1;
+  }
+  char req[128], resp[4096];
+  int len = snprintf(req, sizeof(req), "GET / HTTP/1.0\r\nHost: %s\r\n\r\n",
+                     host);
+  send(sock, req, len, MSG_NOSIGNAL);
+  size_t got = 0;
+  ssize_t n;
+  while (got < sizeof(resp) - 1 &&
+         (n = recv(sock, resp + got, sizeof(resp) - 1 - got, 0)) > 0)
+    got += n;
+  resp[got] = '\0';
+  close(sock);
+  int status = 0;
+  sscanf(resp, "HTTP/%*s %d", &status);
+  printf("status %d bytes %zu ms %.1f\n", status, got, now_ms() - start);
+  return status != 200;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s udp-send HOST PORT SECONDS INTERVAL_US\n"
+          "       %s udp-recv PORT SECONDS\n"
+          "       %s udp-flood HOST PORT FLOWS\n"
+          "       %s serve PORT\n"
+          "       %s bulk HOST PORT down|up SECONDS STREAMS [SRC]\n"
+          "       %s rtt HOST PORT SECONDS INTERVAL_MS [SRC]\n"
+          "       %s dhcp-storm IFACE CLIENTS SECONDS\n"
+          "       %s dns-stub ADDR DELAY_MS TTL\n"
+          "       %s dns-replay SERVER SECONDS NAMES DELAY_MS\n"
+          "       %s http-serve PORT\n"
+          "       %s http-get HOST PORT\n",
+          prog, prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 6 && strcmp(argv[1], "udp-send") == 0)
+    return udp_send(argv[2], atoi(argv[3]), atof(argv[4]), atoi(argv[5]));
+  if (argc == 4 && strcmp(argv[1], "udp-recv") == 0)
+    return udp_recv(atoi(argv[2]), atof(argv[3]));
+  if (argc == 5 && strcmp(argv[1], "udp-flood") == 0)
+    return udp_flood(argv[2], atoi(argv[3]), atoi(argv[4]));
+  if (argc == 3 && strcmp(argv[1], "serve") == 0)
+    return serve(atoi(argv[2]));
+  if ((argc == 7 || argc == 8) && strcmp(argv[1], "bulk") == 0)
+    return bulk(argv[2], atoi(argv[3]), argv[4], atof(argv[5]),
+                atoi(argv[6]), argc == 8 ? argv[7] : NULL);
+  if ((argc == 6 || argc == 7) && strcmp(argv[1], "rtt") == 0)
+    return rtt(argv[2], atoi(argv[3]), atof(argv[4]), atoi(argv[5]),
+               argc == 7 ? argv[6] : NULL);
+  if (argc == 5 && strcmp(argv[1], "dhcp-storm") == 0)
+    return dhcp_storm(argv[2], atoi(argv[3]), atof(argv[4]));
+  if (argc == 5 && strcmp(argv[1], "dns-stub") == 0)
+    return dns_stub(argv[2], atoi(argv[3]), atoi(argv[4]));
+  if (argc == 6 && strcmp(argv[1], "dns-replay") == 0)
+    return dns_replay(argv[2], atof(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  if (argc == 3 && strcmp(argv[1], "http-serve") == 0)
+    return http_serve(atoi(argv[2]));
+  if (argc == 4 && strcmp(argv[1], "http-get") == 0)
+    return http_get(argv[2], atoi(argv[3]));
+  usage(argv[0]);
+  return 2;
+}
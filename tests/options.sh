@@ -0,0 +1,44 @@
+#!/bin/bash
+# Settings from OPTIONS_FILE are range-checked before they are applied, in
+# the engine and in the TUI: a value reported as ignored must leave the
+# setting as it was, and a valid value after it must still be taken.
+. "$(dirname "$0")/lib.sh"
+
+build hsc-harness
+build uic-harness -lncurses
+
+# expect KEY=VALUE... RESULT: applying the settings in order must print
+# RESULT for the last one, in both programs.
+expect() {
+  local want=${*: -1}
+  local h got
+  for h in hsc-harness uic-harness; do
+    got=$("$WORK/$h" options "${@:1:$#-1}" | tail -n 1)
+    [ "$got" = "$want" ] || check_failed "$h: got $got, expected $want"
+  done
+  echo "$want"
+}
+expect ct_watermark=0 "ct_watermark=0 rejected now 80"
+expect ct_watermark=96 "ct_watermark=96 rejected now 80"
+expect ct_watermark=50 ct_watermark=x "ct_watermark=x rejected now 50"
+expect ct_watermark=95 "ct_watermark=95 ok now 95"
+expect ct_max_limit=1023 "ct_max_limit=1023 rejected now 1048576"
+expect ct_max_limit=-5 "ct_max_limit=-5 rejected now 1048576"
+expect ct_max_limit=4096 "ct_max_limit=4096 ok now 4096"
+expect dns_cache_size=100001 "dns_cache_size=100001 rejected now 10000"
+expect dns_cache_size=0 "dns_cache_size=0 ok now 0"
+expect dns_min_ttl=3601 "dns_min_ttl=3601 rejected now 60"
+expect acs_interval=5 "acs_interval=5 rejected now 900"
+expect acs_interval=60 "acs_interval=60 ok now 60"
+expect bssid=02:00:00:00:00:01 bssid=03:00:00:00:00:01 \
+  "bssid=03:00:00:00:00:01 rejected now '02:00:00:00:00:01'"
+expect bssid=02:00:00:00:00:zz "bssid=02:00:00:00:00:zz rejected now ''"
+expect check_interval=0 "check_interval=0 rejected now 0"
+expect check_interval=5 check_interval=3601 \
+  "check_interval=3601 rejected now 5"
+expect ipv6_prefix=2001:db8:1::/64 ipv6_prefix=2001:db8:2::1/64 \
+  "ipv6_prefix=2001:db8:2::1/64 rejected now '2001:db8:1::/64'"
+expect ipv6_prefix=2001:db8::/48 "ipv6_prefix=2001:db8::/48 rejected now ''"
+expect uplink_mtu=1400 uplink_mtu=100 "uplink_mtu=100 rejected now 1400"
+expect uplink_mtu=1400 uplink_mtu=0 "uplink_mtu=0 ok now 0"
+finish
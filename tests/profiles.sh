@@ -0,0 +1,59 @@
+#!/bin/bash
+# Headless profiles and their compiled cache. The cache holds PSKs, so it
+# must be private to root and kept out of /var/cache; it must be rebuilt
+# when the defaults the profiles start from change; and a 64-hex-digit PSK
+# is accepted like on the command line. /var/lib is a private tmpfs here,
+# so the host's cache is left alone.
+PRIVATE_TMP=1 . "$(dirname "$0")/lib.sh"
+
+mount -t tmpfs tmpfs /var/lib || skip "cannot mount a private /var/lib"
+build hsc-harness
+CACHE=/var/lib/hotspot/profiles.bin
+HEX=00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff
+cat >"$WORK/profiles.conf" <<PROFILES
+[cafe]
+ssid=Cafe
+psk=espresso-please
+subnet=10.60.0.0/24
+
+[raw]
+ssid=Raw key
+psk=$HEX
+PROFILES
+
+# expect OUTPUT WANT: check a profile line.
+expect() {
+  echo "$1"
+  [ "$1" = "$2" ] || check_failed "expected '$2'"
+}
+
+out=$("$WORK/hsc-harness" -o check_interval=30 profile "$WORK/profiles.conf" \
+  cafe) || fail "cannot load profile cafe"
+expect "$out" \
+  "profile cafe ssid Cafe psk_len 15 check_interval 30 subnet 10.60.0.0/24"
+[ -f $CACHE ] || fail "no compiled cache in /var/lib/hotspot"
+[ "$(stat -c %a /var/lib/hotspot) $(stat -c %a $CACHE)" = "700 600" ] ||
+  check_failed "cache is not private:" \
+    "$(stat -c '%a %n' /var/lib/hotspot $CACHE)"
+[ ! -e /var/cache/hotspot/profiles.bin ] ||
+  check_failed "PSKs cached in /var/cache"
+
+# Other defaults, same source file: the cached record must not be reused.
+out=$("$WORK/hsc-harness" -o check_interval=90 profile "$WORK/profiles.conf" \
+  cafe) || fail "cannot load profile cafe"
+expect "$out" \
+  "profile cafe ssid Cafe psk_len 15 check_interval 90 subnet 10.60.0.0/24"
+
+out=$("$WORK/hsc-harness" profile "$WORK/profiles.conf" raw) ||
+  fail "a 64-hex-digit psk was rejected"
+expect "$out" \
+  "profile raw ssid Raw key psk_len 64 check_interval 0 subnet 192.168.4.0/24"
+
+# 65 hex digits are neither a passphrase nor a PSK.
+echo "psk=${HEX}0" >>"$WORK/profiles.conf"
+"$WORK/hsc-harness" profile "$WORK/profiles.conf" raw >/dev/null \
+  2>"$WORK/err" && check_failed "a 65-character psk was accepted"
+cat "$WORK/err"
+grep -q "64 hex digits" "$WORK/err" ||
+  check_failed "the error does not mention 64 hex digits"
+finish
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Radio plan and hostapd lines generated from iw output. Each chipset in
+# fixtures/radio has the uplink's `iw dev ... info` (NAME.dev), the phy's
+# `iw phy ... info` (NAME.phy) and `iw reg get` (NAME.reg); a stand-in iw
+# prints them and the generated configuration must match NAME.conf.
+. "$(dirname "$0")/lib.sh"
+
+build hsc-harness
+# The stand-in iw answers from the fixture named by IW_FIXTURE.
+cat >"$WORK/iw" <<'IW'
+#!/bin/sh
+case "$*" in
+"dev "*" info") exec cat "$IW_FIXTURE.dev" ;;
+"phy "*" info") exec cat "$IW_FIXTURE.phy" ;;
+"reg get") exec cat "$IW_FIXTURE.reg" ;;
+esac
+exit 1
+IW
+chmod +x "$WORK/iw"
+
+for dev in "$FIXTURES"/radio/*.dev; do
+  name=$(basename "$dev" .dev)
+  IW_FIXTURE=${dev%.dev} "$WORK/hsc-harness" radio "$WORK/iw" wlan0 \
+    >"$WORK/$name.conf" || { check_failed "$name: no radio plan"; continue; }
+  if diff -u "${dev%.dev}.conf" "$WORK/$name.conf"; then
+    echo "$name: $(head -n 1 "$WORK/$name.conf")"
+  else
+    check_failed "$name: configuration differs"
+  fi
+done
+finish
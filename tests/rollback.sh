@@ -0,0 +1,119 @@
+#!/bin/bash
+# Teardown after a startup returns the gateway to the state it was in
+# before, within MAX_ROLLBACK_MS (three rollback tiers of UNDO_TIER_MS).
+# The journal holds the real set of steps: ap0, a hostapd and a dnsmasq
+# that both ignore SIGTERM, ip_forward, the NAT and forward rules and the
+# shapers. Every rule, qdisc, interface and sysctl of hs-gw is compared
+# with a snapshot taken before ap0 was created. Without iptables a
+# stand-in keeps the rules in a file; without CAKE and fq_codel the uplink
+# gets a plain HTB root in place of the engine's shaper.
+PRIVATE_TMP=1 . "$(dirname "$0")/lib.sh"
+
+need_root
+need_cmd pkill tc
+provide_sudo
+tier_ms=$(awk '$2 == "UNDO_TIER_MS" { print $3 }' "$REPO_DIR/hotspot.c")
+MAX_ROLLBACK_MS=$(threshold MAX_ROLLBACK_MS $((3 * tier_ms)))
+PID_FILE=/tmp/hotspot.dnsmasq.pid
+build hsc-harness
+
+cat >"$WORK/bin/iw" <<'EOF'
+#!/bin/sh
+# ap0 is a veth here; the engine deletes it through iw.
+[ "$*" = "dev ap0 del" ] && exec ip link del ap0
+exit 1
+EOF
+cat >"$WORK/bin/dnsmasq" <<'EOF'
+#!/bin/bash
+trap '' TERM
+echo $$ >"${1#--pid-file=}"
+while :; do sleep 0.05; done
+EOF
+if ! command -v iptables >/dev/null 2>&1; then
+  cat >"$WORK/bin/iptables" <<EOF
+#!/bin/bash
+# Stand-in iptables: "TABLE -A RULE" lines in $WORK/rules.
+rules=$WORK/rules table=filter op=
+touch "\$rules"
+while [ \$# -gt 0 ]; do
+  case \$1 in
+  -w) shift ;;
+  -t) table=\$2; shift 2 ;;
+  -S) op=-S; shift ;;
+  -A | -C | -D) op=\$1; shift; break ;;
+  *) exit 2 ;;
+  esac
+done
+line="\$table -A \$*"
+case \$op in
+-A) echo "\$line" >>"\$rules" ;;
+-C) grep -qxF -- "\$line" "\$rules" ;;
+-D)
+  grep -qxF -- "\$line" "\$rules" || exit 1
+  awk -v l="\$line" '\$0 == l && !done { done = 1; next } 1' "\$rules" \\
+    >"\$rules.new" && mv "\$rules.new" "\$rules" ;;
+-S) grep "^\$table " "\$rules" | cut -d ' ' -f 2- ;;
+esac
+EOF
+  echo "iptables: stand-in"
+fi
+chmod +x "$WORK"/bin/*
+
+add_netns gw up
+add_veth gw up0 up n0
+in_ns gw ip addr add 10.1.0.2/24 dev up0
+
+# snapshot: interfaces, addresses, qdiscs, rules and ip_forward of hs-gw.
+snapshot() {
+  in_ns gw ip -o link show | awk '{ print $2, $3 }'
+  in_ns gw ip -o addr show | awk '{ print $2, $3, $4 }'
+  in_ns gw tc qdisc show
+  in_ns gw iptables -t nat -S
+  in_ns gw iptables -t filter -S
+  echo "ip_forward $(in_ns gw sysctl -n net.ipv4.ip_forward)"
+}
+before=$(snapshot)
+
+# What the engine's startup makes before the journaled steps.
+add_veth gw ap0 up c0
+in_ns gw ip addr add 192.168.4.1/24 dev ap0
+rm -f $PID_FILE
+ip netns exec hs-gw dnsmasq --pid-file=$PID_FILE &
+disown
+for _ in $(seq 100); do
+  [ -s $PID_FILE ] && break
+  sleep 0.01
+done
+dnsmasq=$(cat $PID_FILE)
+
+ip netns exec hs-gw "$WORK/hsc-harness" -o shaper_down_kbit=20000 \
+  -o shaper_up_kbit=20000 teardown up0 >"$WORK/out" 2>&1 &
+harness=$!
+for _ in $(seq 50); do
+  grep -q "^applied" "$WORK/out" && break
+  sleep 0.1
+done
+grep -q "^applied" "$WORK/out" || { cat "$WORK/out"; fail "setup failed"; }
+if grep -q "^shaper failed" "$WORK/out"; then
+  in_ns gw tc qdisc replace dev up0 root handle 1: htb default 10 ||
+    skip "sch_htb is not available"
+  echo "shaper: plain HTB root"
+fi
+hostapd=$(pgrep -P "$harness")
+during=$(snapshot)
+for want in "ap0@" "MASQUERADE" "FORWARD -i ap0 -o up0" "dev up0 root" \
+  "ip_forward 1"; do
+  grep -qF -- "$want" <<<"$during" || check_failed "not applied: $want"
+done
+
+kill -TERM "$harness"
+wait "$harness"
+ms=$(awk '$1 == "rollback_ms" { print $2 }' "$WORK/out")
+check "rollback ms" "$ms" "<" "$MAX_ROLLBACK_MS"
+diff -u <(echo "$before") <(snapshot) ||
+  check_failed "hs-gw is not back to its state before the run"
+for pid in "$hostapd" "$dnsmasq"; do
+  [ -n "$pid" ] && kill -0 "$pid" 2>/dev/null &&
+    check_failed "$(ps -o comm= -p "$pid") ($pid) survived the rollback"
+done
+finish
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Run the hotspot tests and benchmarks: every script under tests/ and
+# tests/bench/, or only the ones named on the command line. Exits nonzero
+# when any of them failed; skipped ones do not count as failures.
+
+cd "$(dirname "$0")" || exit 1
+if [ $# -gt 0 ]; then
+  scripts=("$@")
+else
+  scripts=()
+  for t in *.sh bench/*.sh; do
+    case "$t" in
+    lib.sh | run.sh) ;;
+    *) scripts+=("$t") ;;
+    esac
+  done
+fi
+
+passed=0 failed=0 skipped=0
+for t in "${scripts[@]}"; do
+  echo "=== $t"
+  bash "$t"
+  case $? in
+  0) passed=$((passed + 1)) ;;
+  77) skipped=$((skipped + 1)) ;;
+  *) failed=$((failed + 1)) ;;
+  esac
+done
+echo "=== $passed passed, $failed failed, $skipped skipped"
+[ "$failed" = 0 ]
@@ -0,0 +1,85 @@
+#!/bin/bash
+# Uploads to the speed test server count exactly Content-Length bytes. A
+# client that sends more than Content-Length with its headers, and keeps
+# the connection open for the answer, must be answered at once with the
+# declared length rather than left waiting while the server reads on. An
+# empty body, a body that fits the header read exactly and a 2 MB body
+# sent after the headers are counted too, and the 2 MB one is logged.
+#
+# A POST without Content-Length is answered 411 at once. With
+# SPEEDTEST_MAX_CLIENTS connections open, the next one is answered 503, and
+# an idle connection is closed after SPEEDTEST_TIMEOUT_S.
+PRIVATE_TMP=1 . "$(dirname "$0")/lib.sh"
+
+need_root
+build hsc-harness
+add_netns st
+in_ns st "$WORK/hsc-harness" speedtest 127.0.0.1 >/dev/null ||
+  fail "the speed test server did not start"
+
+# upload LENGTH HEAD_BODY TAIL_BYTES: POST /up declaring LENGTH, with
+# HEAD_BODY in the same write as the headers and TAIL_BYTES more after
+# them, and print the byte count of the answer.
+upload() {
+  printf 'POST /up HTTP/1.1\r\nHost: t\r\nContent-Length: %s\r\n\r\n%s' \
+    "$1" "$2" >"$WORK/head"
+  in_ns st timeout 5 bash -c '
+    exec 3<>/dev/tcp/127.0.0.1/8080
+    cat "$1" >&3 # One write, so the server reads the headers and body together
+    head -c "$2" /dev/zero >&3
+    sed -n "s/^\([0-9]*\) bytes in .*/\1/p" <&3 2>/dev/null' \
+    bash "$WORK/head" "$3"
+}
+
+# expect NAME WANT LENGTH HEAD_BODY TAIL_BYTES
+expect() {
+  local got
+  got=$(upload "$3" "$4" "$5")
+  echo "$1: ${got:-no answer}"
+  [ "$got" = "$2" ] || check_failed "$1: counted '$got', expected $2"
+}
+expect "more than Content-Length" 5 5 xxxxxxxxxx 0
+expect "empty body" 0 0 "" 0
+expect "body in the header read" 10 10 xxxxxxxxxx 0
+expect "2 MB after the headers" 2000000 2000000 "" 2000000
+grep -q " up 2000000 " /tmp/hotspot.speedtest ||
+  check_failed "the 2 MB upload was not logged"
+
+# status REQUEST: send REQUEST and print the status code of the answer.
+status() {
+  in_ns st timeout 5 bash -c '
+    exec 3<>/dev/tcp/127.0.0.1/8080
+    printf "$1" >&3
+    head -n 1 <&3 | cut -d " " -f 2' bash "$1"
+}
+got=$(status 'POST /up HTTP/1.1\r\nHost: t\r\n\r\nxxxxxxxxxx')
+echo "no Content-Length: ${got:-no answer}"
+[ "$got" = 411 ] || check_failed "no Content-Length: got '$got', expected 411"
+
+# define NAME: the value of a #define in hotspot.c.
+define() {
+  awk -v name="$1" '$1 == "#define" && $2 == name { print $3 }' \
+    "$REPO_DIR/hotspot.c"
+}
+max_clients=$(define SPEEDTEST_MAX_CLIENTS)
+timeout_s=$(define SPEEDTEST_TIMEOUT_S)
+
+# Hold SPEEDTEST_MAX_CLIENTS connections open without a request.
+for _ in $(seq "$max_clients"); do
+  in_ns st bash -c 'exec 3<>/dev/tcp/127.0.0.1/8080; cat <&3 >/dev/null' &
+done
+sleep 1
+got=$(status 'GET / HTTP/1.1\r\nHost: t\r\n\r\n')
+echo "connection $((max_clients + 1)): ${got:-no answer}"
+[ "$got" = 503 ] || check_failed "over the cap: got '$got', expected 503"
+
+# The idle connections are closed by the server, not the client.
+start=$(date +%s)
+wait
+idle_s=$(($(date +%s) - start + 1))
+echo "idle connections closed after ${idle_s} s"
+[ "$idle_s" -le $((timeout_s + 2)) ] ||
+  check_failed "idle connections were held ${idle_s} s"
+got=$(status 'GET / HTTP/1.1\r\nHost: t\r\n\r\n')
+[ "$got" = 200 ] || check_failed "after the timeout: got '$got', expected 200"
+finish
@@ -0,0 +1,81 @@
+#!/bin/bash
+# Command traces: what the engine and the TUI record must replay to the
+# same statuses and outputs, byte for byte, in both programs. The outputs
+# include leading blank lines, no trailing newline and a line that looks
+# like a record header, and one command line starts with a newline. A
+# malformed header or a record whose lengths do not match its separators
+# is refused, and a last record cut short by an interrupted write is
+# dropped. A 100-command trace must replay at MIN_REPLAY_ITER_PER_S (1000)
+# full iterations per second or more.
+. "$(dirname "$0")/lib.sh"
+
+MIN_REPLAY_ITER_PER_S=$(threshold MIN_REPLAY_ITER_PER_S 1000)
+build hsc-harness
+build uic-harness -lncurses
+
+cmds=(
+  "printf '\n\nleading blank lines\n'"
+  "printf '\n'"
+  "true"
+  "printf 'no trailing newline'"
+  "exit 3"
+  "printf '0 12 5 6\nheader\n'"
+  $'\nprintf \'after a newline\''
+  "printf 'tab\there\n'"
+  "seq 2000"
+)
+for h in hsc-harness uic-harness; do
+  HSC_TRACE_RECORD="$WORK/$h.trace" "$WORK/$h" trace "${cmds[@]}" \
+    >"$WORK/$h.live" || fail "$h: recording failed"
+done
+for rec in hsc-harness uic-harness; do
+  for h in hsc-harness uic-harness; do
+    HSC_TRACE_REPLAY="$WORK/$rec.trace" "$WORK/$h" trace "${cmds[@]}" \
+      >"$WORK/replay" 2>&1 || check_failed "$h: replay of $rec's trace failed"
+    diff -u "$WORK/$rec.live" "$WORK/replay" ||
+      check_failed "$h: replay of $rec's trace differs from the live run"
+  done
+done
+grep -q '^status 0 bytes 22 output \\n\\nleading blank lines\\n$' \
+  "$WORK/hsc-harness.live" || check_failed "leading blank lines were lost"
+grep -q '^status 3 bytes 0 output $' "$WORK/hsc-harness.live" ||
+  check_failed "the exit status was lost"
+
+# refused NAME: a replay of $WORK/bad must be refused as a whole.
+refused() {
+  HSC_TRACE_REPLAY="$WORK/bad" "$WORK/hsc-harness" trace true \
+    >"$WORK/bad.out" 2>&1 && check_failed "$1: the trace was accepted"
+  grep -q "^Cannot load command trace" "$WORK/bad.out" ||
+    check_failed "$1: $(cat "$WORK/bad.out")"
+}
+printf '0 0 4 0 \ntrue\n\n' >"$WORK/bad"
+refused "space before the header newline"
+printf '0 0 3 0\ntrue\n\n' >"$WORK/bad"
+refused "command length too short"
+printf '0 0 4 1\ntrue\nab\n' >"$WORK/bad"
+refused "output length too short"
+printf '0 0 -4 0\ntrue\n\n' >"$WORK/bad"
+refused "negative command length"
+
+# A cut-off last record is dropped and the ones before it replay.
+head -c -3 "$WORK/hsc-harness.trace" >"$WORK/cut"
+HSC_TRACE_REPLAY="$WORK/cut" "$WORK/hsc-harness" trace "${cmds[0]}" \
+  >"$WORK/replay" 2>&1
+head -n 1 "$WORK/hsc-harness.live" | diff -u - "$WORK/replay" ||
+  check_failed "records before a cut-off one did not replay"
+HSC_TRACE_REPLAY="$WORK/cut" "$WORK/hsc-harness" trace "seq 2000" \
+  >"$WORK/replay" 2>&1
+grep -q "^No recorded result for: seq 2000 >/dev/null" "$WORK/replay" ||
+  check_failed "the cut-off record was replayed: $(cat "$WORK/replay")"
+
+# Replay speed of a startup-sized trace.
+mapfile -t many < <(seq -f 'echo line %g' 100)
+HSC_TRACE_RECORD="$WORK/many.trace" "$WORK/hsc-harness" trace "${many[@]}" \
+  >/dev/null || fail "recording 100 commands failed"
+HSC_TRACE_REPLAY="$WORK/many.trace" "$WORK/hsc-harness" tracebench 5000 \
+  >"$WORK/bench" || fail "tracebench failed"
+echo "replay: $(cat "$WORK/bench")"
+check "replay iterations/s" "$(awk '{ for (i = 1; i < NF; i++)
+  if ($i == "per_s") print $(i + 1) }' "$WORK/bench")" ">" \
+  "$MIN_REPLAY_ITER_PER_S"
+finish
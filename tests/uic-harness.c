@@ -0,0 +1,266 @@
+// Test driver for the TUI: it compiles ui.c in with its main() renamed and
+// runs the screens' data structures without a terminal.
+//
+// Usage: uic-harness COMMAND [ARGS]
+#define main uic_main
+#include "../ui.c"
+#undef main
+
+double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+unsigned int rng_state = 2463534242u;
+
+unsigned int rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+// One synthetic conntrack flow of the replay.
+typedef struct {
+  unsigned int id;
+  int client; // Originated in the AP subnet
+  int alive;
+  int born;          // Round of its NEW event
+  unsigned int rate; // Bytes per accounting interval
+  char tuple[128];   // "src=... dst=... sport=... dport=..."
+} SynthFlow;
+
+// Append a conntrack -E/-L line for f to lines. kind is 'N', 'D' or 'L'.
+void emit_line(char **lines, int *n, SynthFlow *f, int kind, int round) {
+  char line[320];
+  unsigned long long bytes = (unsigned long long)f->rate * (round - f->born);
+  if (kind == 'N')
+    snprintf(line, sizeof(line),
+             "[NEW] tcp      6 120 SYN_SENT %s [UNREPLIED] id=%u", f->tuple,
+             f->id);
+  else if (kind == 'D')
+    snprintf(line, sizeof(line), "[DESTROY] tcp      6 %s id=%u", f->tuple,
+             f->id);
+  else
+    snprintf(line, sizeof(line),
+             "tcp      6 431999 ESTABLISHED %s packets=9 bytes=%llu "
+             "src=10.9.9.9 packets=9 bytes=%llu [ASSURED] mark=0 use=1 id=%u",
+             f->tuple, bytes / 3, bytes - bytes / 3, f->id);
+  lines[(*n)++] = strdup(line);
+}
+
+void new_flow(SynthFlow *f, unsigned int id, int round) {
+  f->id = id;
+  f->client = rng() % 10 != 0;
+  f->alive = 1;
+  f->born = round;
+  f->rate = 1000 + rng() % 100000000;
+  snprintf(f->tuple, sizeof(f->tuple),
+           "src=%s.%u dst=10.%u.%u.%u sport=%u dport=443",
+           f->client ? "192.168.4" : "10.20.0", 2 + rng() % 250,
+           rng() % 256, rng() % 256, 1 + rng() % 254, 1024 + rng() % 60000);
+}
+
+int compare_uint_desc(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+  return (x < y) - (x > y);
+}
+
+// flows FLOWS ROUNDS: replay FLOWS flows through ROUNDS accounting dumps
+// with a tenth of them replaced by DESTROY and NEW events each round, time
+// the top talkers' table updates and top-K scans, and check the ranking
+// against a full sort of the known rates.
+int cmd_flows(int argc, char **argv) {
+  if (argc != 2)
+    return 2;
+  int flows = atoi(argv[0]), rounds = atoi(argv[1]);
+  if (flows < TOP_TALKERS || flows > FLOW_TABLE_SIZE / 2 || rounds < 2)
+    return 2;
+  snprintf(ap_cidr, sizeof(ap_cidr), "192.168.4.1/24");
+  int max_flows = flows + flows / 10 * rounds + 1;
+  SynthFlow *all = calloc(max_flows, sizeof(SynthFlow));
+  int max_lines = max_flows * 2 + flows * rounds;
+  char **lines = calloc(max_lines, sizeof(char *));
+  int *line_round = calloc(max_lines, sizeof(int));
+  if (!all || !lines || !line_round)
+    return 1;
+
+  // Build the event stream up front so only the table work is timed.
+  int n = 0, total = 0;
+  unsigned int next_id = 1;
+  for (; total < flows; total++) {
+    new_flow(&all[total], next_id, 0);
+    next_id += 1 + rng() % 7;
+    line_round[n] = 0;
+    emit_line(lines, &n, &all[total], 'N', 0);
+  }
+  for (int r = 1; r <= rounds; r++) {
+    for (int c = 0; c < flows / 10; c++) {
+      SynthFlow *victim = &all[rng() % total];
+      if (!victim->alive)
+        continue;
+      victim->alive = 0;
+      line_round[n] = r;
+      emit_line(lines, &n, victim, 'D', r);
+      new_flow(&all[total], next_id, r);
+      next_id += 1 + rng() % 7;
+      line_round[n] = r;
+      emit_line(lines, &n, &all[total++], 'N', r);
+    }
+    for (int i = 0; i < total; i++)
+      if (all[i].alive) {
+        line_round[n] = -r; // Part of dump r
+        emit_line(lines, &n, &all[i], 'L', r);
+      }
+  }
+
+  FlowTable table = {calloc(FLOW_TABLE_SIZE, sizeof(Flow)), 0, 0};
+  if (!table.slots)
+    return 1;
+  Flow *heap[TOP_TALKERS];
+  int top = 0;
+  double apply_ns = 0, scan_ns = 0;
+  for (int i = 0; i < n;) {
+    // A run of events, or one whole dump.
+    int dump = line_round[i] < 0, j = i;
+    double start = now_ns();
+    if (dump)
+      table.generation++;
+    while (j < n && line_round[j] == line_round[i]) {
+      apply_flow_line(&table, lines[j], dump ? FLOW_ACCT_INTERVAL : 0);
+      j++;
+    }
+    apply_ns += now_ns() - start;
+    i = j;
+    start = now_ns();
+    top = 0;
+    for (int s = 0; s < FLOW_TABLE_SIZE; s++)
+      if (table.slots[s].id != 0)
+        topk_push(heap, &top, TOP_TALKERS, &table.slots[s]);
+    qsort(heap, top, sizeof(Flow *), compare_flow_rate);
+    scan_ns += now_ns() - start;
+  }
+
+  // Flows listed in the last two dumps report rate / interval; the rest 0.
+  unsigned int *expected = calloc(total, sizeof(unsigned int));
+  int live = 0, ranked = 0;
+  for (int i = 0; i < total; i++)
+    if (all[i].alive && all[i].client) {
+      live++;
+      if (all[i].born < rounds)
+        expected[ranked++] = all[i].rate;
+    }
+  qsort(expected, ranked, sizeof(unsigned int), compare_uint_desc);
+  int ok = table.count == live && top == TOP_TALKERS;
+  for (int i = 0; ok && i < top; i++)
+    ok = heap[i]->rate == (double)expected[i] / FLOW_ACCT_INTERVAL;
+  int scans = 0;
+  for (int i = 0; i < n; i++)
+    scans += i == 0 || line_round[i] != line_round[i - 1];
+  printf("lines %d tracked %d ns_per_line %.0f us_per_scan %.0f top_ok %d\n",
+         n, table.count, apply_ns / n, scan_ns / scans / 1000, ok);
+  return !ok;
+}
+
+// trace CMD...: the TUI's copy of the command layer, as hsc-harness trace.
+int cmd_trace(int argc, char **argv) {
+  if (argc < 1)
+    return 2;
+  for (int i = 0; i < argc; i++) {
+    char *output = exec_cmd(argv[i]);
+    char quiet[512];
+    snprintf(quiet, sizeof(quiet), "%s >/dev/null", argv[i]);
+    int status = run_cmd(quiet);
+    size_t len = output ? strlen(output) : 0;
+    printf("status %d bytes %zu output ", WEXITSTATUS(status), len);
+    for (size_t k = 0; k < len; k++) {
+      unsigned char c = output[k];
+      if (c == '\n')
+        printf("\\n");
+      else if (c == '\\')
+        printf("\\\\");
+      else if (c < 0x20 || c > 0x7e)
+        printf("\\x%02x", c);
+      else
+        putchar(c);
+    }
+    putchar('\n');
+    free(output);
+  }
+  return 0;
+}
+
+// The settings cmd_options() reports back, a number or a string.
+typedef struct {
+  const char *key;
+  int *value;
+  const char *text;
+} KnownOption;
+
+const KnownOption known_options[] = {
+    {"ct_watermark", &opts.ct_watermark},
+    {"ct_max_limit", &opts.ct_max_limit},
+    {"dns_cache_size", &opts.dns_cache_size},
+    {"dns_min_ttl", &opts.dns_min_ttl},
+    {"acs_interval", &opts.acs_interval},
+    {"bssid", NULL, opts.bssid},
+    {"check_interval", &opts.check_interval},
+    {"ipv6_prefix", NULL, opts.ipv6_prefix},
+    {"uplink_mtu", &opts.uplink_mtu},
+};
+
+// options KEY=VALUE...: the TUI's copy of the settings, as hsc-harness
+// options.
+int cmd_options(int argc, char **argv) {
+  if (argc < 1)
+    return 2;
+  for (int i = 0; i < argc; i++) {
+    char *eq = strchr(argv[i], '=');
+    if (!eq)
+      return 2;
+    *eq = '\0';
+    int status = set_hotspot_option(argv[i], eq + 1);
+    printf("%s=%s %s", argv[i], eq + 1, status ? "rejected" : "ok");
+    for (size_t k = 0; k < sizeof(known_options) / sizeof(known_options[0]);
+         k++) {
+      const KnownOption *known = &known_options[k];
+      if (strcmp(argv[i], known->key) != 0)
+        continue;
+      if (known->value)
+        printf(" now %d", *known->value);
+      else
+        printf(" now '%s'", known->text);
+    }
+    putchar('\n');
+  }
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  int (*run)(int argc, char **argv);
+  const char *args;
+} HarnessCommand;
+
+const HarnessCommand commands[] = {
+    {"flows", cmd_flows, "FLOWS ROUNDS"},
+    {"trace", cmd_trace, "CMD..."},
+    {"options", cmd_options, "KEY=VALUE..."},
+};
+
+int main(int argc, char *argv[]) {
+  for (size_t c = 0; argc > 1 && c < sizeof(commands) / sizeof(commands[0]);
+       c++)
+    if (strcmp(argv[1], commands[c].name) == 0) {
+      int status = commands[c].run(argc - 2, argv + 2);
+      if (status == 2)
+        fprintf(stderr, "Usage: %s %s %s\n", argv[0], commands[c].name,
+                commands[c].args);
+      return status;
+    }
+  fprintf(stderr, "Usage: %s COMMAND [ARGS]\n", argv[0]);
+  for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++)
+    fprintf(stderr, "  %s %s\n", commands[c].name, commands[c].args);
+  return 2;
+}